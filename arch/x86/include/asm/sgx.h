@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/**
+ * Copyright(c) 2016-19 Intel Corporation.
+ *
+ * The interface of the SGX core for the other kernel subsystems.
+ */
+#ifndef _ASM_X86_SGX_H
+#define _ASM_X86_SGX_H
+
+#include <linux/types.h>
+#include <asm/sgx_arch.h>
+
+#ifdef CONFIG_KVM_INTEL_SGX
+int sgx_virt_ecreate(struct sgx_pageinfo *pageinfo, void __user *secs,
+		     int *trapnr);
+int sgx_virt_einit(struct sgx_sigstruct *sigstruct,
+		   struct sgx_einittoken *token, void __user *secs,
+		   u64 *lepubkeyhash, int *trapnr);
+#endif
+
+#endif /* _ASM_X86_SGX_H */
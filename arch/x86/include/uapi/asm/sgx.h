@@ -18,6 +18,16 @@
 	_IOW(SGX_MAGIC, 0x02, struct sgx_enclave_init)
 #define SGX_IOC_ENCLAVE_SET_ATTRIBUTE \
 	_IOW(SGX_MAGIC, 0x03, struct sgx_enclave_set_attribute)
+#define SGX_IOC_ENCLAVE_SET_MEMPOLICY \
+	_IOW(SGX_MAGIC, 0x04, struct sgx_enclave_set_mempolicy)
+#define SGX_IOC_ENCLAVE_ADD_PAGES \
+	_IOWR(SGX_MAGIC, 0x05, struct sgx_enclave_add_pages)
+
+/* NUMA placement policies for the EPC pages of an enclave */
+#define SGX_MPOL_DEFAULT	0
+#define SGX_MPOL_PREFERRED	1
+#define SGX_MPOL_BIND		2
+#define SGX_MPOL_INTERLEAVE	3
 
 /**
  * struct sgx_enclave_create - parameter structure for the
@@ -45,6 +55,31 @@ struct sgx_enclave_add_page {
 	__u8	reserved[6];
 };
 
+/**
+ * struct sgx_enclave_add_pages - parameter structure for the
+ *                                %SGX_IOC_ENCLAVE_ADD_PAGES ioctl
+ * @addr:	start address within the ELRANGE, page aligned
+ * @src:	start address of the page data, page aligned
+ * @length:	length of the range in bytes, a multiple of the page size
+ * @secinfo:	address for the SECINFO data, shared by all pages
+ * @mrmask:	bitmask for the measured 256 byte chunks of every page
+ * @reserved:	reserved for future use
+ * @count:	output, the number of bytes added
+ *
+ * When the ioctl is interrupted or fails, @count tells how much of the range
+ * was added, and the rest can be added by another call starting at @addr +
+ * @count and @src + @count.
+ */
+struct sgx_enclave_add_pages {
+	__u64	addr;
+	__u64	src;
+	__u64	length;
+	__u64	secinfo;
+	__u16	mrmask;
+	__u8	reserved[6];
+	__u64	count;
+};
+
 /**
  * struct sgx_enclave_init - parameter structure for the
  *                           %SGX_IOC_ENCLAVE_INIT ioctl
@@ -63,6 +98,20 @@ struct sgx_enclave_set_attribute {
 	__u64 attribute_fd;
 };
 
+/**
+ * struct sgx_enclave_set_mempolicy - parameter structure for the
+ *				      %SGX_IOC_ENCLAVE_SET_MEMPOLICY ioctl
+ * @mode:	%SGX_MPOL_DEFAULT, %SGX_MPOL_PREFERRED, %SGX_MPOL_BIND or
+ *		%SGX_MPOL_INTERLEAVE
+ * @reserved:	reserved for future use
+ * @nodemask:	bitmask of the NUMA nodes, bit N selects node N
+ */
+struct sgx_enclave_set_mempolicy {
+	__u32 mode;
+	__u32 reserved;
+	__u64 nodemask;
+};
+
 /**
  * struct sgx_enclave_exception - structure to report exceptions encountered in
  *				  __vdso_sgx_enter_enclave()
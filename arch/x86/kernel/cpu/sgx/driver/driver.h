@@ -5,14 +5,15 @@
 #include <crypto/hash.h>
 #include <linux/kref.h>
 #include <linux/mmu_notifier.h>
-#include <linux/radix-tree.h>
 #include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <asm/sgx_arch.h>
 #include <uapi/asm/sgx.h>
-#include "../arch.h"
 #include "../encl.h"
 #include "../encls.h"
+#include "../epc_cgroup.h"
 #include "../sgx.h"
 
 #define SGX_DRV_NR_DEVICES	2
@@ -14,6 +14,8 @@
 #include <linux/suspend.h>
 #include "driver.h"
 
+#define SGX_ADD_PAGES_BATCH	16
+
 struct sgx_add_page_req {
 	struct sgx_encl *encl;
 	struct sgx_encl_page *encl_page;
@@ -42,7 +44,7 @@ static int sgx_encl_grow(struct sgx_encl *encl)
 		va_page = kzalloc(sizeof(*va_page), GFP_KERNEL);
 		if (!va_page)
 			return -ENOMEM;
-		va_page->epc_page = sgx_alloc_va_page();
+		va_page->epc_page = sgx_alloc_va_page(encl);
 		if (IS_ERR(va_page->epc_page)) {
 			ret = PTR_ERR(va_page->epc_page);
 			kfree(va_page);
@@ -67,6 +69,68 @@ static int sgx_encl_grow(struct sgx_encl *encl)
 	return 0;
 }
 
+/*
+ * Give back a page slot taken with sgx_encl_grow() that ended up unused, and a
+ * VA page along with it when the count drops back to a VA page boundary and
+ * one of the VA pages has no slot in use.
+ */
+static void sgx_encl_shrink(struct sgx_encl *encl)
+{
+	struct sgx_va_page *va_page;
+
+	lockdep_assert_held(&encl->lock);
+
+	if (--encl->page_cnt % SGX_VA_SLOT_COUNT)
+		return;
+
+	list_for_each_entry(va_page, &encl->va_pages, list) {
+		if (bitmap_empty(va_page->slots, SGX_VA_SLOT_COUNT)) {
+			list_del(&va_page->list);
+			sgx_free_page(va_page->epc_page);
+			kfree(va_page);
+			break;
+		}
+	}
+}
+
+static int sgx_encl_eadd(struct sgx_encl *encl, struct sgx_epc_page *epc_page,
+			 unsigned long addr, struct page *src,
+			 struct sgx_secinfo *secinfo, unsigned long mrmask)
+{
+	u64 start = ktime_get_ns();
+	struct sgx_pageinfo pginfo;
+	int ret;
+	int i;
+
+	pginfo.secs = (unsigned long)sgx_epc_addr(encl->secs.epc_page);
+	pginfo.addr = addr;
+	pginfo.metadata = (unsigned long)secinfo;
+	pginfo.contents = (unsigned long)kmap_atomic(src);
+	ret = __eadd(&pginfo, sgx_epc_addr(epc_page));
+	kunmap_atomic((void *)(unsigned long)pginfo.contents);
+
+	if (ret) {
+		if (encls_failed(ret))
+			ENCLS_WARN(ret, "EADD");
+		return -EFAULT;
+	}
+
+	for_each_set_bit(i, &mrmask, 16) {
+		ret = __eextend(sgx_epc_addr(encl->secs.epc_page),
+				sgx_epc_addr(epc_page) + (i * 0x100));
+		if (ret) {
+			if (encls_failed(ret))
+				ENCLS_WARN(ret, "EEXTEND");
+			return -EFAULT;
+		}
+	}
+
+	atomic64_add(ktime_get_ns() - start, &encl->stats.add_page_ns);
+	atomic_long_inc(&encl->stats.nr_added);
+	atomic_long_inc(&encl->stats.nr_resident);
+	return 0;
+}
+
 static bool sgx_process_add_page_req(struct sgx_add_page_req *req,
 				     struct sgx_epc_page *epc_page)
 {
@@ -74,11 +138,9 @@ static bool sgx_process_add_page_req(struct sgx_add_page_req *req,
 	struct sgx_encl *encl = req->encl;
 	unsigned long page_index = sgx_encl_get_index(encl, encl_page);
 	struct sgx_secinfo secinfo;
-	struct sgx_pageinfo pginfo;
 	struct page *backing;
 	unsigned long addr;
 	int ret;
-	int i;
 
 	if (encl->flags &  SGX_ENCL_DEAD)
 		return false;
@@ -97,30 +159,13 @@ static bool sgx_process_add_page_req(struct sgx_add_page_req *req,
 	 */
 	memcpy(&secinfo, &req->secinfo, sizeof(secinfo));
 
-	pginfo.secs = (unsigned long)sgx_epc_addr(encl->secs.epc_page);
-	pginfo.addr = addr;
-	pginfo.metadata = (unsigned long)&secinfo;
-	pginfo.contents = (unsigned long)kmap_atomic(backing);
-	ret = __eadd(&pginfo, sgx_epc_addr(epc_page));
-	kunmap_atomic((void *)(unsigned long)pginfo.contents);
+	ret = sgx_encl_eadd(encl, epc_page, addr, backing, &secinfo,
+			    req->mrmask);
 
 	put_page(backing);
 
-	if (ret) {
-		if (encls_failed(ret))
-			ENCLS_WARN(ret, "EADD");
+	if (ret)
 		return false;
-	}
-
-	for_each_set_bit(i, &req->mrmask, 16) {
-		ret = __eextend(sgx_epc_addr(encl->secs.epc_page),
-				sgx_epc_addr(epc_page) + (i * 0x100));
-		if (ret) {
-			if (encls_failed(ret))
-				ENCLS_WARN(ret, "EEXTEND");
-			return false;
-		}
-	}
 
 	encl_page->encl = encl;
 	encl_page->epc_page = epc_page;
@@ -156,7 +201,8 @@ static void sgx_add_page_worker(struct work_struct *work)
 		if (skip_rest)
 			goto next;
 
-		epc_page = sgx_alloc_page(req->encl_page, true);
+		epc_page = sgx_alloc_page(req->encl_page, &encl->mempolicy,
+					  encl->epc_cg, true);
 
 		mutex_lock(&encl->lock);
 
@@ -242,19 +288,17 @@ static struct sgx_encl_page *sgx_encl_page_alloc(struct sgx_encl *encl,
 	struct sgx_encl_page *encl_page;
 	int ret;
 
-	if (radix_tree_lookup(&encl->page_tree, PFN_DOWN(addr)))
-		return ERR_PTR(-EEXIST);
 	encl_page = kzalloc(sizeof(*encl_page), GFP_KERNEL);
 	if (!encl_page)
 		return ERR_PTR(-ENOMEM);
 	encl_page->desc = addr;
 	encl_page->encl = encl;
 	encl_page->vm_prot_bits = calc_vm_prot_bits(prot, 0);
-	ret = radix_tree_insert(&encl->page_tree, PFN_DOWN(encl_page->desc),
-				encl_page);
+	ret = xa_insert(&encl->page_array, PFN_DOWN(encl_page->desc),
+			encl_page, GFP_KERNEL);
 	if (ret) {
 		kfree(encl_page);
-		return ERR_PTR(ret);
+		return ERR_PTR(ret == -EBUSY ? -EEXIST : ret);
 	}
 	return encl_page;
 }
@@ -297,7 +341,8 @@ static int sgx_encl_create(struct sgx_encl *encl, struct sgx_secs *secs)
 
 	INIT_WORK(&encl->work, sgx_add_page_worker);
 
-	secs_epc = sgx_alloc_page(&encl->secs, true);
+	secs_epc = sgx_alloc_page(&encl->secs, &encl->mempolicy, encl->epc_cg,
+				  true);
 	if (IS_ERR(secs_epc)) {
 		ret = PTR_ERR(secs_epc);
 		goto err_out;
@@ -327,6 +372,9 @@ static int sgx_encl_create(struct sgx_encl *encl, struct sgx_secs *secs)
 	encl->size = secs->size;
 	encl->ssaframesize = secs->ssa_frame_size;
 	encl->flags |= SGX_ENCL_CREATED;
+	atomic_long_inc(&encl->stats.nr_resident);
+
+	sgx_encl_lock_backing(encl);
 
 	mutex_unlock(&encl->lock);
 	return 0;
@@ -530,8 +578,7 @@ static int sgx_encl_add_page(struct sgx_encl *encl, unsigned long addr,
 
 	ret = __sgx_encl_add_page(encl, encl_page, data, secinfo, mrmask);
 	if (ret) {
-		radix_tree_delete(&encl_page->encl->page_tree,
-				  PFN_DOWN(encl_page->desc));
+		xa_erase(&encl->page_array, PFN_DOWN(encl_page->desc));
 		kfree(encl_page);
 	}
 
@@ -540,6 +587,21 @@ static int sgx_encl_add_page(struct sgx_encl *encl, unsigned long addr,
 	return ret;
 }
 
+static unsigned long sgx_secinfo_to_prot(struct sgx_secinfo *secinfo)
+{
+	unsigned long prot;
+
+	prot = _calc_vm_trans(secinfo->flags, SGX_SECINFO_R, PROT_READ)  |
+	       _calc_vm_trans(secinfo->flags, SGX_SECINFO_W, PROT_WRITE) |
+	       _calc_vm_trans(secinfo->flags, SGX_SECINFO_X, PROT_EXEC);
+
+	/* TCS pages need to be RW in the PTEs, but can be 0 in the EPCM. */
+	if ((secinfo->flags & SGX_SECINFO_PAGE_TYPE_MASK) == SGX_SECINFO_TCS)
+		prot |= PROT_READ | PROT_WRITE;
+
+	return prot;
+}
+
 static int sgx_encl_page_import_user(void *dst, unsigned long src,
 				     unsigned long prot)
 {
@@ -610,13 +672,7 @@ static long sgx_ioc_enclave_add_page(struct file *filep, void __user *arg)
 
 	data = kmap(data_page);
 
-	prot = _calc_vm_trans(secinfo.flags, SGX_SECINFO_R, PROT_READ)  |
-	       _calc_vm_trans(secinfo.flags, SGX_SECINFO_W, PROT_WRITE) |
-	       _calc_vm_trans(secinfo.flags, SGX_SECINFO_X, PROT_EXEC);
-
-	/* TCS pages need to be RW in the PTEs, but can be 0 in the EPCM. */
-	if ((secinfo.flags & SGX_SECINFO_PAGE_TYPE_MASK) == SGX_SECINFO_TCS)
-		prot |= PROT_READ | PROT_WRITE;
+	prot = sgx_secinfo_to_prot(&secinfo);
 
 	ret = sgx_encl_page_import_user(data, addp.src, prot);
 	if (ret)
@@ -633,6 +689,268 @@ static long sgx_ioc_enclave_add_page(struct file *filep, void __user *arg)
 	return ret;
 }
 
+/*
+ * Pin up to @nr source pages.  For an executable page, VM_MAYEXEC of the
+ * source VMA is queried as an indirect path_noexec() check, under the same
+ * mmap_sem hold as the pinning so that the VMA cannot be replaced in between.
+ * Return the number of pages pinned, or -errno.
+ */
+static long sgx_encl_pin_src(unsigned long src, unsigned int nr,
+			     unsigned long prot, struct page **pages)
+{
+	struct vm_area_struct *vmas[SGX_ADD_PAGES_BATCH];
+	long ret;
+	long i;
+
+	down_read(&current->mm->mmap_sem);
+
+	ret = get_user_pages(src, nr, 0, pages, vmas);
+	if (ret > 0 && (prot & PROT_EXEC)) {
+		for (i = 0; i < ret; i++) {
+			if (!(vmas[i]->vm_flags & VM_MAYEXEC))
+				break;
+		}
+
+		if (i < ret) {
+			for (i = 0; i < ret; i++)
+				put_page(pages[i]);
+			ret = -EACCES;
+		}
+	}
+
+	up_read(&current->mm->mmap_sem);
+	return ret ? ret : -EFAULT;
+}
+
+/*
+ * Replace a pinned TCS source page with a copy, so that the TCS fed to EADD is
+ * the one that was validated and cannot be changed by user space in between.
+ */
+static int sgx_encl_copy_tcs(struct sgx_encl *encl, struct page **src)
+{
+	struct page *copy;
+	int ret;
+
+	copy = alloc_page(GFP_HIGHUSER);
+	if (!copy)
+		return -ENOMEM;
+
+	copy_highpage(copy, *src);
+	put_page(*src);
+	*src = copy;
+
+	ret = sgx_validate_tcs(encl, kmap(copy));
+	kunmap(copy);
+	return ret;
+}
+
+/*
+ * Add up to SGX_ADD_PAGES_BATCH pages.  The source pages are pinned and fed
+ * to EADD directly, except for a TCS which is copied first, and all of the EPC
+ * pages are allocated before encl->lock is taken once for the whole batch.
+ * The number of pages added is returned in @nr_added, also on failure.
+ */
+static int sgx_encl_add_pages_batch(struct sgx_encl *encl, unsigned long addr,
+				    unsigned long src, unsigned int nr,
+				    struct sgx_secinfo *secinfo,
+				    unsigned long mrmask, unsigned long prot,
+				    unsigned int *nr_added)
+{
+	u64 page_type = secinfo->flags & SGX_SECINFO_PAGE_TYPE_MASK;
+	struct sgx_epc_page *epc_pages[SGX_ADD_PAGES_BATCH];
+	struct page *src_pages[SGX_ADD_PAGES_BATCH];
+	struct sgx_encl_page *encl_page;
+	unsigned int nr_slots = 0;
+	unsigned int nr_alloced;
+	unsigned int next = 0;
+	unsigned int i;
+	long pinned;
+	int ret = 0;
+
+	*nr_added = 0;
+
+	pinned = sgx_encl_pin_src(src, nr, prot, src_pages);
+	if (pinned < 0)
+		return pinned;
+
+	nr = pinned;
+
+	if (page_type == SGX_SECINFO_TCS) {
+		for (i = 0; i < nr && !ret; i++)
+			ret = sgx_encl_copy_tcs(encl, &src_pages[i]);
+
+		if (ret)
+			goto out_put;
+	}
+
+	for (nr_alloced = 0; nr_alloced < nr; nr_alloced++) {
+		ret = sgx_encl_grow(encl);
+		if (ret)
+			break;
+
+		nr_slots++;
+
+		epc_pages[nr_alloced] = sgx_alloc_page(NULL, &encl->mempolicy,
+						       encl->epc_cg, true);
+		if (IS_ERR(epc_pages[nr_alloced])) {
+			ret = PTR_ERR(epc_pages[nr_alloced]);
+			break;
+		}
+	}
+
+	mutex_lock(&encl->lock);
+
+	if (!(encl->flags & SGX_ENCL_CREATED) ||
+	    (encl->flags & (SGX_ENCL_INITIALIZED | SGX_ENCL_DEAD))) {
+		ret = -EFAULT;
+		goto out_unlock;
+	}
+
+	if (addr < encl->base ||
+	    addr + nr_alloced * PAGE_SIZE > encl->base + encl->size) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < nr_alloced; i++) {
+		encl_page = sgx_encl_page_alloc(encl, addr + i * PAGE_SIZE,
+						prot);
+		if (IS_ERR(encl_page)) {
+			ret = PTR_ERR(encl_page);
+			break;
+		}
+
+		if (page_type == SGX_SECINFO_TCS)
+			encl_page->desc |= SGX_ENCL_PAGE_TCS;
+
+		ret = sgx_encl_eadd(encl, epc_pages[i], addr + i * PAGE_SIZE,
+				    src_pages[i], secinfo, mrmask);
+		if (ret) {
+			xa_erase(&encl->page_array,
+				 PFN_DOWN(encl_page->desc));
+			kfree(encl_page);
+			sgx_free_page(epc_pages[i++]);
+			sgx_encl_destroy(encl);
+			break;
+		}
+
+		epc_pages[i]->owner = encl_page;
+		encl_page->epc_page = epc_pages[i];
+		encl->secs_child_cnt++;
+		sgx_mark_page_reclaimable(encl_page->epc_page);
+		(*nr_added)++;
+	}
+
+	next = i;
+
+out_unlock:
+	for (i = *nr_added; i < nr_slots; i++)
+		sgx_encl_shrink(encl);
+
+	mutex_unlock(&encl->lock);
+
+	for (i = next; i < nr_alloced; i++)
+		sgx_free_page(epc_pages[i]);
+
+out_put:
+	for (i = 0; i < nr; i++)
+		put_page(src_pages[i]);
+
+	return ret;
+}
+
+/**
+ * sgx_ioc_enclave_add_pages - handler for %SGX_IOC_ENCLAVE_ADD_PAGES
+ * @filep:	open file to /dev/sgx
+ * @arg:	a user pointer to a struct sgx_enclave_add_pages instance
+ *
+ * Add a range of pages with the same SECINFO and measurement mask to an
+ * uninitialized enclave.  Unlike %SGX_IOC_ENCLAVE_ADD_PAGE, the pages are
+ * added synchronously: the source pages are pinned and EADD reads them in
+ * place, without a bounce buffer or a detour through the backing storage.
+ * The pages queued by %SGX_IOC_ENCLAVE_ADD_PAGE are flushed first so that the
+ * order of the measurement follows the order of the ioctls.
+ *
+ * The ioctl stops between batches on a pending signal.  The number of bytes
+ * added is written back to @count in all cases, which allows the caller to
+ * resume an interrupted call.
+ *
+ * Return:
+ *   0 on success,
+ *   -EINTR if interrupted by a signal,
+ *   -EINVAL if the range or the SECINFO is invalid,
+ *   -EACCES if the source is located in a noexec partition,
+ *   -errno otherwise
+ */
+static long sgx_ioc_enclave_add_pages(struct file *filep, void __user *arg)
+{
+	struct sgx_encl *encl = filep->private_data;
+	struct sgx_enclave_add_pages addp;
+	struct sgx_secinfo secinfo;
+	unsigned int nr_added;
+	unsigned long prot;
+	unsigned int nr;
+	bool created;
+	int ret = 0;
+
+	if (copy_from_user(&addp, arg, sizeof(addp)))
+		return -EFAULT;
+
+	if (!addp.length || !IS_ALIGNED(addp.addr | addp.src | addp.length,
+					PAGE_SIZE) ||
+	    addp.addr + addp.length < addp.addr ||
+	    memchr_inv(addp.reserved, 0, sizeof(addp.reserved)))
+		return -EINVAL;
+
+	if (copy_from_user(&secinfo, (void __user *)addp.secinfo,
+			   sizeof(secinfo)))
+		return -EFAULT;
+
+	if (sgx_validate_secinfo(&secinfo))
+		return -EINVAL;
+
+	prot = sgx_secinfo_to_prot(&secinfo);
+
+	/* encl->work is only initialized by ECREATE. */
+	mutex_lock(&encl->lock);
+	created = encl->flags & SGX_ENCL_CREATED;
+	mutex_unlock(&encl->lock);
+
+	if (!created)
+		return -EINVAL;
+
+	flush_work(&encl->work);
+
+	for (addp.count = 0; addp.count < addp.length; ) {
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		nr = min_t(u64, (addp.length - addp.count) >> PAGE_SHIFT,
+			   SGX_ADD_PAGES_BATCH);
+
+		ret = sgx_encl_add_pages_batch(encl, addp.addr + addp.count,
+					       addp.src + addp.count, nr,
+					       &secinfo, addp.mrmask, prot,
+					       &nr_added);
+		addp.count += (u64)nr_added << PAGE_SHIFT;
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+
+	/* A restart would add the pages again, let the caller resume. */
+	if (ret == -ERESTARTSYS)
+		ret = -EINTR;
+
+	if (copy_to_user(arg, &addp, sizeof(addp)))
+		return -EFAULT;
+
+	return ret;
+}
+
 static int __sgx_get_key_hash(struct crypto_shash *tfm, const void *modulus,
 			      void *hash)
 {
@@ -816,6 +1134,54 @@ static long sgx_ioc_enclave_set_attribute(struct file *filep, void __user *arg)
 	return ret;
 }
 
+/**
+ * sgx_ioc_enclave_set_mempolicy - handler for %SGX_IOC_ENCLAVE_SET_MEMPOLICY
+ * @filep:	open file to /dev/sgx
+ * @arg:	userspace pointer to a struct sgx_enclave_set_mempolicy instance
+ *
+ * Set the NUMA placement policy for the EPC pages of the enclave.  The policy
+ * must be set before %SGX_IOC_ENCLAVE_CREATE and cannot be changed after it,
+ * i.e. it is fixed while any EPC is allocated for the enclave.
+ *
+ * Return:
+ *   0 on success,
+ *   -EBUSY if the enclave has already been created,
+ *   -errno otherwise
+ */
+static long sgx_ioc_enclave_set_mempolicy(struct file *filep, void __user *arg)
+{
+	struct sgx_encl *encl = filep->private_data;
+	struct sgx_enclave_set_mempolicy params;
+	nodemask_t nodes = NODE_MASK_NONE;
+	unsigned long mask;
+	int nid;
+	int ret;
+
+	if (copy_from_user(&params, arg, sizeof(params)))
+		return -EFAULT;
+
+	if (params.reserved)
+		return -EINVAL;
+
+	mask = params.nodemask;
+	for_each_set_bit(nid, &mask, BITS_PER_LONG) {
+		if (nid >= MAX_NUMNODES)
+			return -EINVAL;
+
+		node_set(nid, nodes);
+	}
+
+	mutex_lock(&encl->lock);
+
+	if (encl->flags & SGX_ENCL_CREATED)
+		ret = -EBUSY;
+	else
+		ret = sgx_mempolicy_init(&encl->mempolicy, params.mode, &nodes);
+
+	mutex_unlock(&encl->lock);
+	return ret;
+}
+
 long sgx_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
@@ -827,6 +1193,10 @@ long sgx_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 		return sgx_ioc_enclave_init(filep, (void __user *)arg);
 	case SGX_IOC_ENCLAVE_SET_ATTRIBUTE:
 		return sgx_ioc_enclave_set_attribute(filep, (void __user *)arg);
+	case SGX_IOC_ENCLAVE_SET_MEMPOLICY:
+		return sgx_ioc_enclave_set_mempolicy(filep, (void __user *)arg);
+	case SGX_IOC_ENCLAVE_ADD_PAGES:
+		return sgx_ioc_enclave_add_pages(filep, (void __user *)arg);
 	default:
 		return -ENOIOCTLCMD;
 	}
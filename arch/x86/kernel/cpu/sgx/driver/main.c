@@ -6,6 +6,7 @@
 #include <linux/mman.h>
 #include <linux/platform_device.h>
 #include <linux/security.h>
+#include <linux/seq_file.h>
 #include <linux/suspend.h>
 #include <asm/traps.h>
 #include "driver.h"
@@ -34,10 +35,16 @@ static int sgx_open(struct inode *inode, struct file *file)
 	kref_init(&encl->refcount);
 	INIT_LIST_HEAD(&encl->add_page_reqs);
 	INIT_LIST_HEAD(&encl->va_pages);
-	INIT_RADIX_TREE(&encl->page_tree, GFP_KERNEL);
+	xa_init(&encl->page_array);
 	mutex_init(&encl->lock);
 	INIT_LIST_HEAD(&encl->mm_list);
 	spin_lock_init(&encl->mm_lock);
+	INIT_LIST_HEAD(&encl->active_page_list);
+	INIT_LIST_HEAD(&encl->inactive_page_list);
+	INIT_LIST_HEAD(&encl->active_link);
+	spin_lock_init(&encl->active_lock);
+	spin_lock_init(&encl->ra_lock);
+	encl->ra_max_window = SGX_FAULT_AROUND_MAX;
 
 	ret = init_srcu_struct(&encl->srcu);
 	if (ret) {
@@ -45,6 +52,7 @@ static int sgx_open(struct inode *inode, struct file *file)
 		return ret;
 	}
 
+	encl->epc_cg = sgx_epc_cgroup_get_current();
 	file->private_data = encl;
 
 	return 0;
@@ -142,6 +150,42 @@ static unsigned long sgx_get_unmapped_area(struct file *file,
 	return addr;
 }
 
+/*
+ * Report the reclaimable EPC pages of the enclave, the number of them
+ * accessed during the last sweep of the aging, i.e. its working set size, how
+ * many of the pages loaded by the fault-around were used, and the counters of
+ * &sgx_encl_stats.
+ */
+static void sgx_show_fdinfo(struct seq_file *m, struct file *file)
+{
+	struct sgx_encl *encl = file->private_data;
+	struct sgx_encl_stats *stats = &encl->stats;
+
+	seq_printf(m, "sgx_active_pages:\t%lu\n",
+		   READ_ONCE(encl->nr_active_pages));
+	seq_printf(m, "sgx_inactive_pages:\t%lu\n",
+		   READ_ONCE(encl->nr_inactive_pages));
+	seq_printf(m, "sgx_wss_pages:\t%lu\n", READ_ONCE(encl->wss_pages));
+	seq_printf(m, "sgx_prefetch_hits:\t%lu\n", READ_ONCE(encl->ra_hits));
+	seq_printf(m, "sgx_prefetch_misses:\t%lu\n",
+		   READ_ONCE(encl->ra_misses));
+	seq_printf(m, "sgx_resident_pages:\t%ld\n",
+		   atomic_long_read(&stats->nr_resident));
+	seq_printf(m, "sgx_faults:\t%ld\n",
+		   atomic_long_read(&stats->nr_faults));
+	seq_printf(m, "sgx_evictions:\t%ld\n",
+		   atomic_long_read(&stats->nr_evicted));
+	seq_printf(m, "sgx_reloads:\t%ld\n",
+		   atomic_long_read(&stats->nr_reloaded));
+	seq_printf(m, "sgx_etrack_retries:\t%ld\n",
+		   atomic_long_read(&stats->nr_etrack_retries));
+	seq_printf(m, "sgx_ipis:\t%ld\n", atomic_long_read(&stats->nr_ipis));
+	seq_printf(m, "sgx_added_pages:\t%ld\n",
+		   atomic_long_read(&stats->nr_added));
+	seq_printf(m, "sgx_add_page_ns:\t%lld\n",
+		   (long long)atomic64_read(&stats->add_page_ns));
+}
+
 static const struct file_operations sgx_encl_fops = {
 	.owner			= THIS_MODULE,
 	.open			= sgx_open,
@@ -152,6 +196,7 @@ static const struct file_operations sgx_encl_fops = {
 #endif
 	.mmap			= sgx_mmap,
 	.get_unmapped_area	= sgx_get_unmapped_area,
+	.show_fdinfo		= sgx_show_fdinfo,
 };
 
 const struct file_operations sgx_provision_fops = {
@@ -202,7 +247,8 @@ int __init sgx_drv_init(void)
 	int ret;
 	int i;
 
-	if (!boot_cpu_has(X86_FEATURE_SGX_LC)) {
+	if (!boot_cpu_has(X86_FEATURE_SGX_LC) &&
+	    !IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU)) {
 		pr_info("sgx: The public key MSRs are not writable\n");
 		return -ENODEV;
 	}
@@ -215,12 +261,12 @@ int __init sgx_drv_init(void)
 	if (ret < 0)
 		goto err_bus;
 
-	cpuid_count(SGX_CPUID, 0, &eax, &ebx, &ecx, &edx);
+	sgx_cpuid_count(0, &eax, &ebx, &ecx, &edx);
 	sgx_misc_reserved_mask = ~ebx | SGX_MISC_RESERVED_MASK;
 	sgx_encl_size_max_64 = 1ULL << ((edx >> 8) & 0xFF);
 	sgx_encl_size_max_32 = 1ULL << (edx & 0xFF);
 
-	cpuid_count(SGX_CPUID, 1, &eax, &ebx, &ecx, &edx);
+	sgx_cpuid_count(1, &eax, &ebx, &ecx, &edx);
 
 	attr_mask = (((u64)ebx) << 32) + (u64)eax;
 	sgx_attributes_reserved_mask = ~attr_mask | SGX_ATTR_RESERVED_MASK;
@@ -0,0 +1,770 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+// Copyright(c) 2016-19 Intel Corporation.
+/*
+ * Software backend for the ENCLS leaf functions.
+ *
+ * The EPC is carved out of regular RAM and the EPCM is kept in a shadow array
+ * with one entry per emulated EPC page.  The emulation implements the page
+ * state machine of the architecture (valid, blocked, tracked, VA slots, SECS
+ * child counts) closely enough that the allocator, the reclaimer and the
+ * driver take the same code paths as on real hardware, including the
+ * SGX_NOT_TRACKED retry in the EWB flow.  It does not provide any of the
+ * security properties of SGX: the emulated EPC is ordinary memory, evicted
+ * pages are merely scrambled, and ENCLU is not emulated, i.e. enclaves can be
+ * built, mapped, faulted and reclaimed but not entered.
+ */
+
+#include <linux/gfp.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <asm/traps.h>
+#include "emu.h"
+#include "encls.h"
+#include "sgx.h"
+
+#define SGX_EMU_GP	(ENCLS_FAULT_FLAG | X86_TRAP_GP)
+#define SGX_EMU_PF	(ENCLS_FAULT_FLAG | X86_TRAP_PF)
+#define SGX_EMU_UD	(ENCLS_FAULT_FLAG | X86_TRAP_UD)
+
+/**
+ * enum sgx_emu_epcm_flags - state bits of an emulated EPCM entry
+ * %SGX_EMU_EPCM_VALID:		The page belongs to an enclave or is a VA page.
+ * %SGX_EMU_EPCM_BLOCKED:	The page has been blocked with EBLOCK.
+ */
+enum sgx_emu_epcm_flags {
+	SGX_EMU_EPCM_VALID	= BIT(0),
+	SGX_EMU_EPCM_BLOCKED	= BIT(1),
+};
+
+/**
+ * struct sgx_emu_epcm - an emulated EPCM entry
+ * @lock:		serializes leaf functions operating on the page
+ * @flags:		&enum sgx_emu_epcm_flags
+ * @type:		&enum sgx_page_type
+ * @secinfo:		SECINFO flags the page was added or loaded with
+ * @linaddr:		address of the page inside the ELRANGE
+ * @secs:		EPC address of the SECS for TCS and REG pages
+ * @block_epoch:	SECS epoch at the time the page was blocked
+ */
+struct sgx_emu_epcm {
+	spinlock_t lock;
+	unsigned int flags;
+	unsigned int type;
+	u64 secinfo;
+	u64 linaddr;
+	void *secs;
+	u64 block_epoch;
+};
+
+/**
+ * struct sgx_emu_secs - emulated microarchitectural SECS state
+ * @eid:		enclave identifier
+ * @epoch:		current tracking epoch, incremented by ETRACK
+ * @mrenclave:		running (non-cryptographic) enclave measurement
+ * @child_cnt:		number of resident TCS and REG pages
+ * @initialized:	set by EINIT
+ *
+ * The state lives in the reserved area of the SECS page itself, i.e. it is
+ * written out by EWB and restored by ELDU together with the rest of the SECS.
+ */
+struct sgx_emu_secs {
+	u64 eid;
+	u64 epoch;
+	u64 mrenclave;
+	u32 child_cnt;
+	u32 initialized;
+} __packed;
+
+/**
+ * struct sgx_emu_mac - contents of the MAC field of an emulated PCMD
+ * @version:	the version stored to the VA slot by EWB
+ * @csum:	checksum of the plaintext page
+ */
+struct sgx_emu_mac {
+	u64 version;
+	u32 csum;
+	u32 reserved;
+} __packed;
+
+struct sgx_emu_section {
+	void *va;
+	u64 pa;
+	u64 size;
+	struct sgx_emu_epcm *epcm;
+};
+
+static struct sgx_emu_section sgx_emu_sections[SGX_MAX_EPC_SECTIONS];
+static int sgx_emu_nr_sections;
+static int sgx_emu_nid = NUMA_NO_NODE;
+static u64 sgx_emu_epc_size = SZ_32M;
+static atomic64_t sgx_emu_eid;
+static atomic64_t sgx_emu_version;
+static u64 sgx_emu_paging_key;
+
+static int __init sgx_emu_parse_epc_size(char *arg)
+{
+	if (!arg)
+		return -EINVAL;
+
+	sgx_emu_epc_size = memparse(arg, NULL) & PAGE_MASK;
+	return 0;
+}
+early_param("sgx_emu_epc", sgx_emu_parse_epc_size);
+
+/**
+ * sgx_emu_alloc_epc() - Allocate an emulated EPC section
+ * @pa:		physical address of the section
+ *
+ * Allocate physically contiguous RAM for the next emulated EPC section, and
+ * the shadow EPCM for it. The total size is limited by the sgx_emu_epc= kernel
+ * parameter and a single section by the largest buddy allocation. The sections
+ * are spread round-robin over the online nodes, like the per-node EPC of
+ * a multi-socket system.
+ *
+ * Return: the size of the section, or zero if no more EPC can be allocated
+ */
+u64 __init sgx_emu_alloc_epc(u64 *pa)
+{
+	struct sgx_emu_section *section;
+	unsigned long nr_pages, i;
+	struct page *pages;
+	unsigned int order;
+
+	if (sgx_emu_nr_sections == SGX_MAX_EPC_SECTIONS ||
+	    sgx_emu_epc_size < PAGE_SIZE)
+		return 0;
+
+	nr_pages = min_t(u64, sgx_emu_epc_size >> PAGE_SHIFT,
+			 MAX_ORDER_NR_PAGES);
+	order = ilog2(nr_pages);
+	nr_pages = 1UL << order;
+
+	section = &sgx_emu_sections[sgx_emu_nr_sections];
+	section->epcm = vzalloc(array_size(nr_pages, sizeof(*section->epcm)));
+	if (!section->epcm)
+		return 0;
+
+	sgx_emu_nid = next_online_node(sgx_emu_nid);
+	if (sgx_emu_nid >= MAX_NUMNODES)
+		sgx_emu_nid = first_online_node;
+
+	pages = alloc_pages_node(sgx_emu_nid, GFP_KERNEL | __GFP_ZERO |
+				 __GFP_NOWARN | __GFP_THISNODE, order);
+	if (!pages)
+		pages = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN,
+				    order);
+	if (!pages) {
+		vfree(section->epcm);
+		section->epcm = NULL;
+		return 0;
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		spin_lock_init(&section->epcm[i].lock);
+
+	if (!sgx_emu_paging_key)
+		sgx_emu_paging_key = get_random_u64();
+
+	section->va = page_address(pages);
+	section->pa = page_to_phys(pages);
+	section->size = nr_pages << PAGE_SHIFT;
+	sgx_emu_epc_size -= section->size;
+	sgx_emu_nr_sections++;
+
+	*pa = section->pa;
+	return section->size;
+}
+
+/**
+ * sgx_emu_free_epc() - Free an emulated EPC section
+ * @pa:		physical address of the section
+ */
+void __init sgx_emu_free_epc(u64 pa)
+{
+	struct sgx_emu_section *section;
+	int i;
+
+	for (i = 0; i < sgx_emu_nr_sections; i++) {
+		section = &sgx_emu_sections[i];
+		if (section->pa != pa || !section->epcm)
+			continue;
+
+		__free_pages(virt_to_page(section->va),
+			     get_order(section->size));
+		vfree(section->epcm);
+		section->epcm = NULL;
+		sgx_emu_epc_size += section->size;
+	}
+}
+
+/**
+ * sgx_emu_cpuid() - Synthesize an SGX CPUID sub-leaf
+ * @sub_leaf:	sub-leaf of %SGX_CPUID
+ * @eax:	EAX output
+ * @ebx:	EBX output
+ * @ecx:	ECX output
+ * @edx:	EDX output
+ *
+ * Report SGX1 with EXINFO, 2^36 and 2^31 byte maximum enclave sizes, all the
+ * architectural attributes and x87/SSE for XFRM. EPC sections are not
+ * enumerated through CPUID but by sgx_emu_alloc_epc().
+ */
+void sgx_emu_cpuid(u32 sub_leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+	*eax = 0;
+	*ebx = 0;
+	*ecx = 0;
+	*edx = 0;
+
+	switch (sub_leaf) {
+	case 0:
+		*eax = BIT(0);
+		*ebx = SGX_MISC_EXINFO;
+		*edx = (36 << 8) | 31;
+		break;
+	case 1:
+		*eax = SGX_ATTR_INIT | SGX_ATTR_DEBUG | SGX_ATTR_MODE64BIT |
+		       SGX_ATTR_PROVISIONKEY | SGX_ATTR_EINITTOKENKEY;
+		*ecx = 0x3;
+		break;
+	}
+}
+
+static struct sgx_emu_epcm *sgx_emu_epcm(void *addr)
+{
+	struct sgx_emu_section *section;
+	int i;
+
+	for (i = 0; i < sgx_emu_nr_sections; i++) {
+		section = &sgx_emu_sections[i];
+		if (addr >= section->va && addr < section->va + section->size)
+			return &section->epcm[(addr - section->va) >>
+					      PAGE_SHIFT];
+	}
+
+	return NULL;
+}
+
+static inline struct sgx_emu_secs *sgx_emu_secs(void *secs)
+{
+	return (struct sgx_emu_secs *)((struct sgx_secs *)secs)->reserved4;
+}
+
+static inline bool sgx_emu_is_child(struct sgx_emu_epcm *epcm)
+{
+	return epcm->type == SGX_PAGE_TYPE_TCS ||
+	       epcm->type == SGX_PAGE_TYPE_REG ||
+	       epcm->type == SGX_PAGE_TYPE_TRIM;
+}
+
+static inline bool sgx_emu_is_valid_secs(struct sgx_emu_epcm *epcm)
+{
+	return (epcm->flags & SGX_EMU_EPCM_VALID) &&
+	       epcm->type == SGX_PAGE_TYPE_SECS;
+}
+
+static void sgx_emu_measure(struct sgx_emu_secs *state, const void *data,
+			    u32 len)
+{
+	u32 lo = jhash(data, len, lower_32_bits(state->mrenclave));
+	u32 hi = jhash(data, len, upper_32_bits(state->mrenclave));
+
+	state->mrenclave = ((u64)hi << 32) | lo;
+}
+
+/* Scramble or unscramble a page, the transform is its own inverse. */
+static void sgx_emu_scramble(void *dst, const void *src, u64 version)
+{
+	u64 key = sgx_emu_paging_key ^ version;
+	const u64 *s = src;
+	u64 *d = dst;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(u64); i++)
+		d[i] = s[i] ^ key;
+}
+
+static inline u32 sgx_emu_csum(const void *addr, u64 version)
+{
+	return jhash2(addr, PAGE_SIZE / sizeof(u32), lower_32_bits(version));
+}
+
+int sgx_emu_ecreate(struct sgx_pageinfo *pginfo, void *secs)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(secs);
+	struct sgx_emu_secs *state;
+	int ret = 0;
+
+	if (!epcm || ((unsigned long)secs & ~PAGE_MASK))
+		return SGX_EMU_PF;
+
+	spin_lock(&epcm->lock);
+
+	if (epcm->flags & SGX_EMU_EPCM_VALID) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	memcpy(secs, (void *)(unsigned long)pginfo->contents, PAGE_SIZE);
+
+	state = sgx_emu_secs(secs);
+	memset(state, 0, sizeof(*state));
+	state->eid = atomic64_inc_return(&sgx_emu_eid);
+
+	epcm->flags = SGX_EMU_EPCM_VALID;
+	epcm->type = SGX_PAGE_TYPE_SECS;
+	epcm->secinfo = SGX_SECINFO_SECS;
+	epcm->linaddr = 0;
+	epcm->secs = NULL;
+
+out:
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_eadd(struct sgx_pageinfo *pginfo, void *addr)
+{
+	struct sgx_secinfo *secinfo = (void *)(unsigned long)pginfo->metadata;
+	void *secs = (void *)(unsigned long)pginfo->secs;
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm = sgx_emu_epcm(secs);
+	u64 type = (secinfo->flags & SGX_SECINFO_PAGE_TYPE_MASK) >> 8;
+	struct sgx_emu_secs *state;
+	u64 mdata[2];
+	int ret = 0;
+
+	if (!epcm || !secs_epcm)
+		return SGX_EMU_PF;
+
+	if (type != SGX_PAGE_TYPE_TCS && type != SGX_PAGE_TYPE_REG)
+		return SGX_EMU_GP;
+
+	spin_lock(&epcm->lock);
+	spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+
+	state = sgx_emu_secs(secs);
+	if ((epcm->flags & SGX_EMU_EPCM_VALID) ||
+	    !sgx_emu_is_valid_secs(secs_epcm) || state->initialized) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	memcpy(addr, (void *)(unsigned long)pginfo->contents, PAGE_SIZE);
+
+	epcm->flags = SGX_EMU_EPCM_VALID;
+	epcm->type = type;
+	epcm->secinfo = secinfo->flags;
+	epcm->linaddr = pginfo->addr;
+	epcm->secs = secs;
+	state->child_cnt++;
+
+	mdata[0] = pginfo->addr - ((struct sgx_secs *)secs)->base;
+	mdata[1] = secinfo->flags;
+	sgx_emu_measure(state, mdata, sizeof(mdata));
+
+out:
+	spin_unlock(&secs_epcm->lock);
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_eextend(void *secs, void *addr)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm = sgx_emu_epcm(secs);
+	int ret = 0;
+
+	if (!epcm || !secs_epcm)
+		return SGX_EMU_PF;
+
+	if ((unsigned long)addr & 0xFF)
+		return SGX_EMU_GP;
+
+	spin_lock(&epcm->lock);
+	spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+
+	if (!(epcm->flags & SGX_EMU_EPCM_VALID) || epcm->secs != secs ||
+	    !sgx_emu_is_valid_secs(secs_epcm) ||
+	    sgx_emu_secs(secs)->initialized) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	sgx_emu_measure(sgx_emu_secs(secs), addr, 0x100);
+
+out:
+	spin_unlock(&secs_epcm->lock);
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+/*
+ * The emulation has no launch control or signature verification, EINIT only
+ * seals the measurement and moves the enclave to the initialized state.
+ */
+int sgx_emu_einit(void *sigstruct, struct sgx_einittoken *einittoken,
+		  void *secs)
+{
+	struct sgx_emu_epcm *secs_epcm = sgx_emu_epcm(secs);
+	struct sgx_emu_secs *state;
+	int ret = 0;
+
+	if (!secs_epcm)
+		return SGX_EMU_PF;
+
+	spin_lock(&secs_epcm->lock);
+
+	state = sgx_emu_secs(secs);
+	if (!sgx_emu_is_valid_secs(secs_epcm) || state->initialized) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	memcpy(((struct sgx_secs *)secs)->mrenclave, &state->mrenclave,
+	       sizeof(state->mrenclave));
+	state->initialized = 1;
+
+out:
+	spin_unlock(&secs_epcm->lock);
+	return ret;
+}
+
+int sgx_emu_eremove(void *addr)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm;
+	int ret = 0;
+
+	if (!epcm)
+		return SGX_EMU_PF;
+
+	spin_lock(&epcm->lock);
+
+	if (!(epcm->flags & SGX_EMU_EPCM_VALID))
+		goto out;
+
+	if (epcm->type == SGX_PAGE_TYPE_SECS &&
+	    sgx_emu_secs(addr)->child_cnt) {
+		ret = SGX_CHILD_PRESENT;
+		goto out;
+	}
+
+	if (sgx_emu_is_child(epcm)) {
+		secs_epcm = sgx_emu_epcm(epcm->secs);
+		spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+		sgx_emu_secs(epcm->secs)->child_cnt--;
+		spin_unlock(&secs_epcm->lock);
+	}
+
+	epcm->flags = 0;
+
+out:
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+static int sgx_emu_edbg(void *addr, unsigned long *data, bool write)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	int ret = 0;
+
+	if (!epcm)
+		return SGX_EMU_PF;
+
+	if ((unsigned long)addr & (sizeof(unsigned long) - 1))
+		return SGX_EMU_GP;
+
+	spin_lock(&epcm->lock);
+
+	if (!(epcm->flags & SGX_EMU_EPCM_VALID) || !sgx_emu_is_child(epcm) ||
+	    !(((struct sgx_secs *)epcm->secs)->attributes & SGX_ATTR_DEBUG)) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	if (write)
+		*(unsigned long *)addr = *data;
+	else
+		*data = *(unsigned long *)addr;
+
+out:
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_edbgrd(void *addr, unsigned long *data)
+{
+	return sgx_emu_edbg(addr, data, false);
+}
+
+int sgx_emu_edbgwr(void *addr, unsigned long *data)
+{
+	return sgx_emu_edbg(addr, data, true);
+}
+
+int sgx_emu_etrack(void *addr)
+{
+	struct sgx_emu_epcm *secs_epcm = sgx_emu_epcm(addr);
+	int ret = 0;
+
+	if (!secs_epcm)
+		return SGX_EMU_PF;
+
+	spin_lock(&secs_epcm->lock);
+
+	if (!sgx_emu_is_valid_secs(secs_epcm)) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	/*
+	 * No logical processor can be inside an emulated enclave, hence the
+	 * tracking cycle completes immediately.
+	 */
+	sgx_emu_secs(addr)->epoch++;
+
+out:
+	spin_unlock(&secs_epcm->lock);
+	return ret;
+}
+
+int sgx_emu_eblock(void *addr)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm;
+	int ret = 0;
+
+	if (!epcm)
+		return SGX_EMU_PF;
+
+	spin_lock(&epcm->lock);
+
+	if (!(epcm->flags & SGX_EMU_EPCM_VALID))
+		ret = SGX_PG_INVLD;
+	else if (epcm->type == SGX_PAGE_TYPE_SECS)
+		ret = SGX_PG_IS_SECS;
+	else if (epcm->type == SGX_PAGE_TYPE_VA)
+		ret = SGX_NOTBLOCKABLE;
+	else if (epcm->flags & SGX_EMU_EPCM_BLOCKED)
+		ret = SGX_BLKSTATE;
+
+	if (!ret) {
+		secs_epcm = sgx_emu_epcm(epcm->secs);
+		spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+		epcm->block_epoch = sgx_emu_secs(epcm->secs)->epoch;
+		epcm->flags |= SGX_EMU_EPCM_BLOCKED;
+		spin_unlock(&secs_epcm->lock);
+	}
+
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_epa(void *addr)
+{
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	int ret = 0;
+
+	if (!epcm || ((unsigned long)addr & ~PAGE_MASK))
+		return SGX_EMU_PF;
+
+	spin_lock(&epcm->lock);
+
+	if (epcm->flags & SGX_EMU_EPCM_VALID) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	memset(addr, 0, PAGE_SIZE);
+	epcm->flags = SGX_EMU_EPCM_VALID;
+	epcm->type = SGX_PAGE_TYPE_VA;
+	epcm->secinfo = SGX_SECINFO_VA;
+	epcm->secs = NULL;
+
+out:
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+static struct sgx_emu_epcm *sgx_emu_va_slot(void *va)
+{
+	struct sgx_emu_epcm *va_epcm = sgx_emu_epcm(va);
+
+	if (!va_epcm || ((unsigned long)va & 7))
+		return NULL;
+
+	if (!(READ_ONCE(va_epcm->flags) & SGX_EMU_EPCM_VALID) ||
+	    READ_ONCE(va_epcm->type) != SGX_PAGE_TYPE_VA)
+		return NULL;
+
+	return va_epcm;
+}
+
+int sgx_emu_ewb(struct sgx_pageinfo *pginfo, void *addr, void *va)
+{
+	struct sgx_pcmd *pcmd = (void *)(unsigned long)pginfo->metadata;
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm = NULL;
+	struct sgx_emu_secs *state;
+	struct sgx_emu_mac mac;
+	int ret = 0;
+
+	if (!epcm)
+		return SGX_EMU_PF;
+
+	if (!sgx_emu_va_slot(va))
+		return SGX_EMU_GP;
+
+	spin_lock(&epcm->lock);
+
+	if (!(epcm->flags & SGX_EMU_EPCM_VALID)) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	if (sgx_emu_is_child(epcm)) {
+		secs_epcm = sgx_emu_epcm(epcm->secs);
+		spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+		state = sgx_emu_secs(epcm->secs);
+
+		if (!(epcm->flags & SGX_EMU_EPCM_BLOCKED)) {
+			ret = SGX_PAGE_NOT_BLOCKED;
+			goto out;
+		}
+
+		if (state->epoch <= epcm->block_epoch) {
+			ret = SGX_NOT_TRACKED;
+			goto out;
+		}
+	} else if (epcm->type == SGX_PAGE_TYPE_SECS) {
+		state = sgx_emu_secs(addr);
+		if (state->child_cnt) {
+			ret = SGX_CHILD_PRESENT;
+			goto out;
+		}
+	} else {
+		state = NULL;
+	}
+
+	mac.version = atomic64_inc_return(&sgx_emu_version);
+	mac.csum = sgx_emu_csum(addr, mac.version);
+	mac.reserved = 0;
+
+	if (cmpxchg64((u64 *)va, 0, mac.version)) {
+		ret = SGX_VA_SLOT_OCCUPIED;
+		goto out;
+	}
+
+	sgx_emu_scramble((void *)(unsigned long)pginfo->contents, addr,
+			 mac.version);
+
+	memset(pcmd, 0, sizeof(*pcmd));
+	pcmd->secinfo.flags = epcm->secinfo;
+	pcmd->enclave_id = state ? state->eid : 0;
+	memcpy(pcmd->mac, &mac, sizeof(mac));
+	pginfo->addr = epcm->linaddr;
+
+	if (secs_epcm)
+		state->child_cnt--;
+
+	epcm->flags = 0;
+
+out:
+	if (secs_epcm)
+		spin_unlock(&secs_epcm->lock);
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_eldu(struct sgx_pageinfo *pginfo, void *addr, void *va)
+{
+	struct sgx_pcmd *pcmd = (void *)(unsigned long)pginfo->metadata;
+	u64 type = (pcmd->secinfo.flags & SGX_SECINFO_PAGE_TYPE_MASK) >> 8;
+	void *secs = (void *)(unsigned long)pginfo->secs;
+	struct sgx_emu_epcm *epcm = sgx_emu_epcm(addr);
+	struct sgx_emu_epcm *secs_epcm = NULL;
+	struct sgx_emu_secs *state = NULL;
+	struct sgx_emu_mac mac;
+	int ret = 0;
+
+	if (!epcm || ((unsigned long)addr & ~PAGE_MASK))
+		return SGX_EMU_PF;
+
+	if (!sgx_emu_va_slot(va))
+		return SGX_EMU_GP;
+
+	memcpy(&mac, pcmd->mac, sizeof(mac));
+
+	spin_lock(&epcm->lock);
+
+	if (epcm->flags & SGX_EMU_EPCM_VALID) {
+		ret = SGX_EMU_GP;
+		goto out;
+	}
+
+	if (type != SGX_PAGE_TYPE_SECS && type != SGX_PAGE_TYPE_VA) {
+		secs_epcm = sgx_emu_epcm(secs);
+		if (!secs_epcm) {
+			ret = SGX_EMU_PF;
+			goto out;
+		}
+
+		spin_lock_nested(&secs_epcm->lock, SINGLE_DEPTH_NESTING);
+
+		if (!sgx_emu_is_valid_secs(secs_epcm)) {
+			ret = SGX_EMU_GP;
+			goto out;
+		}
+
+		state = sgx_emu_secs(secs);
+		if (pcmd->enclave_id != state->eid) {
+			ret = SGX_MAC_COMPARE_FAIL;
+			goto out;
+		}
+	}
+
+	if (READ_ONCE(*(u64 *)va) != mac.version) {
+		ret = SGX_MAC_COMPARE_FAIL;
+		goto out;
+	}
+
+	sgx_emu_scramble(addr, (void *)(unsigned long)pginfo->contents,
+			 mac.version);
+
+	if (sgx_emu_csum(addr, mac.version) != mac.csum ||
+	    (type == SGX_PAGE_TYPE_SECS &&
+	     sgx_emu_secs(addr)->eid != pcmd->enclave_id)) {
+		memset(addr, 0, PAGE_SIZE);
+		ret = SGX_MAC_COMPARE_FAIL;
+		goto out;
+	}
+
+	epcm->flags = SGX_EMU_EPCM_VALID;
+	epcm->type = type;
+	epcm->secinfo = pcmd->secinfo.flags;
+	epcm->linaddr = pginfo->addr;
+	epcm->secs = secs_epcm ? secs : NULL;
+
+	if (state)
+		state->child_cnt++;
+
+	WRITE_ONCE(*(u64 *)va, 0);
+
+out:
+	if (secs_epcm)
+		spin_unlock(&secs_epcm->lock);
+	spin_unlock(&epcm->lock);
+	return ret;
+}
+
+int sgx_emu_unsupported(void)
+{
+	return SGX_EMU_UD;
+}
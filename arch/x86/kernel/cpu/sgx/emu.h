@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/**
+ * Copyright(c) 2016-19 Intel Corporation.
+ *
+ * Software emulation of the ENCLS leaf functions and of the EPC, used to
+ * exercise the SGX core and driver on machines without SGX.
+ */
+#ifndef _X86_SGX_EMU_H
+#define _X86_SGX_EMU_H
+
+#include <linux/kconfig.h>
+#include <linux/types.h>
+#include <asm/processor.h>
+#include <asm/sgx_arch.h>
+
+/*
+ * The declarations are unconditional so that callers can use IS_ENABLED()
+ * instead of #ifdefs; the calls are compiled out when emulation is disabled.
+ */
+u64 sgx_emu_alloc_epc(u64 *pa);
+void sgx_emu_free_epc(u64 pa);
+void sgx_emu_cpuid(u32 sub_leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx);
+
+int sgx_emu_ecreate(struct sgx_pageinfo *pginfo, void *secs);
+int sgx_emu_eextend(void *secs, void *addr);
+int sgx_emu_eadd(struct sgx_pageinfo *pginfo, void *addr);
+int sgx_emu_einit(void *sigstruct, struct sgx_einittoken *einittoken,
+		  void *secs);
+int sgx_emu_eremove(void *addr);
+int sgx_emu_edbgwr(void *addr, unsigned long *data);
+int sgx_emu_edbgrd(void *addr, unsigned long *data);
+int sgx_emu_etrack(void *addr);
+int sgx_emu_eldu(struct sgx_pageinfo *pginfo, void *addr, void *va);
+int sgx_emu_eblock(void *addr);
+int sgx_emu_epa(void *addr);
+int sgx_emu_ewb(struct sgx_pageinfo *pginfo, void *addr, void *va);
+int sgx_emu_unsupported(void);
+
+/**
+ * sgx_cpuid_count() - Query an SGX CPUID sub-leaf
+ * @sub_leaf:	sub-leaf of %SGX_CPUID
+ * @eax:	EAX output
+ * @ebx:	EBX output
+ * @ecx:	ECX output
+ * @edx:	EDX output
+ *
+ * Execute CPUID.(EAX=%SGX_CPUID, ECX=@sub_leaf), or synthesize the result when
+ * the ENCLS leaf functions are emulated in software.
+ */
+static inline void sgx_cpuid_count(u32 sub_leaf, u32 *eax, u32 *ebx, u32 *ecx,
+				   u32 *edx)
+{
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		sgx_emu_cpuid(sub_leaf, eax, ebx, ecx, edx);
+	else
+		cpuid_count(SGX_CPUID, sub_leaf, eax, ebx, ecx, edx);
+}
+
+#endif /* _X86_SGX_EMU_H */
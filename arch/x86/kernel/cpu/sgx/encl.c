@@ -1,46 +1,37 @@
 // SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
 // Copyright(c) 2016-18 Intel Corporation.
 
+#include <linux/cred.h>
 #include <linux/lockdep.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/shmem_fs.h>
 #include <linux/suspend.h>
 #include <linux/sched/mm.h>
-#include "arch.h"
+#include <asm/sgx_arch.h>
 #include "encl.h"
 #include "encls.h"
+#include "epc_cgroup.h"
 #include "sgx.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static int __sgx_encl_eldu(struct sgx_encl_page *encl_page,
-			   struct sgx_epc_page *epc_page)
+			   struct sgx_epc_page *epc_page,
+			   struct sgx_backing *backing)
 {
 	unsigned long addr = SGX_ENCL_PAGE_ADDR(encl_page);
 	unsigned long va_offset = SGX_ENCL_PAGE_VA_OFFSET(encl_page);
+	unsigned long pcmd_offset = sgx_pcmd_offset(backing->page_index);
 	struct sgx_encl *encl = encl_page->encl;
-	pgoff_t page_index = sgx_encl_get_index(encl, encl_page);
-	pgoff_t pcmd_index = sgx_pcmd_index(encl, page_index);
-	unsigned long pcmd_offset = sgx_pcmd_offset(page_index);
 	struct sgx_pageinfo pginfo;
-	struct page *backing;
-	struct page *pcmd;
 	int ret;
 
-	backing = sgx_encl_get_backing_page(encl, page_index);
-	if (IS_ERR(backing)) {
-		ret = PTR_ERR(backing);
-		goto err_backing;
-	}
-
-	pcmd = sgx_encl_get_backing_page(encl, pcmd_index);
-	if (IS_ERR(pcmd)) {
-		ret = PTR_ERR(pcmd);
-		goto err_pcmd;
-	}
-
 	pginfo.addr = addr;
-	pginfo.contents = (unsigned long)kmap_atomic(backing);
-	pginfo.metadata = (unsigned long)kmap_atomic(pcmd) + pcmd_offset;
+	pginfo.contents = (unsigned long)kmap_atomic(backing->contents);
+	pginfo.metadata = (unsigned long)kmap_atomic(backing->pcmd) +
+			  pcmd_offset;
 	pginfo.secs = addr ? (unsigned long)sgx_epc_addr(encl->secs.epc_page) :
 		      0;
 
@@ -56,45 +47,160 @@ static int __sgx_encl_eldu(struct sgx_encl_page *encl_page,
 	kunmap_atomic((void *)(unsigned long)(pginfo.metadata - pcmd_offset));
 	kunmap_atomic((void *)(unsigned long)pginfo.contents);
 
-	put_page(pcmd);
-
-err_pcmd:
-	put_page(backing);
-
-err_backing:
 	return ret;
 }
 
-static struct sgx_epc_page *sgx_encl_eldu(struct sgx_encl_page *encl_page)
+/*
+ * Allocate an EPC page and load the enclave page into it from its pinned
+ * backing storage, which is released.
+ */
+static struct sgx_epc_page *sgx_encl_eldu(struct sgx_encl_page *encl_page,
+					  struct sgx_backing *backing)
 {
-	unsigned long va_offset = SGX_ENCL_PAGE_VA_OFFSET(encl_page);
+	u64 start = sgx_trace_start(sgx_encl_eldu);
 	struct sgx_encl *encl = encl_page->encl;
 	struct sgx_epc_page *epc_page;
 	int ret;
 
-	epc_page = sgx_alloc_page(encl_page, false);
-	if (IS_ERR(epc_page))
-		return epc_page;
+	epc_page = sgx_alloc_page(encl_page, &encl->mempolicy, encl->epc_cg,
+				  false);
+	if (IS_ERR(epc_page)) {
+		ret = PTR_ERR(epc_page);
+		goto out;
+	}
 
-	ret = __sgx_encl_eldu(encl_page, epc_page);
+	ret = __sgx_encl_eldu(encl_page, epc_page, backing);
 	if (ret) {
 		sgx_free_page(epc_page);
-		return ERR_PTR(ret);
+		epc_page = ERR_PTR(ret);
 	}
 
+out:
+	sgx_encl_put_backing(backing, false);
+	trace_sgx_encl_eldu(encl, SGX_ENCL_PAGE_ADDR(encl_page), ret, start);
+	return epc_page;
+}
+
+/*
+ * Release the VA slot of a page loaded with ELDU, and make the page resident.
+ * Called with encl->lock held, as the reclaimer allocates the VA slots.
+ */
+static void sgx_encl_eldu_commit(struct sgx_encl_page *encl_page,
+				 struct sgx_epc_page *epc_page)
+{
+	unsigned long va_offset = SGX_ENCL_PAGE_VA_OFFSET(encl_page);
+	struct sgx_encl *encl = encl_page->encl;
+
 	sgx_free_va_slot(encl_page->va_page, va_offset);
 	list_move(&encl_page->va_page->list, &encl->va_pages);
 	encl_page->desc &= ~SGX_ENCL_PAGE_VA_OFFSET_MASK;
 	encl_page->epc_page = epc_page;
 
-	return epc_page;
+	atomic_long_inc(&encl->stats.nr_reloaded);
+	atomic_long_inc(&encl->stats.nr_resident);
 }
 
-static struct sgx_encl_page *sgx_encl_load_page(struct sgx_encl *encl,
-						unsigned long addr)
+/*
+ * Load the SECS if it has been reclaimed, and take a child reference to it,
+ * which keeps the reclaimer from writing it out while a child is loaded.
+ */
+static int sgx_encl_get_secs(struct sgx_encl *encl)
 {
 	struct sgx_epc_page *epc_page;
+	struct sgx_backing backing;
+	int ret = 0;
+
+	mutex_lock(&encl->lock);
+
+	if (encl->flags & SGX_ENCL_DEAD) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (!encl->secs.epc_page) {
+		ret = sgx_encl_get_backing(encl,
+					   sgx_encl_get_index(encl, &encl->secs),
+					   &backing);
+		if (ret)
+			goto out;
+
+		epc_page = sgx_encl_eldu(&encl->secs, &backing);
+		if (IS_ERR(epc_page)) {
+			ret = PTR_ERR(epc_page);
+			goto out;
+		}
+
+		sgx_encl_eldu_commit(&encl->secs, epc_page);
+	}
+
+	encl->secs_child_cnt++;
+
+out:
+	mutex_unlock(&encl->lock);
+	return ret;
+}
+
+/*
+ * Load a locked enclave page with ELDU from its pinned backing storage, which
+ * is released in any case.  The enclave lock is held only around ELDU, in
+ * order to pin the SECS and to release the VA slot.
+ */
+static int sgx_encl_eldu_locked(struct sgx_encl *encl,
+				struct sgx_encl_page *entry,
+				struct sgx_backing *backing)
+{
+	struct sgx_epc_page *epc_page;
+	int ret;
+
+	ret = sgx_encl_get_secs(encl);
+	if (ret) {
+		sgx_encl_put_backing(backing, false);
+		return ret;
+	}
+
+	epc_page = sgx_encl_eldu(entry, backing);
+
+	mutex_lock(&encl->lock);
+
+	if (IS_ERR(epc_page)) {
+		encl->secs_child_cnt--;
+		mutex_unlock(&encl->lock);
+		return PTR_ERR(epc_page);
+	}
+
+	sgx_encl_eldu_commit(entry, epc_page);
+
+	mutex_unlock(&encl->lock);
+
+	sgx_mark_page_reclaimable(epc_page);
+
+	return 0;
+}
+
+/*
+ * Look up an enclave page and lock it, loading it with ELDU if it is not
+ * resident.  The lookup is lockless, the enclave pages are removed from
+ * @encl->page_array only before EINIT or when the enclave is released, and
+ * are never freed before the enclave.  The page lock serializes the loading
+ * with the reclaimer, and ELDU runs without the enclave lock so that the
+ * different pages of an enclave can be loaded in parallel.  @loaded is set if
+ * the page was loaded with ELDU.
+ *
+ * Return:
+ *   the locked enclave page on success,
+ *   -EBUSY if the page is locked, e.g. by the reclaimer,
+ *   -errno otherwise
+ */
+static struct sgx_encl_page *sgx_encl_load_page(struct sgx_encl *encl,
+						unsigned long addr,
+						bool *loaded)
+{
+	struct sgx_backing backing;
 	struct sgx_encl_page *entry;
+	unsigned int flags;
+	int ret;
+
+	*loaded = false;
 
 	/* If process was forked, VMA is still there but vm_private_data is set
 	 * to NULL.
@@ -102,36 +208,184 @@ static struct sgx_encl_page *sgx_encl_load_page(struct sgx_encl *encl,
 	if (!encl)
 		return ERR_PTR(-EFAULT);
 
-	if ((encl->flags & SGX_ENCL_DEAD) ||
-	    !(encl->flags & SGX_ENCL_INITIALIZED))
+	flags = READ_ONCE(encl->flags);
+	if ((flags & SGX_ENCL_DEAD) || !(flags & SGX_ENCL_INITIALIZED))
 		return ERR_PTR(-EFAULT);
 
-	entry = radix_tree_lookup(&encl->page_tree, addr >> PAGE_SHIFT);
+	entry = xa_load(&encl->page_array, PFN_DOWN(addr));
 	if (!entry)
 		return ERR_PTR(-EFAULT);
 
-	/* Page is already resident in the EPC. */
-	if (entry->epc_page) {
-		if (entry->desc & SGX_ENCL_PAGE_RECLAIMED)
-			return ERR_PTR(-EBUSY);
+	if (!sgx_encl_page_trylock(entry))
+		return ERR_PTR(-EBUSY);
 
+	/* Page is already resident in the EPC. */
+	if (entry->epc_page)
 		return entry;
+
+	ret = sgx_encl_get_backing(encl, sgx_encl_get_index(encl, entry),
+				   &backing);
+	if (!ret)
+		ret = sgx_encl_eldu_locked(encl, entry, &backing);
+	if (ret) {
+		sgx_encl_page_unlock(entry);
+		return ERR_PTR(ret);
 	}
 
-	if (!(encl->secs.epc_page)) {
-		epc_page = sgx_encl_eldu(&encl->secs);
-		if (IS_ERR(epc_page))
-			return ERR_CAST(epc_page);
+	*loaded = true;
+	return entry;
+}
+
+/*
+ * Detect a stream of faults with a constant stride of at most
+ * %SGX_FAULT_AROUND_MAX_STRIDE pages, either sequential or strided, and
+ * return the number of pages to load ahead of @addr.  The window starts at
+ * %SGX_FAULT_AROUND_MIN pages and doubles every time the stream faults right
+ * after the previous window, up to @encl->ra_max_window, which in turn
+ * follows the hit rate of the prefetched pages.
+ */
+static unsigned int sgx_encl_ra_window(struct sgx_encl *encl,
+				       unsigned long addr, long *stride)
+{
+	unsigned int window = 0;
+	long delta;
+
+	spin_lock(&encl->ra_lock);
+
+	delta = (long)(addr - encl->ra_prev);
+	if (delta && delta == encl->ra_stride &&
+	    abs(delta) <= SGX_FAULT_AROUND_MAX_STRIDE * PAGE_SIZE) {
+		window = encl->ra_window ? 2 * encl->ra_window :
+					   SGX_FAULT_AROUND_MIN;
+		window = min(window, encl->ra_max_window);
 	}
 
-	epc_page = entry->epc_page ? entry->epc_page : sgx_encl_eldu(entry);
-	if (IS_ERR(epc_page))
-		return ERR_CAST(epc_page);
+	encl->ra_stride = delta;
+	encl->ra_window = window;
+	encl->ra_prev = addr + window * delta;
 
-	encl->secs_child_cnt++;
-	sgx_mark_page_reclaimable(entry->epc_page);
+	spin_unlock(&encl->ra_lock);
 
-	return entry;
+	*stride = delta;
+	return window;
+}
+
+/**
+ * sgx_encl_ra_account() - Account the outcome of a prefetched page
+ * @encl:	an enclave
+ * @hit:	the page was accessed after it was prefetched
+ *
+ * Called when the accessed bit of a prefetched page is sampled for the first
+ * time.  The maximum window grows by one page on a hit, and halves on a miss.
+ */
+void sgx_encl_ra_account(struct sgx_encl *encl, bool hit)
+{
+	spin_lock(&encl->ra_lock);
+
+	if (hit) {
+		encl->ra_hits++;
+		if (encl->ra_max_window < SGX_FAULT_AROUND_MAX)
+			encl->ra_max_window++;
+	} else {
+		encl->ra_misses++;
+		encl->ra_max_window = max(encl->ra_max_window / 2, 1U);
+	}
+
+	spin_unlock(&encl->ra_lock);
+}
+
+/*
+ * Load and map the locked, evicted enclave pages @entries of the fault-around,
+ * with their backing storage pinned at once, and unlock them.  Return false if
+ * a page could not be loaded, which ends the fault-around.
+ */
+static bool sgx_encl_fault_around_batch(struct vm_area_struct *vma,
+					struct sgx_encl *encl,
+					struct sgx_encl_page **entries,
+					unsigned int nr)
+{
+	struct sgx_backing backing[SGX_BACKING_BATCH];
+	struct sgx_encl_page *entry;
+	unsigned long addr;
+	unsigned int i;
+	bool pinned;
+	int ret;
+
+	for (i = 0; i < nr; i++)
+		backing[i].page_index = sgx_encl_get_index(encl, entries[i]);
+
+	ret = sgx_encl_get_backing_batch(encl, backing, nr);
+	pinned = !ret;
+
+	for (i = 0; i < nr; i++) {
+		entry = entries[i];
+		addr = SGX_ENCL_PAGE_ADDR(entry);
+
+		if (!ret)
+			ret = sgx_encl_eldu_locked(encl, entry, &backing[i]);
+		else if (pinned)
+			sgx_encl_put_backing(&backing[i], false);
+
+		if (!ret && vmf_insert_pfn(vma, addr,
+					   PFN_DOWN(entry->epc_page->desc)) ==
+			    VM_FAULT_NOPAGE) {
+			sgx_encl_test_and_clear_young(vma->vm_mm, entry);
+			set_bit(SGX_ENCL_PAGE_PREFETCHED, &entry->flags);
+		}
+
+		sgx_encl_page_unlock(entry);
+	}
+
+	return !ret;
+}
+
+/*
+ * Load and map the evicted pages that a stream of faults is about to touch
+ * next, after the fault at @addr.  The pages are loaded only as long as there
+ * is free EPC, and never more than a quarter of it, without reclaim.  The
+ * pages locked by someone else, and the resident ones, are skipped.  The rest
+ * are loaded in batches of %SGX_BACKING_BATCH pages, which share the lookups
+ * of their backing storage.
+ */
+static void sgx_encl_fault_around(struct vm_area_struct *vma,
+				  struct sgx_encl *encl, unsigned long addr)
+{
+	struct sgx_encl_page *entries[SGX_BACKING_BATCH];
+	struct sgx_encl_page *entry;
+	unsigned int nr_pages;
+	unsigned int nr = 0;
+	unsigned int i;
+	long stride;
+
+	nr_pages = sgx_encl_ra_window(encl, addr, &stride);
+	nr_pages = min_t(unsigned long, nr_pages, sgx_calc_free_cnt() / 4);
+
+	for (i = 1; i <= nr_pages; i++) {
+		addr += stride;
+		if (addr < vma->vm_start || addr >= vma->vm_end)
+			break;
+
+		entry = xa_load(&encl->page_array, PFN_DOWN(addr));
+		if (!entry || !sgx_encl_page_trylock(entry))
+			continue;
+
+		if (entry->epc_page) {
+			sgx_encl_page_unlock(entry);
+			continue;
+		}
+
+		entries[nr++] = entry;
+		if (nr < SGX_BACKING_BATCH)
+			continue;
+
+		if (!sgx_encl_fault_around_batch(vma, encl, entries, nr))
+			return;
+
+		nr = 0;
+	}
+
+	if (nr)
+		sgx_encl_fault_around_batch(vma, encl, entries, nr);
 }
 
 static void sgx_encl_mm_release_deferred(struct rcu_head *rcu)
@@ -252,24 +506,27 @@ static void sgx_vma_open(struct vm_area_struct *vma)
 
 static unsigned int sgx_vma_fault(struct vm_fault *vmf)
 {
+	u64 start = sgx_trace_start(sgx_vma_fault);
 	unsigned long addr = (unsigned long)vmf->address;
 	struct vm_area_struct *vma = vmf->vma;
 	struct sgx_encl *encl = vma->vm_private_data;
 	struct sgx_encl_page *entry;
 	int ret = VM_FAULT_NOPAGE;
 	unsigned long pfn;
+	bool loaded;
 
 	if (!encl)
 		return VM_FAULT_SIGBUS;
 
-	mutex_lock(&encl->lock);
+	atomic_long_inc(&encl->stats.nr_faults);
 
-	entry = sgx_encl_load_page(encl, addr);
+	entry = sgx_encl_load_page(encl, addr, &loaded);
 	if (IS_ERR(entry)) {
 		if (unlikely(PTR_ERR(entry) != -EBUSY))
 			ret = VM_FAULT_SIGBUS;
 
-		goto out;
+		trace_sgx_vma_fault(encl, addr, ret, start);
+		return ret;
 	}
 
 	if (!follow_pfn(vma, addr, &pfn))
@@ -284,7 +541,12 @@ static unsigned int sgx_vma_fault(struct vm_fault *vmf)
 	sgx_encl_test_and_clear_young(vma->vm_mm, entry);
 
 out:
-	mutex_unlock(&encl->lock);
+	sgx_encl_page_unlock(entry);
+
+	if (loaded && ret == VM_FAULT_NOPAGE)
+		sgx_encl_fault_around(vma, encl, addr & PAGE_MASK);
+
+	trace_sgx_vma_fault(encl, addr, ret, start);
 	return ret;
 }
 
@@ -318,9 +580,7 @@ int sgx_encl_may_map(struct sgx_encl *encl, unsigned long start,
 	idx_end = PFN_DOWN(end - 1);
 
 	for (idx = idx_start; idx <= idx_end; ++idx) {
-		mutex_lock(&encl->lock);
-		page = radix_tree_lookup(&encl->page_tree, idx);
-		mutex_unlock(&encl->lock);
+		page = xa_load(&encl->page_array, idx);
 
 		if (!page || (~page->vm_prot_bits & vm_prot_bits))
 			return -EACCES;
@@ -424,7 +684,7 @@ static int sgx_vma_access(struct vm_area_struct *vma, unsigned long addr,
 			memcpy(buf + i, data + offset, cnt);
 
 out:
-		mutex_unlock(&encl->lock);
+		sgx_encl_page_unlock(entry);
 
 		if (ret)
 			break;
@@ -480,28 +740,28 @@ void sgx_encl_destroy(struct sgx_encl *encl)
 {
 	struct sgx_va_page *va_page;
 	struct sgx_encl_page *entry;
-	struct radix_tree_iter iter;
-	void **slot;
+	unsigned long index;
 
 	encl->flags |= SGX_ENCL_DEAD;
 
-	radix_tree_for_each_slot(slot, &encl->page_tree, &iter, 0) {
-		entry = *slot;
-		if (entry->epc_page) {
-			if (!__sgx_free_page(entry->epc_page)) {
-				encl->secs_child_cnt--;
-				entry->epc_page = NULL;
-
-			}
-
-			radix_tree_delete(&entry->encl->page_tree,
-					  PFN_DOWN(entry->desc));
+	/*
+	 * A page isolated by the reclaimer is written out by the reclaimer,
+	 * or put back, in which case it is freed by the final destroy from
+	 * sgx_encl_release().  Keep it in the page array until then.
+	 */
+	xa_for_each(&encl->page_array, index, entry) {
+		if (entry->epc_page && !__sgx_free_page(entry->epc_page)) {
+			encl->secs_child_cnt--;
+			entry->epc_page = NULL;
+			atomic_long_dec(&encl->stats.nr_resident);
+			xa_erase(&encl->page_array, index);
 		}
 	}
 
 	if (!encl->secs_child_cnt && encl->secs.epc_page) {
 		sgx_free_page(encl->secs.epc_page);
 		encl->secs.epc_page = NULL;
+		atomic_long_dec(&encl->stats.nr_resident);
 	}
 
 
@@ -526,12 +786,18 @@ void sgx_encl_release(struct kref *ref)
 	struct sgx_encl *encl = container_of(ref, struct sgx_encl, refcount);
 
 	sgx_encl_destroy(encl);
+	xa_destroy(&encl->page_array);
+
+	if (encl->backing_user)
+		shmem_lock(encl->backing, 0, encl->backing_user);
 
 	if (encl->backing)
 		fput(encl->backing);
 
 	WARN_ONCE(!list_empty(&encl->mm_list), "sgx: mm_list non-empty");
 
+	sgx_epc_cgroup_put(encl->epc_cg);
+
 	kfree(encl);
 }
 
@@ -568,6 +834,167 @@ struct page *sgx_encl_get_backing_page(struct sgx_encl *encl, pgoff_t index)
 	return shmem_read_mapping_page_gfp(mapping, index, gfpmask);
 }
 
+/*
+ * Pin the contents of the enclave pages, the runs of consecutive indices with
+ * a single walk of the page cache each.  The pages missing from the page
+ * cache, e.g. the ones that have been swapped out, are read one at a time.
+ */
+static int sgx_encl_get_contents(struct sgx_encl *encl,
+				 struct sgx_backing *backing, unsigned int nr)
+{
+	struct address_space *mapping = encl->backing->f_mapping;
+	struct page *pages[SGX_BACKING_BATCH];
+	unsigned int found, run, i = 0, j;
+	struct page *page;
+
+	while (i < nr) {
+		for (run = 1; i + run < nr && run < SGX_BACKING_BATCH; run++)
+			if (backing[i + run].page_index !=
+			    backing[i].page_index + run)
+				break;
+
+		found = find_get_pages_contig(mapping, backing[i].page_index,
+					      run, pages);
+		for (j = 0; j < found && PageUptodate(pages[j]); j++)
+			backing[i + j].contents = pages[j];
+
+		i += j;
+		if (j == run)
+			continue;
+
+		for (; j < found; j++)
+			put_page(pages[j]);
+
+		page = sgx_encl_get_backing_page(encl, backing[i].page_index);
+		if (IS_ERR(page))
+			goto err;
+
+		backing[i++].contents = page;
+	}
+
+	return 0;
+
+err:
+	while (i--)
+		put_page(backing[i].contents);
+
+	return PTR_ERR(page);
+}
+
+/**
+ * sgx_encl_get_backing_batch() - Pin the backing storage of enclave pages
+ * @encl:	an enclave
+ * @backing:	the backing storage of the pages, with @page_index set
+ * @nr:		the number of pages
+ *
+ * Pin the contents and the PCMD pages of @nr enclave pages.  The contents of
+ * consecutive pages are looked up together, and a PCMD page is looked up only
+ * once for the consecutive entries of @backing that share it, hence sorting
+ * @backing by index minimizes the lookups.  Release each entry with
+ * sgx_encl_put_backing().
+ *
+ * Return: 0 on success, -errno otherwise, with nothing pinned
+ */
+int sgx_encl_get_backing_batch(struct sgx_encl *encl,
+			       struct sgx_backing *backing, unsigned int nr)
+{
+	pgoff_t pcmd_index;
+	struct page *pcmd;
+	unsigned int i, j;
+	int ret;
+
+	ret = sgx_encl_get_contents(encl, backing, nr);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		pcmd_index = sgx_pcmd_index(encl, backing[i].page_index);
+		if (i && pcmd_index ==
+			 sgx_pcmd_index(encl, backing[i - 1].page_index)) {
+			get_page(backing[i - 1].pcmd);
+			backing[i].pcmd = backing[i - 1].pcmd;
+			continue;
+		}
+
+		pcmd = sgx_encl_get_backing_page(encl, pcmd_index);
+		if (IS_ERR(pcmd)) {
+			ret = PTR_ERR(pcmd);
+			goto err;
+		}
+
+		backing[i].pcmd = pcmd;
+	}
+
+	return 0;
+
+err:
+	for (j = i; j < nr; j++)
+		put_page(backing[j].contents);
+
+	while (i--)
+		sgx_encl_put_backing(&backing[i], false);
+
+	return ret;
+}
+
+/**
+ * sgx_encl_get_backing() - Pin the backing storage of an enclave page
+ * @encl:	an enclave
+ * @page_index:	the index of the enclave page
+ * @backing:	the backing storage to fill in
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int sgx_encl_get_backing(struct sgx_encl *encl, pgoff_t page_index,
+			 struct sgx_backing *backing)
+{
+	backing->page_index = page_index;
+
+	return sgx_encl_get_backing_batch(encl, backing, 1);
+}
+
+/**
+ * sgx_encl_put_backing() - Unpin the backing storage of an enclave page
+ * @backing:	the backing storage
+ * @do_write:	mark the pages dirty, after EWB has written them
+ */
+void sgx_encl_put_backing(struct sgx_backing *backing, bool do_write)
+{
+	if (do_write) {
+		set_page_dirty(backing->pcmd);
+		set_page_dirty(backing->contents);
+	}
+
+	put_page(backing->pcmd);
+	put_page(backing->contents);
+}
+
+/**
+ * sgx_encl_lock_backing() - Keep the backing storage in memory
+ * @encl:	an enclave
+ *
+ * Make the backing storage of the enclave unevictable, like SHM_LOCK does,
+ * when enabled in /sys/kernel/mm/sgx/lock_backing.  The evicted enclave pages
+ * are then never swapped out, and EWB and ELDU never wait for swap I/O.  The
+ * size of the backing storage is charged to the RLIMIT_MEMLOCK of the current
+ * user, unless it has CAP_IPC_LOCK.  The backing storage stays evictable if
+ * the limit would be exceeded.
+ */
+void sgx_encl_lock_backing(struct sgx_encl *encl)
+{
+	struct user_struct *user = current_user();
+
+	if (!READ_ONCE(sgx_lock_backing))
+		return;
+
+	if (shmem_lock(encl->backing, 1, user)) {
+		pr_debug("sgx: RLIMIT_MEMLOCK exceeded, backing not locked\n");
+		return;
+	}
+
+	encl->backing_user = user;
+}
+
 static int sgx_encl_test_and_clear_young_cb(pte_t *ptep, pgtable_t token,
 					    unsigned long addr, void *data)
 {
@@ -621,8 +1048,8 @@ int sgx_encl_test_and_clear_young(struct mm_struct *mm,
  * @encl:	an enclave
  * @addr:	a page address
  *
- * Load an enclave page and lock the enclave so that the page can be used by
- * EDBG* and EMOD*.
+ * Load an enclave page and lock it so that the page can be used by EDBG* and
+ * EMOD*.  The caller must release the page with sgx_encl_page_unlock().
  *
  * Return:
  *   an enclave page on success
@@ -632,38 +1059,36 @@ struct sgx_encl_page *sgx_encl_reserve_page(struct sgx_encl *encl,
 					    unsigned long addr)
 {
 	struct sgx_encl_page *entry;
+	bool loaded;
 
 	for ( ; ; ) {
-		mutex_lock(&encl->lock);
-
-		entry = sgx_encl_load_page(encl, addr);
+		entry = sgx_encl_load_page(encl, addr, &loaded);
 		if (PTR_ERR(entry) != -EBUSY)
 			break;
 
-		mutex_unlock(&encl->lock);
+		cond_resched();
 	}
 
-	if (IS_ERR(entry))
-		mutex_unlock(&encl->lock);
-
 	return entry;
 }
 
 /**
- * sgx_alloc_page - allocate a VA page
+ * sgx_alloc_va_page - allocate a VA page
+ * @encl:	the enclave the VA page is for
  *
- * Allocates an &sgx_epc_page instance and converts it to a VA page.
+ * Allocates an &sgx_epc_page instance and converts it to a VA page.  The page
+ * is placed by the NUMA policy of @encl.
  *
  * Return:
  *   a &struct sgx_va_page instance,
  *   -errno otherwise
  */
-struct sgx_epc_page *sgx_alloc_va_page(void)
+struct sgx_epc_page *sgx_alloc_va_page(struct sgx_encl *encl)
 {
 	struct sgx_epc_page *epc_page;
 	int ret;
 
-	epc_page = sgx_alloc_page(NULL, true);
+	epc_page = sgx_alloc_page(NULL, &encl->mempolicy, encl->epc_cg, true);
 	if (IS_ERR(epc_page))
 		return ERR_CAST(epc_page);
 
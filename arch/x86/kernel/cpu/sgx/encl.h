@@ -12,9 +12,10 @@
 #include <linux/mmu_notifier.h>
 #include <linux/mutex.h>
 #include <linux/notifier.h>
-#include <linux/radix-tree.h>
 #include <linux/srcu.h>
 #include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include "sgx.h"
 
 /**
  * enum sgx_encl_page_desc - defines bits for an enclave page's descriptor
@@ -44,11 +45,41 @@ enum sgx_encl_page_desc {
 struct sgx_encl_page {
 	unsigned long desc;
 	unsigned long vm_prot_bits;
+	unsigned long flags;
 	struct sgx_epc_page *epc_page;
 	struct sgx_va_page *va_page;
 	struct sgx_encl *encl;
 };
 
+/*
+ * Bits in &sgx_encl_page->flags.
+ *
+ * %SGX_ENCL_PAGE_LOCKED is the lock of the enclave page.  It serializes the
+ * loading, the mapping and the reclaim of the page, hence it protects
+ * @epc_page, @va_page and the VA offset in @desc.  The lock is only ever
+ * tried, as its holders take mmap_sem, and a fault or the reclaimer that
+ * fails to take it backs off.
+ *
+ * %SGX_ENCL_PAGE_PREFETCHED marks a page loaded by the fault-around, until its
+ * accessed bit is sampled.
+ */
+#define SGX_ENCL_PAGE_LOCKED		0
+#define SGX_ENCL_PAGE_PREFETCHED	1
+
+#define SGX_FAULT_AROUND_MIN		4
+#define SGX_FAULT_AROUND_MAX		64
+#define SGX_FAULT_AROUND_MAX_STRIDE	16
+
+static inline bool sgx_encl_page_trylock(struct sgx_encl_page *page)
+{
+	return !test_and_set_bit_lock(SGX_ENCL_PAGE_LOCKED, &page->flags);
+}
+
+static inline void sgx_encl_page_unlock(struct sgx_encl_page *page)
+{
+	clear_bit_unlock(SGX_ENCL_PAGE_LOCKED, &page->flags);
+}
+
 enum sgx_encl_flags {
 	SGX_ENCL_CREATED	= BIT(0),
 	SGX_ENCL_INITIALIZED	= BIT(1),
@@ -56,6 +87,31 @@ enum sgx_encl_flags {
 	SGX_ENCL_DEAD		= BIT(3),
 };
 
+/**
+ * struct sgx_encl_stats - the event counters of an enclave
+ * @nr_resident:	the enclave pages in the EPC, including the SECS
+ * @nr_faults:		the faults on the enclave pages
+ * @nr_evicted:		the pages written back with EWB
+ * @nr_reloaded:	the pages loaded back with ELDU
+ * @nr_etrack_retries:	the ETRACKs retried after the previous tracking had
+ *			not completed
+ * @nr_ipis:		the rounds of IPIs to kick the CPUs out of the enclave
+ * @nr_added:		the pages added with EADD
+ * @add_page_ns:	the time spent in EADD and EEXTEND
+ *
+ * The counters are shown in the fdinfo of the enclave file.
+ */
+struct sgx_encl_stats {
+	atomic_long_t nr_resident;
+	atomic_long_t nr_faults;
+	atomic_long_t nr_evicted;
+	atomic_long_t nr_reloaded;
+	atomic_long_t nr_etrack_retries;
+	atomic_long_t nr_ipis;
+	atomic_long_t nr_added;
+	atomic64_t add_page_ns;
+};
+
 struct sgx_encl_mm {
 	struct sgx_encl *encl;
 	struct mm_struct *mm;
@@ -74,19 +130,46 @@ struct sgx_encl {
 	struct list_head mm_list;
 	spinlock_t mm_lock;
 	struct file *backing;
+	struct user_struct *backing_user;
 	struct kref refcount;
 	struct srcu_struct srcu;
 	unsigned long base;
 	unsigned long size;
 	unsigned long ssaframesize;
 	struct list_head va_pages;
-	struct radix_tree_root page_tree;
+	struct xarray page_array;
 	struct list_head add_page_reqs;
 	struct work_struct work;
 	struct sgx_encl_page secs;
 	cpumask_t cpumask;
+	struct sgx_mempolicy mempolicy;
+	struct sgx_epc_cgroup *epc_cg;
+	struct list_head active_page_list;
+	struct list_head inactive_page_list;
+	unsigned long nr_active_pages;
+	unsigned long nr_inactive_pages;
+	spinlock_t active_lock;
+	struct list_head active_link;
+	unsigned long age_nr_scanned;
+	unsigned long age_nr_young;
+	unsigned long wss_pages;
+	spinlock_t ra_lock;
+	unsigned long ra_prev;
+	long ra_stride;
+	unsigned int ra_window;
+	unsigned int ra_max_window;
+	unsigned long ra_hits;
+	unsigned long ra_misses;
+	struct sgx_encl_stats stats;
 };
 
+/* The number of the reclaimable pages of the enclave, i.e. on either list. */
+static inline unsigned long sgx_encl_nr_lru_pages(struct sgx_encl *encl)
+{
+	return READ_ONCE(encl->nr_active_pages) +
+	       READ_ONCE(encl->nr_inactive_pages);
+}
+
 #define SGX_VA_SLOT_COUNT 512
 
 struct sgx_va_page {
@@ -109,6 +192,21 @@ static inline unsigned long sgx_pcmd_offset(pgoff_t page_index)
 	       sizeof(struct sgx_pcmd);
 }
 
+/**
+ * struct sgx_backing - the pinned backing storage of an enclave page
+ * @page_index:	the index of the enclave page in the backing storage
+ * @contents:	the page holding the encrypted contents
+ * @pcmd:	the page holding the PCMD, at sgx_pcmd_offset(@page_index)
+ */
+struct sgx_backing {
+	pgoff_t page_index;
+	struct page *contents;
+	struct page *pcmd;
+};
+
+/* The maximum number of backing pages looked up in the page cache at once. */
+#define SGX_BACKING_BATCH	16
+
 enum sgx_encl_mm_iter {
 	SGX_ENCL_MM_ITER_DONE		= 0,
 	SGX_ENCL_MM_ITER_NEXT		= 1,
@@ -121,13 +219,20 @@ void sgx_encl_destroy(struct sgx_encl *encl);
 void sgx_encl_release(struct kref *ref);
 pgoff_t sgx_encl_get_index(struct sgx_encl *encl, struct sgx_encl_page *page);
 struct page *sgx_encl_get_backing_page(struct sgx_encl *encl, pgoff_t index);
+int sgx_encl_get_backing_batch(struct sgx_encl *encl,
+			       struct sgx_backing *backing, unsigned int nr);
+int sgx_encl_get_backing(struct sgx_encl *encl, pgoff_t page_index,
+			 struct sgx_backing *backing);
+void sgx_encl_put_backing(struct sgx_backing *backing, bool do_write);
+void sgx_encl_lock_backing(struct sgx_encl *encl);
 int sgx_encl_mm_add(struct sgx_encl *encl, struct mm_struct *mm);
 int sgx_encl_test_and_clear_young(struct mm_struct *mm,
 				  struct sgx_encl_page *page);
 struct sgx_encl_page *sgx_encl_reserve_page(struct sgx_encl *encl,
 					    unsigned long addr);
+void sgx_encl_ra_account(struct sgx_encl *encl, bool hit);
 
-struct sgx_epc_page *sgx_alloc_va_page(void);
+struct sgx_epc_page *sgx_alloc_va_page(struct sgx_encl *encl);
 unsigned int sgx_alloc_va_slot(struct sgx_va_page *va_page);
 void sgx_free_va_slot(struct sgx_va_page *va_page, unsigned int offset);
 bool sgx_va_page_full(struct sgx_va_page *va_page);
@@ -8,7 +8,8 @@
 #include <linux/rwsem.h>
 #include <linux/types.h>
 #include <asm/asm.h>
-#include "arch.h"
+#include <asm/sgx_arch.h>
+#include "emu.h"
 
 /**
  * ENCLS_FAULT_FLAG - flag signifying an ENCLS return code is a trapnr
@@ -163,53 +164,83 @@ bool encls_failed(int ret);
 
 static inline int __ecreate(struct sgx_pageinfo *pginfo, void *secs)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_ecreate(pginfo, secs);
+
 	return __encls_2(SGX_ECREATE, pginfo, secs);
 }
 
 static inline int __eextend(void *secs, void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_eextend(secs, addr);
+
 	return __encls_2(SGX_EEXTEND, secs, addr);
 }
 
 static inline int __eadd(struct sgx_pageinfo *pginfo, void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_eadd(pginfo, addr);
+
 	return __encls_2(SGX_EADD, pginfo, addr);
 }
 
 static inline int __einit(void *sigstruct, struct sgx_einittoken *einittoken,
 			  void *secs)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_einit(sigstruct, einittoken, secs);
+
 	return __encls_ret_3(SGX_EINIT, sigstruct, secs, einittoken);
 }
 
 static inline int __eremove(void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_eremove(addr);
+
 	return __encls_ret_1(SGX_EREMOVE, addr);
 }
 
 static inline int __edbgwr(void *addr, unsigned long *data)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_edbgwr(addr, data);
+
 	return __encls_2(SGX_EDGBWR, *data, addr);
 }
 
 static inline int __edbgrd(void *addr, unsigned long *data)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_edbgrd(addr, data);
+
 	return __encls_1_1(SGX_EDGBRD, *data, addr);
 }
 
 static inline int __etrack(void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_etrack(addr);
+
 	return __encls_ret_1(SGX_ETRACK, addr);
 }
 
 static inline int __eldu(struct sgx_pageinfo *pginfo, void *addr,
 			 void *va)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_eldu(pginfo, addr, va);
+
 	return __encls_ret_3(SGX_ELDU, pginfo, addr, va);
 }
 
 static inline int __eblock(void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_eblock(addr);
+
 	return __encls_ret_1(SGX_EBLOCK, addr);
 }
 
@@ -217,27 +248,42 @@ static inline int __epa(void *addr)
 {
 	unsigned long rbx = SGX_PAGE_TYPE_VA;
 
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_epa(addr);
+
 	return __encls_2(SGX_EPA, rbx, addr);
 }
 
 static inline int __ewb(struct sgx_pageinfo *pginfo, void *addr,
 			void *va)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_ewb(pginfo, addr, va);
+
 	return __encls_ret_3(SGX_EWB, pginfo, addr, va);
 }
 
 static inline int __eaug(struct sgx_pageinfo *pginfo, void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_unsupported();
+
 	return __encls_2(SGX_EAUG, pginfo, addr);
 }
 
 static inline int __emodpr(struct sgx_secinfo *secinfo, void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_unsupported();
+
 	return __encls_ret_2(SGX_EMODPR, secinfo, addr);
 }
 
 static inline int __emodt(struct sgx_secinfo *secinfo, void *addr)
 {
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		return sgx_emu_unsupported();
+
 	return __encls_ret_2(SGX_EMODT, secinfo, addr);
 }
 
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+// Copyright(c) 2016-19 Intel Corporation.
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include "epc_cgroup.h"
+#include "sgx.h"
+
+/*
+ * The number of reclaim passes a charge, a write to sgx_epc.max or the
+ * reclaim work makes before giving up.
+ */
+#define SGX_EPC_CGROUP_MAX_RETRIES	16
+
+static inline struct sgx_epc_cgroup *
+sgx_epc_cgroup_from_css(struct cgroup_subsys_state *css)
+{
+	return container_of(css, struct sgx_epc_cgroup, css);
+}
+
+/**
+ * sgx_epc_cgroup_get_current() - Get the EPC cgroup of the current task
+ *
+ * Return: the EPC cgroup with a reference, see sgx_epc_cgroup_put()
+ */
+struct sgx_epc_cgroup *sgx_epc_cgroup_get_current(void)
+{
+	return sgx_epc_cgroup_from_css(task_get_css(current, sgx_epc_cgrp_id));
+}
+
+/**
+ * sgx_epc_cgroup_put() - Put a reference to an EPC cgroup
+ * @epc_cg:	an EPC cgroup
+ */
+void sgx_epc_cgroup_put(struct sgx_epc_cgroup *epc_cg)
+{
+	css_put(&epc_cg->css);
+}
+
+/**
+ * sgx_epc_cgroup_is_descendant() - Test the ancestry of an EPC cgroup
+ * @epc_cg:	an EPC cgroup
+ * @root:	the root of a subtree
+ *
+ * Return: true if @epc_cg is @root or one of its descendants
+ */
+bool sgx_epc_cgroup_is_descendant(struct sgx_epc_cgroup *epc_cg,
+				  struct sgx_epc_cgroup *root)
+{
+	return cgroup_is_descendant(epc_cg->css.cgroup, root->css.cgroup);
+}
+
+/**
+ * sgx_epc_cgroup_usage() - Get the EPC usage of an EPC cgroup
+ * @epc_cg:	an EPC cgroup
+ *
+ * Return: the number of EPC pages charged to @epc_cg and its descendants
+ */
+unsigned long sgx_epc_cgroup_usage(struct sgx_epc_cgroup *epc_cg)
+{
+	return page_counter_read(&epc_cg->pc);
+}
+
+/*
+ * Reclaim a batch of pages from the enclaves of @epc_cg and of its
+ * descendants with the pipeline of the global reclaimer.
+ */
+static void sgx_epc_cgroup_reclaim(struct sgx_epc_cgroup *epc_cg)
+{
+	unsigned long nr_scanned;
+
+	nr_scanned = sgx_reclaim_epc_cgroup(epc_cg, SGX_NR_TO_SCAN);
+	atomic_long_add(nr_scanned, &epc_cg->nr_scanned);
+}
+
+static void sgx_epc_cgroup_reclaim_work_func(struct work_struct *work)
+{
+	struct sgx_epc_cgroup *epc_cg =
+		container_of(work, struct sgx_epc_cgroup, reclaim_work);
+	unsigned int i;
+
+	for (i = 0; i < SGX_EPC_CGROUP_MAX_RETRIES; i++) {
+		if (page_counter_read(&epc_cg->pc) < READ_ONCE(epc_cg->pc.max))
+			break;
+
+		sgx_epc_cgroup_reclaim(epc_cg);
+		cond_resched();
+	}
+}
+
+/**
+ * sgx_epc_cgroup_try_charge() - Charge an EPC page to an EPC cgroup
+ * @epc_cg:	an EPC cgroup, NULL for none
+ * @reclaim:	reclaim from the cgroup over its limit if necessary
+ *
+ * Charge a page to @epc_cg and to its ancestors.  If any of them is at its
+ * limit, reclaim from its enclaves, or when @reclaim is false, which is the
+ * case for the allocations made while holding locks, kick its reclaim work
+ * and leave the retry to the caller.
+ *
+ * Return:
+ *   0 on success,
+ *   -EBUSY if the cgroup is at its limit and @reclaim is false,
+ *   -ERESTARTSYS if a signal is pending,
+ *   -ENOMEM if the reclaim did not make room
+ */
+int sgx_epc_cgroup_try_charge(struct sgx_epc_cgroup *epc_cg, bool reclaim)
+{
+	unsigned int nr_retries = SGX_EPC_CGROUP_MAX_RETRIES;
+	struct sgx_epc_cgroup *over;
+	struct page_counter *fail;
+
+	if (!epc_cg)
+		return 0;
+
+	while (!page_counter_try_charge(&epc_cg->pc, 1, &fail)) {
+		over = container_of(fail, struct sgx_epc_cgroup, pc);
+		atomic_long_inc(&over->nr_max_events);
+
+		if (!reclaim) {
+			queue_work(system_unbound_wq, &over->reclaim_work);
+			return -EBUSY;
+		}
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+
+		if (!nr_retries--)
+			return -ENOMEM;
+
+		sgx_epc_cgroup_reclaim(over);
+		cond_resched();
+	}
+
+	css_get(&epc_cg->css);
+	return 0;
+}
+
+/**
+ * sgx_epc_cgroup_uncharge() - Uncharge an EPC page from an EPC cgroup
+ * @epc_cg:	the EPC cgroup the page was charged to, NULL for none
+ */
+void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg)
+{
+	if (!epc_cg)
+		return;
+
+	page_counter_uncharge(&epc_cg->pc, 1);
+	css_put(&epc_cg->css);
+}
+
+static struct cgroup_subsys_state *
+sgx_epc_cgroup_css_alloc(struct cgroup_subsys_state *parent_css)
+{
+	struct sgx_epc_cgroup *epc_cg;
+
+	epc_cg = kzalloc(sizeof(*epc_cg), GFP_KERNEL);
+	if (!epc_cg)
+		return ERR_PTR(-ENOMEM);
+
+	page_counter_init(&epc_cg->pc, parent_css ?
+			  &sgx_epc_cgroup_from_css(parent_css)->pc : NULL);
+	INIT_WORK(&epc_cg->reclaim_work, sgx_epc_cgroup_reclaim_work_func);
+
+	return &epc_cg->css;
+}
+
+static void sgx_epc_cgroup_css_free(struct cgroup_subsys_state *css)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(css);
+
+	cancel_work_sync(&epc_cg->reclaim_work);
+	kfree(epc_cg);
+}
+
+static int sgx_epc_cgroup_max_show(struct seq_file *m, void *v)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(seq_css(m));
+	unsigned long max = READ_ONCE(epc_cg->pc.max);
+
+	if (max == PAGE_COUNTER_MAX)
+		seq_puts(m, "max\n");
+	else
+		seq_printf(m, "%llu\n", (u64)max * PAGE_SIZE);
+
+	return 0;
+}
+
+/*
+ * Set the limit, and then reclaim until the usage fits under it.  Like with
+ * memory.max, the new limit stays in effect even if the usage cannot be
+ * brought under it.
+ */
+static ssize_t sgx_epc_cgroup_max_write(struct kernfs_open_file *of,
+					char *buf, size_t nbytes, loff_t off)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(of_css(of));
+	unsigned int nr_retries = SGX_EPC_CGROUP_MAX_RETRIES;
+	unsigned long max;
+	int ret;
+
+	buf = strstrip(buf);
+	ret = page_counter_memparse(buf, "max", &max);
+	if (ret)
+		return ret;
+
+	xchg(&epc_cg->pc.max, max);
+
+	while (page_counter_read(&epc_cg->pc) > max && nr_retries--) {
+		if (signal_pending(current))
+			break;
+
+		sgx_epc_cgroup_reclaim(epc_cg);
+		cond_resched();
+	}
+
+	return nbytes;
+}
+
+static u64 sgx_epc_cgroup_current_read(struct cgroup_subsys_state *css,
+				       struct cftype *cft)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(css);
+
+	return (u64)page_counter_read(&epc_cg->pc) * PAGE_SIZE;
+}
+
+static int sgx_epc_cgroup_stat_show(struct seq_file *m, void *v)
+{
+	struct sgx_epc_cgroup *epc_cg = sgx_epc_cgroup_from_css(seq_css(m));
+
+	seq_printf(m, "pages %lu\n", page_counter_read(&epc_cg->pc));
+	seq_printf(m, "max_events %ld\n",
+		   atomic_long_read(&epc_cg->nr_max_events));
+	seq_printf(m, "reclaim_scanned %ld\n",
+		   atomic_long_read(&epc_cg->nr_scanned));
+
+	return 0;
+}
+
+static struct cftype sgx_epc_cgroup_files[] = {
+	{
+		.name = "max",
+		.seq_show = sgx_epc_cgroup_max_show,
+		.write = sgx_epc_cgroup_max_write,
+		.flags = CFTYPE_NOT_ON_ROOT,
+	},
+	{
+		.name = "current",
+		.read_u64 = sgx_epc_cgroup_current_read,
+	},
+	{
+		.name = "stat",
+		.seq_show = sgx_epc_cgroup_stat_show,
+	},
+	{ }	/* terminate */
+};
+
+struct cgroup_subsys sgx_epc_cgrp_subsys = {
+	.css_alloc	= sgx_epc_cgroup_css_alloc,
+	.css_free	= sgx_epc_cgroup_css_free,
+	.legacy_cftypes	= sgx_epc_cgroup_files,
+	.dfl_cftypes	= sgx_epc_cgroup_files,
+};
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/**
+ * Copyright(c) 2016-19 Intel Corporation.
+ *
+ * The EPC cgroup controller, which limits the EPC used by the enclaves of a
+ * cgroup.
+ */
+#ifndef _X86_SGX_EPC_CGROUP_H
+#define _X86_SGX_EPC_CGROUP_H
+
+#include <linux/cgroup.h>
+#include <linux/page_counter.h>
+#include <linux/workqueue.h>
+
+#ifdef CONFIG_CGROUP_SGX_EPC
+
+/**
+ * struct sgx_epc_cgroup - the EPC state of a cgroup
+ * @css:		the cgroup subsystem state
+ * @pc:			the hierarchical page counter, limited by sgx_epc.max
+ * @reclaim_work:	reclaims from the cgroup for the allocations that
+ *			cannot reclaim themselves
+ * @nr_max_events:	the number of times a charge hit the limit of the cgroup
+ * @nr_scanned:		the pages scanned by the reclaim targeted at the cgroup
+ */
+struct sgx_epc_cgroup {
+	struct cgroup_subsys_state css;
+	struct page_counter pc;
+	struct work_struct reclaim_work;
+	atomic_long_t nr_max_events;
+	atomic_long_t nr_scanned;
+};
+
+struct sgx_epc_cgroup *sgx_epc_cgroup_get_current(void);
+void sgx_epc_cgroup_put(struct sgx_epc_cgroup *epc_cg);
+int sgx_epc_cgroup_try_charge(struct sgx_epc_cgroup *epc_cg, bool reclaim);
+void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg);
+bool sgx_epc_cgroup_is_descendant(struct sgx_epc_cgroup *epc_cg,
+				  struct sgx_epc_cgroup *root);
+unsigned long sgx_epc_cgroup_usage(struct sgx_epc_cgroup *epc_cg);
+
+#else /* CONFIG_CGROUP_SGX_EPC */
+
+struct sgx_epc_cgroup;
+
+static inline struct sgx_epc_cgroup *sgx_epc_cgroup_get_current(void)
+{
+	return NULL;
+}
+
+static inline void sgx_epc_cgroup_put(struct sgx_epc_cgroup *epc_cg)
+{
+}
+
+static inline int sgx_epc_cgroup_try_charge(struct sgx_epc_cgroup *epc_cg,
+					    bool reclaim)
+{
+	return 0;
+}
+
+static inline void sgx_epc_cgroup_uncharge(struct sgx_epc_cgroup *epc_cg)
+{
+}
+
+static inline bool sgx_epc_cgroup_is_descendant(struct sgx_epc_cgroup *epc_cg,
+						struct sgx_epc_cgroup *root)
+{
+	return true;
+}
+
+static inline unsigned long sgx_epc_cgroup_usage(struct sgx_epc_cgroup *epc_cg)
+{
+	return 0;
+}
+
+#endif /* CONFIG_CGROUP_SGX_EPC */
+
+#endif /* _X86_SGX_EPC_CGROUP_H */
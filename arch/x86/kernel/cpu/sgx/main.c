@@ -1,16 +1,23 @@
 // SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
 // Copyright(c) 2016-17 Intel Corporation.
 
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
 #include <linux/freezer.h>
 #include <linux/highmem.h>
+#include <linux/kobject.h>
 #include <linux/kthread.h>
 #include <linux/pagemap.h>
+#include <linux/percpu_counter.h>
 #include <linux/ratelimit.h>
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+#include <asm/sgx_arch.h>
 #include "driver/driver.h"
-#include "arch.h"
 #include "encls.h"
+#include "epc_cgroup.h"
 #include "sgx.h"
 
 struct sgx_epc_section sgx_epc_sections[SGX_MAX_EPC_SECTIONS];
@@ -19,12 +26,43 @@ int sgx_nr_epc_sections;
 /* A per-cpu cache for the last known values of IA32_SGXLEPUBKEYHASHx MSRs. */
 static DEFINE_PER_CPU(u64 [4], sgx_lepubkeyhash_cache);
 
+/*
+ * Per-CPU magazines of free EPC pages.  A magazine is refilled from and drained
+ * to the EPC sections in batches of SGX_EPC_CACHE_BATCH pages, which amortizes
+ * the section locks over many allocations.  Magazines are accessed only by the
+ * local CPU with preemption disabled, remote magazines are drained by queueing
+ * work on their CPU.
+ */
+#define SGX_EPC_CACHE_SIZE	64
+#define SGX_EPC_CACHE_BATCH	16
+
+struct sgx_epc_cache {
+	unsigned int nr;
+	struct sgx_epc_page *pages[SGX_EPC_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct sgx_epc_cache, sgx_epc_cache);
+static DEFINE_PER_CPU(struct work_struct, sgx_epc_cache_drain_work);
+static DEFINE_MUTEX(sgx_epc_cache_drain_mutex);
+static enum cpuhp_state sgx_epc_cache_cpuhp_state;
+
+struct sgx_numa_node *sgx_numa_nodes;
+nodemask_t sgx_epc_nodes;
+
+/* Keep the backing storage of the new enclaves unevictable. */
+bool sgx_lock_backing;
+
+static inline int sgx_home_node(void)
+{
+	return sgx_numa_nodes[numa_node_id()].fallback[0];
+}
+
 static struct sgx_epc_page *sgx_section_try_take_page(
 	struct sgx_epc_section *section)
 {
 	struct sgx_epc_page *page;
 
-	if (!section->free_cnt)
+	if (list_empty(&section->page_list))
 		return NULL;
 
 	page = list_first_entry(&section->page_list, struct sgx_epc_page,
@@ -34,51 +72,695 @@ static struct sgx_epc_page *sgx_section_try_take_page(
 	return page;
 }
 
-static struct sgx_epc_page *sgx_try_alloc_page(void *owner)
+static void sgx_epc_cache_refill(struct sgx_epc_cache *cache, int nid)
 {
 	struct sgx_epc_section *section;
 	struct sgx_epc_page *page;
 	int i;
 
-	for (i = 0; i < sgx_nr_epc_sections; i++) {
+	for_each_set_bit(i, &sgx_numa_nodes[nid].section_mask,
+			 SGX_MAX_EPC_SECTIONS) {
 		section = &sgx_epc_sections[i];
+		if (list_empty(&section->page_list))
+			continue;
+
+		spin_lock(&section->lock);
+		while (cache->nr < SGX_EPC_CACHE_BATCH) {
+			page = sgx_section_try_take_page(section);
+			if (!page)
+				break;
+
+			cache->pages[cache->nr++] = page;
+		}
+		spin_unlock(&section->lock);
+
+		if (cache->nr == SGX_EPC_CACHE_BATCH)
+			break;
+	}
+}
+
+static void sgx_epc_cache_drain(struct sgx_epc_cache *cache, unsigned int nr)
+{
+	struct sgx_epc_section *locked = NULL;
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+
+	while (nr-- && cache->nr) {
+		page = cache->pages[--cache->nr];
+		section = sgx_epc_section(page);
+
+		if (section != locked) {
+			if (locked)
+				spin_unlock(&locked->lock);
+			spin_lock(&section->lock);
+			locked = section;
+		}
+
+		list_add_tail(&page->list, &section->page_list);
+		section->free_cnt++;
+	}
+
+	if (locked)
+		spin_unlock(&locked->lock);
+}
+
+static void sgx_epc_cache_drain_local(struct work_struct *work)
+{
+	struct sgx_epc_cache *cache = get_cpu_ptr(&sgx_epc_cache);
+
+	sgx_epc_cache_drain(cache, cache->nr);
+	put_cpu_ptr(&sgx_epc_cache);
+}
+
+static unsigned long sgx_section_free_cnt(void)
+{
+	unsigned long free_cnt = 0;
+	int i;
+
+	for (i = 0; i < sgx_nr_epc_sections; i++)
+		free_cnt += READ_ONCE(sgx_epc_sections[i].free_cnt);
+
+	return free_cnt;
+}
+
+/*
+ * Move the pages cached in the magazines of all CPUs back to the sections.
+ * Return true if there were pages to drain.
+ */
+static bool sgx_epc_cache_drain_all(void)
+{
+	struct sgx_numa_node *node;
+	s64 free_cnt = 0;
+	int cpu;
+	int nid;
+
+	/* Free pages, including unsanitized, in the sections and magazines. */
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		node = &sgx_numa_nodes[nid];
+		free_cnt += percpu_counter_sum(&node->nr_free_pages);
+	}
+
+	if (free_cnt <= sgx_section_free_cnt())
+		return false;
+
+	mutex_lock(&sgx_epc_cache_drain_mutex);
+	get_online_cpus();
+
+	for_each_online_cpu(cpu)
+		queue_work_on(cpu, system_highpri_wq,
+			      per_cpu_ptr(&sgx_epc_cache_drain_work, cpu));
+
+	for_each_online_cpu(cpu)
+		flush_work(per_cpu_ptr(&sgx_epc_cache_drain_work, cpu));
+
+	put_online_cpus();
+	mutex_unlock(&sgx_epc_cache_drain_mutex);
+
+	return true;
+}
+
+static int sgx_epc_cache_cpu_dead(unsigned int cpu)
+{
+	struct sgx_epc_cache *cache = per_cpu_ptr(&sgx_epc_cache, cpu);
+
+	sgx_epc_cache_drain(cache, cache->nr);
+	return 0;
+}
+
+static struct sgx_epc_page *sgx_node_try_take_page(int nid)
+{
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+	int i;
+
+	for_each_set_bit(i, &sgx_numa_nodes[nid].section_mask,
+			 SGX_MAX_EPC_SECTIONS) {
+		section = &sgx_epc_sections[i];
+		if (list_empty(&section->page_list))
+			continue;
+
 		spin_lock(&section->lock);
 		page = sgx_section_try_take_page(section);
 		spin_unlock(&section->lock);
 
-		if (page) {
-			page->owner = owner;
+		if (page)
 			return page;
+	}
+
+	return NULL;
+}
+
+/*
+ * The EPC is sanitized at boot by SGX_SANITIZE_MAX_WORKERS work items per node
+ * at most, each taking the unsanitized pages of the sections of its node in
+ * chunks of SGX_SANITIZE_CHUNK pages.  The EREMOVEs run outside of the section
+ * lock, so that the allocations can proceed with the pages already sanitized.
+ */
+#define SGX_SANITIZE_CHUNK		64
+#define SGX_SANITIZE_MAX_WORKERS	8
+
+struct sgx_sanitize_work {
+	struct work_struct work;
+	int nid;
+};
+
+static struct sgx_sanitize_work *sgx_sanitize_works;
+static unsigned int sgx_nr_sanitize_works;
+static atomic_t sgx_nr_sanitizers;
+static bool sgx_sanitize_stopping;
+static struct kobject *sgx_kobj;
+
+static bool sgx_sanitize_chunk(struct sgx_epc_section *section)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[section->nid];
+	struct sgx_epc_page *page, *tmp;
+	unsigned long nr_removed = 0;
+	unsigned int nr_taken = 0;
+	LIST_HEAD(secs_list);
+	LIST_HEAD(chunk);
+
+	spin_lock(&section->lock);
+	while (nr_taken < SGX_SANITIZE_CHUNK &&
+	       !list_empty(&section->unsanitized_page_list)) {
+		list_move_tail(section->unsanitized_page_list.next, &chunk);
+		nr_taken++;
+	}
+	spin_unlock(&section->lock);
+
+	if (!nr_taken)
+		return false;
+
+	list_for_each_entry_safe(page, tmp, &chunk, list) {
+		if (__eremove(sgx_epc_addr(page)))
+			list_move_tail(&page->list, &secs_list);
+		else
+			nr_removed++;
+	}
+
+	spin_lock(&section->lock);
+	list_splice_tail(&chunk, &section->page_list);
+	list_splice_tail(&secs_list, &section->unsanitized_secs_list);
+	spin_unlock(&section->lock);
+
+	atomic_long_sub(nr_removed, &node->nr_unsanitized_pages);
+	cond_resched();
+	return true;
+}
+
+/*
+ * EREMOVE the SECS pages, which failed the first pass because they still had
+ * child pages.  Run once all the child pages have been removed.
+ */
+static void sgx_sanitize_secs(struct sgx_epc_section *section)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[section->nid];
+	struct sgx_epc_page *page;
+	int ret;
+
+	spin_lock(&section->lock);
+	while (!list_empty(&section->unsanitized_secs_list)) {
+		page = list_first_entry(&section->unsanitized_secs_list,
+					struct sgx_epc_page, list);
+		list_del_init(&page->list);
+		spin_unlock(&section->lock);
+
+		ret = __eremove(sgx_epc_addr(page));
+		atomic_long_dec(&node->nr_unsanitized_pages);
+
+		spin_lock(&section->lock);
+		if (!WARN_ON_ONCE(ret)) {
+			list_add_tail(&page->list, &section->page_list);
+		} else {
+			section->free_cnt--;
+			percpu_counter_dec(&node->nr_free_pages);
+			kfree(page);
 		}
+		spin_unlock(&section->lock);
+
+		cond_resched();
+		spin_lock(&section->lock);
+	}
+	spin_unlock(&section->lock);
+}
+
+/*
+ * Drop a reference to the sanitization, held by every worker until it runs out
+ * of pages and by an allocation while it sanitizes a page.  The last one out
+ * EREMOVEs the SECS pages, when no child page can be in flight any more.
+ */
+static void sgx_sanitize_put(void)
+{
+	int i;
+
+	/* The child pages of a SECS can be in any section of any node. */
+	if (!atomic_dec_and_test(&sgx_nr_sanitizers))
+		return;
+
+	for (i = 0; i < sgx_nr_epc_sections; i++)
+		sgx_sanitize_secs(&sgx_epc_sections[i]);
+
+	pr_info("sgx: EPC sanitized\n");
+	if (READ_ONCE(sgx_kobj))
+		sysfs_notify(sgx_kobj, NULL, "sanitized");
+}
+
+static void sgx_sanitize_work_func(struct work_struct *work)
+{
+	int nid = container_of(work, struct sgx_sanitize_work, work)->nid;
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	bool progress;
+	int i;
+
+	do {
+		progress = false;
+		for_each_set_bit(i, &node->section_mask, SGX_MAX_EPC_SECTIONS) {
+			if (READ_ONCE(sgx_sanitize_stopping))
+				return;
+
+			if (sgx_sanitize_chunk(&sgx_epc_sections[i]))
+				progress = true;
+		}
+	} while (progress);
+
+	sgx_sanitize_put();
+}
+
+/*
+ * Take an unsanitized page of a node and sanitize it, for an allocation that
+ * has found no free page before the sanitization has completed.  A SECS page
+ * that still has child pages goes to the SECS list, which is drained by the
+ * last holder of a reference to the sanitization.
+ */
+static struct sgx_epc_page *sgx_node_sanitize_page(int nid)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	struct sgx_epc_section *section;
+	struct sgx_epc_page *page;
+	int i;
+
+	/* The SECS pages have been EREMOVE'd already. */
+	if (!atomic_inc_not_zero(&sgx_nr_sanitizers))
+		return NULL;
+
+	for_each_set_bit(i, &node->section_mask, SGX_MAX_EPC_SECTIONS) {
+		section = &sgx_epc_sections[i];
+
+		for ( ; ; ) {
+			spin_lock(&section->lock);
+			if (list_empty(&section->unsanitized_page_list)) {
+				spin_unlock(&section->lock);
+				break;
+			}
+
+			page = list_first_entry(&section->unsanitized_page_list,
+						struct sgx_epc_page, list);
+			list_del_init(&page->list);
+			section->free_cnt--;
+			spin_unlock(&section->lock);
+
+			if (!__eremove(sgx_epc_addr(page))) {
+				atomic_long_dec(&node->nr_unsanitized_pages);
+				goto out;
+			}
+
+			spin_lock(&section->lock);
+			list_add_tail(&page->list,
+				      &section->unsanitized_secs_list);
+			section->free_cnt++;
+			spin_unlock(&section->lock);
+		}
+	}
+
+	page = NULL;
+out:
+	sgx_sanitize_put();
+	return page;
+}
+
+static unsigned long sgx_node_unsanitized_cnt(int nid)
+{
+	return atomic_long_read(&sgx_numa_nodes[nid].nr_unsanitized_pages);
+}
+
+static bool sgx_sanitized(void)
+{
+	int nid;
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		if (sgx_node_unsanitized_cnt(nid))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * sgx_sanitize_init() - Start the sanitization of the EPC
+ *
+ * Queue the sanitization work items of every node with EPC, one per CPU of the
+ * node and at most SGX_SANITIZE_MAX_WORKERS, or one for a node without CPUs.
+ * ksgxswapd and the allocations do not wait for the sanitization, and the
+ * allocations sanitize pages themselves when they find no free page.
+ *
+ * Return:
+ *   0 on success,
+ *   -ENOMEM if the work items cannot be allocated
+ */
+static __init int sgx_sanitize_init(void)
+{
+	unsigned int nr_works, i, j = 0;
+	int nid;
+
+	sgx_sanitize_works = kcalloc(nodes_weight(sgx_epc_nodes) *
+				     SGX_SANITIZE_MAX_WORKERS,
+				     sizeof(*sgx_sanitize_works), GFP_KERNEL);
+	if (!sgx_sanitize_works)
+		return -ENOMEM;
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		nr_works = cpumask_weight(cpumask_of_node(nid));
+		nr_works = clamp_t(unsigned int, nr_works, 1,
+				   SGX_SANITIZE_MAX_WORKERS);
+
+		for (i = 0; i < nr_works; i++, j++) {
+			INIT_WORK(&sgx_sanitize_works[j].work,
+				  sgx_sanitize_work_func);
+			sgx_sanitize_works[j].nid = nid;
+		}
+	}
+
+	sgx_nr_sanitize_works = j;
+	atomic_set(&sgx_nr_sanitizers, j);
+
+	for (j = 0; j < sgx_nr_sanitize_works; j++)
+		queue_work_node(sgx_sanitize_works[j].nid, system_unbound_wq,
+				&sgx_sanitize_works[j].work);
+
+	return 0;
+}
+
+/**
+ * sgx_sanitize_exit() - Stop the sanitization of the EPC
+ */
+static __init void sgx_sanitize_exit(void)
+{
+	unsigned int i;
+
+	WRITE_ONCE(sgx_sanitize_stopping, true);
+
+	for (i = 0; i < sgx_nr_sanitize_works; i++)
+		flush_work(&sgx_sanitize_works[i].work);
+
+	kfree(sgx_sanitize_works);
+	sgx_sanitize_works = NULL;
+	sgx_nr_sanitize_works = 0;
+}
+
+/*
+ * Allocate a page of the given node.  Pages of the home node come from the
+ * magazine of the local CPU, pages of remote nodes directly from the sections.
+ */
+static struct sgx_epc_page *sgx_try_alloc_page(void *owner, int nid)
+{
+	struct sgx_epc_page *page = NULL;
+	struct sgx_epc_cache *cache;
+	bool home;
+
+	cache = get_cpu_ptr(&sgx_epc_cache);
+
+	home = nid == sgx_home_node();
+	if (home) {
+		if (!cache->nr)
+			sgx_epc_cache_refill(cache, nid);
+
+		if (cache->nr)
+			page = cache->pages[--cache->nr];
+	}
+
+	put_cpu_ptr(&sgx_epc_cache);
+
+	if (!home)
+		page = sgx_node_try_take_page(nid);
+
+	if (!page && sgx_node_unsanitized_cnt(nid))
+		page = sgx_node_sanitize_page(nid);
+
+	if (!page)
+		return NULL;
+
+	percpu_counter_add_batch(&sgx_numa_nodes[nid].nr_free_pages, -1,
+				 SGX_EPC_CACHE_BATCH);
+	page->owner = owner;
+	return page;
+}
+
+static int sgx_mempolicy_interleave(struct sgx_mempolicy *pol)
+{
+	unsigned int target;
+	int nid;
+
+	target = (unsigned int)atomic_inc_return(&pol->il_next) %
+		 nodes_weight(pol->nodes);
+
+	nid = first_node(pol->nodes);
+	while (target--)
+		nid = next_node(nid, pol->nodes);
+
+	return nid;
+}
+
+/* Return the node of @mask that is nearest to @nid. */
+static int sgx_nearest_node(int nid, const nodemask_t *mask)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	int i;
+
+	for (i = 0; i < node->nr_fallback; i++) {
+		if (node_isset(node->fallback[i], *mask))
+			return node->fallback[i];
+	}
+
+	return first_node(*mask);
+}
+
+/*
+ * Return the first node to allocate from, and the nodes the allocation may
+ * fall back to, or NULL if any node will do.  Only %SGX_MPOL_BIND restricts
+ * the fallback, and starts from the bound node nearest to the local one.
+ */
+static int sgx_mempolicy_node(struct sgx_mempolicy *pol,
+			      const nodemask_t **allowed)
+{
+	unsigned int mode = pol ? pol->mode : SGX_MPOL_DEFAULT;
+	int nid = sgx_numa_nodes[numa_node_id()].fallback[0];
+
+	*allowed = NULL;
+
+	switch (mode) {
+	case SGX_MPOL_PREFERRED:
+		nid = first_node(pol->nodes);
+		break;
+	case SGX_MPOL_BIND:
+		*allowed = &pol->nodes;
+		nid = sgx_nearest_node(nid, &pol->nodes);
+		break;
+	case SGX_MPOL_INTERLEAVE:
+		nid = sgx_mempolicy_interleave(pol);
+		break;
+	}
+
+	return nid;
+}
+
+/*
+ * Try the first node chosen by the policy, and then the other allowed nodes
+ * in the order of distance from it.
+ */
+static struct sgx_epc_page *sgx_try_alloc_page_policy(void *owner, int nid,
+						      const nodemask_t *allowed)
+{
+	struct sgx_numa_node *node;
+	struct sgx_epc_page *page;
+	int i;
+
+	if (!allowed || node_isset(nid, *allowed)) {
+		page = sgx_try_alloc_page(owner, nid);
+		if (page)
+			return page;
+	}
+
+	node = &sgx_numa_nodes[nid];
+	for (i = 0; i < node->nr_fallback; i++) {
+		if (node->fallback[i] == nid)
+			continue;
+
+		if (allowed && !node_isset(node->fallback[i], *allowed))
+			continue;
+
+		page = sgx_try_alloc_page(owner, node->fallback[i]);
+		if (page)
+			return page;
 	}
 
 	return NULL;
 }
 
+/**
+ * sgx_mempolicy_init() - Initialize a NUMA placement policy
+ * @pol:	the policy
+ * @mode:	an SGX_MPOL_* mode
+ * @nodes:	the nodes of the policy
+ *
+ * The nodes must have EPC. %SGX_MPOL_DEFAULT takes no nodes, the other modes
+ * at least one; %SGX_MPOL_PREFERRED uses the lowest numbered node of @nodes.
+ *
+ * Return:
+ *   0 on success,
+ *   -EINVAL if the mode or the nodes are invalid
+ */
+int sgx_mempolicy_init(struct sgx_mempolicy *pol, unsigned int mode,
+		       const nodemask_t *nodes)
+{
+	switch (mode) {
+	case SGX_MPOL_DEFAULT:
+		if (!nodes_empty(*nodes))
+			return -EINVAL;
+		break;
+	case SGX_MPOL_PREFERRED:
+	case SGX_MPOL_BIND:
+	case SGX_MPOL_INTERLEAVE:
+		if (nodes_empty(*nodes) || !nodes_subset(*nodes, sgx_epc_nodes))
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	pol->mode = mode;
+	pol->nodes = *nodes;
+	atomic_set(&pol->il_next, 0);
+	return 0;
+}
+
+/**
+ * sgx_put_page() - Return a page to the allocator
+ * @page:	an EPC page that is not in use by any enclave
+ *
+ * Put a page, which has been either EREMOVE'd or written out with EWB, to the
+ * free page magazine of the local CPU.  A full magazine is partially drained
+ * to the EPC sections.  A page of a node other than the home node of the CPU
+ * goes directly back to its section.
+ */
+void sgx_put_page(struct sgx_epc_page *page)
+{
+	struct sgx_epc_section *section = sgx_epc_section(page);
+	struct sgx_epc_cache *cache;
+
+	sgx_epc_cgroup_uncharge(page->epc_cg);
+	page->epc_cg = NULL;
+
+	cache = get_cpu_ptr(&sgx_epc_cache);
+
+	if (section->nid == sgx_home_node()) {
+		if (cache->nr == SGX_EPC_CACHE_SIZE)
+			sgx_epc_cache_drain(cache, SGX_EPC_CACHE_BATCH);
+
+		cache->pages[cache->nr++] = page;
+	} else {
+		spin_lock(&section->lock);
+		list_add_tail(&page->list, &section->page_list);
+		section->free_cnt++;
+		spin_unlock(&section->lock);
+	}
+
+	put_cpu_ptr(&sgx_epc_cache);
+
+	percpu_counter_add_batch(&sgx_numa_nodes[section->nid].nr_free_pages, 1,
+				 SGX_EPC_CACHE_BATCH);
+}
+
+/**
+ * sgx_calc_free_cnt() - Estimate the number of free EPC pages
+ *
+ * The estimate is cheap to compute and is meant for the watermark checks.  It
+ * can be off by SGX_EPC_CACHE_BATCH pages per CPU.
+ *
+ * Return: the approximate number of free EPC pages
+ */
+unsigned long sgx_calc_free_cnt(void)
+{
+	unsigned long free_cnt = 0;
+	int nid;
+
+	for_each_node_mask(nid, sgx_epc_nodes)
+		free_cnt += sgx_node_calc_free_cnt(nid);
+
+	return free_cnt;
+}
+
+/**
+ * sgx_node_calc_free_cnt() - Estimate the number of free EPC pages of a node
+ * @nid:	a node with EPC
+ *
+ * Return: the approximate number of free EPC pages of the node
+ */
+unsigned long sgx_node_calc_free_cnt(int nid)
+{
+	return percpu_counter_read_positive(&sgx_numa_nodes[nid].nr_free_pages);
+}
+
 /**
  * sgx_alloc_page - Allocate an EPC page
  * @owner:	the owner of the EPC page
+ * @pol:	the NUMA placement policy, NULL for the default policy
+ * @epc_cg:	the EPC cgroup to charge the page to, NULL for none
  * @reclaim:	reclaim pages if necessary
  *
  * Try to grab a page from the free EPC page list. If there is a free page
  * available, it is returned to the caller. The @reclaim parameter hints
- * the EPC memory manager to swap pages when required.
+ * the EPC memory manager to swap pages when required.  The reclaim in the
+ * context of the caller is throttled per node, see sgx_direct_reclaim().
+ * A cgroup at its limit is reclaimed from first, see
+ * sgx_epc_cgroup_try_charge().  The page is uncharged when it is put back.
  *
  * Return:
  *   a pointer to a &struct sgx_epc_page instance,
  *   -errno on error
  */
-struct sgx_epc_page *sgx_alloc_page(void *owner, bool reclaim)
+struct sgx_epc_page *sgx_alloc_page(void *owner, struct sgx_mempolicy *pol,
+				    struct sgx_epc_cgroup *epc_cg, bool reclaim)
 {
+	const nodemask_t *allowed;
+	struct sgx_numa_node *node;
 	struct sgx_epc_page *entry;
+	bool drained = false;
+	int nid;
+	int ret;
+
+	ret = sgx_epc_cgroup_try_charge(epc_cg, reclaim);
+	if (ret)
+		return ERR_PTR(ret);
+
+	nid = sgx_mempolicy_node(pol, &allowed);
 
 	for ( ; ; ) {
-		entry = sgx_try_alloc_page(owner);
+		entry = sgx_try_alloc_page_policy(owner, nid, allowed);
 		if (entry)
 			break;
 
-		if (list_empty(&sgx_active_page_list))
-			return ERR_PTR(-ENOMEM);
+		/* Pages might be stranded in the magazines of other CPUs. */
+		if (!drained) {
+			drained = true;
+			if (sgx_epc_cache_drain_all())
+				continue;
+		}
+
+		/* The rest of the EPC might be in the hands of the sanitizers. */
+		if (!atomic_long_read(&sgx_nr_active_pages) &&
+		    sgx_sanitized()) {
+			entry = ERR_PTR(-ENOMEM);
+			break;
+		}
 
 		if (!reclaim) {
 			entry = ERR_PTR(-EBUSY);
@@ -90,12 +772,19 @@ struct sgx_epc_page *sgx_alloc_page(void *owner, bool reclaim)
 			break;
 		}
 
-		sgx_reclaim_pages();
-		schedule();
+		sgx_direct_reclaim(nid, allowed);
+	}
+
+	if (!IS_ERR(entry)) {
+		entry->epc_cg = epc_cg;
+		nid = sgx_epc_section(entry)->nid;
+	} else {
+		sgx_epc_cgroup_uncharge(epc_cg);
 	}
 
-	if (sgx_calc_free_cnt() < SGX_NR_LOW_PAGES)
-		wake_up(&ksgxswapd_waitq);
+	node = &sgx_numa_nodes[nid];
+	if (sgx_node_calc_free_cnt(nid) < READ_ONCE(node->low_pages))
+		wake_up(&node->ksgxswapd_waitq);
 
 	return entry;
 }
@@ -114,35 +803,23 @@ struct sgx_epc_page *sgx_alloc_page(void *owner, bool reclaim)
  */
 int __sgx_free_page(struct sgx_epc_page *page)
 {
-	struct sgx_epc_section *section = sgx_epc_section(page);
 	int ret;
 
 	/*
 	 * Remove the page from the active list if necessary.  If the page
-	 * is actively being reclaimed, i.e. RECLAIMABLE is set but the
-	 * page isn't on the active list, return -EBUSY as we can't free
-	 * the page at this time since it is "owned" by the reclaimer.
+	 * is actively being reclaimed, i.e. it has been isolated onto a
+	 * batch of the reclaimer, return -EBUSY as we can't free the page
+	 * at this time since it is "owned" by the reclaimer.
 	 */
-	spin_lock(&sgx_active_page_list_lock);
-	if (page->desc & SGX_EPC_PAGE_RECLAIMABLE) {
-		if (list_empty(&page->list)) {
-			spin_unlock(&sgx_active_page_list_lock);
-			return -EBUSY;
-		}
-		list_del(&page->list);
-		page->desc &= ~SGX_EPC_PAGE_RECLAIMABLE;
-	}
-	spin_unlock(&sgx_active_page_list_lock);
+	ret = sgx_unmark_page_reclaimable(page);
+	if (ret)
+		return ret;
 
 	ret = __eremove(sgx_epc_addr(page));
 	if (ret)
 		return ret;
 
-	spin_lock(&section->lock);
-	list_add_tail(&page->list, &section->page_list);
-	section->free_cnt++;
-	spin_unlock(&section->lock);
-
+	sgx_put_page(page);
 	return 0;
 }
 
@@ -228,11 +905,21 @@ static __init void sgx_free_epc_section(struct sgx_epc_section *section)
 		kfree(page);
 	}
 
+	while (!list_empty(&section->unsanitized_secs_list)) {
+		page = list_first_entry(&section->unsanitized_secs_list,
+					struct sgx_epc_page, list);
+		list_del(&page->list);
+		kfree(page);
+	}
+
 	memunmap(section->va);
+
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		sgx_emu_free_epc(section->pa);
 }
 
 static __init int sgx_init_epc_section(u64 addr, u64 size, unsigned long index,
-				       struct sgx_epc_section *section)
+				       int nid, struct sgx_epc_section *section)
 {
 	unsigned long nr_pages = size >> PAGE_SHIFT;
 	struct sgx_epc_page *page;
@@ -243,9 +930,12 @@ static __init int sgx_init_epc_section(u64 addr, u64 size, unsigned long index,
 		return -ENOMEM;
 
 	section->pa = addr;
+	section->nid = nid;
+	section->nr_pages = nr_pages;
 	spin_lock_init(&section->lock);
 	INIT_LIST_HEAD(&section->page_list);
 	INIT_LIST_HEAD(&section->unsanitized_page_list);
+	INIT_LIST_HEAD(&section->unsanitized_secs_list);
 
 	for (i = 0; i < nr_pages; i++) {
 		page = kzalloc(sizeof(*page), GFP_KERNEL);
@@ -281,15 +971,74 @@ static inline u64 sgx_calc_section_metric(u64 low, u64 high)
 	       ((high & GENMASK_ULL(19, 0)) << 32);
 }
 
-static __init int sgx_page_cache_init(void)
+/*
+ * EPC is not part of the memory map, take the node whose span contains the
+ * section, or else the node of the closest memory below the section.
+ */
+static __init int sgx_pa_to_nid(u64 pa)
+{
+	unsigned long pfn = PHYS_PFN(pa);
+	int nid, best = first_online_node;
+
+	for_each_online_node(nid) {
+		if (pfn >= node_start_pfn(nid) && pfn < node_end_pfn(nid))
+			return nid;
+
+		if (node_start_pfn(nid) <= pfn &&
+		    node_start_pfn(nid) > node_start_pfn(best))
+			best = nid;
+	}
+
+	return best;
+}
+
+static __init int sgx_page_cache_add_section(u64 pa, u64 size, int nid)
+{
+	int ret;
+
+	pr_info("sgx: EPC section 0x%llx-0x%llx, node %d\n", pa, pa + size - 1,
+		nid);
+
+	ret = sgx_init_epc_section(pa, size, sgx_nr_epc_sections, nid,
+				   &sgx_epc_sections[sgx_nr_epc_sections]);
+	if (ret)
+		return ret;
+
+	sgx_nr_epc_sections++;
+	return 0;
+}
+
+static __init int sgx_page_cache_init_emu(void)
+{
+	u64 pa, size;
+	int nid;
+	int ret;
+
+	while (sgx_nr_epc_sections < SGX_MAX_EPC_SECTIONS) {
+		size = sgx_emu_alloc_epc(&pa);
+		if (!size)
+			break;
+
+		/* The emulated EPC is RAM and has a struct page. */
+		nid = page_to_nid(pfn_to_page(PHYS_PFN(pa)));
+
+		ret = sgx_page_cache_add_section(pa, size, nid);
+		if (ret) {
+			sgx_emu_free_epc(pa);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static __init int sgx_page_cache_init_cpuid(void)
 {
 	u32 eax, ebx, ecx, edx, type;
 	u64 pa, size;
 	int ret;
 	int i;
 
-	BUILD_BUG_ON(SGX_MAX_EPC_SECTIONS > (SGX_EPC_SECTION_MASK + 1));
-
 	for (i = 0; i < (SGX_MAX_EPC_SECTIONS + 1); i++) {
 		cpuid_count(SGX_CPUID, i + SGX_CPUID_FIRST_VARIABLE_SUB_LEAF,
 			    &eax, &ebx, &ecx, &edx);
@@ -310,15 +1059,356 @@ static __init int sgx_page_cache_init(void)
 
 		pa = sgx_calc_section_metric(eax, ebx);
 		size = sgx_calc_section_metric(ecx, edx);
-		pr_info("sgx: EPC section 0x%llx-0x%llx\n", pa, pa + size - 1);
 
-		ret = sgx_init_epc_section(pa, size, i, &sgx_epc_sections[i]);
-		if (ret) {
-			sgx_page_cache_teardown();
+		ret = sgx_page_cache_add_section(pa, size, sgx_pa_to_nid(pa));
+		if (ret)
 			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Group the sections by node and order the nodes with EPC by distance from
+ * every possible node.
+ */
+static __init int sgx_numa_init(void)
+{
+	struct sgx_numa_node *node;
+	int nid, epc_nid, i, j;
+	unsigned long free_cnt;
+	int ret;
+
+	sgx_numa_nodes = kcalloc(nr_node_ids, sizeof(*sgx_numa_nodes),
+				 GFP_KERNEL);
+	if (!sgx_numa_nodes)
+		return -ENOMEM;
+
+	for (i = 0; i < sgx_nr_epc_sections; i++) {
+		nid = sgx_epc_sections[i].nid;
+		sgx_numa_nodes[nid].section_mask |= BIT(i);
+		node_set(nid, sgx_epc_nodes);
+	}
+
+	for_each_node(nid) {
+		node = &sgx_numa_nodes[nid];
+
+		/* Insertion sort, there are at most SGX_MAX_EPC_SECTIONS. */
+		for_each_node_mask(epc_nid, sgx_epc_nodes) {
+			for (j = node->nr_fallback; j > 0; j--) {
+				if (node_distance(nid, node->fallback[j - 1]) <=
+				    node_distance(nid, epc_nid))
+					break;
+
+				node->fallback[j] = node->fallback[j - 1];
+			}
+
+			node->fallback[j] = epc_nid;
+			node->nr_fallback++;
+		}
+	}
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		node = &sgx_numa_nodes[nid];
+
+		free_cnt = 0;
+		for_each_set_bit(i, &node->section_mask, SGX_MAX_EPC_SECTIONS)
+			free_cnt += sgx_epc_sections[i].free_cnt;
+
+		ret = percpu_counter_init(&node->nr_free_pages, free_cnt,
+					  GFP_KERNEL);
+		if (ret)
+			goto err_counters;
+
+		atomic_long_set(&node->nr_active_pages, 0);
+		atomic_long_set(&node->nr_unsanitized_pages, free_cnt);
+		node->low_pages = SGX_NR_LOW_PAGES;
+		node->high_pages = SGX_NR_HIGH_PAGES;
+		init_waitqueue_head(&node->ksgxswapd_waitq);
+		init_waitqueue_head(&node->reclaim_waitq);
+		atomic_set(&node->nr_direct_reclaimers, 0);
+		atomic_set(&node->reclaim_seq, 0);
+	}
+
+	return 0;
+
+err_counters:
+	for_each_node_mask(epc_nid, sgx_epc_nodes) {
+		if (epc_nid == nid)
+			break;
+
+		percpu_counter_destroy(&sgx_numa_nodes[epc_nid].nr_free_pages);
+	}
+
+	kfree(sgx_numa_nodes);
+	return ret;
+}
+
+static __init void sgx_numa_teardown(void)
+{
+	int nid;
+
+	for_each_node_mask(nid, sgx_epc_nodes)
+		percpu_counter_destroy(&sgx_numa_nodes[nid].nr_free_pages);
+
+	kfree(sgx_numa_nodes);
+}
+
+static unsigned long sgx_node_total_cnt(int nid)
+{
+	unsigned long cnt = 0;
+	int i;
+
+	for_each_set_bit(i, &sgx_numa_nodes[nid].section_mask,
+			 SGX_MAX_EPC_SECTIONS)
+		cnt += sgx_epc_sections[i].nr_pages;
+
+	return cnt;
+}
+
+static unsigned long sgx_node_free_cnt(int nid)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	s64 cnt = percpu_counter_sum_positive(&node->nr_free_pages);
+
+	return min_t(s64, cnt, sgx_node_total_cnt(nid));
+}
+
+static int sgx_kobj_to_nid(struct kobject *kobj)
+{
+	int nid;
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		if (sgx_numa_nodes[nid].kobj == kobj)
+			return nid;
+	}
+
+	return first_node(sgx_epc_nodes);
+}
+
+static ssize_t total_pages_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", sgx_node_total_cnt(sgx_kobj_to_nid(kobj)));
+}
+static struct kobj_attribute total_pages_attr = __ATTR_RO(total_pages);
+
+static ssize_t free_pages_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", sgx_node_free_cnt(sgx_kobj_to_nid(kobj)));
+}
+static struct kobj_attribute free_pages_attr = __ATTR_RO(free_pages);
+
+static ssize_t used_pages_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	int nid = sgx_kobj_to_nid(kobj);
+
+	return sprintf(buf, "%lu\n",
+		       sgx_node_total_cnt(nid) - sgx_node_free_cnt(nid));
+}
+static struct kobj_attribute used_pages_attr = __ATTR_RO(used_pages);
+
+static ssize_t unsanitized_pages_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	int nid = sgx_kobj_to_nid(kobj);
+
+	return sprintf(buf, "%lu\n", sgx_node_unsanitized_cnt(nid));
+}
+static struct kobj_attribute unsanitized_pages_attr =
+	__ATTR_RO(unsanitized_pages);
+
+static ssize_t low_watermark_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[sgx_kobj_to_nid(kobj)];
+
+	return sprintf(buf, "%lu\n", READ_ONCE(node->low_pages));
+}
+
+static ssize_t low_watermark_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[sgx_kobj_to_nid(kobj)];
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > READ_ONCE(node->high_pages))
+		return -EINVAL;
+
+	WRITE_ONCE(node->low_pages, val);
+	wake_up(&node->ksgxswapd_waitq);
+	return count;
+}
+static struct kobj_attribute low_watermark_attr = __ATTR_RW(low_watermark);
+
+static ssize_t high_watermark_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[sgx_kobj_to_nid(kobj)];
+
+	return sprintf(buf, "%lu\n", READ_ONCE(node->high_pages));
+}
+
+static ssize_t high_watermark_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int nid = sgx_kobj_to_nid(kobj);
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val < READ_ONCE(node->low_pages) || val > sgx_node_total_cnt(nid))
+		return -EINVAL;
+
+	WRITE_ONCE(node->high_pages, val);
+	wake_up(&node->ksgxswapd_waitq);
+	return count;
+}
+static struct kobj_attribute high_watermark_attr = __ATTR_RW(high_watermark);
+
+static struct attribute *sgx_node_attrs[] = {
+	&total_pages_attr.attr,
+	&free_pages_attr.attr,
+	&used_pages_attr.attr,
+	&unsanitized_pages_attr.attr,
+	&low_watermark_attr.attr,
+	&high_watermark_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group sgx_node_attr_group = {
+	.attrs = sgx_node_attrs,
+};
+
+/* Polled by the orchestration to learn when the full EPC is usable. */
+static ssize_t sanitized_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", sgx_sanitized());
+}
+static struct kobj_attribute sanitized_attr = __ATTR_RO(sanitized);
+
+static ssize_t lock_backing_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", READ_ONCE(sgx_lock_backing));
+}
+
+static ssize_t lock_backing_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(sgx_lock_backing, val);
+	return count;
+}
+static struct kobj_attribute lock_backing_attr = __ATTR_RW(lock_backing);
+
+static struct attribute *sgx_attrs[] = {
+	&sanitized_attr.attr,
+	&lock_backing_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group sgx_attr_group = {
+	.attrs = sgx_attrs,
+};
+
+/*
+ * Export the EPC usage and the reclaim watermarks of the nodes in
+ * /sys/kernel/mm/sgx/node<nid>/, the progress of the sanitization in
+ * /sys/kernel/mm/sgx/sanitized, which is notified when it completes, and the
+ * policy of the backing storage of the new enclaves in
+ * /sys/kernel/mm/sgx/lock_backing.  The defaults work without the files, hence
+ * a failure to create them is not fatal.
+ */
+static __init void sgx_sysfs_init(void)
+{
+	struct kobject *parent, *kobj;
+	char name[16];
+	int nid;
+
+	parent = kobject_create_and_add("sgx", mm_kobj);
+	if (!parent)
+		goto err;
+
+	if (sysfs_create_group(parent, &sgx_attr_group))
+		goto err_parent;
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		snprintf(name, sizeof(name), "node%d", nid);
+		kobj = kobject_create_and_add(name, parent);
+		if (!kobj)
+			goto err_nodes;
+
+		if (sysfs_create_group(kobj, &sgx_node_attr_group)) {
+			kobject_put(kobj);
+			goto err_nodes;
 		}
 
-		sgx_nr_epc_sections++;
+		sgx_numa_nodes[nid].kobj = kobj;
+	}
+
+	WRITE_ONCE(sgx_kobj, parent);
+	return;
+
+err_nodes:
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		kobj = sgx_numa_nodes[nid].kobj;
+		if (!kobj)
+			continue;
+
+		sgx_numa_nodes[nid].kobj = NULL;
+		sysfs_remove_group(kobj, &sgx_node_attr_group);
+		kobject_put(kobj);
+	}
+	sysfs_remove_group(parent, &sgx_attr_group);
+err_parent:
+	kobject_put(parent);
+err:
+	pr_warn("sgx: Failed to create the sysfs files\n");
+}
+
+/**
+ * sgx_page_cache_init() - Set up the EPC sections
+ *
+ * Enumerate the EPC sections from CPUID, or carve them out of RAM when the
+ * ENCLS leaf functions are emulated in software.
+ */
+static __init int sgx_page_cache_init(void)
+{
+	int ret;
+	int cpu;
+
+	BUILD_BUG_ON(SGX_MAX_EPC_SECTIONS > (SGX_EPC_SECTION_MASK + 1));
+
+	if (IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
+		ret = sgx_page_cache_init_emu();
+	else
+		ret = sgx_page_cache_init_cpuid();
+
+	if (ret) {
+		sgx_page_cache_teardown();
+		return ret;
 	}
 
 	if (!sgx_nr_epc_sections) {
@@ -326,34 +1416,74 @@ static __init int sgx_page_cache_init(void)
 		return -ENODEV;
 	}
 
+	ret = sgx_numa_init();
+	if (ret)
+		goto err_sections;
+
+	for_each_possible_cpu(cpu)
+		INIT_WORK(per_cpu_ptr(&sgx_epc_cache_drain_work, cpu),
+			  sgx_epc_cache_drain_local);
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN,
+					"x86/sgx/epc_cache:dead", NULL,
+					sgx_epc_cache_cpu_dead);
+	if (ret < 0)
+		goto err_numa;
+
+	sgx_epc_cache_cpuhp_state = ret;
 	return 0;
+
+err_numa:
+	sgx_numa_teardown();
+
+err_sections:
+	sgx_page_cache_teardown();
+	return ret;
 }
 
 static __init int sgx_init(void)
 {
+	int virt_ret;
 	int ret;
 
-	if (!boot_cpu_has(X86_FEATURE_SGX))
+	if (!boot_cpu_has(X86_FEATURE_SGX) &&
+	    !IS_ENABLED(CONFIG_INTEL_SGX_SW_EMU))
 		return false;
 
 	ret = sgx_page_cache_init();
 	if (ret)
 		return ret;
 
-	ret = sgx_page_reclaimer_init();
+	ret = sgx_sanitize_init();
 	if (ret)
 		goto err_page_cache;
 
-	ret = sgx_drv_init();
+	ret = sgx_page_reclaimer_init();
 	if (ret)
+		goto err_sanitize;
+
+	/* Either the driver or the virtual EPC is enough to make use of SGX. */
+	ret = sgx_drv_init();
+	virt_ret = sgx_virt_epc_init();
+	if (ret && virt_ret)
 		goto err_kthread;
 
+	if (ret)
+		pr_info("sgx: Native driver unavailable (%d), virtual EPC only\n",
+			ret);
+
+	sgx_sysfs_init();
 	return 0;
 
 err_kthread:
-	kthread_stop(ksgxswapd_tsk);
+	sgx_page_reclaimer_exit();
+
+err_sanitize:
+	sgx_sanitize_exit();
 
 err_page_cache:
+	cpuhp_remove_state_nocalls(sgx_epc_cache_cpuhp_state);
+	sgx_numa_teardown();
 	sgx_page_cache_teardown();
 
 	return ret;
@@ -4,139 +4,317 @@
 #include <linux/freezer.h>
 #include <linux/highmem.h>
 #include <linux/kthread.h>
+#include <linux/list_sort.h>
 #include <linux/pagemap.h>
 #include <linux/ratelimit.h>
 #include <linux/slab.h>
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include "driver/driver.h"
+#include "epc_cgroup.h"
 #include "sgx.h"
+#include "trace.h"
 
-struct task_struct *ksgxswapd_tsk;
-DECLARE_WAIT_QUEUE_HEAD(ksgxswapd_waitq);
-LIST_HEAD(sgx_active_page_list);
-DEFINE_SPINLOCK(sgx_active_page_list_lock);
+/*
+ * The enclaves that have reclaimable pages, each with its own LRU list of
+ * pages.  The reclaimer rotates through the enclaves, which keeps the pages of
+ * a batch within one enclave.  Lock order: encl->active_lock, then
+ * sgx_active_encl_list_lock.
+ */
+static LIST_HEAD(sgx_active_encl_list);
+static DEFINE_SPINLOCK(sgx_active_encl_list_lock);
+static unsigned int sgx_nr_active_encls;
+atomic_long_t sgx_nr_active_pages = ATOMIC_LONG_INIT(0);
+
+static void sgx_age_pages(struct work_struct *work);
+static DECLARE_DELAYED_WORK(sgx_age_work, sgx_age_pages);
 
-static void sgx_sanitize_section(struct sgx_epc_section *section)
+static inline bool sgx_should_reclaim(int nid)
 {
-	struct sgx_epc_page *page, *tmp;
-	LIST_HEAD(secs_list);
-	int ret;
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+
+	return sgx_node_calc_free_cnt(nid) < READ_ONCE(node->high_pages) &&
+	       atomic_long_read(&node->nr_active_pages);
+}
+
+static unsigned long sgx_nr_to_scan(int nid);
+
+/* Let the throttled direct reclaimers of the node retry their allocations. */
+static void sgx_reclaim_done(struct sgx_numa_node *node)
+{
+	atomic_inc(&node->reclaim_seq);
+
+	if (wq_has_sleeper(&node->reclaim_waitq))
+		wake_up_all(&node->reclaim_waitq);
+}
+
+/*
+ * The reclaimer of a node reclaims only the pages of the sections located in
+ * the node, hence the reclaim throughput scales with the number of nodes with
+ * EPC.  The sanitization of the EPC runs separately, see sgx_sanitize_init().
+ */
+static int ksgxswapd(void *p)
+{
+	int nid = (long)p;
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	unsigned long nr_scanned;
 
-	while (!list_empty(&section->unsanitized_page_list)) {
-		if (kthread_should_stop())
-			return;
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		if (try_to_freeze())
+			continue;
 
-		spin_lock(&section->lock);
+		wait_event_freezable(node->ksgxswapd_waitq,
+				     kthread_should_stop() ||
+				     sgx_should_reclaim(nid));
 
-		page = list_first_entry(&section->unsanitized_page_list,
-					struct sgx_epc_page, list);
+		if (!sgx_should_reclaim(nid))
+			continue;
 
-		ret = __eremove(sgx_epc_addr(page));
-		if (!ret)
-			list_move(&page->list, &section->page_list);
-		else
-			list_move_tail(&page->list, &secs_list);
+		nr_scanned = sgx_reclaim_pages(nid, sgx_nr_to_scan(nid));
+		sgx_reclaim_done(node);
 
-		spin_unlock(&section->lock);
+		/*
+		 * None of the reclaimable pages of the node could be isolated,
+		 * e.g. the other reclaimers hold all of them.  Back off rather
+		 * than spin on the watermark.
+		 */
+		if (!nr_scanned)
+			wait_event_freezable_timeout(node->ksgxswapd_waitq,
+						     kthread_should_stop(),
+						     SGX_RECLAIM_RETRY_WAIT);
 
 		cond_resched();
 	}
 
-	list_for_each_entry_safe(page, tmp, &secs_list, list) {
-		if (kthread_should_stop())
-			return;
+	return 0;
+}
 
-		ret = __eremove(sgx_epc_addr(page));
-		if (!WARN_ON_ONCE(ret)) {
-			spin_lock(&section->lock);
-			list_move(&page->list, &section->page_list);
-			spin_unlock(&section->lock);
-		} else {
-			list_del(&page->list);
-			kfree(page);
+/**
+ * sgx_page_reclaimer_init() - Start the reclaimer threads
+ *
+ * Start a ksgxswapd thread for every node with EPC, bound to the CPUs of the
+ * node when it has any, and the periodic aging of the enclave pages.
+ *
+ * Return:
+ *   0 on success,
+ *   -errno on error
+ */
+int sgx_page_reclaimer_init(void)
+{
+	const struct cpumask *cpumask;
+	struct task_struct *tsk;
+	int nid;
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		tsk = kthread_create_on_node(ksgxswapd, (void *)(long)nid, nid,
+					     "ksgxswapd%d", nid);
+		if (IS_ERR(tsk)) {
+			sgx_page_reclaimer_exit();
+			return PTR_ERR(tsk);
 		}
 
-		cond_resched();
+		cpumask = cpumask_of_node(nid);
+		if (!cpumask_empty(cpumask))
+			set_cpus_allowed_ptr(tsk, cpumask);
+
+		sgx_numa_nodes[nid].ksgxswapd = tsk;
+		wake_up_process(tsk);
+	}
+
+	queue_delayed_work(system_freezable_wq, &sgx_age_work,
+			   SGX_AGE_INTERVAL);
+
+	return 0;
+}
+
+/**
+ * sgx_page_reclaimer_exit() - Stop the reclaimer threads and the aging
+ */
+void sgx_page_reclaimer_exit(void)
+{
+	struct sgx_numa_node *node;
+	int nid;
+
+	cancel_delayed_work_sync(&sgx_age_work);
+
+	for_each_node_mask(nid, sgx_epc_nodes) {
+		node = &sgx_numa_nodes[nid];
+		if (!node->ksgxswapd)
+			continue;
+
+		kthread_stop(node->ksgxswapd);
+		node->ksgxswapd = NULL;
 	}
 }
 
-static inline bool sgx_should_reclaim(void)
+static inline struct sgx_numa_node *sgx_page_node(struct sgx_epc_page *page)
 {
-	return sgx_calc_free_cnt() < SGX_NR_HIGH_PAGES &&
-	       !list_empty(&sgx_active_page_list);
+	return &sgx_numa_nodes[sgx_epc_section(page)->nid];
 }
 
-static int ksgxswapd(void *p)
+/*
+ * Add a page to the tail of the active or the inactive list of the enclave.
+ * Called with encl->active_lock held.
+ */
+static void sgx_encl_lru_add(struct sgx_encl *encl,
+			     struct sgx_epc_page *page, bool active)
 {
-	int i;
+	if (!encl->nr_active_pages && !encl->nr_inactive_pages) {
+		spin_lock(&sgx_active_encl_list_lock);
+		list_add_tail(&encl->active_link, &sgx_active_encl_list);
+		sgx_nr_active_encls++;
+		spin_unlock(&sgx_active_encl_list_lock);
+	}
 
-	set_freezable();
+	if (active) {
+		page->desc |= SGX_EPC_PAGE_ACTIVE;
+		list_add_tail(&page->list, &encl->active_page_list);
+		encl->nr_active_pages++;
+	} else {
+		page->desc &= ~SGX_EPC_PAGE_ACTIVE;
+		list_add_tail(&page->list, &encl->inactive_page_list);
+		encl->nr_inactive_pages++;
+	}
 
-	for (i = 0; i < sgx_nr_epc_sections; i++)
-		sgx_sanitize_section(&sgx_epc_sections[i]);
+	atomic_long_inc(&sgx_nr_active_pages);
+	atomic_long_inc(&sgx_page_node(page)->nr_active_pages);
+}
 
-	while (!kthread_should_stop()) {
-		if (try_to_freeze())
-			continue;
+/* Called with encl->active_lock held. */
+static void sgx_encl_lru_del(struct sgx_encl *encl,
+			     struct sgx_epc_page *page)
+{
+	list_del_init(&page->list);
+	atomic_long_dec(&sgx_nr_active_pages);
+	atomic_long_dec(&sgx_page_node(page)->nr_active_pages);
+
+	if (page->desc & SGX_EPC_PAGE_ACTIVE)
+		encl->nr_active_pages--;
+	else
+		encl->nr_inactive_pages--;
+
+	if (!encl->nr_active_pages && !encl->nr_inactive_pages) {
+		spin_lock(&sgx_active_encl_list_lock);
+		list_del_init(&encl->active_link);
+		sgx_nr_active_encls--;
+		spin_unlock(&sgx_active_encl_list_lock);
+	}
+}
 
-		wait_event_freezable(ksgxswapd_waitq, kthread_should_stop() ||
-						      sgx_should_reclaim());
+/* Called with encl->active_lock held. */
+static void sgx_encl_lru_isolate(struct sgx_encl *encl,
+				 struct sgx_epc_page *page,
+				 struct list_head *batch)
+{
+	sgx_encl_lru_del(encl, page);
+	page->desc |= SGX_EPC_PAGE_ISOLATED;
+	list_add_tail(&page->list, batch);
+}
 
-		if (sgx_should_reclaim())
-			sgx_reclaim_pages();
+/* Called with encl->active_lock held. */
+static void sgx_encl_lru_putback(struct sgx_encl *encl,
+				 struct list_head *pages, bool active)
+{
+	struct sgx_epc_page *epc_page, *tmp;
 
-		cond_resched();
+	list_for_each_entry_safe(epc_page, tmp, pages, list) {
+		list_del(&epc_page->list);
+		epc_page->desc &= ~SGX_EPC_PAGE_ISOLATED;
+		sgx_encl_lru_add(encl, epc_page, active);
 	}
-
-	return 0;
 }
 
-int sgx_page_reclaimer_init(void)
+/*
+ * Return isolated pages to the tails of the active and the inactive lists of
+ * the enclave, @inactive can be NULL.  sgx_encl_destroy() skips the isolated
+ * pages, and the caller must free them instead if the enclave has been
+ * destroyed meanwhile, in which case false is returned and the pages are left
+ * untouched.
+ */
+static bool sgx_encl_putback_pages(struct sgx_encl *encl,
+				   struct list_head *active,
+				   struct list_head *inactive)
 {
-	struct task_struct *tsk;
+	mutex_lock(&encl->lock);
 
-	tsk = kthread_run(ksgxswapd, NULL, "ksgxswapd");
-	if (IS_ERR(tsk))
-		return PTR_ERR(tsk);
+	if (encl->flags & SGX_ENCL_DEAD) {
+		mutex_unlock(&encl->lock);
+		return false;
+	}
 
-	ksgxswapd_tsk = tsk;
+	spin_lock(&encl->active_lock);
 
-	return 0;
+	sgx_encl_lru_putback(encl, active, true);
+	if (inactive)
+		sgx_encl_lru_putback(encl, inactive, false);
+
+	spin_unlock(&encl->active_lock);
+	mutex_unlock(&encl->lock);
+
+	return true;
 }
 
 /**
  * sgx_mark_page_reclaimable() - Mark a page as reclaimable
  * @page:	EPC page
  *
- * Mark a page as reclaimable and add it to the active page list. Pages
- * are automatically removed from the active list when freed.
+ * Mark a page as reclaimable and add it to the active page list of its
+ * enclave, as it has just been loaded. Pages are automatically removed from
+ * the page lists when freed.
  */
 void sgx_mark_page_reclaimable(struct sgx_epc_page *page)
 {
-	spin_lock(&sgx_active_page_list_lock);
+	struct sgx_encl *encl = page->owner->encl;
+
+	spin_lock(&encl->active_lock);
 	page->desc |= SGX_EPC_PAGE_RECLAIMABLE;
-	list_add_tail(&page->list, &sgx_active_page_list);
-	spin_unlock(&sgx_active_page_list_lock);
+	sgx_encl_lru_add(encl, page, true);
+	spin_unlock(&encl->active_lock);
 }
 
-bool sgx_reclaimer_get(struct sgx_epc_page *epc_page)
+/**
+ * sgx_unmark_page_reclaimable() - Remove a page from the page lists
+ * @page:	EPC page
+ *
+ * Clear the reclaimable flag of a page, and remove it from the active or the
+ * inactive page list of its enclave.
+ *
+ * Return:
+ *   0 on success,
+ *   -EBUSY if the page is in the process of being reclaimed
+ */
+int sgx_unmark_page_reclaimable(struct sgx_epc_page *page)
 {
-	struct sgx_encl_page *encl_page = epc_page->owner;
-	struct sgx_encl *encl = encl_page->encl;
+	struct sgx_encl *encl;
 
-	return kref_get_unless_zero(&encl->refcount) != 0;
-}
+	/* Only the pages with an enclave page as the owner are reclaimable. */
+	if (!(page->desc & SGX_EPC_PAGE_RECLAIMABLE))
+		return 0;
 
-void sgx_reclaimer_put(struct sgx_epc_page *epc_page)
-{
-	struct sgx_encl_page *encl_page = epc_page->owner;
-	struct sgx_encl *encl = encl_page->encl;
+	encl = page->owner->encl;
+
+	spin_lock(&encl->active_lock);
+	if (page->desc & SGX_EPC_PAGE_RECLAIMABLE) {
+		if (page->desc & SGX_EPC_PAGE_ISOLATED) {
+			spin_unlock(&encl->active_lock);
+			return -EBUSY;
+		}
+
+		sgx_encl_lru_del(encl, page);
+		page->desc &= ~SGX_EPC_PAGE_RECLAIMABLE;
+	}
+	spin_unlock(&encl->active_lock);
 
-	kref_put(&encl->refcount, sgx_encl_release);
+	return 0;
 }
 
-static bool sgx_reclaimer_evict(struct sgx_epc_page *epc_page)
+/*
+ * Return true if the page can be evicted, i.e. it has not been accessed
+ * recently or the enclave is dead.
+ */
+static bool sgx_reclaimer_age(struct sgx_epc_page *epc_page)
 {
 	struct sgx_encl_page *page = epc_page->owner;
 	struct sgx_encl *encl = page->encl;
@@ -162,6 +340,9 @@ static bool sgx_reclaimer_evict(struct sgx_epc_page *epc_page)
 
 	srcu_read_unlock(&encl->srcu, idx);
 
+	if (test_and_clear_bit(SGX_ENCL_PAGE_PREFETCHED, &page->flags))
+		sgx_encl_ra_account(encl, !ret);
+
 	/*
 	 * Do not reclaim this page if it has been recently accessed by any
 	 * mm_struct *and* if the enclave is still alive.  No need to take
@@ -170,23 +351,19 @@ static bool sgx_reclaimer_evict(struct sgx_epc_page *epc_page)
 	 * accessed page is more common and avoiding lock contention in that
 	 * case is a boon to performance.
 	 */
-	if (!ret && !(encl->flags & SGX_ENCL_DEAD))
-		return false;
-
-	mutex_lock(&encl->lock);
-	page->desc |= SGX_ENCL_PAGE_RECLAIMED;
-	mutex_unlock(&encl->lock);
-
-	return true;
+	return ret || (encl->flags & SGX_ENCL_DEAD);
 }
 
-static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
+/*
+ * Zap the PTEs of the batch in every mm of the enclave, and EBLOCK the pages
+ * under a single hold of the enclave lock.
+ */
+static void sgx_reclaimer_block(struct sgx_encl *encl, struct list_head *batch)
 {
-	struct sgx_encl_page *page = epc_page->owner;
-	unsigned long addr = SGX_ENCL_PAGE_ADDR(page);
-	struct sgx_encl *encl = page->encl;
+	struct sgx_epc_page *epc_page;
 	struct sgx_encl_mm *encl_mm;
 	struct vm_area_struct *vma;
+	unsigned long addr;
 	int idx, ret;
 
 	idx = srcu_read_lock(&encl->srcu);
@@ -197,9 +374,13 @@ static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
 
 		down_read(&encl_mm->mm->mmap_sem);
 
-		ret = sgx_encl_find(encl_mm->mm, addr, &vma);
-		if (!ret && encl == vma->vm_private_data)
-			zap_vma_ptes(vma, addr, PAGE_SIZE);
+		list_for_each_entry(epc_page, batch, list) {
+			addr = SGX_ENCL_PAGE_ADDR(epc_page->owner);
+
+			ret = sgx_encl_find(encl_mm->mm, addr, &vma);
+			if (!ret && encl == vma->vm_private_data)
+				zap_vma_ptes(vma, addr, PAGE_SIZE);
+		}
 
 		up_read(&encl_mm->mm->mmap_sem);
 
@@ -211,55 +392,36 @@ static void sgx_reclaimer_block(struct sgx_epc_page *epc_page)
 	mutex_lock(&encl->lock);
 
 	if (!(encl->flags & SGX_ENCL_DEAD)) {
-		ret = __eblock(sgx_epc_addr(epc_page));
-		if (encls_failed(ret))
-			ENCLS_WARN(ret, "EBLOCK");
+		list_for_each_entry(epc_page, batch, list) {
+			ret = __eblock(sgx_epc_addr(epc_page));
+			if (encls_failed(ret))
+				ENCLS_WARN(ret, "EBLOCK");
+		}
 	}
 
 	mutex_unlock(&encl->lock);
 }
-
 static int __sgx_encl_ewb(struct sgx_encl *encl, struct sgx_epc_page *epc_page,
-			  struct sgx_va_page *va_page, unsigned int va_offset)
+			  struct sgx_va_page *va_page, unsigned int va_offset,
+			  struct sgx_backing *backing)
 {
+	u64 start = sgx_trace_start(sgx_encl_ewb);
+	unsigned long pcmd_offset = sgx_pcmd_offset(backing->page_index);
 	struct sgx_encl_page *encl_page = epc_page->owner;
-	pgoff_t page_index = sgx_encl_get_index(encl, encl_page);
-	pgoff_t pcmd_index = sgx_pcmd_index(encl, page_index);
-	unsigned long pcmd_offset = sgx_pcmd_offset(page_index);
 	struct sgx_pageinfo pginfo;
-	struct page *backing;
-	struct page *pcmd;
 	int ret;
 
-	backing = sgx_encl_get_backing_page(encl, page_index);
-	if (IS_ERR(backing)) {
-		ret = PTR_ERR(backing);
-		goto err_backing;
-	}
-
-	pcmd = sgx_encl_get_backing_page(encl, pcmd_index);
-	if (IS_ERR(pcmd)) {
-		ret = PTR_ERR(pcmd);
-		goto err_pcmd;
-	}
-
 	pginfo.addr = 0;
-	pginfo.contents = (unsigned long)kmap_atomic(backing);
-	pginfo.metadata = (unsigned long)kmap_atomic(pcmd) + pcmd_offset;
+	pginfo.contents = (unsigned long)kmap_atomic(backing->contents);
+	pginfo.metadata = (unsigned long)kmap_atomic(backing->pcmd) +
+			  pcmd_offset;
 	pginfo.secs = 0;
 	ret = __ewb(&pginfo, sgx_epc_addr(epc_page),
 		    sgx_epc_addr(va_page->epc_page) + va_offset);
 	kunmap_atomic((void *)(unsigned long)(pginfo.metadata - pcmd_offset));
 	kunmap_atomic((void *)(unsigned long)pginfo.contents);
 
-	set_page_dirty(pcmd);
-	put_page(pcmd);
-	set_page_dirty(backing);
-
-err_pcmd:
-	put_page(backing);
-
-err_backing:
+	trace_sgx_encl_ewb(encl, SGX_ENCL_PAGE_ADDR(encl_page), ret, start);
 	return ret;
 }
 
@@ -291,7 +453,54 @@ static const cpumask_t *sgx_encl_ewb_cpumask(struct sgx_encl *encl)
 	return cpumask;
 }
 
-static void sgx_encl_ewb(struct sgx_epc_page *epc_page, bool do_free)
+/*
+ * The tracking state of a batch of EWBs of one enclave.  A single ETRACK and
+ * at most one round of IPIs cover all of the pages blocked before them.
+ */
+struct sgx_ewb_state {
+	bool tracked;
+	bool kicked;
+};
+
+static void sgx_encl_kick(struct sgx_encl *encl)
+{
+	u64 start = sgx_trace_start(sgx_encl_ipi);
+	const cpumask_t *cpumask = sgx_encl_ewb_cpumask(encl);
+
+	on_each_cpu_mask(cpumask, sgx_ipi_cb, NULL, 1);
+
+	atomic_long_inc(&encl->stats.nr_ipis);
+	trace_sgx_encl_ipi(encl, cpumask_weight(cpumask), start);
+}
+
+static void sgx_encl_track(struct sgx_encl *encl)
+{
+	int ret;
+
+	ret = __etrack(sgx_epc_addr(encl->secs.epc_page));
+	trace_sgx_encl_etrack(encl, ret);
+	if (ret == SGX_PREV_TRK_INCMPL) {
+		atomic_long_inc(&encl->stats.nr_etrack_retries);
+		sgx_encl_kick(encl);
+		ret = __etrack(sgx_epc_addr(encl->secs.epc_page));
+		trace_sgx_encl_etrack(encl, ret);
+	}
+
+	if (ret) {
+		if (encls_failed(ret) || encls_returned_code(ret))
+			ENCLS_WARN(ret, "ETRACK");
+	}
+}
+
+/*
+ * Write back a blocked page of a live enclave with EWB, or remove the page of a
+ * dead one.  @backing is the pinned backing storage of the page, which is
+ * released, or NULL if it could not be pinned, in which case the contents of
+ * the page are lost.
+ */
+static void sgx_encl_ewb(struct sgx_epc_page *epc_page, bool do_free,
+			 struct sgx_ewb_state *state,
+			 struct sgx_backing *backing)
 {
 	struct sgx_encl_page *encl_page = epc_page->owner;
 	struct sgx_encl *encl = encl_page->encl;
@@ -308,35 +517,40 @@ static void sgx_encl_ewb(struct sgx_epc_page *epc_page, bool do_free)
 		if (sgx_va_page_full(va_page))
 			list_move_tail(&va_page->list, &encl->va_pages);
 
-		ret = __sgx_encl_ewb(encl, epc_page, va_page, va_offset);
-		if (ret == SGX_NOT_TRACKED) {
-			ret = __etrack(sgx_epc_addr(encl->secs.epc_page));
-			if (ret) {
-				if (encls_failed(ret) ||
-				    encls_returned_code(ret))
-					ENCLS_WARN(ret, "ETRACK");
-			}
+		ret = backing ? __sgx_encl_ewb(encl, epc_page, va_page,
+					       va_offset, backing) : -ENOMEM;
+		if (ret == SGX_NOT_TRACKED && !state->tracked) {
+			sgx_encl_track(encl);
+			state->tracked = true;
+			ret = __sgx_encl_ewb(encl, epc_page, va_page,
+					     va_offset, backing);
+		}
 
+		if (ret == SGX_NOT_TRACKED && !state->kicked) {
+			/*
+			 * Slow path, send IPIs to kick cpus out of the
+			 * enclave.  Note, it's imperative that the cpu
+			 * mask is generated *after* ETRACK, else we'll
+			 * miss cpus that entered the enclave between
+			 * generating the mask and incrementing epoch.
+			 * The IPIs are synchronous, hence one round
+			 * covers the rest of the batch.
+			 */
+			sgx_encl_kick(encl);
+			state->kicked = true;
 			ret = __sgx_encl_ewb(encl, epc_page, va_page,
-					     va_offset);
-			if (ret == SGX_NOT_TRACKED) {
-				/*
-				 * Slow path, send IPIs to kick cpus out of the
-				 * enclave.  Note, it's imperative that the cpu
-				 * mask is generated *after* ETRACK, else we'll
-				 * miss cpus that entered the enclave between
-				 * generating the mask and incrementing epoch.
-				 */
-				on_each_cpu_mask(sgx_encl_ewb_cpumask(encl),
-						 sgx_ipi_cb, NULL, 1);
-				ret = __sgx_encl_ewb(encl, epc_page, va_page,
-						     va_offset);
-			}
+					     va_offset, backing);
 		}
 
-		if (ret)
+		if (backing)
+			sgx_encl_put_backing(backing, true);
+
+		if (ret) {
 			if (encls_failed(ret) || encls_returned_code(ret))
 				ENCLS_WARN(ret, "EWB");
+		} else {
+			atomic_long_inc(&encl->stats.nr_evicted);
+		}
 
 		encl_page->desc |= va_offset;
 		encl_page->va_page = va_page;
@@ -349,105 +563,527 @@ static void sgx_encl_ewb(struct sgx_epc_page *epc_page, bool do_free)
 		sgx_free_page(epc_page);
 
 	encl_page->epc_page = NULL;
+	atomic_long_dec(&encl->stats.nr_resident);
 }
 
-static void sgx_reclaimer_write(struct sgx_epc_page *epc_page)
+static int sgx_backing_cmp(void *priv, struct list_head *a,
+			   struct list_head *b)
 {
-	struct sgx_encl_page *encl_page = epc_page->owner;
-	struct sgx_encl *encl = encl_page->encl;
+	struct sgx_encl *encl = priv;
+	pgoff_t index_a, index_b;
+
+	index_a = sgx_encl_get_index(encl, list_entry(a, struct sgx_epc_page,
+						      list)->owner);
+	index_b = sgx_encl_get_index(encl, list_entry(b, struct sgx_epc_page,
+						      list)->owner);
+
+	return index_a < index_b ? -1 : index_a > index_b;
+}
+
+/*
+ * Pin the backing storage of up to %SGX_BACKING_BATCH pages of @batch, from
+ * @epc_page on, at once.  If that fails, pin only the backing storage of
+ * @epc_page.  Return the number of pages pinned.
+ */
+static unsigned int sgx_reclaimer_get_backing(struct sgx_encl *encl,
+					      struct sgx_epc_page *epc_page,
+					      struct list_head *batch,
+					      struct sgx_backing *backing)
+{
+	unsigned int nr = 0;
+
+	list_for_each_entry_from(epc_page, batch, list) {
+		backing[nr].page_index = sgx_encl_get_index(encl,
+							    epc_page->owner);
+		if (++nr == SGX_BACKING_BATCH)
+			break;
+	}
+
+	if (!sgx_encl_get_backing_batch(encl, backing, nr))
+		return nr;
+
+	return sgx_encl_get_backing(encl, backing[0].page_index, backing) ?
+	       0 : 1;
+}
+
+/*
+ * Write back a batch of blocked pages, sorted by their index in the backing
+ * storage, so that the backing storage of consecutive pages is looked up at
+ * once, and the pages that share a PCMD page look it up only once.
+ */
+static void sgx_reclaimer_write(struct sgx_encl *encl, struct list_head *batch)
+{
+	struct sgx_backing backing[SGX_BACKING_BATCH];
+	struct sgx_ewb_state state = { };
+	struct sgx_backing *page_backing;
+	struct sgx_epc_page *epc_page;
+	unsigned int nr = 0;
+	unsigned int i = 0;
+
+	list_sort(encl, batch, sgx_backing_cmp);
 
 	mutex_lock(&encl->lock);
 
-	sgx_encl_ewb(epc_page, false);
-	encl->secs_child_cnt--;
+	/* All of the pages of the batch are blocked, track them at once. */
+	if (!(encl->flags & SGX_ENCL_DEAD)) {
+		sgx_encl_track(encl);
+		state.tracked = true;
+	}
+
+	list_for_each_entry(epc_page, batch, list) {
+		page_backing = NULL;
+
+		if (!(encl->flags & SGX_ENCL_DEAD)) {
+			if (i == nr) {
+				nr = sgx_reclaimer_get_backing(encl, epc_page,
+							       batch, backing);
+				i = 0;
+			}
+
+			if (nr)
+				page_backing = &backing[i++];
+		}
+
+		sgx_encl_ewb(epc_page, false, &state, page_backing);
+		encl->secs_child_cnt--;
+	}
+
 	if (!encl->secs_child_cnt &&
 	    (encl->flags & (SGX_ENCL_DEAD | SGX_ENCL_INITIALIZED))) {
-		sgx_encl_ewb(encl->secs.epc_page, true);
+		page_backing = NULL;
+
+		if (!(encl->flags & SGX_ENCL_DEAD) &&
+		    !sgx_encl_get_backing(encl,
+					  sgx_encl_get_index(encl, &encl->secs),
+					  backing))
+			page_backing = backing;
+
+		sgx_encl_ewb(encl->secs.epc_page, true, &state, page_backing);
 	}
 
 	mutex_unlock(&encl->lock);
 }
 
-/**
- * sgx_reclaim_pages() - Reclaim EPC pages from the consumers
- * Takes a fixed chunk of pages from the global list of consumed EPC pages and
- * tries to swap them. Only the pages that are either being freed by the
- * consumer or actively used are skipped.
+/*
+ * Move up to @nr_to_scan pages from the head of @list to @batch, only the
+ * pages of @nid unless it is NUMA_NO_NODE.  The pages of the other nodes are
+ * rotated to the tail, so that the next walk reaches the pages of @nid behind
+ * them.  At most @nr_walk pages are walked in order to bound the hold time of
+ * the lock.  Called with encl->active_lock held.
  */
-void sgx_reclaim_pages(void)
+static unsigned long sgx_encl_isolate_list(struct sgx_encl *encl,
+					   struct list_head *list, int nid,
+					   unsigned long nr_to_scan,
+					   unsigned long *nr_walk,
+					   struct list_head *batch)
 {
-	struct sgx_epc_page *chunk[SGX_NR_TO_SCAN + 1];
-	struct sgx_epc_page *epc_page;
-	struct sgx_epc_section *section;
-	int i, j;
+	struct sgx_epc_page *epc_page, *tmp;
+	unsigned long nr_isolated = 0;
 
-	spin_lock(&sgx_active_page_list_lock);
-	for (i = 0, j = 0; i < SGX_NR_TO_SCAN; i++) {
-		if (list_empty(&sgx_active_page_list))
+	list_for_each_entry_safe(epc_page, tmp, list, list) {
+		if (nr_isolated == nr_to_scan || !*nr_walk)
 			break;
 
-		epc_page = list_first_entry(&sgx_active_page_list,
-					    struct sgx_epc_page, list);
-		list_del_init(&epc_page->list);
+		(*nr_walk)--;
 
-		if (sgx_reclaimer_get(epc_page))
-			chunk[j++] = epc_page;
-		else
-			/* The owner is freeing the page. No need to add the
-			 * page back to the list of reclaimable pages.
-			 */
-			epc_page->desc &= ~SGX_EPC_PAGE_RECLAIMABLE;
+		if (nid != NUMA_NO_NODE &&
+		    sgx_epc_section(epc_page)->nid != nid) {
+			list_move_tail(&epc_page->list, list);
+			continue;
+		}
+
+		sgx_encl_lru_isolate(encl, epc_page, batch);
+		nr_isolated++;
 	}
-	spin_unlock(&sgx_active_page_list_lock);
 
-	for (i = 0; i < j; i++) {
-		epc_page = chunk[i];
-		if (sgx_reclaimer_evict(epc_page))
-			continue;
+	return nr_isolated;
+}
 
-		sgx_reclaimer_put(epc_page);
+/*
+ * Isolate up to @nr_to_scan pages of the enclave for reclaim, the least
+ * recently used inactive pages first, and the active pages only when there are
+ * not enough of them.
+ */
+static unsigned long sgx_encl_isolate_pages(struct sgx_encl *encl, int nid,
+					    unsigned long nr_to_scan,
+					    struct list_head *batch)
+{
+	unsigned long nr_walk = 4 * nr_to_scan;
+	unsigned long nr_isolated;
+
+	spin_lock(&encl->active_lock);
+
+	nr_isolated = sgx_encl_isolate_list(encl, &encl->inactive_page_list,
+					    nid, nr_to_scan, &nr_walk, batch);
+	nr_isolated += sgx_encl_isolate_list(encl, &encl->active_page_list,
+					     nid, nr_to_scan - nr_isolated,
+					     &nr_walk, batch);
+
+	spin_unlock(&encl->active_lock);
+
+	return nr_isolated;
+}
+
+/*
+ * Age, block, track and write back a batch of pages of one enclave.  The pages
+ * accessed since they were last sampled, or locked by a fault, are promoted to
+ * the active list instead.  The rest are locked until they have been written
+ * back.  Return the number of pages written back.
+ */
+static unsigned long sgx_reclaim_encl_pages(struct sgx_encl *encl,
+					    struct list_head *batch)
+{
+	struct sgx_epc_page *epc_page, *tmp;
+	unsigned long nr_written = 0;
+	LIST_HEAD(young);
+
+	list_for_each_entry_safe(epc_page, tmp, batch, list) {
+		if (!sgx_reclaimer_age(epc_page) ||
+		    !sgx_encl_page_trylock(epc_page->owner))
+			list_move_tail(&epc_page->list, &young);
+	}
 
-		spin_lock(&sgx_active_page_list_lock);
-		list_add_tail(&epc_page->list, &sgx_active_page_list);
-		spin_unlock(&sgx_active_page_list_lock);
+	/*
+	 * Write the pages of a destroyed enclave out with the rest.  A dead
+	 * enclave is no longer mapped, but a fault that raced with its
+	 * destruction can still hold the lock of a page for a moment.  Such a
+	 * page is put back and retried on the next pass, sgx_encl_release()
+	 * frees it if the enclave goes away first.
+	 */
+	if (!list_empty(&young) &&
+	    !sgx_encl_putback_pages(encl, &young, NULL)) {
+		list_for_each_entry_safe(epc_page, tmp, &young, list) {
+			if (sgx_encl_page_trylock(epc_page->owner))
+				list_move_tail(&epc_page->list, batch);
+		}
 
-		chunk[i] = NULL;
+		if (!list_empty(&young)) {
+			spin_lock(&encl->active_lock);
+			sgx_encl_lru_putback(encl, &young, true);
+			spin_unlock(&encl->active_lock);
+		}
 	}
 
-	for (i = 0; i < j; i++) {
-		epc_page = chunk[i];
-		if (epc_page)
-			sgx_reclaimer_block(epc_page);
+	if (list_empty(batch))
+		return 0;
+
+	mutex_lock(&encl->lock);
+	list_for_each_entry(epc_page, batch, list)
+		epc_page->owner->desc |= SGX_ENCL_PAGE_RECLAIMED;
+	mutex_unlock(&encl->lock);
+
+	sgx_reclaimer_block(encl, batch);
+	sgx_reclaimer_write(encl, batch);
+
+	list_for_each_entry_safe(epc_page, tmp, batch, list) {
+		list_del_init(&epc_page->list);
+		sgx_encl_page_unlock(epc_page->owner);
+		epc_page->desc &= ~(SGX_EPC_PAGE_RECLAIMABLE |
+				    SGX_EPC_PAGE_ISOLATED);
+		sgx_put_page(epc_page);
+		nr_written++;
 	}
 
-	for (i = 0; i < j; i++) {
-		epc_page = chunk[i];
-		if (epc_page) {
-			sgx_reclaimer_write(epc_page);
-			sgx_reclaimer_put(epc_page);
-			epc_page->desc &= ~SGX_EPC_PAGE_RECLAIMABLE;
+	return nr_written;
+}
+
+/*
+ * Visit the enclaves with reclaimable pages in round-robin order, and call @fn
+ * with a quota that is proportional to the share of the enclave of the
+ * reclaimable pages, until @fn has scanned @nr_to_scan pages in total.  With
+ * @epc_cg set, only the enclaves charged to @epc_cg or to its descendants are
+ * visited, and the share is taken of the usage of @epc_cg.
+ */
+static unsigned long sgx_walk_encls(unsigned long nr_to_scan,
+				    unsigned long (*fn)(struct sgx_encl *encl,
+							unsigned long quota,
+							int nid),
+				    int nid, struct sgx_epc_cgroup *epc_cg)
+{
+	unsigned long nr_scanned = 0;
+	unsigned long nr_total;
+	struct sgx_encl *encl;
+	unsigned int nr_encls;
+	unsigned long quota;
+	unsigned int i;
+
+	spin_lock(&sgx_active_encl_list_lock);
+	nr_encls = sgx_nr_active_encls;
+	spin_unlock(&sgx_active_encl_list_lock);
+
+	for (i = 0; i < nr_encls && nr_scanned < nr_to_scan; i++) {
+		spin_lock(&sgx_active_encl_list_lock);
+
+		if (list_empty(&sgx_active_encl_list)) {
+			spin_unlock(&sgx_active_encl_list_lock);
+			break;
+		}
 
-			section = sgx_epc_section(epc_page);
+		encl = list_first_entry(&sgx_active_encl_list, struct sgx_encl,
+					active_link);
+		list_move_tail(&encl->active_link, &sgx_active_encl_list);
 
-			spin_lock(&section->lock);
-			list_add_tail(&epc_page->list,
-				      &section->page_list);
-			section->free_cnt++;
-			spin_unlock(&section->lock);
+		if (epc_cg) {
+			if (!sgx_epc_cgroup_is_descendant(encl->epc_cg,
+							  epc_cg)) {
+				spin_unlock(&sgx_active_encl_list_lock);
+				continue;
+			}
+			nr_total = sgx_epc_cgroup_usage(epc_cg);
+		} else {
+			nr_total = atomic_long_read(&sgx_nr_active_pages);
 		}
+
+		nr_total = max_t(long, nr_total, 1);
+		quota = DIV_ROUND_UP(nr_to_scan * sgx_encl_nr_lru_pages(encl),
+				     nr_total);
+		quota = min(quota, nr_to_scan - nr_scanned);
+
+		/* The enclave is being released, its pages will be freed. */
+		if (!kref_get_unless_zero(&encl->refcount))
+			encl = NULL;
+
+		spin_unlock(&sgx_active_encl_list_lock);
+
+		if (!encl)
+			continue;
+
+		nr_scanned += fn(encl, quota, nid);
+
+		kref_put(&encl->refcount, sgx_encl_release);
 	}
+
+	return nr_scanned;
+}
+
+/*
+ * Scan SGX_NR_TO_SCAN pages of the node at its high watermark, and more the
+ * further the free page count of the node drops below it, up to
+ * SGX_NR_TO_SCAN_MAX.
+ */
+static unsigned long sgx_nr_to_scan(int nid)
+{
+	unsigned long high = READ_ONCE(sgx_numa_nodes[nid].high_pages);
+	unsigned long free_cnt = sgx_node_calc_free_cnt(nid);
+
+	if (free_cnt >= high)
+		return SGX_NR_TO_SCAN;
+
+	return SGX_NR_TO_SCAN + (SGX_NR_TO_SCAN_MAX - SGX_NR_TO_SCAN) *
+	       (high - free_cnt) / high;
+}
+
+static unsigned long sgx_reclaim_encl(struct sgx_encl *encl,
+				      unsigned long nr_to_scan, int nid)
+{
+	u64 start = sgx_trace_start(sgx_reclaim_batch_end);
+	unsigned long nr_scanned, nr_written;
+	LIST_HEAD(batch);
+
+	trace_sgx_reclaim_batch_begin(encl, nid, nr_to_scan);
+
+	nr_scanned = sgx_encl_isolate_pages(encl, nid, nr_to_scan, &batch);
+	nr_written = sgx_reclaim_encl_pages(encl, &batch);
+
+	trace_sgx_reclaim_batch_end(encl, nr_scanned, nr_written, start);
+
+	return nr_scanned;
+}
+
+/**
+ * sgx_reclaim_pages() - Reclaim EPC pages from the consumers
+ * @nid:	the node to reclaim the pages of, NUMA_NO_NODE for any node
+ * @nr_to_scan:	the number of pages to scan
+ *
+ * Visit the enclaves with reclaimable pages in round-robin order, and take
+ * from each a batch that is proportional to its share of the reclaimable
+ * pages, until @nr_to_scan pages have been scanned.  The inactive pages are
+ * taken before the active ones.  Every batch is written back with a single
+ * ETRACK.  Only the pages that are either being freed by the consumer or
+ * actively used are skipped.
+ *
+ * The reclaimers of the different nodes can run concurrently, the pages of a
+ * batch are isolated from the page lists of the enclave.
+ *
+ * Return: the number of pages scanned
+ */
+unsigned long sgx_reclaim_pages(int nid, unsigned long nr_to_scan)
+{
+	return sgx_walk_encls(nr_to_scan, sgx_reclaim_encl, nid, NULL);
+}
+
+/**
+ * sgx_reclaim_epc_cgroup() - Reclaim EPC pages charged to a cgroup
+ * @epc_cg:	the EPC cgroup
+ * @nr_to_scan:	the number of pages to scan
+ *
+ * Reclaim pages of the enclaves charged to @epc_cg or to its descendants from
+ * all nodes, in the same way as sgx_reclaim_pages().
+ *
+ * Return: the number of pages scanned
+ */
+unsigned long sgx_reclaim_epc_cgroup(struct sgx_epc_cgroup *epc_cg,
+				     unsigned long nr_to_scan)
+{
+	return sgx_walk_encls(nr_to_scan, sgx_reclaim_encl, NUMA_NO_NODE,
+			      epc_cg);
 }
 
-unsigned long sgx_calc_free_cnt(void)
+/*
+ * The aging sweeps the page lists of an enclave like the hand of a clock.  The
+ * pages found accessed during the last complete sweep are the working set of
+ * the enclave.  Only the aging work updates the counters of a sweep.
+ */
+static void sgx_encl_update_wss(struct sgx_encl *encl,
+				unsigned long nr_scanned, unsigned long nr_young)
 {
-	struct sgx_epc_section *section;
-	unsigned long free_cnt = 0;
+	encl->age_nr_scanned += nr_scanned;
+	encl->age_nr_young += nr_young;
+
+	if (encl->age_nr_scanned < sgx_encl_nr_lru_pages(encl))
+		return;
+
+	WRITE_ONCE(encl->wss_pages, encl->age_nr_young);
+	encl->age_nr_scanned = 0;
+	encl->age_nr_young = 0;
+}
+
+/*
+ * Sample the accessed bits of up to @nr_to_scan pages of the enclave, taken
+ * from the heads of the active and the inactive list in proportion to their
+ * length.  The accessed pages are moved to the tail of the active list, which
+ * promotes the inactive ones, and the rest to the tail of the inactive list,
+ * which demotes the active ones.
+ */
+static unsigned long sgx_encl_age(struct sgx_encl *encl,
+				  unsigned long nr_to_scan, int nid)
+{
+	struct sgx_epc_page *epc_page, *tmp;
+	unsigned long nr_young = 0;
+	unsigned long nr_inactive;
+	unsigned long nr_scanned;
+	unsigned long nr_walk;
+	LIST_HEAD(batch);
+	LIST_HEAD(young);
+	LIST_HEAD(old);
+
+	spin_lock(&encl->active_lock);
+
+	nr_walk = nr_to_scan;
+	nr_inactive = DIV_ROUND_UP(nr_to_scan * encl->nr_inactive_pages,
+				   max(sgx_encl_nr_lru_pages(encl), 1UL));
+	nr_scanned = sgx_encl_isolate_list(encl, &encl->inactive_page_list,
+					   NUMA_NO_NODE, nr_inactive, &nr_walk,
+					   &batch);
+	nr_scanned += sgx_encl_isolate_list(encl, &encl->active_page_list,
+					    NUMA_NO_NODE,
+					    nr_to_scan - nr_scanned, &nr_walk,
+					    &batch);
+
+	spin_unlock(&encl->active_lock);
+
+	list_for_each_entry_safe(epc_page, tmp, &batch, list) {
+		if (sgx_reclaimer_age(epc_page)) {
+			list_move_tail(&epc_page->list, &old);
+		} else {
+			list_move_tail(&epc_page->list, &young);
+			nr_young++;
+		}
+
+		cond_resched();
+	}
+
+	if (!sgx_encl_putback_pages(encl, &young, &old)) {
+		list_splice_tail(&young, &old);
+		sgx_reclaim_encl_pages(encl, &old);
+		return nr_scanned;
+	}
+
+	sgx_encl_update_wss(encl, nr_scanned, nr_young);
+
+	return nr_scanned;
+}
+
+/*
+ * Age %SGX_NR_TO_AGE pages every %SGX_AGE_INTERVAL, independently of the EPC
+ * pressure, so that the working set estimates stay current.
+ */
+static void sgx_age_pages(struct work_struct *work)
+{
+	sgx_walk_encls(SGX_NR_TO_AGE, sgx_encl_age, NUMA_NO_NODE, NULL);
+
+	queue_delayed_work(system_freezable_wq, &sgx_age_work,
+			   SGX_AGE_INTERVAL);
+}
+
+/*
+ * Return the node to reclaim from when @nid has no reclaimable pages: any node
+ * for an unbound allocation, otherwise the nearest node of @allowed that has
+ * reclaimable pages.
+ */
+static int sgx_direct_reclaim_node(int nid, const nodemask_t *allowed)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	int fallback;
 	int i;
 
-	for (i = 0; i < sgx_nr_epc_sections; i++) {
-		section = &sgx_epc_sections[i];
-		free_cnt += section->free_cnt;
+	if (!allowed)
+		return NUMA_NO_NODE;
+
+	for (i = 0; i < node->nr_fallback; i++) {
+		fallback = node->fallback[i];
+		if (node_isset(fallback, *allowed) &&
+		    atomic_long_read(&sgx_numa_nodes[fallback].nr_active_pages))
+			return fallback;
 	}
 
-	return free_cnt;
+	return nid;
+}
+
+/**
+ * sgx_direct_reclaim() - Reclaim EPC pages in the context of an allocation
+ * @nid:	the node the allocation prefers
+ * @allowed:	the nodes the allocation is bound to, NULL for any node
+ *
+ * Reclaim a batch of the pages of @nid, or of another node allowed for the
+ * allocation if @nid has no reclaimable pages, so that an allocation bound to
+ * some nodes never evicts the pages of the others.
+ * At most %SGX_NR_DIRECT_RECLAIMERS tasks reclaim the pages of a node at a
+ * time, the rest kick ksgxswapd and sleep until it or a direct reclaimer has
+ * completed a reclaim pass over the node, or for at most
+ * %SGX_DIRECT_RECLAIM_WAIT.
+ * This bounds the contention on the enclaves and the latency of a fault, and
+ * the waiters are woken up all at once so that none of them is starved.
+ */
+void sgx_direct_reclaim(int nid, const nodemask_t *allowed)
+{
+	struct sgx_numa_node *node = &sgx_numa_nodes[nid];
+	int reclaim_nid = nid;
+	int seq;
+
+	if (atomic_inc_return(&node->nr_direct_reclaimers) <=
+	    SGX_NR_DIRECT_RECLAIMERS) {
+		if (!atomic_long_read(&node->nr_active_pages))
+			reclaim_nid = sgx_direct_reclaim_node(nid, allowed);
+
+		sgx_reclaim_pages(reclaim_nid, SGX_NR_TO_SCAN);
+		atomic_dec(&node->nr_direct_reclaimers);
+		sgx_reclaim_done(node);
+
+		cond_resched();
+		return;
+	}
+
+	atomic_dec(&node->nr_direct_reclaimers);
+
+	/*
+	 * The free page count includes the pages in the magazines of the other
+	 * CPUs and the pages yet to be sanitized, which the caller could not
+	 * get.  Wait for a reclaim pass to complete instead.
+	 */
+	seq = atomic_read(&node->reclaim_seq);
+	wake_up(&node->ksgxswapd_waitq);
+	wait_event_interruptible_timeout(node->reclaim_waitq,
+					 atomic_read(&node->reclaim_seq) != seq,
+					 SGX_DIRECT_RECLAIM_WAIT);
 }
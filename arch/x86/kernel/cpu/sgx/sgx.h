@@ -2,18 +2,27 @@
 #ifndef _X86_SGX_H
 #define _X86_SGX_H
 
+#include <linux/atomic.h>
 #include <linux/bitops.h>
 #include <linux/err.h>
 #include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/nodemask.h>
+#include <linux/percpu_counter.h>
 #include <linux/rwsem.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 #include <asm/asm.h>
+#include <uapi/asm/sgx.h>
 #include <uapi/asm/sgx_errno.h>
 
+struct sgx_epc_cgroup;
+
 struct sgx_epc_page {
 	unsigned long desc;
 	struct sgx_encl_page *owner;
 	struct list_head list;
+	struct sgx_epc_cgroup *epc_cg;
 };
 
 /**
@@ -23,18 +32,43 @@ struct sgx_epc_page {
  * physical memory e.g. for memory areas of the each node. This structure is
  * used to store EPC pages for one EPC section and virtual memory area where
  * the pages have been mapped.
+ *
+ * The pages may hold enclaves left over from before a kexec, and start on
+ * @unsanitized_page_list until they have been EREMOVE'd.  The SECS pages,
+ * which cannot be removed before their child pages, wait on
+ * @unsanitized_secs_list for the rest of the EPC to be sanitized.
  */
 struct sgx_epc_section {
 	unsigned long pa;
 	void *va;
 	struct list_head page_list;
 	struct list_head unsanitized_page_list;
+	struct list_head unsanitized_secs_list;
 	unsigned long free_cnt;
+	unsigned long nr_pages;
+	int nid;
 	spinlock_t lock;
 };
 
 #define SGX_MAX_EPC_SECTIONS	8
 
+/**
+ * struct sgx_mempolicy - NUMA placement policy for EPC allocations
+ * @mode:	%SGX_MPOL_DEFAULT, %SGX_MPOL_PREFERRED, %SGX_MPOL_BIND or
+ *		%SGX_MPOL_INTERLEAVE
+ * @nodes:	the nodes of the policy, empty for %SGX_MPOL_DEFAULT
+ * @il_next:	the rotor of %SGX_MPOL_INTERLEAVE
+ *
+ * The default policy allocates from the nearest node with EPC and falls back
+ * to the other nodes in the order of distance. A zeroed structure is a valid
+ * default policy.
+ */
+struct sgx_mempolicy {
+	unsigned int mode;
+	nodemask_t nodes;
+	atomic_t il_next;
+};
+
 extern struct sgx_epc_section sgx_epc_sections[SGX_MAX_EPC_SECTIONS];
 
 /**
@@ -47,10 +81,16 @@ extern struct sgx_epc_section sgx_epc_sections[SGX_MAX_EPC_SECTIONS];
  *				Pages need to be colored this way because a page
  *				can be out of the active page list in the
  *				process of being swapped out.
+ * %SGX_EPC_PAGE_ACTIVE:	The page is on the active list of its enclave,
+ *				otherwise on the inactive list.
+ * %SGX_EPC_PAGE_ISOLATED:	The page has been taken off the page lists by
+ *				the reclaimer or the aging, and cannot be freed.
  */
 enum sgx_epc_page_desc {
 	SGX_EPC_SECTION_MASK			= GENMASK_ULL(3, 0),
 	SGX_EPC_PAGE_RECLAIMABLE		= BIT(4),
+	SGX_EPC_PAGE_ACTIVE			= BIT(5),
+	SGX_EPC_PAGE_ISOLATED			= BIT(6),
 	/* bits 12-63 are reserved for the physical page address of the page */
 };
 
@@ -66,25 +106,101 @@ static inline void *sgx_epc_addr(struct sgx_epc_page *page)
 	return section->va + (page->desc & PAGE_MASK) - section->pa;
 }
 
+/*
+ * The start time of an operation traced by @event, which is measured only
+ * while the tracepoint is enabled, and the time elapsed since.
+ */
+#define sgx_trace_start(event) \
+	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+static inline u64 sgx_trace_elapsed(u64 start)
+{
+	return start ? ktime_get_ns() - start : 0;
+}
+
 #define SGX_NR_TO_SCAN		16
+#define SGX_NR_TO_SCAN_MAX	256
 #define SGX_NR_LOW_PAGES	32
 #define SGX_NR_HIGH_PAGES	64
+#define SGX_NR_DIRECT_RECLAIMERS	2
+#define SGX_DIRECT_RECLAIM_WAIT		(HZ / 50)
+#define SGX_RECLAIM_RETRY_WAIT		(HZ / 10)
+#define SGX_NR_TO_AGE			512
+#define SGX_AGE_INTERVAL		HZ
+
+/**
+ * struct sgx_numa_node - EPC of a NUMA node
+ * @section_mask:	the EPC sections located in the node
+ * @fallback:		the nodes with EPC in the order of distance from the node
+ * @nr_fallback:	the number of entries in @fallback
+ * @nr_free_pages:	free pages in the sections and magazines of the node
+ * @nr_active_pages:	pages of the node on the page lists of the enclaves
+ * @nr_unsanitized_pages: pages of the node not yet sanitized since the boot
+ * @low_pages:		ksgxswapd is woken up below this many free pages
+ * @high_pages:		ksgxswapd reclaims until this many pages are free
+ * @ksgxswapd:		the reclaimer thread of the node
+ * @ksgxswapd_waitq:	ksgxswapd waits here for the free pages to drop
+ * @reclaim_waitq:	throttled direct reclaimers wait here for free pages
+ * @nr_direct_reclaimers: the tasks reclaiming pages of the node themselves
+ * @reclaim_seq:	bumped whenever a reclaim pass over the node completes
+ * @kobj:		/sys/kernel/mm/sgx/node<nid>, for the nodes with EPC
+ *
+ * An entry exists for every possible node, so that the CPUs of the nodes
+ * without EPC can look up their nearest EPC in @fallback[0], their home node.
+ * The magazine of a CPU caches only pages of its home node.  The rest of the
+ * fields are used only for the nodes with EPC.
+ */
+struct sgx_numa_node {
+	unsigned long section_mask;
+	int fallback[SGX_MAX_EPC_SECTIONS];
+	int nr_fallback;
+	struct percpu_counter nr_free_pages;
+	atomic_long_t nr_active_pages;
+	atomic_long_t nr_unsanitized_pages;
+	unsigned long low_pages;
+	unsigned long high_pages;
+	struct task_struct *ksgxswapd;
+	wait_queue_head_t ksgxswapd_waitq;
+	wait_queue_head_t reclaim_waitq;
+	atomic_t nr_direct_reclaimers;
+	atomic_t reclaim_seq;
+	struct kobject *kobj;
+};
 
 extern int sgx_nr_epc_sections;
-extern struct task_struct *ksgxswapd_tsk;
-extern struct wait_queue_head(ksgxswapd_waitq);
-extern struct list_head sgx_active_page_list;
-extern spinlock_t sgx_active_page_list_lock;
+extern struct sgx_numa_node *sgx_numa_nodes;
+extern nodemask_t sgx_epc_nodes;
+extern atomic_long_t sgx_nr_active_pages;
+extern bool sgx_lock_backing;
 
 int sgx_page_reclaimer_init(void);
+void sgx_page_reclaimer_exit(void);
 void sgx_mark_page_reclaimable(struct sgx_epc_page *page);
+int sgx_unmark_page_reclaimable(struct sgx_epc_page *page);
 unsigned long sgx_calc_free_cnt(void);
-void sgx_reclaim_pages(void);
+unsigned long sgx_node_calc_free_cnt(int nid);
+unsigned long sgx_reclaim_pages(int nid, unsigned long nr_to_scan);
+unsigned long sgx_reclaim_epc_cgroup(struct sgx_epc_cgroup *epc_cg,
+				     unsigned long nr_to_scan);
+void sgx_direct_reclaim(int nid, const nodemask_t *allowed);
 
-struct sgx_epc_page *sgx_alloc_page(void *owner, bool reclaim);
+int sgx_mempolicy_init(struct sgx_mempolicy *pol, unsigned int mode,
+		       const nodemask_t *nodes);
+struct sgx_epc_page *sgx_alloc_page(void *owner, struct sgx_mempolicy *pol,
+				    struct sgx_epc_cgroup *epc_cg, bool reclaim);
+void sgx_put_page(struct sgx_epc_page *page);
 int __sgx_free_page(struct sgx_epc_page *page);
 void sgx_free_page(struct sgx_epc_page *page);
 int sgx_einit(struct sgx_sigstruct *sigstruct, struct sgx_einittoken *token,
 	      struct sgx_epc_page *secs, u64 *lepubkeyhash);
 
+#ifdef CONFIG_KVM_INTEL_SGX
+int sgx_virt_epc_init(void);
+#else
+static inline int sgx_virt_epc_init(void)
+{
+	return -ENODEV;
+}
+#endif
+
 #endif /* _X86_SGX_H */
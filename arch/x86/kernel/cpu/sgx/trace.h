@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/**
+ * Copyright(c) 2016-19 Intel Corporation.
+ *
+ * The tracepoints of the enclave page faults and of the paging of the EPC.
+ * The latencies are measured only while the tracepoints are enabled: the
+ * callers pass the start time from sgx_trace_start(), which is zero when the
+ * tracepoint is disabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sgx
+
+#if !defined(_TRACE_SGX_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SGX_H
+
+#include <linux/tracepoint.h>
+#include "encl.h"
+
+DECLARE_EVENT_CLASS(sgx_encl_page_op,
+	TP_PROTO(struct sgx_encl *encl, unsigned long addr, int ret,
+		 u64 start),
+	TP_ARGS(encl, addr, ret, start),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	base		)
+		__field(	unsigned long,	addr		)
+		__field(	int,		ret		)
+		__field(	u64,		ns		)
+	),
+
+	TP_fast_assign(
+		__entry->base	= encl->base;
+		__entry->addr	= addr;
+		__entry->ret	= ret;
+		__entry->ns	= sgx_trace_elapsed(start);
+	),
+
+	TP_printk("encl 0x%lx addr 0x%lx ret %d ns %llu",
+		  __entry->base, __entry->addr, __entry->ret, __entry->ns)
+);
+
+/* A fault on an enclave page, @ret is the vm_fault_t. */
+DEFINE_EVENT(sgx_encl_page_op, sgx_vma_fault,
+	TP_PROTO(struct sgx_encl *encl, unsigned long addr, int ret,
+		 u64 start),
+	TP_ARGS(encl, addr, ret, start)
+);
+
+/* A reload of an enclave page, including the allocation of the EPC page. */
+DEFINE_EVENT(sgx_encl_page_op, sgx_encl_eldu,
+	TP_PROTO(struct sgx_encl *encl, unsigned long addr, int ret,
+		 u64 start),
+	TP_ARGS(encl, addr, ret, start)
+);
+
+/* An EWB attempt, %SGX_NOT_TRACKED in @ret is retried after ETRACK or IPIs. */
+DEFINE_EVENT(sgx_encl_page_op, sgx_encl_ewb,
+	TP_PROTO(struct sgx_encl *encl, unsigned long addr, int ret,
+		 u64 start),
+	TP_ARGS(encl, addr, ret, start)
+);
+
+TRACE_EVENT(sgx_encl_etrack,
+	TP_PROTO(struct sgx_encl *encl, int ret),
+	TP_ARGS(encl, ret),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	base		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->base	= encl->base;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("encl 0x%lx ret %d", __entry->base, __entry->ret)
+);
+
+/* The IPIs that kick the CPUs out of the enclave. */
+TRACE_EVENT(sgx_encl_ipi,
+	TP_PROTO(struct sgx_encl *encl, unsigned int nr_cpus, u64 start),
+	TP_ARGS(encl, nr_cpus, start),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	base		)
+		__field(	unsigned int,	nr_cpus		)
+		__field(	u64,		ns		)
+	),
+
+	TP_fast_assign(
+		__entry->base		= encl->base;
+		__entry->nr_cpus	= nr_cpus;
+		__entry->ns		= sgx_trace_elapsed(start);
+	),
+
+	TP_printk("encl 0x%lx nr_cpus %u ns %llu",
+		  __entry->base, __entry->nr_cpus, __entry->ns)
+);
+
+TRACE_EVENT(sgx_reclaim_batch_begin,
+	TP_PROTO(struct sgx_encl *encl, int nid, unsigned long nr_to_scan),
+	TP_ARGS(encl, nid, nr_to_scan),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	base		)
+		__field(	int,		nid		)
+		__field(	unsigned long,	nr_to_scan	)
+	),
+
+	TP_fast_assign(
+		__entry->base		= encl->base;
+		__entry->nid		= nid;
+		__entry->nr_to_scan	= nr_to_scan;
+	),
+
+	TP_printk("encl 0x%lx nid %d nr_to_scan %lu",
+		  __entry->base, __entry->nid, __entry->nr_to_scan)
+);
+
+TRACE_EVENT(sgx_reclaim_batch_end,
+	TP_PROTO(struct sgx_encl *encl, unsigned long nr_scanned,
+		 unsigned long nr_written, u64 start),
+	TP_ARGS(encl, nr_scanned, nr_written, start),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	base		)
+		__field(	unsigned long,	nr_scanned	)
+		__field(	unsigned long,	nr_written	)
+		__field(	u64,		ns		)
+	),
+
+	TP_fast_assign(
+		__entry->base		= encl->base;
+		__entry->nr_scanned	= nr_scanned;
+		__entry->nr_written	= nr_written;
+		__entry->ns		= sgx_trace_elapsed(start);
+	),
+
+	TP_printk("encl 0x%lx nr_scanned %lu nr_written %lu ns %llu",
+		  __entry->base, __entry->nr_scanned, __entry->nr_written,
+		  __entry->ns)
+);
+
+#endif /* _TRACE_SGX_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../arch/x86/kernel/cpu/sgx
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
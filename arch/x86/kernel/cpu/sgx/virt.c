@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+// Copyright(c) 2016-19 Intel Corporation.
+/*
+ * The virtual EPC, i.e. EPC exposed to KVM guests.
+ *
+ * A VMM maps /dev/sgx/virt_epc into its address space and hands the mapping
+ * to the guest as a memory slot.  The EPC pages are allocated on the first
+ * fault and are owned by the guest until the file is released: the host does
+ * not know what the guest uses them for, hence they are neither reclaimed nor
+ * EREMOVE'd before the release.  The pages are charged to the EPC cgroup of
+ * the task that opened the file, like the pages of the host enclaves.
+ *
+ * KVM traps ECREATE and EINIT of the guests to check them against the CPUID
+ * of the guest and to use the launch control MSRs of the guest, and runs them
+ * on the guest's behalf with sgx_virt_ecreate() and sgx_virt_einit().
+ */
+
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include <asm/sgx.h>
+#include <asm/traps.h>
+#include "encls.h"
+#include "epc_cgroup.h"
+#include "sgx.h"
+
+struct sgx_virt_epc {
+	struct xarray page_array;
+	struct mutex lock;
+	struct sgx_epc_cgroup *epc_cg;
+};
+
+/*
+ * SECS pages that could not be EREMOVE'd on the release of their virtual EPC,
+ * because their child pages live in another virtual EPC of the same guest.
+ * They are retried whenever a virtual EPC is released.
+ */
+static LIST_HEAD(sgx_virt_epc_zombie_pages);
+static DEFINE_MUTEX(sgx_virt_epc_zombie_lock);
+
+static const struct vm_operations_struct sgx_virt_epc_vm_ops;
+
+/* Get the page at @index, allocating it on the first access. */
+static struct sgx_epc_page *sgx_virt_epc_get_page(struct sgx_virt_epc *vepc,
+						  unsigned long index)
+{
+	struct sgx_epc_page *epc_page;
+	int ret;
+
+	lockdep_assert_held(&vepc->lock);
+
+	epc_page = xa_load(&vepc->page_array, index);
+	if (epc_page)
+		return epc_page;
+
+	epc_page = sgx_alloc_page(NULL, NULL, vepc->epc_cg, false);
+	if (IS_ERR(epc_page))
+		return epc_page;
+
+	ret = xa_err(xa_store(&vepc->page_array, index, epc_page, GFP_KERNEL));
+	if (ret) {
+		sgx_put_page(epc_page);
+		return ERR_PTR(ret);
+	}
+
+	return epc_page;
+}
+
+static vm_fault_t sgx_virt_epc_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct sgx_virt_epc *vepc = vma->vm_private_data;
+	struct sgx_epc_page *epc_page;
+	unsigned long index;
+	vm_fault_t ret;
+
+	index = vma->vm_pgoff + PFN_DOWN(vmf->address - vma->vm_start);
+
+	mutex_lock(&vepc->lock);
+
+	epc_page = sgx_virt_epc_get_page(vepc, index);
+	if (IS_ERR(epc_page)) {
+		/* The allocation has kicked the reclaimer, retry. */
+		if (PTR_ERR(epc_page) == -EBUSY)
+			ret = VM_FAULT_NOPAGE;
+		else
+			ret = VM_FAULT_SIGBUS;
+	} else {
+		ret = vmf_insert_pfn(vma, vmf->address,
+				     PFN_DOWN(epc_page->desc));
+	}
+
+	mutex_unlock(&vepc->lock);
+
+	return ret;
+}
+
+static const struct vm_operations_struct sgx_virt_epc_vm_ops = {
+	.fault = sgx_virt_epc_fault,
+};
+
+static int sgx_virt_epc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct sgx_virt_epc *vepc = file->private_data;
+
+	/* A private mapping would need copy-on-write of the EPC. */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vma->vm_ops = &sgx_virt_epc_vm_ops;
+	vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTDUMP | VM_DONTEXPAND |
+			 VM_DONTCOPY;
+	vma->vm_private_data = vepc;
+
+	return 0;
+}
+
+static int sgx_virt_epc_free_page(struct sgx_epc_page *epc_page)
+{
+	int ret;
+
+	ret = __eremove(sgx_epc_addr(epc_page));
+	if (ret)
+		return ret;
+
+	sgx_put_page(epc_page);
+	return 0;
+}
+
+static int sgx_virt_epc_release(struct inode *inode, struct file *file)
+{
+	struct sgx_virt_epc *vepc = file->private_data;
+	struct sgx_epc_page *epc_page, *tmp;
+	unsigned long index;
+	LIST_HEAD(secs_pages);
+	int ret;
+
+	/*
+	 * EREMOVE fails with SGX_CHILD_PRESENT for the SECS pages that still
+	 * have child pages, which are retried after the rest of the pages have
+	 * been removed.
+	 */
+	xa_for_each(&vepc->page_array, index, epc_page) {
+		if (sgx_virt_epc_free_page(epc_page))
+			continue;
+
+		xa_erase(&vepc->page_array, index);
+	}
+
+	xa_for_each(&vepc->page_array, index, epc_page) {
+		xa_erase(&vepc->page_array, index);
+
+		ret = sgx_virt_epc_free_page(epc_page);
+		if (!ret)
+			continue;
+
+		WARN_ONCE(ret != SGX_CHILD_PRESENT,
+			  "sgx: EREMOVE returned %d (0x%x)", ret, ret);
+		list_add_tail(&epc_page->list, &secs_pages);
+	}
+
+	mutex_lock(&sgx_virt_epc_zombie_lock);
+
+	list_for_each_entry_safe(epc_page, tmp, &sgx_virt_epc_zombie_pages,
+				 list) {
+		if (__eremove(sgx_epc_addr(epc_page)))
+			continue;
+
+		list_del(&epc_page->list);
+		sgx_put_page(epc_page);
+	}
+
+	list_splice_tail(&secs_pages, &sgx_virt_epc_zombie_pages);
+
+	mutex_unlock(&sgx_virt_epc_zombie_lock);
+
+	xa_destroy(&vepc->page_array);
+	sgx_epc_cgroup_put(vepc->epc_cg);
+	kfree(vepc);
+
+	return 0;
+}
+
+static int sgx_virt_epc_open(struct inode *inode, struct file *file)
+{
+	struct sgx_virt_epc *vepc;
+
+	vepc = kzalloc(sizeof(*vepc), GFP_KERNEL);
+	if (!vepc)
+		return -ENOMEM;
+
+	xa_init(&vepc->page_array);
+	mutex_init(&vepc->lock);
+	vepc->epc_cg = sgx_epc_cgroup_get_current();
+
+	file->private_data = vepc;
+
+	return 0;
+}
+
+static const struct file_operations sgx_virt_epc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= sgx_virt_epc_open,
+	.release	= sgx_virt_epc_release,
+	.mmap		= sgx_virt_epc_mmap,
+};
+
+static struct miscdevice sgx_virt_epc_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "sgx_virt_epc",
+	.nodename	= "sgx/virt_epc",
+	.fops		= &sgx_virt_epc_fops,
+};
+
+/*
+ * Look up the EPC page mapped at a user address of the current process, which
+ * must be in a virtual EPC mapping.  Called with mmap_sem held, which keeps
+ * the page from being freed.
+ */
+static struct sgx_epc_page *sgx_virt_epc_lookup(unsigned long addr,
+						int *trapnr)
+{
+	struct sgx_epc_page *epc_page;
+	struct vm_area_struct *vma;
+	struct sgx_virt_epc *vepc;
+	unsigned long index;
+
+	vma = find_vma(current->mm, addr);
+	if (!vma || vma->vm_start > addr ||
+	    vma->vm_ops != &sgx_virt_epc_vm_ops) {
+		/* Like ENCLS with a non-EPC operand. */
+		*trapnr = X86_TRAP_GP;
+		return ERR_PTR(-EFAULT);
+	}
+
+	vepc = vma->vm_private_data;
+	index = vma->vm_pgoff + PFN_DOWN(addr - vma->vm_start);
+
+	mutex_lock(&vepc->lock);
+	epc_page = sgx_virt_epc_get_page(vepc, index);
+	mutex_unlock(&vepc->lock);
+
+	if (epc_page == ERR_PTR(-EBUSY))
+		return ERR_PTR(-EAGAIN);
+
+	return epc_page;
+}
+
+/**
+ * sgx_virt_ecreate() - Run ECREATE on behalf of a guest
+ * @pageinfo:	a PAGEINFO, with the contents and the SECINFO in kernel memory
+ * @secs:	the user address of the SECS page in a virtual EPC mapping
+ * @trapnr:	the trap number, when ECREATE faults
+ *
+ * Return:
+ *   0 on success,
+ *   -EAGAIN if the EPC page of @secs is not available yet,
+ *   -EFAULT if ECREATE faulted,
+ *   -errno on other errors
+ */
+int sgx_virt_ecreate(struct sgx_pageinfo *pageinfo, void __user *secs,
+		     int *trapnr)
+{
+	struct sgx_epc_page *epc_page;
+	int ret;
+
+	down_read(&current->mm->mmap_sem);
+
+	epc_page = sgx_virt_epc_lookup((unsigned long)secs, trapnr);
+	if (IS_ERR(epc_page)) {
+		up_read(&current->mm->mmap_sem);
+		return PTR_ERR(epc_page);
+	}
+
+	ret = __ecreate(pageinfo, sgx_epc_addr(epc_page));
+
+	up_read(&current->mm->mmap_sem);
+
+	if (encls_faulted(ret)) {
+		*trapnr = ENCLS_TRAPNR(ret);
+		return -EFAULT;
+	}
+
+	/* ECREATE does not return an error code, it succeeds or faults. */
+	return WARN_ON_ONCE(ret) ? -EIO : 0;
+}
+EXPORT_SYMBOL_GPL(sgx_virt_ecreate);
+
+/**
+ * sgx_virt_einit() - Run EINIT on behalf of a guest
+ * @sigstruct:	a SIGSTRUCT in kernel memory
+ * @token:	an EINITTOKEN in kernel memory
+ * @secs:	the user address of the SECS page in a virtual EPC mapping
+ * @lepubkeyhash: the launch control MSRs of the guest
+ * @trapnr:	the trap number, when EINIT faults
+ *
+ * Return:
+ *   0 on success,
+ *   -EAGAIN if the EPC page of @secs is not available yet,
+ *   -EFAULT if EINIT faulted,
+ *   -errno on other errors,
+ *   SGX error code if EINIT fails
+ */
+int sgx_virt_einit(struct sgx_sigstruct *sigstruct,
+		   struct sgx_einittoken *token, void __user *secs,
+		   u64 *lepubkeyhash, int *trapnr)
+{
+	struct sgx_epc_page *epc_page;
+	int ret;
+
+	down_read(&current->mm->mmap_sem);
+
+	epc_page = sgx_virt_epc_lookup((unsigned long)secs, trapnr);
+	if (IS_ERR(epc_page)) {
+		up_read(&current->mm->mmap_sem);
+		return PTR_ERR(epc_page);
+	}
+
+	ret = sgx_einit(sigstruct, token, epc_page, lepubkeyhash);
+
+	up_read(&current->mm->mmap_sem);
+
+	if (encls_faulted(ret)) {
+		*trapnr = ENCLS_TRAPNR(ret);
+		return -EFAULT;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(sgx_virt_einit);
+
+/**
+ * sgx_virt_epc_init() - Create /dev/sgx/virt_epc
+ *
+ * Return:
+ *   0 on success,
+ *   -ENODEV if the CPU does not support VMX,
+ *   -errno on other errors
+ */
+int __init sgx_virt_epc_init(void)
+{
+	if (!boot_cpu_has(X86_FEATURE_VMX))
+		return -ENODEV;
+
+	return misc_register(&sgx_virt_epc_dev);
+}
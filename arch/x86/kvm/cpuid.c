@@ -18,6 +18,7 @@
 #include <asm/processor.h>
 #include <asm/user.h>
 #include <asm/fpu/xstate.h>
+#include <asm/sgx_arch.h>
 #include "cpuid.h"
 #include "lapic.h"
 #include "mmu.h"
@@ -332,6 +333,8 @@ static inline int __do_cpuid_ent(struct kvm_cpuid_entry2 *entry, u32 function,
 	unsigned f_xsaves = kvm_x86_ops->xsaves_supported() ? F(XSAVES) : 0;
 	unsigned f_umip = kvm_x86_ops->umip_emulated() ? F(UMIP) : 0;
 	unsigned f_intel_pt = kvm_x86_ops->pt_supported() ? F(INTEL_PT) : 0;
+	unsigned f_sgx = kvm_x86_ops->sgx_supported() ? F(SGX) : 0;
+	unsigned f_sgx_lc = f_sgx ? F(SGX_LC) : 0;
 	unsigned f_la57 = 0;
 
 	/* cpuid 1.edx */
@@ -391,7 +394,7 @@ static inline int __do_cpuid_ent(struct kvm_cpuid_entry2 *entry, u32 function,
 		F(BMI2) | F(ERMS) | f_invpcid | F(RTM) | f_mpx | F(RDSEED) |
 		F(ADX) | F(SMAP) | F(AVX512IFMA) | F(AVX512F) | F(AVX512PF) |
 		F(AVX512ER) | F(AVX512CD) | F(CLFLUSHOPT) | F(CLWB) | F(AVX512DQ) |
-		F(SHA_NI) | F(AVX512BW) | F(AVX512VL) | f_intel_pt;
+		F(SHA_NI) | F(AVX512BW) | F(AVX512VL) | f_intel_pt | f_sgx;
 
 	/* cpuid 0xD.1.eax */
 	const u32 kvm_cpuid_D_1_eax_x86_features =
@@ -402,7 +405,7 @@ static inline int __do_cpuid_ent(struct kvm_cpuid_entry2 *entry, u32 function,
 		F(AVX512VBMI) | F(LA57) | F(PKU) | 0 /*OSPKE*/ |
 		F(AVX512_VPOPCNTDQ) | F(UMIP) | F(AVX512_VBMI2) | F(GFNI) |
 		F(VAES) | F(VPCLMULQDQ) | F(AVX512_VNNI) | F(AVX512_BITALG) |
-		F(CLDEMOTE) | F(MOVDIRI) | F(MOVDIR64B);
+		F(CLDEMOTE) | F(MOVDIRI) | F(MOVDIR64B) | f_sgx_lc;
 
 	/* cpuid 7.0.edx*/
 	const u32 kvm_cpuid_7_0_edx_x86_features =
@@ -423,7 +426,8 @@ static inline int __do_cpuid_ent(struct kvm_cpuid_entry2 *entry, u32 function,
 
 	switch (function) {
 	case 0:
-		entry->eax = min(entry->eax, (u32)(f_intel_pt ? 0x14 : 0xd));
+		entry->eax = min(entry->eax,
+				 (u32)(f_intel_pt ? 0x14 : f_sgx ? 0x12 : 0xd));
 		break;
 	case 1:
 		entry->edx &= kvm_cpuid_1_edx_x86_features;
@@ -604,6 +608,40 @@ static inline int __do_cpuid_ent(struct kvm_cpuid_entry2 *entry, u32 function,
 		}
 		break;
 	}
+	/* Intel SGX */
+	case 0x12:
+		if (!f_sgx) {
+			entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+			break;
+		}
+
+		/*
+		 * Sub-leaf 0 enumerates the leaf functions and the MISCSELECT
+		 * bits, KVM knows how to virtualize SGX1, SGX2 and EXINFO.
+		 */
+		entry->flags |= KVM_CPUID_FLAG_SIGNIFCANT_INDEX;
+		entry->eax &= F(SGX1) | F(SGX2);
+		entry->ebx &= SGX_MISC_EXINFO;
+		entry->ecx = 0;
+
+		if (*nent >= maxnent)
+			goto out;
+
+		/*
+		 * Sub-leaf 1 enumerates the SECS.ATTRIBUTES the guest may set.
+		 * PROVISIONKEY is withheld, the provisioning of a guest is up
+		 * to the VMM.  The XFRM is limited to the XCR0 of the guests.
+		 * The EPC sections of sub-leaf 2+ are defined by the VMM.
+		 */
+		do_cpuid_1_ent(&entry[1], function, 1);
+		entry[1].flags |= KVM_CPUID_FLAG_SIGNIFCANT_INDEX;
+		entry[1].eax &= SGX_ATTR_DEBUG | SGX_ATTR_MODE64BIT |
+				SGX_ATTR_EINITTOKENKEY;
+		entry[1].ebx = 0;
+		entry[1].ecx &= (u32)kvm_supported_xcr0();
+		entry[1].edx &= (u32)(kvm_supported_xcr0() >> 32);
+		++*nent;
+		break;
 	/* Intel PT */
 	case 0x14: {
 		int t, times = entry->eax;
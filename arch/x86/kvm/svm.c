@@ -5973,6 +5973,11 @@ static bool svm_pt_supported(void)
 	return false;
 }
 
+static bool svm_sgx_supported(void)
+{
+	return false;
+}
+
 static bool svm_has_wbinvd_exit(void)
 {
 	return true;
@@ -7245,6 +7250,7 @@ static struct kvm_x86_ops svm_x86_ops __ro_after_init = {
 	.xsaves_supported = svm_xsaves_supported,
 	.umip_emulated = svm_umip_emulated,
 	.pt_supported = svm_pt_supported,
+	.sgx_supported = svm_sgx_supported,
 
 	.set_supported_cpuid = svm_set_supported_cpuid,
 
@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * SGX virtualization for the guests.
+ *
+ * The EPC of a guest is a virtual EPC of the host, mapped by the VMM into a
+ * memory slot.  Most of the ENCLS leaves run natively in the guest.  KVM traps
+ * ECREATE, to check the SECS against the CPUID of the guest, and EINIT when the
+ * launch control MSRs are writable, to run it with the MSRs of the guest.
+ */
+
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <asm/sgx.h>
+#include <asm/traps.h>
+
+#include "cpuid.h"
+#include "kvm_cache_regs.h"
+#include "sgx.h"
+#include "vmx.h"
+#include "x86.h"
+
+bool __read_mostly enable_sgx = 1;
+module_param_named(sgx, enable_sgx, bool, 0444);
+
+/* The reset value of IA32_SGXLEPUBKEYHASHx, the hash of Intel's key. */
+static const u64 sgx_intel_lepubkeyhash[4] = {
+	0xa6053e051270b7acULL, 0x6cfbe8ba8b3b413dULL,
+	0xc4916d99f2b3735dULL, 0xd4f8c05909f9bb3bULL,
+};
+
+static u32 sgx_guest_leaves(struct kvm_vcpu *vcpu)
+{
+	struct kvm_cpuid_entry2 *best;
+
+	best = kvm_find_cpuid_entry(vcpu, SGX_CPUID, 0);
+	return best ? best->eax : 0;
+}
+
+static bool sgx_guest_has_sgx2(struct kvm_vcpu *vcpu)
+{
+	return sgx_guest_leaves(vcpu) & bit(X86_FEATURE_SGX2);
+}
+
+static bool sgx_enabled_in_guest_bios(struct kvm_vcpu *vcpu)
+{
+	const u64 bits = FEATURE_CONTROL_SGX_ENABLE | FEATURE_CONTROL_LOCKED;
+
+	return (to_vmx(vcpu)->msr_ia32_feature_control & bits) == bits;
+}
+
+static bool encls_leaf_enabled_in_guest(struct kvm_vcpu *vcpu, u32 leaf)
+{
+	u32 leaves = sgx_guest_leaves(vcpu);
+
+	if (!guest_cpuid_has(vcpu, X86_FEATURE_SGX))
+		return false;
+
+	if (leaf >= SGX_ECREATE && leaf <= SGX_ETRACK)
+		return leaves & bit(X86_FEATURE_SGX1);
+
+	if (leaf >= SGX_EAUG && leaf <= SGX_EMODT)
+		return leaves & bit(X86_FEATURE_SGX2);
+
+	return false;
+}
+
+static int sgx_exit_internal_error(struct kvm_vcpu *vcpu)
+{
+	vcpu->run->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+	vcpu->run->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+	vcpu->run->internal.ndata = 0;
+	return 0;
+}
+
+/*
+ * Compute the linear address of an implicit memory operand of ENCLS, which is
+ * relative to DS.  Inject a #GP and return -EINVAL if the operand is not
+ * accessible or not aligned.
+ */
+static int sgx_get_encls_gva(struct kvm_vcpu *vcpu, unsigned long offset,
+			     int size, int alignment, gva_t *gva)
+{
+	struct kvm_segment s;
+	bool fault;
+
+	vmx_get_segment(vcpu, &s, VCPU_SREG_DS);
+
+	/* The base of DS is ignored in 64-bit mode. */
+	if (is_64_bit_mode(vcpu)) {
+		*gva = offset;
+		fault = is_noncanonical_address(*gva, vcpu);
+	} else {
+		*gva = (s.base + offset) & 0xffffffff;
+		fault = s.unusable || (s.type != 2 && s.type != 3) ||
+			offset > s.limit ||
+			(u64)offset + size - 1 > s.limit;
+	}
+
+	if (!IS_ALIGNED(*gva, alignment))
+		fault = true;
+
+	if (fault) {
+		kvm_inject_gp(vcpu, 0);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sgx_read_guest(struct kvm_vcpu *vcpu, gva_t gva, void *data,
+			  unsigned int size)
+{
+	struct x86_exception ex;
+
+	if (kvm_read_guest_virt(vcpu, gva, data, size, &ex)) {
+		kvm_inject_page_fault(vcpu, &ex);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Translate the address of an EPC page of the guest to the address of the
+ * virtual EPC in the VMM.  Inject the fault into the guest on failure.
+ */
+static int sgx_gva_to_hva(struct kvm_vcpu *vcpu, gva_t gva,
+			  unsigned long *hva)
+{
+	struct x86_exception ex;
+	gpa_t gpa;
+
+	gpa = kvm_mmu_gva_to_gpa_write(vcpu, gva, &ex);
+	if (gpa == UNMAPPED_GVA) {
+		kvm_inject_page_fault(vcpu, &ex);
+		return -EFAULT;
+	}
+
+	*hva = kvm_vcpu_gfn_to_hva(vcpu, PFN_DOWN(gpa));
+	if (kvm_is_error_hva(*hva)) {
+		/* Like ENCLS with a non-EPC operand. */
+		kvm_inject_gp(vcpu, 0);
+		return -EFAULT;
+	}
+
+	*hva |= gpa & ~PAGE_MASK;
+	return 0;
+}
+
+/*
+ * Reflect a fault of ENCLS into the guest.  A #PF is due to an EPCM conflict
+ * and has the SGX bit set in the error code, except on SGX1 CPUs, which #GP.
+ */
+static int sgx_inject_fault(struct kvm_vcpu *vcpu, gva_t gva, int trapnr)
+{
+	struct x86_exception ex;
+
+	if (trapnr == X86_TRAP_PF && sgx_guest_has_sgx2(vcpu)) {
+		memset(&ex, 0, sizeof(ex));
+		ex.vector = PF_VECTOR;
+		ex.error_code_valid = true;
+		ex.error_code = PFERR_PRESENT_MASK | PFERR_WRITE_MASK |
+				PFERR_SGX_MASK;
+		ex.address = gva;
+		kvm_inject_page_fault(vcpu, &ex);
+		return 1;
+	}
+
+	if (trapnr == X86_TRAP_PF || trapnr == X86_TRAP_GP) {
+		kvm_inject_gp(vcpu, 0);
+		return 1;
+	}
+
+	/* The leaf has been checked, anything else is a bug of the host. */
+	return sgx_exit_internal_error(vcpu);
+}
+
+/* Check the SECS of ECREATE against the CPUID of the guest. */
+static bool sgx_secs_allowed(struct kvm_vcpu *vcpu, struct sgx_secs *secs)
+{
+	struct kvm_cpuid_entry2 *sgx_0, *sgx_1;
+	u64 allowed_attributes, allowed_xfrm;
+	u8 max_size_log2;
+
+	sgx_0 = kvm_find_cpuid_entry(vcpu, SGX_CPUID, 0);
+	sgx_1 = kvm_find_cpuid_entry(vcpu, SGX_CPUID, 1);
+	if (!sgx_0 || !sgx_1)
+		return false;
+
+	allowed_attributes = ((u64)sgx_1->ebx << 32) | sgx_1->eax;
+	allowed_xfrm = ((u64)sgx_1->edx << 32) | sgx_1->ecx;
+
+	/* The provisioning key is not given to the guests. */
+	if (secs->attributes & SGX_ATTR_PROVISIONKEY)
+		return false;
+
+	if ((secs->miscselect & ~sgx_0->ebx) ||
+	    (secs->attributes & ~allowed_attributes) ||
+	    (secs->xfrm & ~allowed_xfrm))
+		return false;
+
+	if (secs->attributes & SGX_ATTR_MODE64BIT)
+		max_size_log2 = (sgx_0->edx >> 8) & 0xff;
+	else
+		max_size_log2 = sgx_0->edx & 0xff;
+
+	return max_size_log2 < 64 && secs->size <= BIT_ULL(max_size_log2);
+}
+
+static int handle_encls_ecreate(struct kvm_vcpu *vcpu)
+{
+	gva_t pageinfo_gva, secs_gva, metadata_gva, contents_gva;
+	struct sgx_pageinfo pageinfo;
+	struct sgx_secinfo secinfo;
+	unsigned long secs_hva;
+	struct sgx_secs *secs;
+	int trapnr;
+	int ret;
+
+	if (sgx_get_encls_gva(vcpu, kvm_rbx_read(vcpu), 32, 32,
+			      &pageinfo_gva) ||
+	    sgx_get_encls_gva(vcpu, kvm_rcx_read(vcpu), PAGE_SIZE, PAGE_SIZE,
+			      &secs_gva))
+		return 1;
+
+	if (sgx_read_guest(vcpu, pageinfo_gva, &pageinfo, sizeof(pageinfo)))
+		return 1;
+
+	if (sgx_get_encls_gva(vcpu, pageinfo.metadata, 64, 64,
+			      &metadata_gva) ||
+	    sgx_get_encls_gva(vcpu, pageinfo.contents, PAGE_SIZE, PAGE_SIZE,
+			      &contents_gva))
+		return 1;
+
+	secs = (struct sgx_secs *)__get_free_page(GFP_KERNEL);
+	if (!secs)
+		return sgx_exit_internal_error(vcpu);
+
+	if (sgx_read_guest(vcpu, metadata_gva, &secinfo, sizeof(secinfo)) ||
+	    sgx_read_guest(vcpu, contents_gva, secs, PAGE_SIZE) ||
+	    sgx_gva_to_hva(vcpu, secs_gva, &secs_hva)) {
+		ret = 1;
+		goto out;
+	}
+
+	if (!sgx_secs_allowed(vcpu, secs)) {
+		kvm_inject_gp(vcpu, 0);
+		ret = 1;
+		goto out;
+	}
+
+	pageinfo.metadata = (u64)&secinfo;
+	pageinfo.contents = (u64)secs;
+
+	ret = sgx_virt_ecreate(&pageinfo, (void __user *)secs_hva, &trapnr);
+	if (ret == -EAGAIN)
+		ret = 1;
+	else if (ret == -EFAULT)
+		ret = sgx_inject_fault(vcpu, secs_gva, trapnr);
+	else if (ret)
+		ret = sgx_exit_internal_error(vcpu);
+	else
+		ret = kvm_skip_emulated_instruction(vcpu);
+
+out:
+	free_page((unsigned long)secs);
+	return ret;
+}
+
+static int handle_encls_einit(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_vmx *vmx = to_vmx(vcpu);
+	gva_t sigstruct_gva, secs_gva, token_gva;
+	struct sgx_sigstruct *sigstruct;
+	struct sgx_einittoken *token;
+	unsigned long secs_hva;
+	unsigned long rflags;
+	void *page;
+	int trapnr;
+	int ret;
+
+	if (sgx_get_encls_gva(vcpu, kvm_rbx_read(vcpu),
+			      sizeof(*sigstruct), PAGE_SIZE, &sigstruct_gva) ||
+	    sgx_get_encls_gva(vcpu, kvm_rcx_read(vcpu), PAGE_SIZE, PAGE_SIZE,
+			      &secs_gva) ||
+	    sgx_get_encls_gva(vcpu, kvm_rdx_read(vcpu), sizeof(*token), 512,
+			      &token_gva))
+		return 1;
+
+	/* Both fit in a page, the SIGSTRUCT in the first half. */
+	BUILD_BUG_ON(sizeof(*sigstruct) > PAGE_SIZE / 2);
+	BUILD_BUG_ON(sizeof(*token) > PAGE_SIZE / 2);
+
+	page = (void *)__get_free_page(GFP_KERNEL);
+	if (!page)
+		return sgx_exit_internal_error(vcpu);
+
+	sigstruct = page;
+	token = page + PAGE_SIZE / 2;
+
+	if (sgx_read_guest(vcpu, sigstruct_gva, sigstruct,
+			   sizeof(*sigstruct)) ||
+	    sgx_read_guest(vcpu, token_gva, token, sizeof(*token)) ||
+	    sgx_gva_to_hva(vcpu, secs_gva, &secs_hva)) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = sgx_virt_einit(sigstruct, token, (void __user *)secs_hva,
+			     vmx->msr_ia32_sgxlepubkeyhash, &trapnr);
+	if (ret == -EAGAIN) {
+		ret = 1;
+	} else if (ret == -EFAULT) {
+		ret = sgx_inject_fault(vcpu, secs_gva, trapnr);
+	} else if (ret < 0) {
+		ret = sgx_exit_internal_error(vcpu);
+	} else {
+		/* EINIT returns its error code in RAX and sets ZF on error. */
+		rflags = vmx_get_rflags(vcpu);
+		rflags &= ~(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF |
+			    X86_EFLAGS_SF | X86_EFLAGS_OF | X86_EFLAGS_ZF);
+		if (ret)
+			rflags |= X86_EFLAGS_ZF;
+		vmx_set_rflags(vcpu, rflags);
+
+		kvm_rax_write(vcpu, ret);
+		ret = kvm_skip_emulated_instruction(vcpu);
+	}
+
+out:
+	free_page((unsigned long)page);
+	return ret;
+}
+
+int handle_encls(struct kvm_vcpu *vcpu)
+{
+	u32 leaf = (u32)kvm_rax_read(vcpu);
+
+	if (!encls_leaf_enabled_in_guest(vcpu, leaf)) {
+		kvm_queue_exception(vcpu, UD_VECTOR);
+	} else if (!sgx_enabled_in_guest_bios(vcpu)) {
+		kvm_inject_gp(vcpu, 0);
+	} else {
+		if (leaf == SGX_ECREATE)
+			return handle_encls_ecreate(vcpu);
+		if (leaf == SGX_EINIT)
+			return handle_encls_einit(vcpu);
+
+		WARN(1, "KVM: unexpected exit on ENCLS[%u]", leaf);
+		vcpu->run->exit_reason = KVM_EXIT_UNKNOWN;
+		vcpu->run->hw.hardware_exit_reason = EXIT_REASON_ENCLS;
+		return 0;
+	}
+
+	return 1;
+}
+
+void vcpu_setup_sgx_lepubkeyhash(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_vmx *vmx = to_vmx(vcpu);
+
+	memcpy(vmx->msr_ia32_sgxlepubkeyhash, sgx_intel_lepubkeyhash,
+	       sizeof(sgx_intel_lepubkeyhash));
+}
+
+/*
+ * SGX has no enable bit that is virtualized by the CPU, hence all the leaves
+ * are trapped, to inject a #UD or a #GP, unless SGX is exposed to the guest
+ * and enabled by its firmware.  Even then ECREATE is trapped to check the SECS
+ * against the CPUID of the guest, and EINIT is trapped if the launch control
+ * MSRs of the host are writable, to run it with the MSRs of the guest.
+ */
+void vmx_write_encls_bitmap(struct kvm_vcpu *vcpu)
+{
+	u64 bitmap = -1ull;
+	u32 leaves;
+
+	if (!cpu_has_vmx_encls_vmexit())
+		return;
+
+	if (guest_cpuid_has(vcpu, X86_FEATURE_SGX) &&
+	    sgx_enabled_in_guest_bios(vcpu)) {
+		leaves = sgx_guest_leaves(vcpu);
+
+		if (leaves & bit(X86_FEATURE_SGX1)) {
+			bitmap &= ~GENMASK_ULL(SGX_ETRACK, SGX_ECREATE);
+			bitmap |= BIT_ULL(SGX_ECREATE);
+			if (boot_cpu_has(X86_FEATURE_SGX_LC))
+				bitmap |= BIT_ULL(SGX_EINIT);
+		}
+
+		if (leaves & bit(X86_FEATURE_SGX2))
+			bitmap &= ~GENMASK_ULL(SGX_EMODT, SGX_EAUG);
+	}
+
+	vmcs_write64(ENCLS_EXITING_BITMAP, bitmap);
+}
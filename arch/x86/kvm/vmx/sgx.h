@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __KVM_X86_SGX_H
+#define __KVM_X86_SGX_H
+
+#include <linux/kvm_host.h>
+
+#include "capabilities.h"
+#include "ops.h"
+
+#ifdef CONFIG_KVM_INTEL_SGX
+extern bool __read_mostly enable_sgx;
+
+int handle_encls(struct kvm_vcpu *vcpu);
+
+void vcpu_setup_sgx_lepubkeyhash(struct kvm_vcpu *vcpu);
+void vmx_write_encls_bitmap(struct kvm_vcpu *vcpu);
+#else
+#define enable_sgx 0
+
+static inline void vcpu_setup_sgx_lepubkeyhash(struct kvm_vcpu *vcpu) { }
+
+static inline void vmx_write_encls_bitmap(struct kvm_vcpu *vcpu)
+{
+	/* Trap all leaves to inject a #UD, there is no enable bit for SGX. */
+	if (cpu_has_vmx_encls_vmexit())
+		vmcs_write64(ENCLS_EXITING_BITMAP, -1ull);
+}
+#endif
+
+#endif /* __KVM_X86_SGX_H */
@@ -16,6 +16,7 @@
 #include <linux/workqueue.h>
 #include <linux/cgroup.h>
 #include <linux/blk-cgroup.h>
+#include <linux/cpuhotplug.h>
 
 #include <trace/events/block.h>
 #include "blk.h"
@@ -235,6 +236,94 @@ void bio_uninit(struct bio *bio)
 }
 EXPORT_SYMBOL(bio_uninit);
 
+/*
+ * Per-cpu cache of bios for bio_sets created with BIOSET_PERCPU_CACHE. Bios
+ * without a separately allocated bvec table that are freed from task
+ * context go here instead of back to the mempool, and allocations from task
+ * context that fit in the inline vecs are served from here first. That
+ * takes the mempool and slab out of the path for polled I/O, where both
+ * submission and completion run in the task.
+ */
+#define ALLOC_CACHE_MAX		512
+#define ALLOC_CACHE_SLACK	 64
+
+struct bio_alloc_cache {
+	struct bio_list		free_list;
+	unsigned int		nr;
+};
+
+static void bio_alloc_cache_prune(struct bio_set *bs,
+				  struct bio_alloc_cache *cache,
+				  unsigned int nr)
+{
+	struct bio *bio;
+
+	while (nr-- && (bio = bio_list_pop(&cache->free_list)) != NULL) {
+		cache->nr--;
+		mempool_free((void *)bio - bs->front_pad, &bs->bio_pool);
+	}
+}
+
+static struct bio *bio_alloc_cache_get(struct bio_set *bs,
+				       unsigned int nr_iovecs)
+{
+	struct bio_alloc_cache *cache;
+	struct bio *bio;
+
+	if (!in_task())
+		return NULL;
+
+	cache = per_cpu_ptr(bs->cache, get_cpu());
+	bio = bio_list_pop(&cache->free_list);
+	if (bio)
+		cache->nr--;
+	put_cpu();
+
+	if (!bio)
+		return NULL;
+
+	bio_init(bio, nr_iovecs ? bio->bi_inline_vecs : NULL, nr_iovecs);
+	bio->bi_pool = bs;
+	return bio;
+}
+
+static bool bio_alloc_cache_put(struct bio_set *bs, struct bio *bio)
+{
+	struct bio_alloc_cache *cache;
+
+	if (!in_task() || BVEC_POOL_IDX(bio))
+		return false;
+
+	cache = per_cpu_ptr(bs->cache, get_cpu());
+	bio_list_add_head(&cache->free_list, bio);
+	if (++cache->nr > ALLOC_CACHE_MAX)
+		bio_alloc_cache_prune(bs, cache, ALLOC_CACHE_SLACK);
+	put_cpu();
+	return true;
+}
+
+static int bio_cpu_dead(unsigned int cpu, struct hlist_node *node)
+{
+	struct bio_set *bs = hlist_entry(node, struct bio_set, cpuhp_dead);
+
+	bio_alloc_cache_prune(bs, per_cpu_ptr(bs->cache, cpu), -1U);
+	return 0;
+}
+
+static void bio_alloc_cache_destroy(struct bio_set *bs)
+{
+	int cpu;
+
+	if (!bs->cache)
+		return;
+
+	cpuhp_state_remove_instance_nocalls(CPUHP_BIO_DEAD, &bs->cpuhp_dead);
+	for_each_possible_cpu(cpu)
+		bio_alloc_cache_prune(bs, per_cpu_ptr(bs->cache, cpu), -1U);
+	free_percpu(bs->cache);
+	bs->cache = NULL;
+}
+
 static void bio_free(struct bio *bio)
 {
 	struct bio_set *bs = bio->bi_pool;
@@ -243,6 +332,9 @@ static void bio_free(struct bio *bio)
 	bio_uninit(bio);
 
 	if (bs) {
+		if (bs->cache && bio_alloc_cache_put(bs, bio))
+			return;
+
 		bvec_free(&bs->bvec_pool, bio->bi_io_vec, BVEC_POOL_IDX(bio));
 
 		/*
@@ -446,6 +538,13 @@ struct bio *bio_alloc_bioset(gfp_t gfp_mask, unsigned int nr_iovecs,
 		if (WARN_ON_ONCE(!mempool_initialized(&bs->bvec_pool) &&
 				 nr_iovecs > 0))
 			return NULL;
+
+		if (bs->cache && nr_iovecs <= BIO_INLINE_VECS) {
+			bio = bio_alloc_cache_get(bs, nr_iovecs);
+			if (bio)
+				return bio;
+		}
+
 		/*
 		 * generic_make_request() converts recursion to iteration; this
 		 * means if we're running beneath it, any bios we allocate and
@@ -1893,6 +1992,7 @@ void bioset_exit(struct bio_set *bs)
 		destroy_workqueue(bs->rescue_workqueue);
 	bs->rescue_workqueue = NULL;
 
+	bio_alloc_cache_destroy(bs);
 	mempool_exit(&bs->bio_pool);
 	mempool_exit(&bs->bvec_pool);
 
@@ -1908,8 +2008,8 @@ EXPORT_SYMBOL(bioset_exit);
  * @bs:		pool to initialize
  * @pool_size:	Number of bio and bio_vecs to cache in the mempool
  * @front_pad:	Number of bytes to allocate in front of the returned bio
- * @flags:	Flags to modify behavior, currently %BIOSET_NEED_BVECS
- *              and %BIOSET_NEED_RESCUER
+ * @flags:	Flags to modify behavior, currently %BIOSET_NEED_BVECS,
+ *              %BIOSET_NEED_RESCUER and %BIOSET_PERCPU_CACHE
  *
  * Description:
  *    Set up a bio_set to be used with @bio_alloc_bioset. Allows the caller
@@ -1922,6 +2022,10 @@ EXPORT_SYMBOL(bioset_exit);
  *    for allocating iovecs.  This pool is not needed e.g. for bio_clone_fast().
  *    If %BIOSET_NEED_RESCUER is set, a workqueue is created which can be used to
  *    dispatch queued requests when the mempool runs out of space.
+ *    If %BIOSET_PERCPU_CACHE is set, bios freed from task context are kept
+ *    in a per-cpu cache and handed out again by the next allocation from
+ *    task context, bypassing the mempool. This is meant for bio_sets that
+ *    see polled I/O.
  *
  */
 int bioset_init(struct bio_set *bs,
@@ -1948,6 +2052,14 @@ int bioset_init(struct bio_set *bs,
 	    biovec_init_pool(&bs->bvec_pool, pool_size))
 		goto bad;
 
+	if (flags & BIOSET_PERCPU_CACHE) {
+		bs->cache = alloc_percpu(struct bio_alloc_cache);
+		if (!bs->cache)
+			goto bad;
+		cpuhp_state_add_instance_nocalls(CPUHP_BIO_DEAD,
+						 &bs->cpuhp_dead);
+	}
+
 	if (!(flags & BIOSET_NEED_RESCUER))
 		return 0;
 
@@ -1975,6 +2087,8 @@ int bioset_init_from_src(struct bio_set *bs, struct bio_set *src)
 		flags |= BIOSET_NEED_BVECS;
 	if (src->rescue_workqueue)
 		flags |= BIOSET_NEED_RESCUER;
+	if (src->cache)
+		flags |= BIOSET_PERCPU_CACHE;
 
 	return bioset_init(bs, src->bio_pool.min_nr, src->front_pad, flags);
 }
@@ -2149,6 +2263,9 @@ static int __init init_bio(void)
 	bio_integrity_init();
 	biovec_init_slabs();
 
+	cpuhp_setup_state_multi(CPUHP_BIO_DEAD, "block/bio:dead", NULL,
+				bio_cpu_dead);
+
 	if (bioset_init(&fs_bio_set, BIO_POOL_SIZE, 0, BIOSET_NEED_BVECS))
 		panic("bio: can't allocate bios\n");
 
@@ -190,6 +190,30 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 	return tag + tag_offset;
 }
 
+/*
+ * Grab up to @nr_tags driver tags at once for a plug that is about to issue
+ * that many requests. Only done when there is nothing to be fair to: no
+ * scheduler tags, no shallow depth limit and no tag sharing between queues.
+ * Never sleeps, a return of zero means the caller should fall back to
+ * blk_mq_get_tag().
+ */
+unsigned long blk_mq_get_tags(struct blk_mq_alloc_data *data, int nr_tags,
+			      unsigned int *offset)
+{
+	struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
+	unsigned long ret;
+
+	if (data->shallow_depth ||
+	    (data->flags & (BLK_MQ_REQ_RESERVED | BLK_MQ_REQ_INTERNAL)) ||
+	    (data->hctx->flags & BLK_MQ_F_TAG_SHARED))
+		return 0;
+
+	ret = __sbitmap_queue_get_batch(&tags->bitmap_tags, nr_tags, offset);
+	if (ret)
+		*offset += tags->nr_reserved_tags;
+	return ret;
+}
+
 void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_tags *tags,
 		    struct blk_mq_ctx *ctx, unsigned int tag)
 {
@@ -204,6 +228,12 @@ void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_tags *tags,
 	}
 }
 
+void blk_mq_put_tags(struct blk_mq_tags *tags, int *tag_array, int nr_tags)
+{
+	sbitmap_queue_clear_batch(&tags->bitmap_tags, tags->nr_reserved_tags,
+				  tag_array, nr_tags);
+}
+
 struct bt_iter_data {
 	struct blk_mq_hw_ctx *hctx;
 	busy_iter_fn *fn;
@@ -348,6 +348,40 @@ static struct request *blk_mq_rq_ctx_init(struct blk_mq_alloc_data *data,
 	return rq;
 }
 
+/*
+ * Allocate as many of the data->nr_tags requests as one tag bitmap word
+ * gives us. The first one is returned, the rest are initialized in the
+ * same way and parked on data->cached_rqs for the plug to hand out.
+ */
+static struct request *blk_mq_get_request_batch(struct blk_mq_alloc_data *data)
+{
+	unsigned long tag_mask;
+	unsigned int tag_offset, i;
+	struct request *rq, *first = NULL;
+
+	tag_mask = blk_mq_get_tags(data, data->nr_tags, &tag_offset);
+	if (!tag_mask)
+		return NULL;
+
+	/* the caller took the queue reference of the first request */
+	percpu_ref_get_many(&data->q->q_usage_counter,
+			    hweight_long(tag_mask) - 1);
+
+	while (tag_mask) {
+		i = __ffs(tag_mask);
+		tag_mask &= ~(1UL << i);
+
+		rq = blk_mq_rq_ctx_init(data, tag_offset + i, data->cmd_flags);
+		rq->elv.icq = NULL;
+		data->hctx->queued++;
+		if (!first)
+			first = rq;
+		else
+			list_add_tail(&rq->queuelist, data->cached_rqs);
+	}
+	return first;
+}
+
 static struct request *blk_mq_get_request(struct request_queue *q,
 					  struct bio *bio,
 					  struct blk_mq_alloc_data *data)
@@ -385,6 +419,12 @@ static struct request *blk_mq_get_request(struct request_queue *q,
 		blk_mq_tag_busy(data->hctx);
 	}
 
+	if (data->nr_tags > 1) {
+		rq = blk_mq_get_request_batch(data);
+		if (rq)
+			return rq;
+	}
+
 	tag = blk_mq_get_tag(data);
 	if (tag == BLK_MQ_TAG_FAIL) {
 		if (clear_ctx_on_error)
@@ -526,13 +566,8 @@ void blk_mq_free_request(struct request *rq)
 }
 EXPORT_SYMBOL_GPL(blk_mq_free_request);
 
-inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
+static inline void __blk_mq_end_request_acct(struct request *rq, u64 now)
 {
-	u64 now = 0;
-
-	if (blk_mq_need_time_stamp(rq))
-		now = ktime_get_ns();
-
 	if (rq->rq_flags & RQF_STATS) {
 		blk_mq_poll_stats_start(rq->q);
 		blk_stat_add(rq, now);
@@ -542,6 +577,16 @@ inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
 		blk_mq_sched_completed_request(rq, now);
 
 	blk_account_io_done(rq, now);
+}
+
+inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
+{
+	u64 now = 0;
+
+	if (blk_mq_need_time_stamp(rq))
+		now = ktime_get_ns();
+
+	__blk_mq_end_request_acct(rq, now);
 
 	if (rq->end_io) {
 		rq_qos_done(rq->q, rq);
@@ -560,6 +605,79 @@ void blk_mq_end_request(struct request *rq, blk_status_t error)
 }
 EXPORT_SYMBOL(blk_mq_end_request);
 
+#define BLK_MQ_END_BATCH	32
+
+static void blk_mq_flush_tag_batch(struct blk_mq_hw_ctx *hctx, int *tag_array,
+				   int nr_tags)
+{
+	struct request_queue *q = hctx->queue;
+
+	blk_mq_put_tags(hctx->tags, tag_array, nr_tags);
+	blk_mq_sched_restart(hctx);
+	percpu_ref_put_many(&q->q_usage_counter, nr_tags);
+}
+
+/**
+ * blk_mq_end_request_batch - end a list of successfully completed requests
+ * @list: requests to end, linked through ->queuelist
+ *
+ * Same as calling blk_mq_end_request() with BLK_STS_OK on each request, for
+ * drivers that reap many completions at once, e.g. from ->poll(). Requests
+ * that are freed right here, i.e. that have no ->end_io, no scheduler tag and
+ * no reserved or shared tag, give their tags back with one bitmap update per
+ * hardware queue and drop their queue references in one go.
+ */
+void blk_mq_end_request_batch(struct list_head *list)
+{
+	int tags[BLK_MQ_END_BATCH], nr_tags = 0;
+	struct blk_mq_hw_ctx *cur_hctx = NULL;
+	struct request *rq, *next;
+	u64 now = 0;
+
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		struct blk_mq_hw_ctx *hctx = rq->mq_hctx;
+
+		list_del_init(&rq->queuelist);
+		if (blk_update_request(rq, BLK_STS_OK, blk_rq_bytes(rq)))
+			BUG();
+
+		if (rq->end_io || rq->internal_tag != -1 ||
+		    (rq->rq_flags & (RQF_ELVPRIV | RQF_MQ_INFLIGHT)) ||
+		    blk_mq_tag_is_reserved(hctx->tags, rq->tag)) {
+			__blk_mq_end_request(rq, BLK_STS_OK);
+			continue;
+		}
+
+		if (!now && blk_mq_need_time_stamp(rq))
+			now = ktime_get_ns();
+		__blk_mq_end_request_acct(rq, now);
+
+		/* what blk_mq_free_request() does for this kind of request */
+		rq->mq_ctx->rq_completed[rq_is_sync(rq)]++;
+		if (unlikely(laptop_mode && !blk_rq_is_passthrough(rq)))
+			laptop_io_completion(rq->q->backing_dev_info);
+		rq_qos_done(rq->q, rq);
+
+		WRITE_ONCE(rq->state, MQ_RQ_IDLE);
+		if (!refcount_dec_and_test(&rq->ref))
+			continue;
+
+		blk_pm_mark_last_busy(rq);
+		rq->mq_hctx = NULL;
+		if (nr_tags == BLK_MQ_END_BATCH ||
+		    (cur_hctx && cur_hctx != hctx)) {
+			blk_mq_flush_tag_batch(cur_hctx, tags, nr_tags);
+			nr_tags = 0;
+		}
+		cur_hctx = hctx;
+		tags[nr_tags++] = rq->tag;
+	}
+
+	if (nr_tags)
+		blk_mq_flush_tag_batch(cur_hctx, tags, nr_tags);
+}
+EXPORT_SYMBOL_GPL(blk_mq_end_request_batch);
+
 static void __blk_mq_complete_request_remote(void *data)
 {
 	struct request *rq = data;
@@ -1760,6 +1878,20 @@ void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule)
 	}
 }
 
+/*
+ * Give back the requests that blk_mq_make_request() allocated for the plug
+ * but that no bio ended up using.
+ */
+void blk_mq_free_plug_rqs(struct blk_plug *plug)
+{
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, &plug->cached_rqs, queuelist) {
+		list_del_init(&rq->queuelist);
+		blk_mq_free_request(rq);
+	}
+}
+
 static void blk_mq_bio_to_request(struct request *rq, struct bio *bio,
 		unsigned int nr_segs)
 {
@@ -1930,6 +2062,37 @@ static void blk_add_rq_to_plug(struct blk_plug *plug, struct request *rq)
 	}
 }
 
+/*
+ * Use a request left over from the batch allocated for the plug, if it
+ * fits this bio. If it doesn't, the plug is probably switching devices or
+ * queue types, so don't sit on tags that others may need.
+ */
+static struct request *blk_mq_get_cached_request(struct request_queue *q,
+						 struct blk_plug *plug,
+						 struct bio *bio,
+						 struct blk_mq_alloc_data *data)
+{
+	struct request *rq;
+
+	if (list_empty(&plug->cached_rqs))
+		return NULL;
+
+	rq = list_first_entry(&plug->cached_rqs, struct request, queuelist);
+	if (rq->q != q ||
+	    blk_mq_map_queue(q, bio->bi_opf, rq->mq_ctx) != rq->mq_hctx) {
+		blk_mq_free_plug_rqs(plug);
+		return NULL;
+	}
+
+	list_del_init(&rq->queuelist);
+	rq->cmd_flags = bio->bi_opf;
+	if (blk_mq_need_time_stamp(rq))
+		rq->start_time_ns = ktime_get_ns();
+	data->ctx = rq->mq_ctx;
+	data->hctx = rq->mq_hctx;
+	return rq;
+}
+
 static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 {
 	const int is_sync = op_is_sync(bio->bi_opf);
@@ -1956,13 +2119,25 @@ static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 
 	rq_qos_throttle(q, bio);
 
+	plug = current->plug;
 	data.cmd_flags = bio->bi_opf;
-	rq = blk_mq_get_request(q, bio, &data);
-	if (unlikely(!rq)) {
-		rq_qos_cleanup(q, bio);
-		if (bio->bi_opf & REQ_NOWAIT)
-			bio_wouldblock_error(bio);
-		return BLK_QC_T_NONE;
+	rq = NULL;
+	if (plug && !is_flush_fua) {
+		rq = blk_mq_get_cached_request(q, plug, bio, &data);
+		if (!rq && plug->nr_ios > 1) {
+			data.nr_tags = plug->nr_ios;
+			data.cached_rqs = &plug->cached_rqs;
+			plug->nr_ios = 1;
+		}
+	}
+	if (!rq) {
+		rq = blk_mq_get_request(q, bio, &data);
+		if (unlikely(!rq)) {
+			rq_qos_cleanup(q, bio);
+			if (bio->bi_opf & REQ_NOWAIT)
+				bio_wouldblock_error(bio);
+			return BLK_QC_T_NONE;
+		}
 	}
 
 	trace_block_getrq(q, bio, bio->bi_opf);
@@ -1973,7 +2148,6 @@ static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 
 	blk_mq_bio_to_request(rq, bio, nr_segs);
 
-	plug = current->plug;
 	if (unlikely(is_flush_fua)) {
 		/* bypass scheduler for flush rq */
 		blk_insert_flush(rq);
@@ -456,6 +456,11 @@ static void lo_complete_rq(struct request *rq)
 	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
 	blk_status_t ret = BLK_STS_OK;
 
+	if (cmd->css) {
+		css_put(cmd->css);
+		cmd->css = NULL;
+	}
+
 	if (!cmd->use_aio || cmd->ret < 0 || cmd->ret == blk_rq_bytes(rq) ||
 	    req_op(rq) != REQ_OP_READ) {
 		if (cmd->ret < 0)
@@ -501,8 +506,6 @@ static void lo_rw_aio_complete(struct kiocb *iocb, long ret, long ret2)
 {
 	struct loop_cmd *cmd = container_of(iocb, struct loop_cmd, iocb);
 
-	if (cmd->css)
-		css_put(cmd->css);
 	cmd->ret = ret;
 	lo_rw_aio_do_completion(cmd);
 }
@@ -563,8 +566,6 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 	cmd->iocb.ki_complete = lo_rw_aio_complete;
 	cmd->iocb.ki_flags = IOCB_DIRECT;
 	cmd->iocb.ki_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
-	if (cmd->css)
-		kthread_associate_blkcg(cmd->css);
 
 	if (rw == WRITE)
 		ret = call_write_iter(file, &cmd->iocb, &iter);
@@ -572,7 +573,6 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 		ret = call_read_iter(file, &cmd->iocb, &iter);
 
 	lo_rw_aio_do_completion(cmd);
-	kthread_associate_blkcg(NULL);
 
 	if (ret != -EIOCBQUEUED)
 		cmd->iocb.ki_complete(&cmd->iocb, ret, 0);
@@ -877,26 +877,81 @@ static void loop_config_discard(struct loop_device *lo)
 	blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
 }
 
-static void loop_unprepare_queue(struct loop_device *lo)
+/*
+ * Requests are handled by one worker per hardware queue and blkcg, so the
+ * queues of a device make progress in parallel and the I/O a request causes
+ * on the backing file is charged to the cgroup that issued it. Workers are
+ * created on demand and freed once they have been idle for
+ * LOOP_IDLE_WORKER_TIMEOUT.
+ */
+#define LOOP_IDLE_WORKER_TIMEOUT (60 * HZ)
+
+struct loop_worker {
+	struct rb_node rb_node;
+	struct work_struct work;
+	struct list_head cmd_list;
+	struct list_head idle_list;
+	struct loop_device *lo;
+	struct cgroup_subsys_state *css;
+	unsigned int hctx_idx;
+	unsigned long last_ran_at;
+};
+
+static void loop_free_worker(struct loop_device *lo,
+			     struct loop_worker *worker)
 {
-	kthread_flush_worker(&lo->worker);
-	kthread_stop(lo->worker_task);
+	list_del(&worker->idle_list);
+	rb_erase(&worker->rb_node, &lo->worker_tree);
+	if (worker->css)
+		css_put(worker->css);
+	kfree(worker);
 }
 
-static int loop_kthread_worker_fn(void *worker_ptr)
+static void loop_set_timer(struct loop_device *lo)
 {
-	current->flags |= PF_LESS_THROTTLE;
-	return kthread_worker_fn(worker_ptr);
+	timer_reduce(&lo->timer, jiffies + LOOP_IDLE_WORKER_TIMEOUT);
+}
+
+static void loop_free_idle_workers(struct timer_list *timer)
+{
+	struct loop_device *lo = container_of(timer, struct loop_device, timer);
+	struct loop_worker *pos, *worker;
+
+	spin_lock_irq(&lo->lo_work_lock);
+	list_for_each_entry_safe(worker, pos, &lo->idle_worker_list,
+				 idle_list) {
+		if (time_is_after_jiffies(worker->last_ran_at +
+					  LOOP_IDLE_WORKER_TIMEOUT))
+			break;
+		loop_free_worker(lo, worker);
+	}
+	if (!list_empty(&lo->idle_worker_list))
+		loop_set_timer(lo);
+	spin_unlock_irq(&lo->lo_work_lock);
+}
+
+static void loop_unprepare_queue(struct loop_device *lo)
+{
+	struct loop_worker *pos, *worker;
+
+	destroy_workqueue(lo->workqueue);
+
+	/* with the workqueue drained, every worker is on the idle list */
+	spin_lock_irq(&lo->lo_work_lock);
+	list_for_each_entry_safe(worker, pos, &lo->idle_worker_list,
+				 idle_list)
+		loop_free_worker(lo, worker);
+	spin_unlock_irq(&lo->lo_work_lock);
+	del_timer_sync(&lo->timer);
 }
 
 static int loop_prepare_queue(struct loop_device *lo)
 {
-	kthread_init_worker(&lo->worker);
-	lo->worker_task = kthread_run(loop_kthread_worker_fn,
-			&lo->worker, "loop%d", lo->lo_number);
-	if (IS_ERR(lo->worker_task))
+	lo->workqueue = alloc_workqueue("loop%d",
+					WQ_UNBOUND | WQ_FREEZABLE | WQ_HIGHPRI,
+					0, lo->lo_number);
+	if (!lo->workqueue)
 		return -ENOMEM;
-	set_user_nice(lo->worker_task, MIN_NICE);
 	return 0;
 }
 
@@ -1832,6 +1887,9 @@ static const struct block_device_operations lo_fops = {
 static int max_loop;
 module_param(max_loop, int, 0444);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
+static int nr_hw_queues;
+module_param(nr_hw_queues, int, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Hardware queues per device (0: online CPUs)");
 module_param(max_part, int, 0444);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
 MODULE_LICENSE("GPL");
@@ -1875,6 +1933,149 @@ int loop_unregister_transfer(int number)
 EXPORT_SYMBOL(loop_register_transfer);
 EXPORT_SYMBOL(loop_unregister_transfer);
 
+static void loop_handle_cmd(struct loop_cmd *cmd)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	const bool write = op_is_write(req_op(rq));
+	struct loop_device *lo = rq->q->queuedata;
+	struct cgroup_subsys_state *css = cmd->css;
+	int ret = 0;
+
+	if (write && (lo->lo_flags & LO_FLAGS_READ_ONLY)) {
+		ret = -EIO;
+		goto failed;
+	}
+
+	/* an aio request may complete and drop cmd->css before we get back */
+	if (css)
+		kthread_associate_blkcg(css);
+	ret = do_req_filebacked(lo, rq);
+	if (css)
+		kthread_associate_blkcg(NULL);
+ failed:
+	/* complete non-aio request */
+	if (!cmd->use_aio || ret) {
+		cmd->ret = ret ? -EIO : 0;
+		blk_mq_complete_request(rq);
+	}
+}
+
+static void loop_process_work(struct loop_worker *worker,
+			      struct list_head *cmd_list,
+			      struct loop_device *lo)
+{
+	unsigned int orig_flags = current->flags;
+	struct loop_cmd *cmd;
+
+	current->flags |= PF_LESS_THROTTLE | PF_MEMALLOC_NOIO;
+	spin_lock_irq(&lo->lo_work_lock);
+	while (!list_empty(cmd_list)) {
+		cmd = list_first_entry(cmd_list, struct loop_cmd, list_entry);
+		list_del(&cmd->list_entry);
+		spin_unlock_irq(&lo->lo_work_lock);
+
+		loop_handle_cmd(cmd);
+		cond_resched();
+
+		spin_lock_irq(&lo->lo_work_lock);
+	}
+
+	/*
+	 * Only a worker that has nothing left to do and won't run again goes
+	 * on the idle list, so anything on it is safe to free.
+	 */
+	if (worker && !work_pending(&worker->work)) {
+		worker->last_ran_at = jiffies;
+		list_add_tail(&worker->idle_list, &lo->idle_worker_list);
+		loop_set_timer(lo);
+	}
+	spin_unlock_irq(&lo->lo_work_lock);
+	current->flags = orig_flags;
+}
+
+static void loop_workfn(struct work_struct *work)
+{
+	struct loop_worker *worker =
+		container_of(work, struct loop_worker, work);
+
+	loop_process_work(worker, &worker->cmd_list, worker->lo);
+}
+
+static void loop_rootcg_workfn(struct work_struct *work)
+{
+	struct loop_device *lo =
+		container_of(work, struct loop_device, rootcg_work);
+
+	loop_process_work(NULL, &lo->rootcg_cmd_list, lo);
+}
+
+static int loop_worker_cmp(struct loop_worker *worker,
+			   struct cgroup_subsys_state *css,
+			   unsigned int hctx_idx)
+{
+	if (css != worker->css)
+		return css < worker->css ? -1 : 1;
+	if (hctx_idx != worker->hctx_idx)
+		return hctx_idx < worker->hctx_idx ? -1 : 1;
+	return 0;
+}
+
+static void loop_queue_work(struct loop_device *lo, struct loop_cmd *cmd,
+			    unsigned int hctx_idx)
+{
+	struct rb_node **node = &lo->worker_tree.rb_node, *parent = NULL;
+	struct loop_worker *cur_worker, *worker = NULL;
+	struct work_struct *work;
+	struct list_head *cmd_list;
+	int cmp;
+
+	spin_lock_irq(&lo->lo_work_lock);
+
+	while (*node) {
+		parent = *node;
+		cur_worker = container_of(*node, struct loop_worker, rb_node);
+		cmp = loop_worker_cmp(cur_worker, cmd->css, hctx_idx);
+		if (!cmp) {
+			worker = cur_worker;
+			break;
+		}
+		node = cmp < 0 ? &(*node)->rb_left : &(*node)->rb_right;
+	}
+
+	if (!worker) {
+		worker = kzalloc(sizeof(*worker), GFP_NOWAIT | __GFP_NOWARN);
+		/*
+		 * If we can't allocate a worker, the request goes to the
+		 * fallback worker of the device. It is still charged to its
+		 * blkcg, it just doesn't run in parallel with the others.
+		 */
+		if (!worker) {
+			work = &lo->rootcg_work;
+			cmd_list = &lo->rootcg_cmd_list;
+			goto queue;
+		}
+		worker->css = cmd->css;
+		if (worker->css)
+			css_get(worker->css);
+		worker->hctx_idx = hctx_idx;
+		worker->lo = lo;
+		INIT_WORK(&worker->work, loop_workfn);
+		INIT_LIST_HEAD(&worker->cmd_list);
+		INIT_LIST_HEAD(&worker->idle_list);
+		rb_link_node(&worker->rb_node, parent, node);
+		rb_insert_color(&worker->rb_node, &lo->worker_tree);
+	}
+
+	/* keep the idle timer from freeing the worker under us */
+	list_del_init(&worker->idle_list);
+	work = &worker->work;
+	cmd_list = &worker->cmd_list;
+queue:
+	list_add_tail(&cmd->list_entry, cmd_list);
+	queue_work(lo->workqueue, work);
+	spin_unlock_irq(&lo->lo_work_lock);
+}
+
 static blk_status_t loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 		const struct blk_mq_queue_data *bd)
 {
@@ -1898,60 +2099,29 @@ static blk_status_t loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 		break;
 	}
 
-	/* always use the first bio's css */
+	/* always use the first bio's css, the root one needs no pinning */
+	cmd->css = NULL;
 #ifdef CONFIG_BLK_CGROUP
-	if (cmd->use_aio && rq->bio && rq->bio->bi_blkg) {
+	if (rq->bio && rq->bio->bi_blkg &&
+	    &bio_blkcg(rq->bio)->css != blkcg_root_css) {
 		cmd->css = &bio_blkcg(rq->bio)->css;
 		css_get(cmd->css);
-	} else
-#endif
-		cmd->css = NULL;
-	kthread_queue_work(&lo->worker, &cmd->work);
-
-	return BLK_STS_OK;
-}
-
-static void loop_handle_cmd(struct loop_cmd *cmd)
-{
-	struct request *rq = blk_mq_rq_from_pdu(cmd);
-	const bool write = op_is_write(req_op(rq));
-	struct loop_device *lo = rq->q->queuedata;
-	int ret = 0;
-
-	if (write && (lo->lo_flags & LO_FLAGS_READ_ONLY)) {
-		ret = -EIO;
-		goto failed;
-	}
-
-	ret = do_req_filebacked(lo, rq);
- failed:
-	/* complete non-aio request */
-	if (!cmd->use_aio || ret) {
-		cmd->ret = ret ? -EIO : 0;
-		blk_mq_complete_request(rq);
 	}
-}
-
-static void loop_queue_work(struct kthread_work *work)
-{
-	struct loop_cmd *cmd =
-		container_of(work, struct loop_cmd, work);
-
-	loop_handle_cmd(cmd);
-}
+#endif
 
-static int loop_init_request(struct blk_mq_tag_set *set, struct request *rq,
-		unsigned int hctx_idx, unsigned int numa_node)
-{
-	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	/*
+	 * Requests handled by different workers aren't ordered against each
+	 * other. Nothing needs them to be: the flush machinery only issues a
+	 * flush once the writes it covers have completed, and FUA writes are
+	 * followed by a flush of their own as loop doesn't advertise FUA.
+	 */
+	loop_queue_work(lo, cmd, hctx->queue_num);
 
-	kthread_init_work(&cmd->work, loop_queue_work);
-	return 0;
+	return BLK_STS_OK;
 }
 
 static const struct blk_mq_ops loop_mq_ops = {
 	.queue_rq       = loop_queue_rq,
-	.init_request	= loop_init_request,
 	.complete	= lo_complete_rq,
 };
 
@@ -1982,7 +2152,7 @@ static int loop_add(struct loop_device **l, int i)
 
 	err = -ENOMEM;
 	lo->tag_set.ops = &loop_mq_ops;
-	lo->tag_set.nr_hw_queues = 1;
+	lo->tag_set.nr_hw_queues = nr_hw_queues;
 	lo->tag_set.queue_depth = 128;
 	lo->tag_set.numa_node = NUMA_NO_NODE;
 	lo->tag_set.cmd_size = sizeof(struct loop_cmd);
@@ -2039,6 +2209,12 @@ static int loop_add(struct loop_device **l, int i)
 	atomic_set(&lo->lo_refcnt, 0);
 	lo->lo_number		= i;
 	spin_lock_init(&lo->lo_lock);
+	spin_lock_init(&lo->lo_work_lock);
+	INIT_WORK(&lo->rootcg_work, loop_rootcg_workfn);
+	INIT_LIST_HEAD(&lo->rootcg_cmd_list);
+	INIT_LIST_HEAD(&lo->idle_worker_list);
+	lo->worker_tree = RB_ROOT;
+	timer_setup(&lo->timer, loop_free_idle_workers, TIMER_DEFERRABLE);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
 	disk->fops		= &lo_fops;
@@ -2224,6 +2400,9 @@ static int __init loop_init(void)
 		goto err_out;
 	}
 
+	if (nr_hw_queues <= 0)
+		nr_hw_queues = num_online_cpus();
+
 	/*
 	 * If max_loop is specified, create that many devices upfront.
 	 * This also becomes a hard limit. If max_loop is not specified,
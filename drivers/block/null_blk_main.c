@@ -91,6 +91,10 @@ static int g_submit_queues = 1;
 module_param_named(submit_queues, g_submit_queues, int, 0444);
 MODULE_PARM_DESC(submit_queues, "Number of submission queues");
 
+static int g_poll_queues;
+module_param_named(poll_queues, g_poll_queues, int, 0444);
+MODULE_PARM_DESC(poll_queues, "Number of IOPOLL submission queues. Default: 0");
+
 static int g_home_node = NUMA_NO_NODE;
 module_param_named(home_node, g_home_node, int, 0444);
 MODULE_PARM_DESC(home_node, "Home node for the device");
@@ -284,6 +288,7 @@ CONFIGFS_ATTR(nullb_device_, NAME);
 NULLB_DEVICE_ATTR(size, ulong);
 NULLB_DEVICE_ATTR(completion_nsec, ulong);
 NULLB_DEVICE_ATTR(submit_queues, uint);
+NULLB_DEVICE_ATTR(poll_queues, uint);
 NULLB_DEVICE_ATTR(home_node, uint);
 NULLB_DEVICE_ATTR(queue_mode, uint);
 NULLB_DEVICE_ATTR(blocksize, uint);
@@ -398,6 +403,7 @@ static struct configfs_attribute *nullb_device_attrs[] = {
 	&nullb_device_attr_size,
 	&nullb_device_attr_completion_nsec,
 	&nullb_device_attr_submit_queues,
+	&nullb_device_attr_poll_queues,
 	&nullb_device_attr_home_node,
 	&nullb_device_attr_queue_mode,
 	&nullb_device_attr_blocksize,
@@ -467,7 +473,7 @@ nullb_group_drop_item(struct config_group *group, struct config_item *item)
 
 static ssize_t memb_group_features_show(struct config_item *item, char *page)
 {
-	return snprintf(page, PAGE_SIZE, "memory_backed,discard,bandwidth,cache,badblocks,zoned,zone_size\n");
+	return snprintf(page, PAGE_SIZE, "memory_backed,discard,bandwidth,cache,badblocks,zoned,zone_size,poll_queues\n");
 }
 
 CONFIGFS_ATTR_RO(memb_group_, features);
@@ -519,6 +525,7 @@ static struct nullb_device *null_alloc_dev(void)
 	dev->size = g_gb * 1024;
 	dev->completion_nsec = g_completion_nsec;
 	dev->submit_queues = g_submit_queues;
+	dev->poll_queues = g_poll_queues;
 	dev->home_node = g_home_node;
 	dev->queue_mode = g_queue_mode;
 	dev->blocksize = g_bs;
@@ -1216,6 +1223,15 @@ static blk_status_t null_handle_cmd(struct nullb_cmd *cmd)
 			null_zone_reset(cmd, sector);
 	}
 out:
+	/* Requests on poll queues are completed by null_poll() */
+	if (dev->queue_mode == NULL_Q_MQ &&
+	    cmd->rq->mq_hctx->type == HCTX_TYPE_POLL) {
+		spin_lock(&cmd->nq->poll_lock);
+		list_add_tail(&cmd->rq->queuelist, &cmd->nq->poll_list);
+		spin_unlock(&cmd->nq->poll_lock);
+		return BLK_STS_OK;
+	}
+
 	/* Complete IO by inline, softirq or timer */
 	switch (dev->irqmode) {
 	case NULL_IRQ_SOFTIRQ:
@@ -1311,6 +1327,10 @@ static bool should_requeue_request(struct request *rq)
 
 static enum blk_eh_timer_return null_timeout_rq(struct request *rq, bool res)
 {
+	/* polled requests are completed by null_poll(), and nothing else */
+	if (rq->mq_hctx->type == HCTX_TYPE_POLL)
+		return BLK_EH_RESET_TIMER;
+
 	pr_info("null: rq %p timed out\n", rq);
 	blk_mq_complete_request(rq);
 	return BLK_EH_DONE;
@@ -1346,16 +1366,76 @@ static blk_status_t null_queue_rq(struct blk_mq_hw_ctx *hctx,
 			return BLK_STS_OK;
 		}
 	}
-	if (should_timeout_request(bd->rq))
+	if (hctx->type != HCTX_TYPE_POLL && should_timeout_request(bd->rq))
 		return BLK_STS_OK;
 
 	return null_handle_cmd(cmd);
 }
 
+static int null_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct nullb_queue *nq = hctx->driver_data;
+	struct request *rq, *next;
+	LIST_HEAD(list);
+	LIST_HEAD(done);
+	int nr = 0;
+
+	spin_lock(&nq->poll_lock);
+	list_splice_init(&nq->poll_list, &list);
+	spin_unlock(&nq->poll_lock);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		struct nullb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		list_del_init(&rq->queuelist);
+		if (cmd->error)
+			end_cmd(cmd);
+		else
+			list_add_tail(&rq->queuelist, &done);
+		nr++;
+	}
+
+	/* free the whole batch with one tag bitmap update */
+	blk_mq_end_request_batch(&done);
+	return nr;
+}
+
+static int null_map_queues(struct blk_mq_tag_set *set)
+{
+	struct nullb *nullb = set->driver_data;
+	unsigned int poll_queues = nullb ? nullb->dev->poll_queues :
+					   g_poll_queues;
+	int i, qoff;
+
+	for (i = 0, qoff = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = set->nr_hw_queues - poll_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+
+	return 0;
+}
+
 static const struct blk_mq_ops null_mq_ops = {
 	.queue_rq       = null_queue_rq,
 	.complete	= null_complete_rq,
 	.timeout	= null_timeout_rq,
+	.poll		= null_poll,
+	.map_queues	= null_map_queues,
 };
 
 static void cleanup_queue(struct nullb_queue *nq)
@@ -1436,6 +1516,8 @@ static void null_init_queue(struct nullb *nullb, struct nullb_queue *nq)
 	init_waitqueue_head(&nq->wait);
 	nq->queue_depth = nullb->queue_depth;
 	nq->dev = nullb->dev;
+	spin_lock_init(&nq->poll_lock);
+	INIT_LIST_HEAD(&nq->poll_list);
 }
 
 static void null_init_queues(struct nullb *nullb)
@@ -1483,7 +1565,8 @@ static int setup_commands(struct nullb_queue *nq)
 
 static int setup_queues(struct nullb *nullb)
 {
-	nullb->queues = kcalloc(nullb->dev->submit_queues,
+	nullb->queues = kcalloc(nullb->dev->submit_queues +
+				nullb->dev->poll_queues,
 				sizeof(struct nullb_queue),
 				GFP_KERNEL);
 	if (!nullb->queues)
@@ -1544,9 +1627,15 @@ static int null_gendisk_register(struct nullb *nullb)
 
 static int null_init_tag_set(struct nullb *nullb, struct blk_mq_tag_set *set)
 {
+	unsigned int poll_queues = nullb ? nullb->dev->poll_queues :
+					   g_poll_queues;
+
 	set->ops = &null_mq_ops;
 	set->nr_hw_queues = nullb ? nullb->dev->submit_queues :
 						g_submit_queues;
+	set->nr_hw_queues += poll_queues;
+	if (poll_queues)
+		set->nr_maps = HCTX_MAX_TYPES;
 	set->queue_depth = nullb ? nullb->dev->hw_queue_depth :
 						g_hw_queue_depth;
 	set->numa_node = nullb ? nullb->dev->home_node : g_home_node;
@@ -1554,7 +1643,7 @@ static int null_init_tag_set(struct nullb *nullb, struct blk_mq_tag_set *set)
 	set->flags = BLK_MQ_F_SHOULD_MERGE;
 	if (g_no_sched)
 		set->flags |= BLK_MQ_F_NO_SCHED;
-	set->driver_data = NULL;
+	set->driver_data = nullb;
 
 	if ((nullb && nullb->dev->blocking) || g_blocking)
 		set->flags |= BLK_MQ_F_BLOCKING;
@@ -1578,6 +1667,12 @@ static void null_validate_conf(struct nullb_device *dev)
 	dev->queue_mode = min_t(unsigned int, dev->queue_mode, NULL_Q_MQ);
 	dev->irqmode = min_t(unsigned int, dev->irqmode, NULL_IRQ_TIMER);
 
+	/* only blk-mq can poll */
+	if (dev->queue_mode != NULL_Q_MQ)
+		dev->poll_queues = 0;
+	else if (dev->poll_queues > nr_cpu_ids)
+		dev->poll_queues = nr_cpu_ids;
+
 	/* Do memory allocation, so set blocking */
 	if (dev->memory_backed)
 		dev->blocking = true;
@@ -1769,6 +1864,11 @@ static int __init null_init(void)
 	else if (g_submit_queues <= 0)
 		g_submit_queues = 1;
 
+	if (g_queue_mode != NULL_Q_MQ || g_poll_queues < 0)
+		g_poll_queues = 0;
+	else if (g_poll_queues > nr_cpu_ids)
+		g_poll_queues = nr_cpu_ids;
+
 	if (g_queue_mode == NULL_Q_MQ && shared_tags) {
 		ret = null_init_tag_set(NULL, &tag_set);
 		if (ret)
@@ -0,0 +1,889 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Userspace block device - blk-mq driver whose requests are served by a
+ * user-space process.
+ *
+ * Every hardware queue has a descriptor array and a ring of tags, both
+ * mapped into the server through a file of the /dev/ublkcN character device
+ * that has been bound to the queue. ->queue_rq() fills in the descriptor of
+ * the request's tag, publishes the tag on the ring and wakes up pollers. The
+ * server copies data between the request's bio pages and its own buffers
+ * with pread/pwrite on the queue file, and completes requests by writing
+ * completion entries to it. See include/uapi/linux/ublk.h for the layout.
+ *
+ * Copies and completions hold a reference on the request, the one handed to
+ * the server is dropped on completion, so a request only ends once copies
+ * racing with its completion are done with its pages.
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/miscdevice.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include <uapi/linux/ublk.h>
+
+#define UBLK_MINORS		(1U << MINORBITS)
+
+enum {
+	UBLK_IO_INFLIGHT,	/* handed to the server, not completed yet */
+};
+
+struct ublk_io {
+	unsigned long		flags;
+	refcount_t		ref;
+	int			res;
+};
+
+struct ublk_queue {
+	struct ublk_device	*ub;
+	unsigned int		q_id;
+	unsigned int		q_depth;
+
+	/* protects the ring tail, server and dead */
+	spinlock_t		lock;
+	struct file		*server;
+	bool			dead;
+	wait_queue_head_t	wait;
+
+	void			*area;
+	size_t			area_size;
+	struct ublk_io_desc	*descs;
+	struct ublk_queue_ring	*ring;
+	/*
+	 * The ring is mapped writable by the server, the kernel only ever
+	 * indexes it with its own copies of the tail and mask.
+	 */
+	unsigned int		ring_tail;
+	unsigned int		ring_mask;
+
+	struct ublk_io		ios[];
+};
+
+struct ublk_device {
+	struct device		cdev_dev;
+	struct cdev		cdev;
+	struct ublk_dev_info	info;
+
+	/* protects started and removed */
+	struct mutex		mutex;
+	bool			started;
+	bool			removed;
+
+	struct gendisk		*disk;
+	struct blk_mq_tag_set	tag_set;
+	struct ublk_queue	**queues;
+};
+
+static DEFINE_IDR(ublk_index_idr);
+static DEFINE_MUTEX(ublk_index_mutex);
+
+static dev_t ublk_chr_devt;
+static struct class *ublk_chr_class;
+static int ublk_major;
+
+static struct ublk_device *ublk_ch_dev(struct file *file)
+{
+	return container_of(file_inode(file)->i_cdev, struct ublk_device, cdev);
+}
+
+static inline struct request *ublk_tag_to_rq(struct ublk_queue *ubq,
+					     unsigned int tag)
+{
+	return blk_mq_tag_to_rq(ubq->ub->tag_set.tags[ubq->q_id], tag);
+}
+
+static void ublk_wake(struct ublk_queue *ubq)
+{
+	if (wq_has_sleeper(&ubq->wait))
+		wake_up(&ubq->wait);
+}
+
+/*
+ * Take a reference on an in-flight request, so its pages stay around while
+ * data is copied. Fails once the request has been completed.
+ */
+static bool ublk_get_io(struct ublk_queue *ubq, unsigned int tag)
+{
+	struct ublk_io *io = &ubq->ios[tag];
+
+	if (!refcount_inc_not_zero(&io->ref))
+		return false;
+	if (!test_bit(UBLK_IO_INFLIGHT, &io->flags)) {
+		if (refcount_dec_and_test(&io->ref))
+			blk_mq_end_request(ublk_tag_to_rq(ubq, tag),
+					   errno_to_blk_status(io->res));
+		return false;
+	}
+	return true;
+}
+
+static void ublk_put_io(struct ublk_queue *ubq, unsigned int tag)
+{
+	struct ublk_io *io = &ubq->ios[tag];
+
+	if (refcount_dec_and_test(&io->ref))
+		blk_mq_end_request(ublk_tag_to_rq(ubq, tag),
+				   errno_to_blk_status(io->res));
+}
+
+/*
+ * Drop the reference the server got with the request. Only one of the
+ * server's completion and an abort gets to do that.
+ */
+static bool ublk_end_io(struct ublk_queue *ubq, unsigned int tag, int res)
+{
+	struct ublk_io *io = &ubq->ios[tag];
+
+	if (!test_and_clear_bit(UBLK_IO_INFLIGHT, &io->flags))
+		return false;
+	io->res = res < 0 ? res : 0;
+	ublk_put_io(ubq, tag);
+	return true;
+}
+
+static void ublk_abort_queue(struct ublk_queue *ubq)
+{
+	unsigned int tag;
+
+	for (tag = 0; tag < ubq->q_depth; tag++)
+		ublk_end_io(ubq, tag, -EIO);
+}
+
+static blk_status_t ublk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				  const struct blk_mq_queue_data *bd)
+{
+	struct ublk_queue *ubq = hctx->driver_data;
+	struct ublk_queue_ring *ring = ubq->ring;
+	struct request *rq = bd->rq;
+	struct ublk_io_desc *desc = &ubq->descs[rq->tag];
+	struct ublk_io *io = &ubq->ios[rq->tag];
+	unsigned long flags;
+	u8 op;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		op = UBLK_IO_OP_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = UBLK_IO_OP_WRITE;
+		break;
+	case REQ_OP_FLUSH:
+		op = UBLK_IO_OP_FLUSH;
+		break;
+	case REQ_OP_DISCARD:
+		op = UBLK_IO_OP_DISCARD;
+		break;
+	case REQ_OP_WRITE_ZEROES:
+		op = UBLK_IO_OP_WRITE_ZEROES;
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	blk_mq_start_request(rq);
+
+	spin_lock_irqsave(&ubq->lock, flags);
+	if (unlikely(!ubq->server || ubq->dead)) {
+		spin_unlock_irqrestore(&ubq->lock, flags);
+		return BLK_STS_IOERR;
+	}
+
+	desc->op = op;
+	desc->flags = (rq->cmd_flags & REQ_FUA) ? UBLK_IO_F_FUA : 0;
+	desc->nr_sectors = blk_rq_sectors(rq);
+	desc->start_sector = blk_rq_pos(rq);
+
+	io->res = 0;
+	refcount_set(&io->ref, 1);
+	set_bit(UBLK_IO_INFLIGHT, &io->flags);
+
+	ring->tags[ubq->ring_tail & ubq->ring_mask] = rq->tag;
+	WRITE_ONCE(ubq->ring_tail, ubq->ring_tail + 1);
+	/* descriptor and tag must be visible before the new tail */
+	smp_store_release(&ring->tail, ubq->ring_tail);
+	spin_unlock_irqrestore(&ubq->lock, flags);
+
+	if (bd->last)
+		ublk_wake(ubq);
+	return BLK_STS_OK;
+}
+
+static void ublk_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	ublk_wake(hctx->driver_data);
+}
+
+static enum blk_eh_timer_return ublk_timeout(struct request *rq, bool reserved)
+{
+	/* the server owns the request until it completes it, or goes away */
+	return BLK_EH_RESET_TIMER;
+}
+
+static int ublk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int hctx_idx)
+{
+	struct ublk_device *ub = data;
+
+	hctx->driver_data = ub->queues[hctx_idx];
+	return 0;
+}
+
+static int ublk_map_queues(struct blk_mq_tag_set *set)
+{
+	return blk_mq_map_queues(&set->map[HCTX_TYPE_DEFAULT]);
+}
+
+static const struct blk_mq_ops ublk_mq_ops = {
+	.queue_rq	= ublk_queue_rq,
+	.commit_rqs	= ublk_commit_rqs,
+	.timeout	= ublk_timeout,
+	.init_hctx	= ublk_init_hctx,
+	.map_queues	= ublk_map_queues,
+};
+
+static const struct block_device_operations ublk_fops = {
+	.owner		= THIS_MODULE,
+};
+
+/*
+ * Copy data between a request's pages and the server. @pos is
+ * UBLK_IO_BUF_OFFSET(tag) plus the offset into the request's data.
+ */
+static ssize_t ublk_copy_io(struct ublk_queue *ubq, loff_t pos,
+			    struct iov_iter *iter, int dir)
+{
+	unsigned int tag = pos >> UBLK_IO_BUF_BITS;
+	size_t off = pos & (UBLK_MAX_IO_BYTES - 1);
+	struct req_iterator riter;
+	struct request *rq;
+	struct bio_vec bv;
+	ssize_t done = 0;
+
+	if (pos < 0 || pos >= UBLK_CMPL_OFFSET || tag >= ubq->q_depth)
+		return -EINVAL;
+	if (!ublk_get_io(ubq, tag))
+		return -EINVAL;
+
+	rq = ublk_tag_to_rq(ubq, tag);
+	if (req_op(rq) != (dir == READ ? REQ_OP_WRITE : REQ_OP_READ)) {
+		done = -EINVAL;
+		goto out;
+	}
+	if (off >= blk_rq_bytes(rq))
+		goto out;
+
+	rq_for_each_segment(bv, rq, riter) {
+		size_t len, copied;
+
+		if (off >= bv.bv_len) {
+			off -= bv.bv_len;
+			continue;
+		}
+		len = bv.bv_len - off;
+		if (dir == READ)
+			copied = copy_page_to_iter(bv.bv_page,
+						   bv.bv_offset + off, len,
+						   iter);
+		else
+			copied = copy_page_from_iter(bv.bv_page,
+						     bv.bv_offset + off, len,
+						     iter);
+		done += copied;
+		if (copied != len || !iov_iter_count(iter))
+			break;
+		off = 0;
+	}
+	if (!done && iov_iter_count(iter))
+		done = -EFAULT;
+out:
+	ublk_put_io(ubq, tag);
+	return done;
+}
+
+static ssize_t ublk_commit_cmpls(struct ublk_queue *ubq,
+				 struct iov_iter *from)
+{
+	struct ublk_io_cmpl cmpls[16];
+	ssize_t done = 0;
+
+	if (iov_iter_count(from) % sizeof(cmpls[0]))
+		return -EINVAL;
+
+	while (iov_iter_count(from)) {
+		size_t len = min(iov_iter_count(from), sizeof(cmpls));
+		unsigned int i;
+
+		if (copy_from_iter(cmpls, len, from) != len)
+			return done ? done : -EFAULT;
+
+		for (i = 0; i < len / sizeof(cmpls[0]); i++) {
+			if (cmpls[i].tag >= ubq->q_depth ||
+			    !ublk_end_io(ubq, cmpls[i].tag, cmpls[i].result))
+				return done ? done : -EINVAL;
+			done += sizeof(cmpls[0]);
+		}
+	}
+	return done;
+}
+
+static ssize_t ublk_ch_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct ublk_queue *ubq = iocb->ki_filp->private_data;
+
+	if (!ubq)
+		return -EBADFD;
+	return ublk_copy_io(ubq, iocb->ki_pos, to, READ);
+}
+
+static ssize_t ublk_ch_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ublk_queue *ubq = iocb->ki_filp->private_data;
+
+	if (!ubq)
+		return -EBADFD;
+	if (iocb->ki_pos == UBLK_CMPL_OFFSET)
+		return ublk_commit_cmpls(ubq, from);
+	return ublk_copy_io(ubq, iocb->ki_pos, from, WRITE);
+}
+
+static __poll_t ublk_ch_poll(struct file *file, poll_table *wait)
+{
+	struct ublk_queue *ubq = file->private_data;
+	struct ublk_queue_ring *ring;
+	__poll_t mask = 0;
+
+	if (!ubq)
+		return EPOLLERR;
+
+	ring = ubq->ring;
+	poll_wait(file, &ubq->wait, wait);
+	if (READ_ONCE(ubq->dead))
+		mask |= EPOLLHUP;
+	if (READ_ONCE(ring->head) != READ_ONCE(ubq->ring_tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
+static int ublk_ch_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ublk_queue *ubq = file->private_data;
+
+	if (!ubq)
+		return -EBADFD;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ubq->area, 0);
+}
+
+static int ublk_bind_queue(struct ublk_device *ub, struct file *file,
+			   unsigned long q_id)
+{
+	struct ublk_queue *ubq;
+	int ret = 0;
+
+	if (q_id >= ub->info.nr_hw_queues)
+		return -EINVAL;
+
+	mutex_lock(&ub->mutex);
+	ubq = ub->queues[q_id];
+	if (ub->removed) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (file->private_data) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	spin_lock_irq(&ubq->lock);
+	if (ubq->server) {
+		ret = -EBUSY;
+	} else {
+		/* a previous server's requests have all been aborted */
+		ubq->ring_tail = 0;
+		ubq->ring->head = 0;
+		ubq->ring->tail = 0;
+		ubq->server = file;
+		file->private_data = ubq;
+	}
+	spin_unlock_irq(&ubq->lock);
+out:
+	mutex_unlock(&ub->mutex);
+	return ret;
+}
+
+static int ublk_get_queue_affinity(struct ublk_device *ub,
+				   struct ublk_queue_affinity __user *uarg)
+{
+	struct ublk_queue_affinity arg;
+	cpumask_var_t mask;
+	unsigned int cpu;
+	size_t len;
+	int ret = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.q_id >= ub->info.nr_hw_queues || arg.resv)
+		return -EINVAL;
+	if (arg.len * BITS_PER_BYTE < nr_cpu_ids)
+		return -EINVAL;
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	mutex_lock(&ub->mutex);
+	if (ub->removed) {
+		ret = -ENODEV;
+		goto out;
+	}
+	for_each_possible_cpu(cpu) {
+		if (ub->tag_set.map[HCTX_TYPE_DEFAULT].mq_map[cpu] == arg.q_id)
+			cpumask_set_cpu(cpu, mask);
+	}
+	len = min_t(size_t, arg.len, cpumask_size());
+	if (copy_to_user(u64_to_user_ptr(arg.mask), cpumask_bits(mask), len))
+		ret = -EFAULT;
+out:
+	mutex_unlock(&ub->mutex);
+	free_cpumask_var(mask);
+	return ret;
+}
+
+static long ublk_ch_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct ublk_device *ub = ublk_ch_dev(file);
+
+	switch (cmd) {
+	case UBLK_BIND_QUEUE:
+		return ublk_bind_queue(ub, file, arg);
+	case UBLK_GET_QUEUE_AFFINITY:
+		return ublk_get_queue_affinity(ub, (void __user *)arg);
+	}
+	return -ENOTTY;
+}
+
+static int ublk_ch_release(struct inode *inode, struct file *file)
+{
+	struct ublk_queue *ubq = file->private_data;
+
+	if (!ubq)
+		return 0;
+
+	/* the server is gone, fail what it still owned and what comes next */
+	spin_lock_irq(&ubq->lock);
+	ubq->server = NULL;
+	spin_unlock_irq(&ubq->lock);
+	ublk_abort_queue(ubq);
+	return 0;
+}
+
+static const struct file_operations ublk_ch_fops = {
+	.owner		= THIS_MODULE,
+	.release	= ublk_ch_release,
+	.llseek		= no_llseek,
+	.read_iter	= ublk_ch_read_iter,
+	.write_iter	= ublk_ch_write_iter,
+	.poll		= ublk_ch_poll,
+	.mmap		= ublk_ch_mmap,
+	.unlocked_ioctl	= ublk_ch_ioctl,
+	.compat_ioctl	= ublk_ch_ioctl,
+};
+
+static struct ublk_queue *ublk_alloc_queue(struct ublk_device *ub,
+					   unsigned int q_id)
+{
+	unsigned int depth = ub->info.queue_depth;
+	unsigned int entries = roundup_pow_of_two(depth);
+	struct ublk_queue *ubq;
+
+	ubq = kzalloc(struct_size(ubq, ios, depth), GFP_KERNEL);
+	if (!ubq)
+		return NULL;
+
+	ubq->area_size = PAGE_ALIGN(UBLK_RING_OFFSET(depth) +
+				    struct_size(ubq->ring, tags, entries));
+	ubq->area = vmalloc_user(ubq->area_size);
+	if (!ubq->area) {
+		kfree(ubq);
+		return NULL;
+	}
+	ubq->descs = ubq->area;
+	ubq->ring = ubq->area + UBLK_RING_OFFSET(depth);
+	ubq->ring_mask = entries - 1;
+	/* only informs the server, never read back */
+	ubq->ring->mask = ubq->ring_mask;
+
+	ubq->ub = ub;
+	ubq->q_id = q_id;
+	ubq->q_depth = depth;
+	spin_lock_init(&ubq->lock);
+	init_waitqueue_head(&ubq->wait);
+	return ubq;
+}
+
+static void ublk_free_queues(struct ublk_device *ub)
+{
+	unsigned int i;
+
+	if (!ub->queues)
+		return;
+	for (i = 0; i < ub->info.nr_hw_queues; i++) {
+		if (!ub->queues[i])
+			continue;
+		vfree(ub->queues[i]->area);
+		kfree(ub->queues[i]);
+	}
+	kfree(ub->queues);
+}
+
+static void ublk_cdev_rel(struct device *dev)
+{
+	struct ublk_device *ub = container_of(dev, struct ublk_device,
+					      cdev_dev);
+
+	ublk_free_queues(ub);
+	kfree(ub);
+}
+
+static int ublk_validate_info(struct ublk_dev_info *info)
+{
+	if (!info->nr_hw_queues || info->nr_hw_queues > UBLK_MAX_NR_QUEUES)
+		return -EINVAL;
+	if (!info->queue_depth || info->queue_depth > UBLK_MAX_QUEUE_DEPTH)
+		return -EINVAL;
+	if (info->block_size < SECTOR_SIZE || info->block_size > PAGE_SIZE ||
+	    !is_power_of_2(info->block_size))
+		return -EINVAL;
+	if (info->max_io_bytes < info->block_size ||
+	    info->max_io_bytes > UBLK_MAX_IO_BYTES)
+		return -EINVAL;
+	if (!info->dev_sectors ||
+	    info->flags & ~(UBLK_F_FLUSH | UBLK_F_DISCARD))
+		return -EINVAL;
+
+	info->nr_hw_queues = min_t(unsigned int, info->nr_hw_queues,
+				   nr_cpu_ids);
+	info->max_io_bytes = round_down(info->max_io_bytes, info->block_size);
+	return 0;
+}
+
+static void ublk_config_queue(struct ublk_device *ub)
+{
+	struct request_queue *q = ub->disk->queue;
+	struct ublk_dev_info *info = &ub->info;
+
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+	blk_queue_logical_block_size(q, info->block_size);
+	blk_queue_physical_block_size(q, info->block_size);
+	blk_queue_io_min(q, info->block_size);
+	blk_queue_max_hw_sectors(q, info->max_io_bytes >> SECTOR_SHIFT);
+	blk_queue_max_segments(q, USHRT_MAX);
+	blk_queue_max_segment_size(q, UINT_MAX);
+
+	if (info->flags & UBLK_F_FLUSH)
+		blk_queue_write_cache(q, true, true);
+	if (info->flags & UBLK_F_DISCARD) {
+		q->limits.discard_granularity = info->block_size;
+		blk_queue_max_discard_sectors(q, UINT_MAX >> SECTOR_SHIFT);
+		blk_queue_max_write_zeroes_sectors(q,
+					UINT_MAX >> SECTOR_SHIFT);
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+	}
+}
+
+static int ublk_add_dev(struct ublk_dev_info *info)
+{
+	struct ublk_device *ub;
+	struct request_queue *q;
+	unsigned int i;
+	int err;
+
+	err = ublk_validate_info(info);
+	if (err)
+		return err;
+
+	ub = kzalloc(sizeof(*ub), GFP_KERNEL);
+	if (!ub)
+		return -ENOMEM;
+	ub->info = *info;
+	mutex_init(&ub->mutex);
+
+	mutex_lock(&ublk_index_mutex);
+	/* not visible to START and DEL until fully set up */
+	err = idr_alloc(&ublk_index_idr, NULL, 0, UBLK_MINORS, GFP_KERNEL);
+	mutex_unlock(&ublk_index_mutex);
+	if (err < 0) {
+		kfree(ub);
+		return err;
+	}
+	ub->info.dev_id = err;
+
+	/* from here on the device release frees ub and its queues */
+	device_initialize(&ub->cdev_dev);
+	ub->cdev_dev.class = ublk_chr_class;
+	ub->cdev_dev.devt = MKDEV(MAJOR(ublk_chr_devt), ub->info.dev_id);
+	ub->cdev_dev.release = ublk_cdev_rel;
+	err = dev_set_name(&ub->cdev_dev, "ublkc%u", ub->info.dev_id);
+	if (err)
+		goto out_put_dev;
+
+	err = -ENOMEM;
+	ub->queues = kcalloc(ub->info.nr_hw_queues, sizeof(*ub->queues),
+			     GFP_KERNEL);
+	if (!ub->queues)
+		goto out_put_dev;
+	for (i = 0; i < ub->info.nr_hw_queues; i++) {
+		ub->queues[i] = ublk_alloc_queue(ub, i);
+		if (!ub->queues[i])
+			goto out_put_dev;
+	}
+
+	ub->disk = alloc_disk(1);
+	if (!ub->disk)
+		goto out_put_dev;
+
+	ub->tag_set.ops = &ublk_mq_ops;
+	ub->tag_set.nr_hw_queues = ub->info.nr_hw_queues;
+	ub->tag_set.queue_depth = ub->info.queue_depth;
+	ub->tag_set.numa_node = NUMA_NO_NODE;
+	ub->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	ub->tag_set.driver_data = ub;
+	err = blk_mq_alloc_tag_set(&ub->tag_set);
+	if (err)
+		goto out_put_disk;
+
+	q = blk_mq_init_queue(&ub->tag_set);
+	if (IS_ERR(q)) {
+		err = PTR_ERR(q);
+		goto out_free_tags;
+	}
+	q->queuedata = ub;
+	ub->disk->queue = q;
+	ublk_config_queue(ub);
+
+	ub->disk->major = ublk_major;
+	ub->disk->first_minor = ub->info.dev_id;
+	ub->disk->flags |= GENHD_FL_NO_PART_SCAN;
+	ub->disk->fops = &ublk_fops;
+	ub->disk->private_data = ub;
+	sprintf(ub->disk->disk_name, "ublkb%u", ub->info.dev_id);
+	set_capacity(ub->disk, ub->info.dev_sectors);
+
+	cdev_init(&ub->cdev, &ublk_ch_fops);
+	err = cdev_device_add(&ub->cdev, &ub->cdev_dev);
+	if (err)
+		goto out_cleanup_queue;
+
+	mutex_lock(&ublk_index_mutex);
+	idr_replace(&ublk_index_idr, ub, ub->info.dev_id);
+	mutex_unlock(&ublk_index_mutex);
+
+	*info = ub->info;
+	return 0;
+
+out_cleanup_queue:
+	ub->disk->queue = NULL;
+	blk_cleanup_queue(q);
+out_free_tags:
+	blk_mq_free_tag_set(&ub->tag_set);
+out_put_disk:
+	put_disk(ub->disk);
+out_put_dev:
+	mutex_lock(&ublk_index_mutex);
+	idr_remove(&ublk_index_idr, ub->info.dev_id);
+	mutex_unlock(&ublk_index_mutex);
+	put_device(&ub->cdev_dev);
+	return err;
+}
+
+static int ublk_start_dev(struct ublk_device *ub)
+{
+	unsigned int i;
+	int ret = 0;
+
+	mutex_lock(&ub->mutex);
+	if (ub->removed) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (ub->started) {
+		ret = -EEXIST;
+		goto out;
+	}
+	/* I/O to a queue without a server would just fail */
+	for (i = 0; i < ub->info.nr_hw_queues; i++) {
+		if (!READ_ONCE(ub->queues[i]->server)) {
+			ret = -ENXIO;
+			goto out;
+		}
+	}
+	add_disk(ub->disk);
+	ub->started = true;
+out:
+	mutex_unlock(&ub->mutex);
+	return ret;
+}
+
+/*
+ * Called with ublk_index_mutex held, after ub was unhashed
+ */
+static void ublk_del_dev(struct ublk_device *ub)
+{
+	struct request_queue *q = ub->disk->queue;
+	struct ublk_queue *ubq;
+	unsigned int i;
+
+	mutex_lock(&ub->mutex);
+	ub->removed = true;
+	/* the server still serves the writeback this may kick off */
+	if (ub->started)
+		del_gendisk(ub->disk);
+
+	for (i = 0; i < ub->info.nr_hw_queues; i++) {
+		ubq = ub->queues[i];
+		spin_lock_irq(&ubq->lock);
+		ubq->dead = true;
+		spin_unlock_irq(&ubq->lock);
+		ublk_abort_queue(ubq);
+		wake_up(&ubq->wait);
+	}
+
+	/*
+	 * Once every request has ended, ublk_get_io() fails for any tag, so
+	 * servers that keep their files open never get at the freed tags.
+	 */
+	blk_cleanup_queue(q);
+	blk_mq_free_tag_set(&ub->tag_set);
+	/* only add_disk() took a queue reference for the disk to drop */
+	if (!ub->started)
+		ub->disk->queue = NULL;
+	ub->disk->private_data = NULL;
+	put_disk(ub->disk);
+	mutex_unlock(&ub->mutex);
+
+	cdev_device_del(&ub->cdev, &ub->cdev_dev);
+	put_device(&ub->cdev_dev);
+}
+
+static long ublk_ctl_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct ublk_dev_info info;
+	struct ublk_device *ub;
+	int ret;
+
+	switch (cmd) {
+	case UBLK_CTL_ADD_DEV:
+		if (copy_from_user(&info, (void __user *)arg, sizeof(info)))
+			return -EFAULT;
+		ret = ublk_add_dev(&info);
+		if (!ret && copy_to_user((void __user *)arg, &info,
+					 sizeof(info)))
+			ret = -EFAULT;
+		return ret;
+	case UBLK_CTL_START_DEV:
+		mutex_lock(&ublk_index_mutex);
+		ub = idr_find(&ublk_index_idr, arg);
+		ret = ub ? ublk_start_dev(ub) : -ENODEV;
+		mutex_unlock(&ublk_index_mutex);
+		return ret;
+	case UBLK_CTL_DEL_DEV:
+		mutex_lock(&ublk_index_mutex);
+		ub = idr_find(&ublk_index_idr, arg);
+		if (ub) {
+			idr_remove(&ublk_index_idr, arg);
+			ublk_del_dev(ub);
+		}
+		mutex_unlock(&ublk_index_mutex);
+		return ub ? 0 : -ENODEV;
+	}
+	return -ENOTTY;
+}
+
+static const struct file_operations ublk_ctl_fops = {
+	.open		= nonseekable_open,
+	.unlocked_ioctl	= ublk_ctl_ioctl,
+	.compat_ioctl	= ublk_ctl_ioctl,
+	.owner		= THIS_MODULE,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice ublk_misc = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "ublk-control",
+	.fops		= &ublk_ctl_fops,
+};
+
+static int __init ublk_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&ublk_chr_devt, 0, UBLK_MINORS, "ublk-char");
+	if (ret)
+		return ret;
+
+	ublk_chr_class = class_create(THIS_MODULE, "ublk-char");
+	if (IS_ERR(ublk_chr_class)) {
+		ret = PTR_ERR(ublk_chr_class);
+		goto out_unregister_chr;
+	}
+
+	ublk_major = register_blkdev(0, "ublkb");
+	if (ublk_major < 0) {
+		ret = ublk_major;
+		goto out_destroy_class;
+	}
+
+	ret = misc_register(&ublk_misc);
+	if (ret)
+		goto out_unregister_blk;
+	return 0;
+
+out_unregister_blk:
+	unregister_blkdev(ublk_major, "ublkb");
+out_destroy_class:
+	class_destroy(ublk_chr_class);
+out_unregister_chr:
+	unregister_chrdev_region(ublk_chr_devt, UBLK_MINORS);
+	return ret;
+}
+
+static int ublk_exit_cb(int id, void *ptr, void *data)
+{
+	ublk_del_dev(ptr);
+	return 0;
+}
+
+static void __exit ublk_exit(void)
+{
+	misc_deregister(&ublk_misc);
+
+	mutex_lock(&ublk_index_mutex);
+	idr_for_each(&ublk_index_idr, &ublk_exit_cb, NULL);
+	idr_destroy(&ublk_index_idr);
+	mutex_unlock(&ublk_index_mutex);
+
+	unregister_blkdev(ublk_major, "ublkb");
+	class_destroy(ublk_chr_class);
+	unregister_chrdev_region(ublk_chr_devt, UBLK_MINORS);
+}
+
+module_init(ublk_init);
+module_exit(ublk_exit);
+
+MODULE_DESCRIPTION("Userspace block device");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Bounded pool of worker threads for the async work of io_uring.
+ *
+ * There is a pool for each NUMA node, work is queued on the pool of the node
+ * that queues it, and is run by a kthread bound to that node.  The workers
+ * are forked on demand by a manager thread, up to the bound of the io_wq, and
+ * exit once they have been idle for a while.
+ *
+ * Hashed work is serialized with the other work of the same hash: a worker
+ * skips the work whose bucket is already being run by another worker of the
+ * pool, so work of a bucket runs in the order it was queued.
+ */
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/errno.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/cred.h>
+#include <linux/hash.h>
+#include <linux/topology.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "io-wq.h"
+
+#define WORKER_IDLE_TIMEOUT	(5 * HZ)
+#define IO_WQ_HASH_ORDER	5
+
+enum {
+	IO_WORKER_F_FREE	= 1,	/* on the free list */
+};
+
+enum {
+	IO_WQ_BIT_EXIT		= 0,	/* io_wq is being destroyed */
+};
+
+struct io_wqe;
+
+struct io_worker {
+	struct list_head list;		/* on the free list */
+	struct list_head all_list;
+	struct task_struct *task;
+	struct io_wqe *wqe;
+	unsigned flags;
+
+	struct mm_struct *mm;
+	mm_segment_t old_fs;
+	const struct cred *saved_creds;
+};
+
+/*
+ * The pool of a node.  All of it is protected by @lock, which is taken from
+ * irq context by io_wq_enqueue().
+ */
+struct io_wqe {
+	spinlock_t lock;
+	struct list_head work_list;
+	unsigned long hash_map;		/* the buckets being run */
+	unsigned nr_queued;
+
+	unsigned nr_workers;
+	unsigned nr_busy;
+	unsigned max_workers;
+	struct list_head free_list;
+	struct list_head all_list;
+
+	int node;
+	struct io_wq *wq;
+};
+
+struct io_wq {
+	struct io_wqe **wqes;
+	unsigned long state;
+
+	struct task_struct *manager;
+	struct mm_struct *mm;
+	const struct cred *creds;
+
+	/* one for the owner, and one for each worker */
+	atomic_t refs;
+	struct completion done;
+};
+
+static void io_worker_grab_mm(struct io_worker *worker)
+{
+	struct mm_struct *mm = worker->wqe->wq->mm;
+
+	/* the owner is exiting, the work fails on the missing mm */
+	if (!mm || !mmget_not_zero(mm))
+		return;
+
+	use_mm(mm);
+	worker->old_fs = get_fs();
+	set_fs(USER_DS);
+	worker->mm = mm;
+}
+
+static void io_worker_drop_mm(struct io_worker *worker)
+{
+	if (!worker->mm)
+		return;
+
+	set_fs(worker->old_fs);
+	unuse_mm(worker->mm);
+	mmput(worker->mm);
+	worker->mm = NULL;
+}
+
+/*
+ * Wake up an idle worker for newly queued work.  It is taken off the free
+ * list right away, so that the next work wakes up another one.
+ */
+static bool io_wqe_activate_free_worker(struct io_wqe *wqe)
+{
+	struct io_worker *worker;
+
+	worker = list_first_entry_or_null(&wqe->free_list, struct io_worker,
+					  list);
+	if (!worker)
+		return false;
+
+	list_del_init(&worker->list);
+	worker->flags &= ~IO_WORKER_F_FREE;
+	wake_up_process(worker->task);
+	return true;
+}
+
+static bool io_wqe_need_worker(struct io_wqe *wqe)
+{
+	return wqe->nr_queued && list_empty(&wqe->free_list) &&
+		wqe->nr_workers < wqe->max_workers;
+}
+
+static struct io_wq_work *io_get_next_work(struct io_wqe *wqe, unsigned *hash)
+{
+	struct io_wq_work *work;
+
+	list_for_each_entry(work, &wqe->work_list, list) {
+		if (!(work->flags & IO_WQ_WORK_HASHED)) {
+			*hash = -1U;
+		} else if (!(wqe->hash_map & BIT(work->hash))) {
+			wqe->hash_map |= BIT(work->hash);
+			*hash = work->hash;
+		} else {
+			/* the bucket is being run by another worker */
+			continue;
+		}
+
+		list_del(&work->list);
+		wqe->nr_queued--;
+		return work;
+	}
+
+	return NULL;
+}
+
+static void io_worker_run(struct io_worker *worker, struct io_wq_work *work,
+			  unsigned hash)
+	__releases(wqe->lock)
+{
+	struct io_wqe *wqe = worker->wqe;
+	bool fork = false;
+
+	/* woken up by something else than io_wqe_activate_free_worker() */
+	if (worker->flags & IO_WORKER_F_FREE) {
+		list_del_init(&worker->list);
+		worker->flags &= ~IO_WORKER_F_FREE;
+	}
+	wqe->nr_busy++;
+
+	/* get the rest of the work going while this one runs */
+	if (wqe->nr_queued && !io_wqe_activate_free_worker(wqe))
+		fork = io_wqe_need_worker(wqe);
+	spin_unlock_irq(&wqe->lock);
+
+	if (fork)
+		wake_up_process(wqe->wq->manager);
+
+	if ((work->flags & IO_WQ_WORK_NEEDS_USER) && !worker->mm)
+		io_worker_grab_mm(worker);
+
+	/* @work may be freed by the time ->func() returns */
+	work->func(work);
+
+	spin_lock_irq(&wqe->lock);
+	wqe->nr_busy--;
+	if (hash != -1U)
+		wqe->hash_map &= ~BIT(hash);
+	spin_unlock_irq(&wqe->lock);
+}
+
+static void io_worker_exit(struct io_worker *worker)
+	__releases(wqe->lock)
+{
+	struct io_wqe *wqe = worker->wqe;
+	struct io_wq *wq = wqe->wq;
+
+	if (worker->flags & IO_WORKER_F_FREE)
+		list_del(&worker->list);
+	list_del(&worker->all_list);
+	wqe->nr_workers--;
+	spin_unlock_irq(&wqe->lock);
+
+	io_worker_drop_mm(worker);
+	revert_creds(worker->saved_creds);
+	kfree(worker);
+
+	if (atomic_dec_and_test(&wq->refs))
+		complete(&wq->done);
+}
+
+static int io_wqe_worker(void *data)
+{
+	struct io_worker *worker = data;
+	struct io_wqe *wqe = worker->wqe;
+	struct io_wq *wq = wqe->wq;
+	struct io_wq_work *work;
+	unsigned hash;
+
+	worker->saved_creds = override_creds(wq->creds);
+
+	while (1) {
+		spin_lock_irq(&wqe->lock);
+		work = io_get_next_work(wqe, &hash);
+		if (work) {
+			io_worker_run(worker, work, hash);
+			continue;
+		}
+
+		/* the queued work has been run, exit */
+		if (test_bit(IO_WQ_BIT_EXIT, &wq->state))
+			break;
+
+		/* don't pin the mm of the owner while idle */
+		if (worker->mm) {
+			spin_unlock_irq(&wqe->lock);
+			io_worker_drop_mm(worker);
+			continue;
+		}
+
+		if (!(worker->flags & IO_WORKER_F_FREE)) {
+			worker->flags |= IO_WORKER_F_FREE;
+			list_add(&worker->list, &wqe->free_list);
+		}
+		__set_current_state(TASK_INTERRUPTIBLE);
+		spin_unlock_irq(&wqe->lock);
+
+		if (schedule_timeout(WORKER_IDLE_TIMEOUT))
+			continue;
+
+		/* idle for too long, exit unless it is the last worker */
+		spin_lock_irq(&wqe->lock);
+		if ((worker->flags & IO_WORKER_F_FREE) && wqe->nr_workers > 1)
+			break;
+		spin_unlock_irq(&wqe->lock);
+	}
+
+	io_worker_exit(worker);
+	return 0;
+}
+
+static bool create_io_worker(struct io_wq *wq, struct io_wqe *wqe)
+{
+	const struct cpumask *mask = cpumask_of_node(wqe->node);
+	struct io_worker *worker;
+
+	worker = kzalloc_node(sizeof(*worker), GFP_KERNEL, wqe->node);
+	if (!worker)
+		goto fail;
+
+	worker->wqe = wqe;
+	INIT_LIST_HEAD(&worker->list);
+	worker->task = kthread_create_on_node(io_wqe_worker, worker, wqe->node,
+					      "io_wqe_worker-%d", wqe->node);
+	if (IS_ERR(worker->task)) {
+		kfree(worker);
+		goto fail;
+	}
+	if (wqe->node != NUMA_NO_NODE && !cpumask_empty(mask))
+		set_cpus_allowed_ptr(worker->task, mask);
+
+	spin_lock_irq(&wqe->lock);
+	list_add(&worker->all_list, &wqe->all_list);
+	spin_unlock_irq(&wqe->lock);
+
+	atomic_inc(&wq->refs);
+	wake_up_process(worker->task);
+	return true;
+fail:
+	spin_lock_irq(&wqe->lock);
+	wqe->nr_workers--;
+	spin_unlock_irq(&wqe->lock);
+	return false;
+}
+
+/*
+ * Forks the workers, so that the queueing side never sleeps.  Woken up when
+ * work is queued with no idle worker, and polls once a second in case the
+ * last fork failed.
+ */
+static int io_wq_manager(void *data)
+{
+	struct io_wq *wq = data;
+	bool forked;
+	int node;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		forked = false;
+
+		for_each_node(node) {
+			struct io_wqe *wqe = wq->wqes[node];
+			bool fork;
+
+			spin_lock_irq(&wqe->lock);
+			fork = io_wqe_need_worker(wqe);
+			if (fork)
+				wqe->nr_workers++;
+			spin_unlock_irq(&wqe->lock);
+
+			if (fork) {
+				__set_current_state(TASK_RUNNING);
+				forked |= create_io_worker(wq, wqe);
+			}
+		}
+
+		if (!forked)
+			schedule_timeout(HZ);
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void io_wqe_enqueue(struct io_wqe *wqe, struct io_wq_work *work)
+{
+	unsigned long flags;
+	bool fork = false;
+
+	spin_lock_irqsave(&wqe->lock, flags);
+	list_add_tail(&work->list, &wqe->work_list);
+	wqe->nr_queued++;
+	if (!io_wqe_activate_free_worker(wqe))
+		fork = io_wqe_need_worker(wqe);
+	spin_unlock_irqrestore(&wqe->lock, flags);
+
+	if (fork)
+		wake_up_process(wqe->wq->manager);
+}
+
+/**
+ * io_wq_enqueue() - queue work on the pool of the local node
+ * @wq:		the io_wq
+ * @work:	the work, set up with INIT_IO_WORK()
+ *
+ * May be called from any context.
+ */
+void io_wq_enqueue(struct io_wq *wq, struct io_wq_work *work)
+{
+	io_wqe_enqueue(wq->wqes[numa_node_id()], work);
+}
+
+/**
+ * io_wq_enqueue_hashed() - queue work serialized with the work of the same key
+ * @wq:		the io_wq
+ * @work:	the work, set up with INIT_IO_WORK()
+ * @val:	the key, e.g. the inode written by @work
+ *
+ * The work queued with the same key on a node runs one at a time, in the order
+ * it was queued.  Keys may share a bucket, which only costs concurrency.
+ */
+void io_wq_enqueue_hashed(struct io_wq *wq, struct io_wq_work *work,
+			  void *val)
+{
+	work->flags |= IO_WQ_WORK_HASHED;
+	work->hash = hash_ptr(val, IO_WQ_HASH_ORDER);
+	io_wq_enqueue(wq, work);
+}
+
+/**
+ * io_wq_create() - create a pool of workers
+ * @bounded:	the maximum number of workers of each node
+ * @mm:		the mm the work flagged %IO_WQ_WORK_NEEDS_USER runs with
+ * @creds:	the credentials the work runs with
+ *
+ * Return: the io_wq, or an ERR_PTR()
+ */
+struct io_wq *io_wq_create(unsigned bounded, struct mm_struct *mm,
+			   const struct cred *creds)
+{
+	struct io_wq *wq;
+	int ret = -ENOMEM;
+	int node;
+
+	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
+	if (!wq)
+		return ERR_PTR(-ENOMEM);
+
+	wq->wqes = kcalloc(nr_node_ids, sizeof(struct io_wqe *), GFP_KERNEL);
+	if (!wq->wqes)
+		goto err;
+
+	for_each_node(node) {
+		int alloc_node = node_online(node) ? node : NUMA_NO_NODE;
+		struct io_wqe *wqe;
+
+		wqe = kzalloc_node(sizeof(*wqe), GFP_KERNEL, alloc_node);
+		if (!wqe)
+			goto err;
+		wq->wqes[node] = wqe;
+
+		spin_lock_init(&wqe->lock);
+		INIT_LIST_HEAD(&wqe->work_list);
+		INIT_LIST_HEAD(&wqe->free_list);
+		INIT_LIST_HEAD(&wqe->all_list);
+		wqe->max_workers = max(bounded, 1U);
+		wqe->node = alloc_node;
+		wqe->wq = wq;
+	}
+
+	wq->mm = mm;
+	wq->creds = get_cred(creds);
+	atomic_set(&wq->refs, 1);
+	init_completion(&wq->done);
+
+	wq->manager = kthread_create(io_wq_manager, wq, "io_wq_manager");
+	if (IS_ERR(wq->manager)) {
+		ret = PTR_ERR(wq->manager);
+		put_cred(wq->creds);
+		goto err;
+	}
+	wake_up_process(wq->manager);
+	return wq;
+err:
+	if (wq->wqes) {
+		for_each_node(node)
+			kfree(wq->wqes[node]);
+	}
+	kfree(wq->wqes);
+	kfree(wq);
+	return ERR_PTR(ret);
+}
+
+/**
+ * io_wq_destroy() - run the queued work and free the pool
+ * @wq:		the io_wq
+ *
+ * The work queued before the call is run before it returns, and no work may
+ * be queued after.
+ */
+void io_wq_destroy(struct io_wq *wq)
+{
+	struct io_worker *worker;
+	int node;
+
+	set_bit(IO_WQ_BIT_EXIT, &wq->state);
+	/* no worker is forked past this point */
+	kthread_stop(wq->manager);
+
+	for_each_node(node) {
+		struct io_wqe *wqe = wq->wqes[node];
+
+		spin_lock_irq(&wqe->lock);
+		list_for_each_entry(worker, &wqe->all_list, all_list)
+			wake_up_process(worker->task);
+		spin_unlock_irq(&wqe->lock);
+	}
+
+	if (!atomic_dec_and_test(&wq->refs))
+		wait_for_completion(&wq->done);
+
+	for_each_node(node)
+		kfree(wq->wqes[node]);
+	kfree(wq->wqes);
+	put_cred(wq->creds);
+	kfree(wq);
+}
+
+/**
+ * io_wq_show_fdinfo() - show the state of the pools of the online nodes
+ * @wq:		the io_wq
+ * @m:		the fdinfo file
+ */
+void io_wq_show_fdinfo(struct io_wq *wq, struct seq_file *m)
+{
+	int node;
+
+	for_each_online_node(node) {
+		struct io_wqe *wqe = wq->wqes[node];
+
+		spin_lock_irq(&wqe->lock);
+		seq_printf(m, "wq_node%d:\tworkers %u/%u busy %u queued %u\n",
+			   node, wqe->nr_workers, wqe->max_workers,
+			   wqe->nr_busy, wqe->nr_queued);
+		spin_unlock_irq(&wqe->lock);
+	}
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef INTERNAL_IO_WQ_H
+#define INTERNAL_IO_WQ_H
+
+struct io_wq;
+struct seq_file;
+
+enum {
+	IO_WQ_WORK_HASHED	= 1,	/* serialized with work of same hash */
+	IO_WQ_WORK_NEEDS_USER	= 2,	/* runs with the mm of the io_wq */
+};
+
+struct io_wq_work {
+	struct list_head list;
+	void (*func)(struct io_wq_work *);
+	unsigned flags;
+	unsigned hash;
+};
+
+#define INIT_IO_WORK(work, _func)			\
+	do {						\
+		(work)->func = _func;			\
+		(work)->flags = 0;			\
+	} while (0)
+
+struct io_wq *io_wq_create(unsigned bounded, struct mm_struct *mm,
+			   const struct cred *creds);
+void io_wq_destroy(struct io_wq *wq);
+
+void io_wq_enqueue(struct io_wq *wq, struct io_wq_work *work);
+void io_wq_enqueue_hashed(struct io_wq *wq, struct io_wq_work *work,
+			  void *val);
+
+void io_wq_show_fdinfo(struct io_wq *wq, struct seq_file *m);
+
+#endif
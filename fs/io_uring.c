@@ -66,17 +66,25 @@
 #include <net/scm.h>
 #include <linux/anon_inodes.h>
 #include <linux/sched/mm.h>
+#include <linux/sched/clock.h>
 #include <linux/uaccess.h>
 #include <linux/nospec.h>
 #include <linux/sizes.h>
 #include <linux/hugetlb.h>
+#include <linux/pagemap.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/cred.h>
 
 #include <uapi/linux/io_uring.h>
 
 #include "internal.h"
+#include "io-wq.h"
 
 #define IORING_MAX_ENTRIES	4096
-#define IORING_MAX_FIXED_FILES	1024
+#define IORING_MAX_FIXED_FILES	(1U << 15)
 
 struct io_uring {
 	u32 head ____cacheline_aligned_in_smp;
@@ -195,14 +203,69 @@ struct io_mapped_ubuf {
 	unsigned int	nr_bvecs;
 };
 
-struct async_list {
-	spinlock_t		lock;
-	atomic_t		cnt;
+/*
+ * A buffer provided with IORING_OP_PROVIDE_BUFFERS. It belongs to the group
+ * until a request with IOSQE_BUFFER_SELECT picks it, and to the application
+ * once that request completes.
+ */
+struct io_buffer {
 	struct list_head	list;
+	u64			addr;
+	u32			len;
+	u16			bid;
+	u16			bgid;
+};
+
+struct io_buffer_list {
+	struct list_head	buf_list;
+};
+
+/*
+ * A generation of the fixed file table. Requests hold a reference to the
+ * generation they looked their fixed file up in. The files replaced while it
+ * was current are put once it is released, after those of the generation
+ * before it, which holds a reference to ->next until then.
+ */
+struct io_file_ref_node {
+	struct percpu_ref	refs;
+	struct list_head	file_list;
+	struct io_file_ref_node	*next;
+	struct io_ring_ctx	*ctx;
+	struct work_struct	work;
+};
 
+struct io_file_put {
+	struct list_head	list;
 	struct file		*file;
-	off_t			io_end;
-	size_t			io_pages;
+};
+
+/*
+ * A SQ poll thread, shared by the rings set up with IORING_SETUP_ATTACH_SQ.
+ * The rings are only added to or removed from ->ctx_list while the thread
+ * is parked, under ->lock.
+ */
+struct io_sq_data {
+	refcount_t		refs;
+	struct mutex		lock;
+	struct list_head	ctx_list;
+	struct task_struct	*thread;
+	struct wait_queue_head	wait;
+
+	/* the longest idle period of the rings */
+	unsigned		sq_thread_idle;
+};
+
+/*
+ * How long the sqes of a ring wait for the SQ poll thread, to tell whether
+ * the rings sharing it are served fairly. A batch is taken to have waited
+ * since the previous pass over the ring, or since the thread woke up.
+ */
+struct io_sq_stats {
+	u64			last_poll;	/* local_clock() */
+	u64			nr_sqes;
+	u64			nr_batches;
+	u64			wait_ns;
+	u64			wait_max_ns;
 };
 
 struct io_ring_ctx {
@@ -227,10 +290,15 @@ struct io_ring_ctx {
 	} ____cacheline_aligned_in_smp;
 
 	/* IO offload */
-	struct workqueue_struct	*sqo_wq;
-	struct task_struct	*sqo_thread;	/* if using sq thread polling */
+	struct io_wq		*io_wq;
+	struct io_sq_data	*sq_data;	/* if using sq thread polling */
+	struct list_head	sqd_list;	/* on sq_data->ctx_list */
 	struct mm_struct	*sqo_mm;
-	wait_queue_head_t	sqo_wait;
+	const struct cred	*creds;
+
+	/* only used by the sq thread */
+	unsigned		sq_inflight;
+	struct io_sq_stats	sq_stats;
 
 	struct {
 		/* CQ ring */
@@ -244,17 +312,28 @@ struct io_ring_ctx {
 	} ____cacheline_aligned_in_smp;
 
 	/*
-	 * If used, fixed file set. Writers must ensure that ->refs is dead,
-	 * readers must ensure that ->refs is alive as long as the file* is
-	 * used. Only updated through io_uring_register(2).
+	 * If used, fixed file set, empty slots are NULL. Only updated through
+	 * io_uring_register(2), and looked up at submission, both under
+	 * ->uring_lock. Requests pin the files through ->file_node.
 	 */
 	struct file		**user_files;
 	unsigned		nr_user_files;
+	struct io_file_ref_node	*file_node;
+	atomic_t		nr_file_nodes;
+	/* serializes the updates of the skbs that hold the fixed files */
+	struct mutex		file_scm_lock;
 
 	/* if used, fixed mapped user buffers */
 	unsigned		nr_user_bufs;
 	struct io_mapped_ubuf	*user_bufs;
 
+	/*
+	 * Provided buffer groups, by group ID. A group lives until the ring
+	 * is freed, even once it runs out of buffers.
+	 */
+	struct mutex		buf_lock;
+	struct idr		io_buffer_idr;
+
 	struct user_struct	*user;
 
 	struct completion	ctx_done;
@@ -275,10 +354,15 @@ struct io_ring_ctx {
 		 */
 		struct list_head	poll_list;
 		struct list_head	cancel_list;
+		/*
+		 * Pending IORING_OP_TIMEOUT requests, sorted by the completion
+		 * count that ends them, the ones without a count last.
+		 */
+		struct list_head	timeout_list;
+		/* the completions posted for timeouts themselves */
+		unsigned		cq_timeouts;
 	} ____cacheline_aligned_in_smp;
 
-	struct async_list	pending_async[2];
-
 #if defined(CONFIG_UNIX)
 	struct socket		*ring_sock;
 #endif
@@ -305,6 +389,11 @@ struct io_poll_iocb {
 	struct wait_queue_entry		wait;
 };
 
+struct io_timeout {
+	struct file			*file;
+	struct hrtimer			timer;
+};
+
 /*
  * NOTE! Each of the iocb union members has the file pointer
  * as the first entry in their struct definition. So you can
@@ -316,25 +405,36 @@ struct io_kiocb {
 		struct file		*file;
 		struct kiocb		rw;
 		struct io_poll_iocb	poll;
+		struct io_timeout	timeout;
 	};
 
 	struct sqe_submit	submit;
 
 	struct io_ring_ctx	*ctx;
 	struct list_head	list;
+	/* the requests that are issued once this one completed, in order */
+	struct list_head	link_list;
 	unsigned int		flags;
 	refcount_t		refs;
 #define REQ_F_NOWAIT		1	/* must not punt to workers */
 #define REQ_F_IOPOLL_COMPLETED	2	/* polled IO has completed */
 #define REQ_F_FIXED_FILE	4	/* ctx owns file */
-#define REQ_F_SEQ_PREV		8	/* sequential with previous */
 #define REQ_F_IO_DRAIN		16	/* drain existing IO first */
 #define REQ_F_IO_DRAINED	32	/* drain done */
+#define REQ_F_LINK		64	/* linked sqes */
+#define REQ_F_FAIL_LINK		128	/* fail rest of links */
+#define REQ_F_TIMEOUT_NOSEQ	256	/* timeout without completion count */
+#define REQ_F_BUFFER_SELECT	512	/* pick a provided buffer */
+#define REQ_F_PAGE_WAIT		1024	/* read waits on locked pages */
 	u64			user_data;
 	u32			error;	/* iopoll result from callback */
 	u32			sequence;
+	struct io_buffer	*kbuf;	/* selected buffer, if any */
+	struct io_file_ref_node	*file_node;	/* pins a fixed file */
+	struct wait_page_queue	wpq;	/* page a buffered read waits on */
+	atomic_t		wpq_refs;
 
-	struct work_struct	work;
+	struct io_wq_work	work;
 };
 
 #define IO_PLUG_THRESHOLD		2
@@ -360,7 +460,11 @@ struct io_submit_state {
 	unsigned int		ios_left;
 };
 
-static void io_sq_wq_submit_work(struct work_struct *work);
+static void io_sq_wq_submit_work(struct io_wq_work *work);
+static void io_poll_retry_work(struct io_wq_work *work);
+static void io_page_retry_work(struct io_wq_work *work);
+static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			   const struct sqe_submit *s, bool force_nonblock);
 
 static struct kmem_cache *req_cachep;
 
@@ -389,7 +493,6 @@ static void io_ring_ctx_ref_free(struct percpu_ref *ref)
 static struct io_ring_ctx *io_ring_ctx_alloc(struct io_uring_params *p)
 {
 	struct io_ring_ctx *ctx;
-	int i;
 
 	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
 	if (!ctx)
@@ -405,15 +508,14 @@ static struct io_ring_ctx *io_ring_ctx_alloc(struct io_uring_params *p)
 	init_completion(&ctx->ctx_done);
 	mutex_init(&ctx->uring_lock);
 	init_waitqueue_head(&ctx->wait);
-	for (i = 0; i < ARRAY_SIZE(ctx->pending_async); i++) {
-		spin_lock_init(&ctx->pending_async[i].lock);
-		INIT_LIST_HEAD(&ctx->pending_async[i].list);
-		atomic_set(&ctx->pending_async[i].cnt, 0);
-	}
+	mutex_init(&ctx->buf_lock);
+	mutex_init(&ctx->file_scm_lock);
+	idr_init(&ctx->io_buffer_idr);
 	spin_lock_init(&ctx->completion_lock);
 	INIT_LIST_HEAD(&ctx->poll_list);
 	INIT_LIST_HEAD(&ctx->cancel_list);
 	INIT_LIST_HEAD(&ctx->defer_list);
+	INIT_LIST_HEAD(&ctx->timeout_list);
 	return ctx;
 }
 
@@ -457,15 +559,70 @@ static void __io_commit_cqring(struct io_ring_ctx *ctx)
 	}
 }
 
+/*
+ * Return the first timeout whose completion count has been reached, not
+ * counting the completions of timeouts.
+ */
+static struct io_kiocb *io_get_timeout_req(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	req = list_first_entry_or_null(&ctx->timeout_list, struct io_kiocb,
+					list);
+	if (!req || (req->flags & REQ_F_TIMEOUT_NOSEQ))
+		return NULL;
+	if ((int) (req->sequence - (ctx->cached_cq_tail - ctx->cq_timeouts)) > 0)
+		return NULL;
+
+	return req;
+}
+
+static inline bool io_sqe_needs_user(const struct io_uring_sqe *sqe)
+{
+	u8 opcode = READ_ONCE(sqe->opcode);
+
+	return !(opcode == IORING_OP_READ_FIXED ||
+		 opcode == IORING_OP_WRITE_FIXED);
+}
+
+/*
+ * Punt a request that was set up with io_sq_wq_submit_work() to the workers.
+ * Buffered writes to the same file are serialized, they would only contend
+ * on the inode lock in parallel.
+ */
+static void io_queue_async_work(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	const struct io_uring_sqe *sqe = req->submit.sqe;
+	u8 opcode = READ_ONCE(sqe->opcode);
+
+	if (io_sqe_needs_user(sqe))
+		req->work.flags |= IO_WQ_WORK_NEEDS_USER;
+
+	if ((opcode == IORING_OP_WRITEV || opcode == IORING_OP_WRITE_FIXED) &&
+	    req->file && !(req->file->f_flags & O_DIRECT) &&
+	    S_ISREG(file_inode(req->file)->i_mode)) {
+		io_wq_enqueue_hashed(ctx->io_wq, &req->work,
+				     file_inode(req->file));
+		return;
+	}
+
+	io_wq_enqueue(ctx->io_wq, &req->work);
+}
+
+static void io_kill_timeout(struct io_kiocb *req, long res);
+
 static void io_commit_cqring(struct io_ring_ctx *ctx)
 {
 	struct io_kiocb *req;
 
+	while ((req = io_get_timeout_req(ctx)) != NULL)
+		io_kill_timeout(req, 0);
+
 	__io_commit_cqring(ctx);
 
 	while ((req = io_get_deferred_req(ctx)) != NULL) {
 		req->flags |= REQ_F_IO_DRAINED;
-		queue_work(ctx->sqo_wq, &req->work);
+		io_queue_async_work(ctx, req);
 	}
 }
 
@@ -487,8 +644,8 @@ static struct io_uring_cqe *io_get_cqring(struct io_ring_ctx *ctx)
 	return &ring->cqes[tail & ctx->cq_mask];
 }
 
-static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
-				 long res)
+static void __io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
+				   long res, unsigned cflags)
 {
 	struct io_uring_cqe *cqe;
 
@@ -501,7 +658,7 @@ static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
 	if (cqe) {
 		WRITE_ONCE(cqe->user_data, ki_user_data);
 		WRITE_ONCE(cqe->res, res);
-		WRITE_ONCE(cqe->flags, 0);
+		WRITE_ONCE(cqe->flags, cflags);
 	} else {
 		unsigned overflow = READ_ONCE(ctx->cq_ring->overflow);
 
@@ -509,29 +666,59 @@ static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
 	}
 }
 
+static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 ki_user_data,
+				 long res)
+{
+	__io_cqring_fill_event(ctx, ki_user_data, res, 0);
+}
+
 static void io_cqring_ev_posted(struct io_ring_ctx *ctx)
 {
 	if (waitqueue_active(&ctx->wait))
 		wake_up(&ctx->wait);
-	if (waitqueue_active(&ctx->sqo_wait))
-		wake_up(&ctx->sqo_wait);
+	if (ctx->sq_data && waitqueue_active(&ctx->sq_data->wait))
+		wake_up(&ctx->sq_data->wait);
 	if (ctx->cq_ev_fd)
 		eventfd_signal(ctx->cq_ev_fd, 1);
 }
 
-static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
-				long res)
+static void __io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				  long res, unsigned cflags)
 {
 	unsigned long flags;
 
 	spin_lock_irqsave(&ctx->completion_lock, flags);
-	io_cqring_fill_event(ctx, user_data, res);
+	__io_cqring_fill_event(ctx, user_data, res, cflags);
 	io_commit_cqring(ctx);
 	spin_unlock_irqrestore(&ctx->completion_lock, flags);
 
 	io_cqring_ev_posted(ctx);
 }
 
+static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				long res)
+{
+	__io_cqring_add_event(ctx, user_data, res, 0);
+}
+
+/*
+ * Hand the selected buffer over to the application, returns the cqe->flags
+ * that tell it which one it got.
+ */
+static unsigned io_put_kbuf(struct io_kiocb *req)
+{
+	struct io_buffer *kbuf = req->kbuf;
+	unsigned cflags;
+
+	if (!kbuf)
+		return 0;
+
+	cflags = IORING_CQE_F_BUFFER | (kbuf->bid << IORING_CQE_BUFFER_SHIFT);
+	req->kbuf = NULL;
+	kfree(kbuf);
+	return cflags;
+}
+
 static void io_ring_drop_ctx_refs(struct io_ring_ctx *ctx, unsigned refs)
 {
 	percpu_ref_put_many(&ctx->refs, refs);
@@ -582,6 +769,7 @@ static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx,
 	req->file = NULL;
 	req->ctx = ctx;
 	req->flags = 0;
+	req->kbuf = NULL;
 	/* one is dropped after submission, the other at completion */
 	refcount_set(&req->refs, 2);
 	return req;
@@ -592,21 +780,99 @@ static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx,
 
 static void io_free_req_many(struct io_ring_ctx *ctx, void **reqs, int *nr)
 {
+	int i;
+
 	if (*nr) {
+		/* only requests with fixed files are freed in bulk */
+		for (i = 0; i < *nr; i++) {
+			struct io_kiocb *req = reqs[i];
+
+			percpu_ref_put(&req->file_node->refs);
+		}
 		kmem_cache_free_bulk(req_cachep, *nr, reqs);
 		io_ring_drop_ctx_refs(ctx, *nr);
 		*nr = 0;
 	}
 }
 
-static void io_free_req(struct io_kiocb *req)
+static void __io_free_req(struct io_kiocb *req)
 {
-	if (req->file && !(req->flags & REQ_F_FIXED_FILE))
+	/* the buffer is lost if the request never posted a completion */
+	kfree(req->kbuf);
+	if (req->flags & REQ_F_FIXED_FILE)
+		percpu_ref_put(&req->file_node->refs);
+	else if (req->file)
 		fput(req->file);
 	io_ring_drop_ctx_refs(req->ctx, 1);
 	kmem_cache_free(req_cachep, req);
 }
 
+static inline void req_set_fail_links(struct io_kiocb *req)
+{
+	if (req->flags & REQ_F_LINK)
+		req->flags |= REQ_F_FAIL_LINK;
+}
+
+/*
+ * Issue the next request of the chain, which inherits the rest of it. The
+ * linked requests always run from a worker, like a punted request.
+ */
+static void io_req_link_next(struct io_kiocb *req)
+{
+	struct io_kiocb *nxt;
+
+	nxt = list_first_entry_or_null(&req->link_list, struct io_kiocb, list);
+	if (!nxt)
+		return;
+
+	list_del(&nxt->list);
+	if (!list_empty(&req->link_list)) {
+		INIT_LIST_HEAD(&nxt->link_list);
+		list_splice(&req->link_list, &nxt->link_list);
+		nxt->flags |= REQ_F_LINK;
+	}
+
+	INIT_IO_WORK(&nxt->work, io_sq_wq_submit_work);
+	io_queue_async_work(req->ctx, nxt);
+}
+
+/*
+ * Cancel the rest of a chain whose request failed. The linked requests were
+ * never issued, so they hold no reference but their own.
+ */
+static void io_fail_links(struct io_kiocb *req)
+{
+	struct io_kiocb *link;
+
+	while (!list_empty(&req->link_list)) {
+		link = list_first_entry(&req->link_list, struct io_kiocb, list);
+		list_del(&link->list);
+
+		io_cqring_add_event(req->ctx, link->submit.sqe->user_data,
+					-ECANCELED);
+		kfree(link->submit.sqe);
+		__io_free_req(link);
+	}
+}
+
+static void io_free_req(struct io_kiocb *req)
+{
+	/*
+	 * If LINK is set, we have dependent requests in this chain. If we
+	 * didn't fail this request, queue the first one up, moving any other
+	 * dependencies to the next request. In case of failure, fail the rest
+	 * of the chain.
+	 */
+	if (req->flags & REQ_F_LINK) {
+		if (req->flags & REQ_F_FAIL_LINK)
+			io_fail_links(req);
+		else
+			io_req_link_next(req);
+	}
+
+	__io_free_req(req);
+}
+
 static void io_put_req(struct io_kiocb *req)
 {
 	if (refcount_dec_and_test(&req->refs))
@@ -628,16 +894,18 @@ static void io_iopoll_complete(struct io_ring_ctx *ctx, unsigned int *nr_events,
 		req = list_first_entry(done, struct io_kiocb, list);
 		list_del(&req->list);
 
-		io_cqring_fill_event(ctx, req->user_data, req->error);
+		__io_cqring_fill_event(ctx, req->user_data, req->error,
+				       io_put_kbuf(req));
 		(*nr_events)++;
 
 		if (refcount_dec_and_test(&req->refs)) {
 			/* If we're not using fixed files, we have to pair the
 			 * completion part with the file put. Use regular
 			 * completions for those, only batch free for fixed
-			 * file.
+			 * file and non-linked commands.
 			 */
-			if (req->flags & REQ_F_FIXED_FILE) {
+			if ((req->flags & (REQ_F_FIXED_FILE | REQ_F_LINK)) ==
+			    REQ_F_FIXED_FILE) {
 				reqs[to_free++] = req;
 				if (to_free == ARRAY_SIZE(reqs))
 					io_free_req_many(ctx, reqs, &to_free);
@@ -776,7 +1044,9 @@ static void io_complete_rw(struct kiocb *kiocb, long res, long res2)
 
 	kiocb_end_write(kiocb);
 
-	io_cqring_add_event(req->ctx, req->user_data, res);
+	if (res < 0)
+		req_set_fail_links(req);
+	__io_cqring_add_event(req->ctx, req->user_data, res, io_put_kbuf(req));
 	io_put_req(req);
 }
 
@@ -786,6 +1056,8 @@ static void io_complete_rw_iopoll(struct kiocb *kiocb, long res, long res2)
 
 	kiocb_end_write(kiocb);
 
+	if (res < 0 && res != -EAGAIN)
+		req_set_fail_links(req);
 	req->error = res;
 	if (res != -EAGAIN)
 		req->flags |= REQ_F_IOPOLL_COMPLETED;
@@ -961,6 +1233,101 @@ static inline void io_rw_done(struct kiocb *kiocb, ssize_t ret)
 	}
 }
 
+/*
+ * Pick a buffer from the group in sqe->buf_group, and clamp *len to its size.
+ * A request keeps the buffer it got across retries, until it completes or
+ * puts it back with io_recycle_kbuf().
+ */
+static struct io_buffer *io_buffer_select(struct io_kiocb *req,
+					  const struct io_uring_sqe *sqe,
+					  size_t *len)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_buffer *kbuf = req->kbuf;
+	struct io_buffer_list *bl;
+
+	if (!kbuf) {
+		mutex_lock(&ctx->buf_lock);
+		bl = idr_find(&ctx->io_buffer_idr, READ_ONCE(sqe->buf_group));
+		if (bl && !list_empty(&bl->buf_list)) {
+			kbuf = list_first_entry(&bl->buf_list, struct io_buffer,
+						list);
+			list_del(&kbuf->list);
+		}
+		mutex_unlock(&ctx->buf_lock);
+
+		if (!kbuf)
+			return ERR_PTR(-ENOBUFS);
+		req->kbuf = kbuf;
+	}
+
+	if (*len > kbuf->len)
+		*len = kbuf->len;
+	return kbuf;
+}
+
+/*
+ * Give the buffer back to its group when the request did not complete, i.e.
+ * it failed before issue or is waiting for data. It goes first, as it is the
+ * most likely to be cache hot.
+ */
+static void io_recycle_kbuf(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_buffer *kbuf = req->kbuf;
+	struct io_buffer_list *bl;
+
+	if (!kbuf)
+		return;
+
+	req->kbuf = NULL;
+	mutex_lock(&ctx->buf_lock);
+	bl = idr_find(&ctx->io_buffer_idr, kbuf->bgid);
+	list_add(&kbuf->list, &bl->buf_list);
+	mutex_unlock(&ctx->buf_lock);
+}
+
+/*
+ * IORING_OP_READV with IOSQE_BUFFER_SELECT: sqe->addr points to a single
+ * iovec whose length caps the read, its base is ignored.
+ */
+static int io_import_kbuf(struct io_kiocb *req, int rw,
+			  const struct sqe_submit *s, struct iovec *iov,
+			  struct iov_iter *iter)
+{
+	const struct io_uring_sqe *sqe = s->sqe;
+	void __user *uiov = u64_to_user_ptr(READ_ONCE(sqe->addr));
+	struct io_buffer *kbuf;
+	size_t len;
+
+	if (READ_ONCE(sqe->len) != 1)
+		return -EINVAL;
+	if (!s->has_user)
+		return -EFAULT;
+
+#ifdef CONFIG_COMPAT
+	if (req->ctx->compat) {
+		struct compat_iovec __user *ciov = uiov;
+		compat_ssize_t clen;
+
+		if (get_user(clen, &ciov->iov_len))
+			return -EFAULT;
+		if (clen < 0)
+			return -EINVAL;
+		len = clen;
+	} else
+#endif
+	if (get_user(len, &((struct iovec __user *) uiov)->iov_len))
+		return -EFAULT;
+
+	kbuf = io_buffer_select(req, sqe, &len);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+
+	return import_single_range(rw, u64_to_user_ptr(kbuf->addr), len, iov,
+				   iter);
+}
+
 static int io_import_fixed(struct io_ring_ctx *ctx, int rw,
 			   const struct io_uring_sqe *sqe,
 			   struct iov_iter *iter)
@@ -1001,10 +1368,11 @@ static int io_import_fixed(struct io_ring_ctx *ctx, int rw,
 	return 0;
 }
 
-static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
+static int io_import_iovec(struct io_kiocb *req, int rw,
 			   const struct sqe_submit *s, struct iovec **iovec,
 			   struct iov_iter *iter)
 {
+	struct io_ring_ctx *ctx = req->ctx;
 	const struct io_uring_sqe *sqe = s->sqe;
 	void __user *buf = u64_to_user_ptr(READ_ONCE(sqe->addr));
 	size_t sqe_len = READ_ONCE(sqe->len);
@@ -1026,6 +1394,12 @@ static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
 		return ret;
 	}
 
+	if (req->flags & REQ_F_BUFFER_SELECT) {
+		int ret = io_import_kbuf(req, rw, s, *iovec, iter);
+		*iovec = NULL;
+		return ret;
+	}
+
 	if (!s->has_user)
 		return -EFAULT;
 
@@ -1039,44 +1413,14 @@ static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
 }
 
 /*
- * Make a note of the last file/offset/direction we punted to async
- * context. We'll use this information to see if we can piggy back a
- * sequential request onto the previous one, if it's still hasn't been
- * completed by the async worker.
+ * A read queued on a page waitqueue is retried by io_page_retry_work(). The
+ * page can be unlocked while ->read_iter() is still on its way out and using
+ * the kiocb, so whichever of the waker and the issuer comes last queues it.
  */
-static void io_async_list_note(int rw, struct io_kiocb *req, size_t len)
+static void io_page_retry_put(struct io_kiocb *req)
 {
-	struct async_list *async_list = &req->ctx->pending_async[rw];
-	struct kiocb *kiocb = &req->rw;
-	struct file *filp = kiocb->ki_filp;
-	off_t io_end = kiocb->ki_pos + len;
-
-	if (filp == async_list->file && kiocb->ki_pos == async_list->io_end) {
-		unsigned long max_pages;
-
-		/* Use 8x RA size as a decent limiter for both reads/writes */
-		max_pages = filp->f_ra.ra_pages;
-		if (!max_pages)
-			max_pages = VM_READAHEAD_PAGES;
-		max_pages *= 8;
-
-		/* If max pages are exceeded, reset the state */
-		len >>= PAGE_SHIFT;
-		if (async_list->io_pages + len <= max_pages) {
-			req->flags |= REQ_F_SEQ_PREV;
-			async_list->io_pages += len;
-		} else {
-			io_end = 0;
-			async_list->io_pages = 0;
-		}
-	}
-
-	/* New file? Reset state. */
-	if (async_list->file != filp) {
-		async_list->io_pages = 0;
-		async_list->file = filp;
-	}
-	async_list->io_end = io_end;
+	if (atomic_dec_and_test(&req->wpq_refs))
+		io_wq_enqueue(req->ctx->io_wq, &req->work);
 }
 
 static int io_read(struct io_kiocb *req, const struct sqe_submit *s,
@@ -1099,30 +1443,41 @@ static int io_read(struct io_kiocb *req, const struct sqe_submit *s,
 	if (unlikely(!file->f_op->read_iter))
 		return -EINVAL;
 
-	ret = io_import_iovec(req->ctx, READ, s, &iovec, &iter);
+	ret = io_import_iovec(req, READ, s, &iovec, &iter);
 	if (ret)
-		return ret;
+		goto out;
 
 	iov_count = iov_iter_count(&iter);
 	ret = rw_verify_area(READ, file, &kiocb->ki_pos, iov_count);
 	if (!ret) {
+		bool waitq = false;
 		ssize_t ret2;
 
+		if (force_nonblock && (req->flags & REQ_F_PAGE_WAIT) &&
+		    !(kiocb->ki_flags & IOCB_DIRECT)) {
+			kiocb->ki_flags |= IOCB_WAITQ;
+			kiocb->ki_waitq = &req->wpq;
+			atomic_set(&req->wpq_refs, 2);
+			waitq = true;
+		}
+
 		/* Catch -EAGAIN return for forced non-blocking submission */
 		ret2 = call_read_iter(file, kiocb, &iter);
-		if (!force_nonblock || ret2 != -EAGAIN) {
+		if (waitq && ret2 == -EIOCBQUEUED) {
+			kfree(iovec);
+			io_page_retry_put(req);
+			return -EIOCBQUEUED;
+		}
+		if (!force_nonblock || ret2 != -EAGAIN)
 			io_rw_done(kiocb, ret2);
-		} else {
-			/*
-			 * If ->needs_lock is true, we're already in async
-			 * context.
-			 */
-			if (!s->needs_lock)
-				io_async_list_note(READ, req, iov_count);
+		else
 			ret = -EAGAIN;
-		}
 	}
 	kfree(iovec);
+out:
+	/* a provided buffer is only held once the read is issued */
+	if (ret)
+		io_recycle_kbuf(req);
 	return ret;
 }
 
@@ -1146,19 +1501,15 @@ static int io_write(struct io_kiocb *req, const struct sqe_submit *s,
 	if (unlikely(!file->f_op->write_iter))
 		return -EINVAL;
 
-	ret = io_import_iovec(req->ctx, WRITE, s, &iovec, &iter);
+	ret = io_import_iovec(req, WRITE, s, &iovec, &iter);
 	if (ret)
 		return ret;
 
 	iov_count = iov_iter_count(&iter);
 
 	ret = -EAGAIN;
-	if (force_nonblock && !(kiocb->ki_flags & IOCB_DIRECT)) {
-		/* If ->needs_lock is true, we're already in async context. */
-		if (!s->needs_lock)
-			io_async_list_note(WRITE, req, iov_count);
+	if (force_nonblock && !(kiocb->ki_flags & IOCB_DIRECT))
 		goto out_free;
-	}
 
 	ret = rw_verify_area(WRITE, file, &kiocb->ki_pos, iov_count);
 	if (!ret) {
@@ -1180,17 +1531,10 @@ static int io_write(struct io_kiocb *req, const struct sqe_submit *s,
 		kiocb->ki_flags |= IOCB_WRITE;
 
 		ret2 = call_write_iter(file, kiocb, &iter);
-		if (!force_nonblock || ret2 != -EAGAIN) {
+		if (!force_nonblock || ret2 != -EAGAIN)
 			io_rw_done(kiocb, ret2);
-		} else {
-			/*
-			 * If ->needs_lock is true, we're already in async
-			 * context.
-			 */
-			if (!s->needs_lock)
-				io_async_list_note(WRITE, req, iov_count);
+		else
 			ret = -EAGAIN;
-		}
 	}
 out_free:
 	kfree(iovec);
@@ -1253,6 +1597,8 @@ static int io_fsync(struct io_kiocb *req, const struct io_uring_sqe *sqe,
 				end > 0 ? end : LLONG_MAX,
 				fsync_flags & IORING_FSYNC_DATASYNC);
 
+	if (ret < 0)
+		req_set_fail_links(req);
 	io_cqring_add_event(req->ctx, sqe->user_data, ret);
 	io_put_req(req);
 	return 0;
@@ -1297,78 +1643,385 @@ static int io_sync_file_range(struct io_kiocb *req,
 
 	ret = sync_file_range(req->rw.ki_filp, sqe_off, sqe_len, flags);
 
+	if (ret < 0)
+		req_set_fail_links(req);
 	io_cqring_add_event(req->ctx, sqe->user_data, ret);
 	io_put_req(req);
 	return 0;
 }
 
-static void io_poll_remove_one(struct io_kiocb *req)
+/*
+ * Free up to @nbufs buffers of a group, returns how many were freed. Called
+ * with ->buf_lock held.
+ */
+static int __io_remove_buffers(struct io_buffer_list *bl, unsigned nbufs)
 {
-	struct io_poll_iocb *poll = &req->poll;
-
-	spin_lock(&poll->head->lock);
-	WRITE_ONCE(poll->canceled, true);
-	if (!list_empty(&poll->wait.entry)) {
-		list_del_init(&poll->wait.entry);
-		queue_work(req->ctx->sqo_wq, &req->work);
+	struct io_buffer *kbuf;
+	unsigned i = 0;
+
+	while (i < nbufs && !list_empty(&bl->buf_list)) {
+		kbuf = list_first_entry(&bl->buf_list, struct io_buffer, list);
+		list_del(&kbuf->list);
+		kfree(kbuf);
+		i++;
 	}
-	spin_unlock(&poll->head->lock);
-
-	list_del_init(&req->list);
-}
-
-static void io_poll_remove_all(struct io_ring_ctx *ctx)
-{
-	struct io_kiocb *req;
 
-	spin_lock_irq(&ctx->completion_lock);
-	while (!list_empty(&ctx->cancel_list)) {
-		req = list_first_entry(&ctx->cancel_list, struct io_kiocb,list);
-		io_poll_remove_one(req);
-	}
-	spin_unlock_irq(&ctx->completion_lock);
+	return i;
 }
 
 /*
- * Find a running poll command that matches one specified in sqe->addr,
- * and remove it if found.
+ * IORING_OP_PROVIDE_BUFFERS: add sqe->fd buffers of sqe->len bytes, laid out
+ * back to back from sqe->addr, to the group in sqe->buf_group. They get the
+ * buffer IDs from sqe->off on. Posts the number of buffers added.
  */
-static int io_poll_remove(struct io_kiocb *req, const struct io_uring_sqe *sqe)
+static int io_provide_buffers(struct io_kiocb *req,
+			      const struct io_uring_sqe *sqe)
 {
 	struct io_ring_ctx *ctx = req->ctx;
-	struct io_kiocb *poll_req, *next;
-	int ret = -ENOENT;
+	u64 addr = READ_ONCE(sqe->addr);
+	u32 len = READ_ONCE(sqe->len);
+	s32 nbufs = READ_ONCE(sqe->fd);
+	u64 bid = READ_ONCE(sqe->off);
+	u16 bgid = READ_ONCE(sqe->buf_group);
+	struct io_buffer *kbuf, *tmp;
+	struct io_buffer_list *bl;
+	LIST_HEAD(bufs);
+	unsigned long size;
+	int i, ret;
 
-	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
+	if (unlikely(ctx->flags & IORING_SETUP_IOPOLL))
 		return -EINVAL;
-	if (sqe->ioprio || sqe->off || sqe->len || sqe->buf_index ||
-	    sqe->poll_events)
+	if (sqe->ioprio || sqe->rw_flags)
 		return -EINVAL;
+	if (nbufs <= 0 || bid + nbufs > USHRT_MAX + 1)
+		return -EINVAL;
+	if (!len || len > MAX_RW_COUNT)
+		return -EINVAL;
+	if (check_mul_overflow((unsigned long) len, (unsigned long) nbufs,
+			       &size))
+		return -EOVERFLOW;
+	if (!access_ok(u64_to_user_ptr(addr), size))
+		return -EFAULT;
 
-	spin_lock_irq(&ctx->completion_lock);
-	list_for_each_entry_safe(poll_req, next, &ctx->cancel_list, list) {
-		if (READ_ONCE(sqe->addr) == poll_req->user_data) {
-			io_poll_remove_one(poll_req);
-			ret = 0;
+	for (i = 0; i < nbufs; i++) {
+		kbuf = kmalloc(sizeof(*kbuf), GFP_KERNEL_ACCOUNT);
+		if (!kbuf)
 			break;
+
+		kbuf->addr = addr + (u64) i * len;
+		kbuf->len = len;
+		kbuf->bid = bid + i;
+		kbuf->bgid = bgid;
+		list_add_tail(&kbuf->list, &bufs);
+	}
+
+	mutex_lock(&ctx->buf_lock);
+	bl = idr_find(&ctx->io_buffer_idr, bgid);
+	if (!bl && i) {
+		bl = kmalloc(sizeof(*bl), GFP_KERNEL_ACCOUNT);
+		if (bl) {
+			INIT_LIST_HEAD(&bl->buf_list);
+			ret = idr_alloc(&ctx->io_buffer_idr, bl, bgid, bgid + 1,
+					GFP_KERNEL);
+			if (ret < 0) {
+				kfree(bl);
+				bl = NULL;
+			}
 		}
 	}
-	spin_unlock_irq(&ctx->completion_lock);
+	if (bl) {
+		list_splice_tail(&bufs, &bl->buf_list);
+		ret = i;
+	} else {
+		list_for_each_entry_safe(kbuf, tmp, &bufs, list)
+			kfree(kbuf);
+		ret = -ENOMEM;
+	}
+	mutex_unlock(&ctx->buf_lock);
 
-	io_cqring_add_event(req->ctx, sqe->user_data, ret);
+	if (ret < 0)
+		req_set_fail_links(req);
+	io_cqring_add_event(ctx, sqe->user_data, ret);
 	io_put_req(req);
 	return 0;
 }
 
-static void io_poll_complete(struct io_ring_ctx *ctx, struct io_kiocb *req,
-			     __poll_t mask)
+/*
+ * IORING_OP_REMOVE_BUFFERS: free up to sqe->fd buffers of the group in
+ * sqe->buf_group. Posts the number of buffers freed.
+ */
+static int io_remove_buffers(struct io_kiocb *req,
+			     const struct io_uring_sqe *sqe)
 {
-	req->poll.done = true;
-	io_cqring_fill_event(ctx, req->user_data, mangle_poll(mask));
-	io_commit_cqring(ctx);
-}
+	struct io_ring_ctx *ctx = req->ctx;
+	s32 nbufs = READ_ONCE(sqe->fd);
+	struct io_buffer_list *bl;
+	int ret;
+
+	if (unlikely(ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (sqe->ioprio || sqe->rw_flags || sqe->addr || sqe->len || sqe->off)
+		return -EINVAL;
+	if (nbufs <= 0)
+		return -EINVAL;
+
+	mutex_lock(&ctx->buf_lock);
+	bl = idr_find(&ctx->io_buffer_idr, READ_ONCE(sqe->buf_group));
+	ret = bl ? __io_remove_buffers(bl, nbufs) : -ENOENT;
+	mutex_unlock(&ctx->buf_lock);
+
+	if (ret < 0)
+		req_set_fail_links(req);
+	io_cqring_add_event(ctx, sqe->user_data, ret);
+	io_put_req(req);
+	return 0;
+}
+
+static void io_destroy_buffers(struct io_ring_ctx *ctx)
+{
+	struct io_buffer_list *bl;
+	int id;
+
+	idr_for_each_entry(&ctx->io_buffer_idr, bl, id) {
+		__io_remove_buffers(bl, -1U);
+		kfree(bl);
+	}
+	idr_destroy(&ctx->io_buffer_idr);
+}
+
+#if defined(CONFIG_NET)
+/*
+ * The socket operations are attempted with MSG_DONTWAIT on submission; an
+ * -EAGAIN is retried once the socket is ready, see io_poll_retry_arm(). If
+ * the application asked for MSG_DONTWAIT itself, the -EAGAIN is posted.
+ */
+static unsigned io_sock_flags(struct io_kiocb *req,
+			      const struct io_uring_sqe *sqe,
+			      bool force_nonblock)
+{
+	unsigned flags = READ_ONCE(sqe->msg_flags);
+
+	if (flags & MSG_DONTWAIT)
+		req->flags |= REQ_F_NOWAIT;
+	else if (force_nonblock)
+		flags |= MSG_DONTWAIT;
+
+	return flags;
+}
+
+static int io_send_recvmsg(struct io_kiocb *req, const struct sqe_submit *s,
+			   bool force_nonblock,
+		   long (*fn)(struct socket *, struct user_msghdr __user *,
+				unsigned int))
+{
+	const struct io_uring_sqe *sqe = s->sqe;
+	struct socket *sock;
+	int ret;
+
+	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (unlikely(sqe->ioprio || sqe->off || sqe->len || sqe->buf_index))
+		return -EINVAL;
+	if (!s->has_user)
+		return -EFAULT;
+
+	sock = sock_from_file(req->file, &ret);
+	if (sock) {
+		struct user_msghdr __user *msg;
+		unsigned flags;
+
+		flags = io_sock_flags(req, sqe, force_nonblock);
+		msg = u64_to_user_ptr(READ_ONCE(sqe->addr));
+
+		ret = fn(sock, msg, flags);
+		if (force_nonblock && ret == -EAGAIN)
+			return ret;
+	}
+
+	if (ret < 0)
+		req_set_fail_links(req);
+	io_cqring_add_event(req->ctx, sqe->user_data, ret);
+	io_put_req(req);
+	return 0;
+}
+
+static int io_send_recv(struct io_kiocb *req, const struct sqe_submit *s,
+			bool force_nonblock, int rw)
+{
+	const struct io_uring_sqe *sqe = s->sqe;
+	struct socket *sock;
+	int ret;
+
+	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (unlikely(sqe->ioprio || sqe->off))
+		return -EINVAL;
+	if (unlikely(sqe->buf_index && !(req->flags & REQ_F_BUFFER_SELECT)))
+		return -EINVAL;
+	if (!s->has_user)
+		return -EFAULT;
+
+	sock = sock_from_file(req->file, &ret);
+	if (sock) {
+		void __user *buf = u64_to_user_ptr(READ_ONCE(sqe->addr));
+		size_t len = READ_ONCE(sqe->len);
+		struct msghdr msg;
+		struct iovec iov;
+		unsigned flags;
+
+		/* sqe->len caps the receive, sqe->addr is ignored */
+		if (req->flags & REQ_F_BUFFER_SELECT) {
+			struct io_buffer *kbuf;
+
+			kbuf = io_buffer_select(req, sqe, &len);
+			if (IS_ERR(kbuf)) {
+				ret = PTR_ERR(kbuf);
+				goto out;
+			}
+			buf = u64_to_user_ptr(kbuf->addr);
+		}
+
+		ret = import_single_range(rw, buf, len, &iov, &msg.msg_iter);
+		if (ret)
+			goto out;
+
+		flags = io_sock_flags(req, sqe, force_nonblock);
+		msg.msg_name = NULL;
+		msg.msg_namelen = 0;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		msg.msg_iocb = NULL;
+		msg.msg_flags = flags;
+
+		if (rw == WRITE)
+			ret = sock_sendmsg(sock, &msg);
+		else
+			ret = sock_recvmsg(sock, &msg, flags);
+		if (force_nonblock && ret == -EAGAIN) {
+			/* don't hold the buffer while waiting for data */
+			io_recycle_kbuf(req);
+			return ret;
+		}
+	}
+
+out:
+	if (ret < 0)
+		req_set_fail_links(req);
+	__io_cqring_add_event(req->ctx, sqe->user_data, ret, io_put_kbuf(req));
+	io_put_req(req);
+	return 0;
+}
+#endif
+
+static int io_sendmsg(struct io_kiocb *req, const struct sqe_submit *s,
+		      bool force_nonblock)
+{
+#if defined(CONFIG_NET)
+	return io_send_recvmsg(req, s, force_nonblock, __sys_sendmsg_sock);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int io_recvmsg(struct io_kiocb *req, const struct sqe_submit *s,
+		      bool force_nonblock)
+{
+#if defined(CONFIG_NET)
+	return io_send_recvmsg(req, s, force_nonblock, __sys_recvmsg_sock);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
 
-static void io_poll_complete_work(struct work_struct *work)
+static int io_send(struct io_kiocb *req, const struct sqe_submit *s,
+		   bool force_nonblock)
+{
+#if defined(CONFIG_NET)
+	return io_send_recv(req, s, force_nonblock, WRITE);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int io_recv(struct io_kiocb *req, const struct sqe_submit *s,
+		   bool force_nonblock)
+{
+#if defined(CONFIG_NET)
+	return io_send_recv(req, s, force_nonblock, READ);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static void io_poll_remove_one(struct io_kiocb *req)
+{
+	struct io_poll_iocb *poll = &req->poll;
+
+	spin_lock(&poll->head->lock);
+	WRITE_ONCE(poll->canceled, true);
+	if (!list_empty(&poll->wait.entry)) {
+		list_del_init(&poll->wait.entry);
+		io_wq_enqueue(req->ctx->io_wq, &req->work);
+	}
+	spin_unlock(&poll->head->lock);
+
+	list_del_init(&req->list);
+}
+
+static void io_poll_remove_all(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	spin_lock_irq(&ctx->completion_lock);
+	while (!list_empty(&ctx->cancel_list)) {
+		req = list_first_entry(&ctx->cancel_list, struct io_kiocb,list);
+		io_poll_remove_one(req);
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+}
+
+/*
+ * Find a running poll command that matches one specified in sqe->addr,
+ * and remove it if found.
+ */
+static int io_poll_remove(struct io_kiocb *req, const struct io_uring_sqe *sqe)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_kiocb *poll_req, *next;
+	int ret = -ENOENT;
+
+	if (unlikely(req->ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (sqe->ioprio || sqe->off || sqe->len || sqe->buf_index ||
+	    sqe->poll_events)
+		return -EINVAL;
+
+	spin_lock_irq(&ctx->completion_lock);
+	list_for_each_entry_safe(poll_req, next, &ctx->cancel_list, list) {
+		if (READ_ONCE(sqe->addr) == poll_req->user_data) {
+			io_poll_remove_one(poll_req);
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+
+	if (ret < 0)
+		req_set_fail_links(req);
+	io_cqring_add_event(req->ctx, sqe->user_data, ret);
+	io_put_req(req);
+	return 0;
+}
+
+static void io_poll_complete(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			     __poll_t mask)
+{
+	req->poll.done = true;
+	io_cqring_fill_event(ctx, req->user_data, mangle_poll(mask));
+	io_commit_cqring(ctx);
+}
+
+static void io_poll_complete_work(struct io_wq_work *work)
 {
 	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
 	struct io_poll_iocb *poll = &req->poll;
@@ -1424,7 +2077,7 @@ static int io_poll_wake(struct wait_queue_entry *wait, unsigned mode, int sync,
 		io_cqring_ev_posted(ctx);
 		io_put_req(req);
 	} else {
-		queue_work(ctx->sqo_wq, &req->work);
+		io_wq_enqueue(ctx->io_wq, &req->work);
 	}
 
 	return 1;
@@ -1451,12 +2104,65 @@ static void io_poll_queue_proc(struct file *file, struct wait_queue_head *head,
 	add_wait_queue(head, &pt->req->poll.wait);
 }
 
+/*
+ * Arm @req->poll for @events with the wakeup callback @wake_func, and return
+ * the events that are already pending, in which case the waitqueue entry
+ * has been removed again and the caller completes the request itself.
+ * Otherwise the request is on ->cancel_list until it is woken, unless
+ * @ipt->error is set.
+ */
+static __poll_t io_poll_arm(struct io_kiocb *req, __poll_t events,
+			    wait_queue_func_t wake_func,
+			    struct io_poll_table *ipt)
+{
+	struct io_poll_iocb *poll = &req->poll;
+	struct io_ring_ctx *ctx = req->ctx;
+	bool cancel = false;
+	__poll_t mask;
+
+	poll->events = events;
+	poll->head = NULL;
+	poll->done = false;
+	poll->canceled = false;
+
+	ipt->pt._qproc = io_poll_queue_proc;
+	ipt->pt._key = poll->events;
+	ipt->req = req;
+	ipt->error = -EINVAL; /* same as no support for IOCB_CMD_POLL */
+
+	/* initialized the list so that we can do list_empty checks */
+	INIT_LIST_HEAD(&poll->wait.entry);
+	init_waitqueue_func_entry(&poll->wait, wake_func);
+
+	mask = vfs_poll(poll->file, &ipt->pt) & poll->events;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (likely(poll->head)) {
+		spin_lock(&poll->head->lock);
+		if (unlikely(list_empty(&poll->wait.entry))) {
+			if (ipt->error)
+				cancel = true;
+			ipt->error = 0;
+			mask = 0;
+		}
+		if (mask || ipt->error)
+			list_del_init(&poll->wait.entry);
+		else if (cancel)
+			WRITE_ONCE(poll->canceled, true);
+		else if (!poll->done) /* actually waiting for an event */
+			list_add_tail(&req->list, &ctx->cancel_list);
+		spin_unlock(&poll->head->lock);
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+
+	return mask;
+}
+
 static int io_poll_add(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 {
 	struct io_poll_iocb *poll = &req->poll;
 	struct io_ring_ctx *ctx = req->ctx;
 	struct io_poll_table ipt;
-	bool cancel = false;
 	__poll_t mask;
 	u16 events;
 
@@ -1467,53 +2173,343 @@ static int io_poll_add(struct io_kiocb *req, const struct io_uring_sqe *sqe)
 	if (!poll->file)
 		return -EBADF;
 
-	INIT_WORK(&req->work, io_poll_complete_work);
+	INIT_IO_WORK(&req->work, io_poll_complete_work);
 	events = READ_ONCE(sqe->poll_events);
-	poll->events = demangle_poll(events) | EPOLLERR | EPOLLHUP;
 
-	poll->head = NULL;
-	poll->done = false;
-	poll->canceled = false;
+	mask = io_poll_arm(req, demangle_poll(events) | EPOLLERR | EPOLLHUP,
+			   io_poll_wake, &ipt);
+	if (!mask)
+		return ipt.error;
+
+	/* no async, we'd stolen it */
+	spin_lock_irq(&ctx->completion_lock);
+	io_poll_complete(ctx, req, mask);
+	spin_unlock_irq(&ctx->completion_lock);
 
-	ipt.pt._qproc = io_poll_queue_proc;
-	ipt.pt._key = poll->events;
-	ipt.req = req;
-	ipt.error = -EINVAL; /* same as no support for IOCB_CMD_POLL */
+	io_cqring_ev_posted(ctx);
+	io_put_req(req);
+	return 0;
+}
 
-	/* initialized the list so that we can do list_empty checks */
-	INIT_LIST_HEAD(&poll->wait.entry);
-	init_waitqueue_func_entry(&poll->wait, io_poll_wake);
+/*
+ * The events a request waits for before it is retried, if it returned
+ * -EAGAIN for a forced non-blocking submission.
+ */
+static __poll_t io_op_poll_events(const struct io_uring_sqe *sqe)
+{
+	switch (READ_ONCE(sqe->opcode)) {
+	case IORING_OP_SENDMSG:
+	case IORING_OP_SEND:
+		return EPOLLOUT | EPOLLWRNORM;
+	case IORING_OP_RECVMSG:
+	case IORING_OP_RECV:
+		return EPOLLIN | EPOLLRDNORM;
+	default:
+		return 0;
+	}
+}
+
+static int io_poll_retry_wake(struct wait_queue_entry *wait, unsigned mode,
+			      int sync, void *key)
+{
+	struct io_poll_iocb *poll = container_of(wait, struct io_poll_iocb,
+							wait);
+	struct io_kiocb *req = container_of(poll, struct io_kiocb, poll);
+	__poll_t mask = key_to_poll(key);
+
+	/* for instances that support it check for an event match first: */
+	if (mask && !(mask & poll->events))
+		return 0;
+
+	/* a retry can finish before io_poll_arm(), keep it off ->cancel_list */
+	poll->done = true;
+	list_del_init(&poll->wait.entry);
+	io_wq_enqueue(req->ctx->io_wq, &req->work);
+	return 1;
+}
+
+/*
+ * Arm a poll for a request that got -EAGAIN, rather than punting it to a
+ * worker that blocks until it can make progress. io_poll_retry_work() is
+ * queued once the file is ready, and retries the request non-blocking. A
+ * pending retry is on ->cancel_list, like a IORING_OP_POLL_ADD.
+ *
+ * The caller has set up ->submit with a copy of the sqe. Returns false if
+ * the request or the file doesn't support this, the caller then punts it.
+ */
+static bool io_poll_retry_arm(struct io_kiocb *req)
+{
+	struct io_poll_table ipt;
+	__poll_t events, mask;
+
+	events = io_op_poll_events(req->submit.sqe);
+	if (!events || !file_can_poll(req->file))
+		return false;
+
+	INIT_LIST_HEAD(&req->list);
+	INIT_IO_WORK(&req->work, io_poll_retry_work);
+	req->work.flags |= IO_WQ_WORK_NEEDS_USER;
+
+	/* a wakeup can retry and free the request inside io_poll_arm() */
+	refcount_inc(&req->refs);
+	mask = io_poll_arm(req, events | EPOLLERR | EPOLLHUP,
+			   io_poll_retry_wake, &ipt);
+	if (mask)
+		io_wq_enqueue(req->ctx->io_wq, &req->work);
+	io_put_req(req);
+
+	return mask || !ipt.error;
+}
+
+/*
+ * Finish a request that was issued from a copy of its sqe, by a retry or by
+ * the submitter while arming one.
+ */
+static void io_retry_done(struct io_kiocb *req, int ret)
+{
+	const struct io_uring_sqe *sqe = req->submit.sqe;
+	struct io_ring_ctx *ctx = req->ctx;
+
+	/* drop submission reference */
+	io_put_req(req);
+
+	if (ret) {
+		io_cqring_add_event(ctx, sqe->user_data, ret);
+		req_set_fail_links(req);
+		io_put_req(req);
+	}
+
+	/* retries always use a copy of the sqe */
+	kfree(sqe);
+}
+
+static void io_poll_retry_work(struct io_wq_work *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct sqe_submit *s = &req->submit;
+	struct io_ring_ctx *ctx = req->ctx;
+	int ret;
+
+	spin_lock_irq(&ctx->completion_lock);
+	list_del_init(&req->list);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	ret = -ECANCELED;
+	if (READ_ONCE(req->poll.canceled))
+		goto out;
+
+	/* the worker runs with the mm of the ring, unless it is exiting */
+	ret = -EFAULT;
+	if (!current->mm)
+		goto out;
+
+	s->has_user = true;
+	s->needs_lock = true;
+	ret = __io_submit_sqe(ctx, req, s, true);
+	if (ret == -EAGAIN && !(req->flags & REQ_F_NOWAIT)) {
+		/* the request can be retried and freed as soon as it's armed */
+		if (io_poll_retry_arm(req))
+			return;
+		ret = __io_submit_sqe(ctx, req, s, false);
+	}
+out:
+	io_retry_done(req, ret);
+}
+
+static int io_page_retry_wake(struct wait_queue_entry *wait, unsigned mode,
+			      int sync, void *key)
+{
+	struct wait_page_queue *wpq = container_of(wait,
+					struct wait_page_queue, wait);
+	struct io_kiocb *req = container_of(wpq, struct io_kiocb, wpq);
+	int ret;
+
+	ret = wake_page_match(wpq, key);
+	if (ret != 1)
+		return ret;
+
+	list_del_init(&wait->entry);
+	io_page_retry_put(req);
+	return 1;
+}
+
+/*
+ * A buffered read of a regular file can't be polled, but it only blocks on
+ * pages that are not uptodate yet. Reissue it with IOCB_WAITQ, which starts
+ * readahead and queues ->wpq on the first page that is still locked, rather
+ * than returning -EAGAIN. io_page_retry_work() is queued once that page is
+ * unlocked and reissues the read, so no worker ever sleeps on the IO. Data
+ * that was already cached is returned as a short read.
+ *
+ * The caller has set up ->submit with a copy of the sqe. Returns false if
+ * the request or the file doesn't support this, the caller then punts it.
+ * Otherwise the request is waiting or already completed.
+ */
+static bool io_page_retry_arm(struct io_kiocb *req)
+{
+	struct sqe_submit *s = &req->submit;
+	u8 opcode = READ_ONCE(s->sqe->opcode);
+	int ret;
+
+	if (opcode != IORING_OP_READV && opcode != IORING_OP_READ_FIXED)
+		return false;
+	if (!req->file || !S_ISREG(file_inode(req->file)->i_mode) ||
+	    (req->file->f_flags & O_DIRECT))
+		return false;
+
+	init_waitqueue_func_entry(&req->wpq.wait, io_page_retry_wake);
+	INIT_IO_WORK(&req->work, io_page_retry_work);
+	if (io_sqe_needs_user(s->sqe))
+		req->work.flags |= IO_WQ_WORK_NEEDS_USER;
+
+	req->flags |= REQ_F_PAGE_WAIT;
+	ret = __io_submit_sqe(req->ctx, req, s, true);
+	if (ret == -EIOCBQUEUED)
+		return true;
+
+	req->flags &= ~REQ_F_PAGE_WAIT;
+	/* the filesystem doesn't take IOCB_WAITQ, have a worker block */
+	if (ret == -EAGAIN)
+		return false;
+
+	io_retry_done(req, ret);
+	return true;
+}
+
+static void io_page_retry_work(struct io_wq_work *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct sqe_submit *s = &req->submit;
+	struct io_ring_ctx *ctx = req->ctx;
+	int ret;
+
+	/* the worker runs with the mm of the ring, unless it is exiting */
+	ret = -EFAULT;
+	if (io_sqe_needs_user(s->sqe) && !current->mm)
+		goto out;
+
+	s->has_user = current->mm != NULL;
+	s->needs_lock = true;
+	ret = __io_submit_sqe(ctx, req, s, true);
+	if (ret == -EIOCBQUEUED)
+		return;
+	if (ret == -EAGAIN) {
+		req->flags &= ~REQ_F_PAGE_WAIT;
+		ret = __io_submit_sqe(ctx, req, s, false);
+	}
+out:
+	io_retry_done(req, ret);
+}
+
+static enum hrtimer_restart io_timeout_fn(struct hrtimer *timer)
+{
+	struct io_kiocb *req = container_of(timer, struct io_kiocb,
+						timeout.timer);
+	struct io_ring_ctx *ctx = req->ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	/*
+	 * io_kill_timeout() takes the request off the list, and leaves it to
+	 * us if it finds us running.
+	 */
+	list_del_init(&req->list);
+	ctx->cq_timeouts++;
+	io_cqring_fill_event(ctx, req->user_data, -ETIME);
+	io_commit_cqring(ctx);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	io_cqring_ev_posted(ctx);
+	io_put_req(req);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Complete a timeout with @res before it expired, called with the
+ * ->completion_lock held. A timeout can't be linked, so dropping the last
+ * reference here doesn't issue or fail other requests.
+ */
+static void io_kill_timeout(struct io_kiocb *req, long res)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+
+	list_del_init(&req->list);
+	if (hrtimer_try_to_cancel(&req->timeout.timer) == -1)
+		return;
+
+	ctx->cq_timeouts++;
+	io_cqring_fill_event(ctx, req->user_data, res);
+	io_put_req(req);
+}
+
+static void io_timeout_remove_all(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	spin_lock_irq(&ctx->completion_lock);
+	while (!list_empty(&ctx->timeout_list)) {
+		req = list_first_entry(&ctx->timeout_list, struct io_kiocb,
+					list);
+		io_kill_timeout(req, -ECANCELED);
+	}
+	io_commit_cqring(ctx);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	io_cqring_ev_posted(ctx);
+}
+
+/*
+ * IORING_OP_TIMEOUT completes with -ETIME once the timespec at sqe->addr has
+ * elapsed, or with 0 once sqe->off other requests have completed, if that is
+ * not zero. An application can block in io_uring_enter(2) for a number of
+ * events or a timeout this way.
+ */
+static int io_timeout(struct io_kiocb *req, const struct sqe_submit *s)
+{
+	const struct io_uring_sqe *sqe = s->sqe;
+	struct io_ring_ctx *ctx = req->ctx;
+	struct list_head *entry;
+	struct timespec64 ts;
+	unsigned count;
+
+	if (unlikely(ctx->flags & IORING_SETUP_IOPOLL))
+		return -EINVAL;
+	if (sqe->ioprio || sqe->buf_index || sqe->len != 1 ||
+	    sqe->timeout_flags)
+		return -EINVAL;
+	if (READ_ONCE(sqe->flags) & IOSQE_IO_LINK)
+		return -EINVAL;
+	if (!s->has_user)
+		return -EFAULT;
+	if (get_timespec64(&ts, u64_to_user_ptr(READ_ONCE(sqe->addr))))
+		return -EFAULT;
+
+	count = READ_ONCE(sqe->off);
+	hrtimer_init(&req->timeout.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	req->timeout.timer.function = io_timeout_fn;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (!count) {
+		req->flags |= REQ_F_TIMEOUT_NOSEQ;
+		entry = ctx->timeout_list.prev;
+	} else {
+		req->sequence = ctx->cached_cq_tail - ctx->cq_timeouts + count;
 
-	mask = vfs_poll(poll->file, &ipt.pt) & poll->events;
+		list_for_each_prev(entry, &ctx->timeout_list) {
+			struct io_kiocb *nxt = list_entry(entry,
+						struct io_kiocb, list);
 
-	spin_lock_irq(&ctx->completion_lock);
-	if (likely(poll->head)) {
-		spin_lock(&poll->head->lock);
-		if (unlikely(list_empty(&poll->wait.entry))) {
-			if (ipt.error)
-				cancel = true;
-			ipt.error = 0;
-			mask = 0;
+			if (nxt->flags & REQ_F_TIMEOUT_NOSEQ)
+				continue;
+			if ((int) (req->sequence - nxt->sequence) >= 0)
+				break;
 		}
-		if (mask || ipt.error)
-			list_del_init(&poll->wait.entry);
-		else if (cancel)
-			WRITE_ONCE(poll->canceled, true);
-		else if (!poll->done) /* actually waiting for an event */
-			list_add_tail(&req->list, &ctx->cancel_list);
-		spin_unlock(&poll->head->lock);
-	}
-	if (mask) { /* no async, we'd stolen it */
-		ipt.error = 0;
-		io_poll_complete(ctx, req, mask);
 	}
+	list_add(&req->list, entry);
+	hrtimer_start(&req->timeout.timer, timespec64_to_ktime(ts),
+			HRTIMER_MODE_REL);
 	spin_unlock_irq(&ctx->completion_lock);
-
-	if (mask) {
-		io_cqring_ev_posted(ctx);
-		io_put_req(req);
-	}
-	return ipt.error;
+	return 0;
 }
 
 static int io_req_defer(struct io_ring_ctx *ctx, struct io_kiocb *req,
@@ -1538,7 +2534,7 @@ static int io_req_defer(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	memcpy(sqe_copy, sqe, sizeof(*sqe_copy));
 	req->submit.sqe = sqe_copy;
 
-	INIT_WORK(&req->work, io_sq_wq_submit_work);
+	INIT_IO_WORK(&req->work, io_sq_wq_submit_work);
 	list_add_tail(&req->list, &ctx->defer_list);
 	spin_unlock_irq(&ctx->completion_lock);
 	return -EIOCBQUEUED;
@@ -1554,12 +2550,18 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	req->user_data = READ_ONCE(s->sqe->user_data);
 
 	opcode = READ_ONCE(s->sqe->opcode);
+	/* only the reads into a single buffer can pick a provided one */
+	if ((req->flags & REQ_F_BUFFER_SELECT) &&
+	    opcode != IORING_OP_READV && opcode != IORING_OP_RECV)
+		return -EINVAL;
+
 	switch (opcode) {
 	case IORING_OP_NOP:
 		ret = io_nop(req, req->user_data);
 		break;
 	case IORING_OP_READV:
-		if (unlikely(s->sqe->buf_index))
+		if (unlikely(s->sqe->buf_index &&
+			     !(req->flags & REQ_F_BUFFER_SELECT)))
 			return -EINVAL;
 		ret = io_read(req, s, force_nonblock);
 		break;
@@ -1586,6 +2588,27 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	case IORING_OP_SYNC_FILE_RANGE:
 		ret = io_sync_file_range(req, s->sqe, force_nonblock);
 		break;
+	case IORING_OP_SENDMSG:
+		ret = io_sendmsg(req, s, force_nonblock);
+		break;
+	case IORING_OP_RECVMSG:
+		ret = io_recvmsg(req, s, force_nonblock);
+		break;
+	case IORING_OP_SEND:
+		ret = io_send(req, s, force_nonblock);
+		break;
+	case IORING_OP_RECV:
+		ret = io_recv(req, s, force_nonblock);
+		break;
+	case IORING_OP_TIMEOUT:
+		ret = io_timeout(req, s);
+		break;
+	case IORING_OP_PROVIDE_BUFFERS:
+		ret = io_provide_buffers(req, s->sqe);
+		break;
+	case IORING_OP_REMOVE_BUFFERS:
+		ret = io_remove_buffers(req, s->sqe);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -1598,7 +2621,7 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 		if (req->error == -EAGAIN)
 			return -EAGAIN;
 
-		/* workqueue context doesn't hold uring_lock, grab it now */
+		/* async context doesn't hold uring_lock, grab it now */
 		if (s->needs_lock)
 			mutex_lock(&ctx->uring_lock);
 		io_iopoll_req_issued(req);
@@ -1609,167 +2632,48 @@ static int __io_submit_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
 	return 0;
 }
 
-static struct async_list *io_async_list_from_sqe(struct io_ring_ctx *ctx,
-						 const struct io_uring_sqe *sqe)
-{
-	switch (sqe->opcode) {
-	case IORING_OP_READV:
-	case IORING_OP_READ_FIXED:
-		return &ctx->pending_async[READ];
-	case IORING_OP_WRITEV:
-	case IORING_OP_WRITE_FIXED:
-		return &ctx->pending_async[WRITE];
-	default:
-		return NULL;
-	}
-}
-
-static inline bool io_sqe_needs_user(const struct io_uring_sqe *sqe)
-{
-	u8 opcode = READ_ONCE(sqe->opcode);
-
-	return !(opcode == IORING_OP_READ_FIXED ||
-		 opcode == IORING_OP_WRITE_FIXED);
-}
-
-static void io_sq_wq_submit_work(struct work_struct *work)
+static void io_sq_wq_submit_work(struct io_wq_work *work)
 {
 	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct sqe_submit *s = &req->submit;
+	const struct io_uring_sqe *sqe = s->sqe;
 	struct io_ring_ctx *ctx = req->ctx;
-	struct mm_struct *cur_mm = NULL;
-	struct async_list *async_list;
-	LIST_HEAD(req_list);
-	mm_segment_t old_fs;
-	int ret;
+	int ret = 0;
 
-	async_list = io_async_list_from_sqe(ctx, req->submit.sqe);
-restart:
-	do {
-		struct sqe_submit *s = &req->submit;
-		const struct io_uring_sqe *sqe = s->sqe;
+	/* Ensure we clear previously set non-block flag */
+	req->rw.ki_flags &= ~IOCB_NOWAIT;
 
-		/* Ensure we clear previously set non-block flag */
-		req->rw.ki_flags &= ~IOCB_NOWAIT;
+	/* the worker runs with the mm of the ring, unless it is exiting */
+	if (io_sqe_needs_user(sqe) && !current->mm)
+		ret = -EFAULT;
 
-		ret = 0;
-		if (io_sqe_needs_user(sqe) && !cur_mm) {
-			if (!mmget_not_zero(ctx->sqo_mm)) {
-				ret = -EFAULT;
-			} else {
-				cur_mm = ctx->sqo_mm;
-				use_mm(cur_mm);
-				old_fs = get_fs();
-				set_fs(USER_DS);
-			}
-		}
+	if (!ret) {
+		s->has_user = current->mm != NULL;
+		s->needs_lock = true;
+		do {
+			ret = __io_submit_sqe(ctx, req, s, false);
+			/*
+			 * We can get EAGAIN for polled IO even though we're
+			 * forcing a sync submission from here, since we can't
+			 * wait for request slots on the block side.
+			 */
+			if (ret != -EAGAIN)
+				break;
+			cond_resched();
+		} while (1);
+	}
 
-		if (!ret) {
-			s->has_user = cur_mm != NULL;
-			s->needs_lock = true;
-			do {
-				ret = __io_submit_sqe(ctx, req, s, false);
-				/*
-				 * We can get EAGAIN for polled IO even though
-				 * we're forcing a sync submission from here,
-				 * since we can't wait for request slots on the
-				 * block side.
-				 */
-				if (ret != -EAGAIN)
-					break;
-				cond_resched();
-			} while (1);
-		}
+	/* drop submission reference */
+	io_put_req(req);
 
-		/* drop submission reference */
+	if (ret) {
+		io_cqring_add_event(ctx, sqe->user_data, ret);
+		req_set_fail_links(req);
 		io_put_req(req);
-
-		if (ret) {
-			io_cqring_add_event(ctx, sqe->user_data, ret);
-			io_put_req(req);
-		}
-
-		/* async context always use a copy of the sqe */
-		kfree(sqe);
-
-		if (!async_list)
-			break;
-		if (!list_empty(&req_list)) {
-			req = list_first_entry(&req_list, struct io_kiocb,
-						list);
-			list_del(&req->list);
-			continue;
-		}
-		if (list_empty(&async_list->list))
-			break;
-
-		req = NULL;
-		spin_lock(&async_list->lock);
-		if (list_empty(&async_list->list)) {
-			spin_unlock(&async_list->lock);
-			break;
-		}
-		list_splice_init(&async_list->list, &req_list);
-		spin_unlock(&async_list->lock);
-
-		req = list_first_entry(&req_list, struct io_kiocb, list);
-		list_del(&req->list);
-	} while (req);
-
-	/*
-	 * Rare case of racing with a submitter. If we find the count has
-	 * dropped to zero AND we have pending work items, then restart
-	 * the processing. This is a tiny race window.
-	 */
-	if (async_list) {
-		ret = atomic_dec_return(&async_list->cnt);
-		while (!ret && !list_empty(&async_list->list)) {
-			spin_lock(&async_list->lock);
-			atomic_inc(&async_list->cnt);
-			list_splice_init(&async_list->list, &req_list);
-			spin_unlock(&async_list->lock);
-
-			if (!list_empty(&req_list)) {
-				req = list_first_entry(&req_list,
-							struct io_kiocb, list);
-				list_del(&req->list);
-				goto restart;
-			}
-			ret = atomic_dec_return(&async_list->cnt);
-		}
-	}
-
-	if (cur_mm) {
-		set_fs(old_fs);
-		unuse_mm(cur_mm);
-		mmput(cur_mm);
 	}
-}
 
-/*
- * See if we can piggy back onto previously submitted work, that is still
- * running. We currently only allow this if the new request is sequential
- * to the previous one we punted.
- */
-static bool io_add_to_prev_work(struct async_list *list, struct io_kiocb *req)
-{
-	bool ret = false;
-
-	if (!list)
-		return false;
-	if (!(req->flags & REQ_F_SEQ_PREV))
-		return false;
-	if (!atomic_read(&list->cnt))
-		return false;
-
-	ret = true;
-	spin_lock(&list->lock);
-	list_add_tail(&req->list, &list->list);
-	if (!atomic_read(&list->cnt)) {
-		list_del_init(&req->list);
-		ret = false;
-	}
-	spin_unlock(&list->lock);
-	return ret;
+	/* async context always use a copy of the sqe */
+	kfree(sqe);
 }
 
 static bool io_op_needs_file(const struct io_uring_sqe *sqe)
@@ -1779,6 +2683,9 @@ static bool io_op_needs_file(const struct io_uring_sqe *sqe)
 	switch (op) {
 	case IORING_OP_NOP:
 	case IORING_OP_POLL_REMOVE:
+	case IORING_OP_TIMEOUT:
+	case IORING_OP_PROVIDE_BUFFERS:
+	case IORING_OP_REMOVE_BUFFERS:
 		return false;
 	default:
 		return true;
@@ -1798,6 +2705,8 @@ static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 		req->flags |= REQ_F_IO_DRAIN;
 		req->sequence = ctx->cached_sq_head - 1;
 	}
+	if (flags & IOSQE_BUFFER_SELECT)
+		req->flags |= REQ_F_BUFFER_SELECT;
 
 	if (!io_op_needs_file(s->sqe))
 		return 0;
@@ -1806,8 +2715,13 @@ static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 		if (unlikely(!ctx->user_files ||
 		    (unsigned) fd >= ctx->nr_user_files))
 			return -EBADF;
+		fd = array_index_nospec(fd, ctx->nr_user_files);
 		req->file = ctx->user_files[fd];
+		if (unlikely(!req->file))
+			return -EBADF;
 		req->flags |= REQ_F_FIXED_FILE;
+		req->file_node = ctx->file_node;
+		percpu_ref_get(&req->file_node->refs);
 	} else {
 		if (s->needs_fixed_file)
 			return -EBADF;
@@ -1819,29 +2733,16 @@ static int io_req_set_file(struct io_ring_ctx *ctx, const struct sqe_submit *s,
 	return 0;
 }
 
-static int io_submit_sqe(struct io_ring_ctx *ctx, struct sqe_submit *s,
-			 struct io_submit_state *state)
+static int io_queue_sqe(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			struct sqe_submit *s)
 {
-	struct io_kiocb *req;
 	int ret;
 
-	/* enforce forwards compatibility on users */
-	if (unlikely(s->sqe->flags & ~(IOSQE_FIXED_FILE | IOSQE_IO_DRAIN)))
-		return -EINVAL;
-
-	req = io_get_req(ctx, state);
-	if (unlikely(!req))
-		return -EAGAIN;
-
-	ret = io_req_set_file(ctx, s, state, req);
-	if (unlikely(ret))
-		goto out;
-
 	ret = io_req_defer(ctx, req, s->sqe);
 	if (ret) {
 		if (ret == -EIOCBQUEUED)
-			ret = 0;
-		return ret;
+			return 0;
+		goto out;
 	}
 
 	ret = __io_submit_sqe(ctx, req, s, true);
@@ -1850,24 +2751,22 @@ static int io_submit_sqe(struct io_ring_ctx *ctx, struct sqe_submit *s,
 
 		sqe_copy = kmalloc(sizeof(*sqe_copy), GFP_KERNEL);
 		if (sqe_copy) {
-			struct async_list *list;
-
 			memcpy(sqe_copy, s->sqe, sizeof(*sqe_copy));
 			s->sqe = sqe_copy;
 
-			memcpy(&req->submit, s, sizeof(*s));
-			list = io_async_list_from_sqe(ctx, s->sqe);
-			if (!io_add_to_prev_work(list, req)) {
-				if (list)
-					atomic_inc(&list->cnt);
-				INIT_WORK(&req->work, io_sq_wq_submit_work);
-				queue_work(ctx->sqo_wq, &req->work);
-			}
+			/* a link head is queued from its own ->submit */
+			if (s != &req->submit)
+				req->submit = *s;
+			if (io_poll_retry_arm(req) || io_page_retry_arm(req))
+				return 0;
+
+			INIT_IO_WORK(&req->work, io_sq_wq_submit_work);
+			io_queue_async_work(ctx, req);
 
 			/*
-			 * Queued up for async execution, worker will release
-			 * submit reference when the iocb is actually
-			 * submitted.
+			 * Queued up for async execution or armed for a retry,
+			 * worker will release submit reference when the iocb
+			 * is actually submitted.
 			 */
 			return 0;
 		}
@@ -1878,9 +2777,92 @@ static int io_submit_sqe(struct io_ring_ctx *ctx, struct sqe_submit *s,
 	io_put_req(req);
 
 	/* and drop final reference, if we failed */
-	if (ret)
+	if (ret) {
+		req_set_fail_links(req);
 		io_put_req(req);
+	}
+
+	return ret;
+}
+
+/*
+ * Queue the head of a chain, once all of its requests have been submitted.
+ */
+static void io_queue_link_head(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	u64 user_data = READ_ONCE(req->submit.sqe->user_data);
+	int ret;
+
+	ret = io_queue_sqe(ctx, req, &req->submit);
+	if (ret)
+		io_cqring_add_event(ctx, user_data, ret);
+}
+
+#define SQE_VALID_FLAGS	(IOSQE_FIXED_FILE|IOSQE_IO_DRAIN|IOSQE_IO_LINK|\
+			 IOSQE_BUFFER_SELECT)
+
+static int io_submit_sqe(struct io_ring_ctx *ctx, struct sqe_submit *s,
+			 struct io_submit_state *state, struct io_kiocb **link)
+{
+	struct io_kiocb *req;
+	int ret;
+
+	/* enforce forwards compatibility on users */
+	if (unlikely(s->sqe->flags & ~SQE_VALID_FLAGS)) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	req = io_get_req(ctx, state);
+	if (unlikely(!req)) {
+		ret = -EAGAIN;
+		goto err;
+	}
+
+	ret = io_req_set_file(ctx, s, state, req);
+	if (unlikely(ret))
+		goto err_req;
 
+	/*
+	 * If we already have a head request, queue this one for async
+	 * submittal once the head completes. If we don't have a head but
+	 * IOSQE_IO_LINK is set in the sqe, start a new head. This one will be
+	 * submitted sync once the chain is complete. If none of those
+	 * conditions are true (normal request), then just queue it.
+	 */
+	if (*link) {
+		struct io_uring_sqe *sqe_copy;
+
+		sqe_copy = kmemdup(s->sqe, sizeof(*sqe_copy), GFP_KERNEL);
+		if (!sqe_copy) {
+			ret = -EAGAIN;
+			goto err_req;
+		}
+
+		s->sqe = sqe_copy;
+		memcpy(&req->submit, s, sizeof(*s));
+		list_add_tail(&req->list, &(*link)->link_list);
+	} else if (s->sqe->flags & IOSQE_IO_LINK) {
+		req->flags |= REQ_F_LINK;
+
+		memcpy(&req->submit, s, sizeof(*s));
+		INIT_LIST_HEAD(&req->link_list);
+		*link = req;
+	} else {
+		return io_queue_sqe(ctx, req, s);
+	}
+
+	return 0;
+
+err_req:
+	__io_free_req(req);
+err:
+	/*
+	 * The rest of the chain is canceled once its head completes, or by the
+	 * caller if this was the head.
+	 */
+	if (*link)
+		(*link)->flags |= REQ_F_FAIL_LINK;
 	return ret;
 }
 
@@ -1902,7 +2884,7 @@ static void io_submit_state_end(struct io_submit_state *state)
 static void io_submit_state_start(struct io_submit_state *state,
 				  struct io_ring_ctx *ctx, unsigned max_ios)
 {
-	blk_start_plug(&state->plug);
+	blk_start_plug_nr_ios(&state->plug, max_ios);
 	state->free_reqs = 0;
 	state->file = NULL;
 	state->ios_left = max_ios;
@@ -1966,6 +2948,9 @@ static int io_submit_sqes(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
 			  unsigned int nr, bool has_user, bool mm_fault)
 {
 	struct io_submit_state state, *statep = NULL;
+	struct io_kiocb *link = NULL;
+	bool prev_was_link = false;
+	bool fail_link = false;
 	int ret, i, submitted = 0;
 
 	if (nr > IO_PLUG_THRESHOLD) {
@@ -1974,162 +2959,256 @@ static int io_submit_sqes(struct io_ring_ctx *ctx, struct sqe_submit *sqes,
 	}
 
 	for (i = 0; i < nr; i++) {
-		if (unlikely(mm_fault)) {
+		/*
+		 * If previous wasn't linked and we have a linked command,
+		 * that's the end of the chain. Submit the previous link.
+		 */
+		if (!prev_was_link) {
+			if (link) {
+				io_queue_link_head(ctx, link);
+				link = NULL;
+			}
+			fail_link = false;
+		}
+		prev_was_link = (READ_ONCE(sqes[i].sqe->flags) &
+					IOSQE_IO_LINK) != 0;
+
+		if (fail_link) {
+			ret = -ECANCELED;
+		} else if (unlikely(mm_fault)) {
 			ret = -EFAULT;
 		} else {
 			sqes[i].has_user = has_user;
-			sqes[i].needs_lock = true;
+			/* io_sq_thread_pass() holds ->uring_lock */
+			sqes[i].needs_lock = false;
 			sqes[i].needs_fixed_file = true;
-			ret = io_submit_sqe(ctx, &sqes[i], statep);
+			ret = io_submit_sqe(ctx, &sqes[i], statep, &link);
 		}
 		if (!ret) {
 			submitted++;
 			continue;
 		}
 
+		/* the head of a chain failed, cancel the rest of the chain */
+		if (!link && prev_was_link)
+			fail_link = true;
 		io_cqring_add_event(ctx, sqes[i].sqe->user_data, ret);
 	}
 
+	if (link)
+		io_queue_link_head(ctx, link);
 	if (statep)
 		io_submit_state_end(&state);
 
 	return submitted;
 }
 
-static int io_sq_thread(void *data)
+static bool io_sqring_pending(struct io_ring_ctx *ctx)
 {
-	struct sqe_submit sqes[IO_IOPOLL_BATCH];
-	struct io_ring_ctx *ctx = data;
-	struct mm_struct *cur_mm = NULL;
-	mm_segment_t old_fs;
-	DEFINE_WAIT(wait);
-	unsigned inflight;
-	unsigned long timeout;
+	return ctx->cached_sq_head != smp_load_acquire(&ctx->sq_ring->r.tail);
+}
 
-	old_fs = get_fs();
-	set_fs(USER_DS);
+static void io_sq_thread_drop_mm(struct mm_struct **cur_mm)
+{
+	if (*cur_mm) {
+		unuse_mm(*cur_mm);
+		mmput(*cur_mm);
+		*cur_mm = NULL;
+	}
+}
 
-	timeout = inflight = 0;
-	while (!kthread_should_park()) {
-		bool all_fixed, mm_fault = false;
-		int i;
-
-		if (inflight) {
-			unsigned nr_events = 0;
-
-			if (ctx->flags & IORING_SETUP_IOPOLL) {
-				/*
-				 * We disallow the app entering submit/complete
-				 * with polling, but we still need to lock the
-				 * ring to prevent racing with polled issue
-				 * that got punted to a workqueue.
-				 */
-				mutex_lock(&ctx->uring_lock);
-				io_iopoll_check(ctx, &nr_events, 0);
-				mutex_unlock(&ctx->uring_lock);
-			} else {
-				/*
-				 * Normal IO, just pretend everything completed.
-				 * We don't have to poll completions for that.
-				 */
-				nr_events = inflight;
-			}
+/*
+ * One pass of the SQ poll thread over a ring: reap its polled completions,
+ * and submit at most IO_IOPOLL_BATCH sqes, so that a busy ring doesn't starve
+ * the others sharing the thread. Returns true if the ring has IO in flight
+ * or had sqes.
+ */
+static bool io_sq_thread_pass(struct io_ring_ctx *ctx,
+			      struct mm_struct **cur_mm)
+{
+	struct sqe_submit sqes[IO_IOPOLL_BATCH];
+	struct io_sq_stats *stats = &ctx->sq_stats;
+	bool all_fixed, mm_fault = false;
+	s64 wait;
+	u64 now;
+	int i;
 
-			inflight -= nr_events;
-			if (!inflight)
-				timeout = jiffies + ctx->sq_thread_idle;
-		}
+	if (ctx->sq_inflight) {
+		unsigned nr_events = 0;
 
-		if (!io_get_sqring(ctx, &sqes[0])) {
+		if (ctx->flags & IORING_SETUP_IOPOLL) {
 			/*
-			 * We're polling. If we're within the defined idle
-			 * period, then let us spin without work before going
-			 * to sleep.
+			 * We disallow the app entering submit/complete
+			 * with polling, but we still need to lock the
+			 * ring to prevent racing with polled issue
+			 * that got punted to a worker.
 			 */
-			if (inflight || !time_after(jiffies, timeout)) {
-				cpu_relax();
-				continue;
-			}
-
+			mutex_lock(&ctx->uring_lock);
+			io_iopoll_check(ctx, &nr_events, 0);
+			mutex_unlock(&ctx->uring_lock);
+		} else {
 			/*
-			 * Drop cur_mm before scheduling, we can't hold it for
-			 * long periods (or over schedule()). Do this before
-			 * adding ourselves to the waitqueue, as the unuse/drop
-			 * may sleep.
+			 * Normal IO, just pretend everything completed.
+			 * We don't have to poll completions for that.
 			 */
-			if (cur_mm) {
-				unuse_mm(cur_mm);
-				mmput(cur_mm);
-				cur_mm = NULL;
-			}
+			nr_events = ctx->sq_inflight;
+		}
 
-			prepare_to_wait(&ctx->sqo_wait, &wait,
-						TASK_INTERRUPTIBLE);
+		ctx->sq_inflight -= nr_events;
+	}
 
-			/* Tell userspace we may need a wakeup call */
-			ctx->sq_ring->flags |= IORING_SQ_NEED_WAKEUP;
-			/* make sure to read SQ tail after writing flags */
-			smp_mb();
+	now = local_clock();
+	if (!io_sqring_pending(ctx)) {
+		stats->last_poll = now;
+		return ctx->sq_inflight != 0;
+	}
 
-			if (!io_get_sqring(ctx, &sqes[0])) {
-				if (kthread_should_park()) {
-					finish_wait(&ctx->sqo_wait, &wait);
-					break;
-				}
-				if (signal_pending(current))
-					flush_signals(current);
-				schedule();
-				finish_wait(&ctx->sqo_wait, &wait);
+	/*
+	 * Submit under ->uring_lock, like io_uring_enter(2), so that the fixed
+	 * file table is stable. Don't wait for it, io_uring_register(2) may
+	 * hold it while it parks this thread.
+	 */
+	if (!mutex_trylock(&ctx->uring_lock))
+		return true;
+	if (!io_get_sqring(ctx, &sqes[0])) {
+		mutex_unlock(&ctx->uring_lock);
+		stats->last_poll = now;
+		return ctx->sq_inflight != 0;
+	}
 
-				ctx->sq_ring->flags &= ~IORING_SQ_NEED_WAKEUP;
-				continue;
-			}
-			finish_wait(&ctx->sqo_wait, &wait);
+	i = 0;
+	all_fixed = true;
+	do {
+		if (all_fixed && io_sqe_needs_user(sqes[i].sqe))
+			all_fixed = false;
 
-			ctx->sq_ring->flags &= ~IORING_SQ_NEED_WAKEUP;
+		i++;
+		if (i == ARRAY_SIZE(sqes))
+			break;
+	} while (io_get_sqring(ctx, &sqes[i]));
+
+	/* Unless all new commands are FIXED regions, grab the ring's mm */
+	if (!all_fixed && *cur_mm != ctx->sqo_mm) {
+		io_sq_thread_drop_mm(cur_mm);
+		mm_fault = !mmget_not_zero(ctx->sqo_mm);
+		if (!mm_fault) {
+			use_mm(ctx->sqo_mm);
+			*cur_mm = ctx->sqo_mm;
+		}
+	}
+
+	ctx->sq_inflight += io_submit_sqes(ctx, sqes, i,
+					   *cur_mm == ctx->sqo_mm, mm_fault);
+
+	/* Commit SQ ring head once we've consumed all SQEs */
+	io_commit_sqring(ctx);
+	mutex_unlock(&ctx->uring_lock);
+
+	wait = now - stats->last_poll;
+	if (wait < 0)
+		wait = 0;
+	stats->nr_sqes += i;
+	stats->nr_batches++;
+	stats->wait_ns += wait;
+	if (wait > stats->wait_max_ns)
+		stats->wait_max_ns = wait;
+	stats->last_poll = local_clock();
+	return true;
+}
+
+static void io_sq_thread_reset_stats(struct io_sq_data *sqd)
+{
+	struct io_ring_ctx *ctx;
+	u64 now = local_clock();
+
+	/* the sqes queued meanwhile waited for a wakeup, not for a pass */
+	list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+		ctx->sq_stats.last_poll = now;
+}
+
+static int io_sq_thread(void *data)
+{
+	struct io_sq_data *sqd = data;
+	struct mm_struct *cur_mm = NULL;
+	struct io_ring_ctx *ctx;
+	mm_segment_t old_fs;
+	DEFINE_WAIT(wait);
+	unsigned long timeout;
+	bool busy;
+
+	old_fs = get_fs();
+	set_fs(USER_DS);
+
+	io_sq_thread_reset_stats(sqd);
+	timeout = jiffies + sqd->sq_thread_idle;
+	while (!kthread_should_stop()) {
+		/* rings are attached and detached while we're parked */
+		if (kthread_should_park()) {
+			io_sq_thread_drop_mm(&cur_mm);
+			kthread_parkme();
+			io_sq_thread_reset_stats(sqd);
+			timeout = jiffies + sqd->sq_thread_idle;
+			continue;
+		}
+
+		busy = false;
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			busy |= io_sq_thread_pass(ctx, &cur_mm);
+
+		/*
+		 * We're polling. If any ring had work within the idle period,
+		 * then let us spin without work before going to sleep.
+		 */
+		if (busy)
+			timeout = jiffies + sqd->sq_thread_idle;
+		if (!time_after(jiffies, timeout)) {
+			cpu_relax();
+			continue;
 		}
 
-		i = 0;
-		all_fixed = true;
-		do {
-			if (all_fixed && io_sqe_needs_user(sqes[i].sqe))
-				all_fixed = false;
+		/*
+		 * Drop cur_mm before scheduling, we can't hold it for
+		 * long periods (or over schedule()). Do this before
+		 * adding ourselves to the waitqueue, as the unuse/drop
+		 * may sleep.
+		 */
+		io_sq_thread_drop_mm(&cur_mm);
 
-			i++;
-			if (i == ARRAY_SIZE(sqes))
-				break;
-		} while (io_get_sqring(ctx, &sqes[i]));
-
-		/* Unless all new commands are FIXED regions, grab mm */
-		if (!all_fixed && !cur_mm) {
-			mm_fault = !mmget_not_zero(ctx->sqo_mm);
-			if (!mm_fault) {
-				use_mm(ctx->sqo_mm);
-				cur_mm = ctx->sqo_mm;
-			}
-		}
+		prepare_to_wait(&sqd->wait, &wait, TASK_INTERRUPTIBLE);
 
-		inflight += io_submit_sqes(ctx, sqes, i, cur_mm != NULL,
-						mm_fault);
+		/* Tell userspace we may need a wakeup call */
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			ctx->sq_ring->flags |= IORING_SQ_NEED_WAKEUP;
+		/* make sure to read SQ tail after writing flags */
+		smp_mb();
+
+		busy = kthread_should_park() || kthread_should_stop();
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			busy |= io_sqring_pending(ctx);
+		if (!busy) {
+			if (signal_pending(current))
+				flush_signals(current);
+			schedule();
+		}
+		finish_wait(&sqd->wait, &wait);
 
-		/* Commit SQ ring head once we've consumed all SQEs */
-		io_commit_sqring(ctx);
+		list_for_each_entry(ctx, &sqd->ctx_list, sqd_list)
+			ctx->sq_ring->flags &= ~IORING_SQ_NEED_WAKEUP;
+		io_sq_thread_reset_stats(sqd);
+		timeout = jiffies + sqd->sq_thread_idle;
 	}
 
 	set_fs(old_fs);
-	if (cur_mm) {
-		unuse_mm(cur_mm);
-		mmput(cur_mm);
-	}
-
-	kthread_parkme();
-
+	io_sq_thread_drop_mm(&cur_mm);
 	return 0;
 }
 
 static int io_ring_submit(struct io_ring_ctx *ctx, unsigned int to_submit)
 {
 	struct io_submit_state state, *statep = NULL;
+	struct io_kiocb *link = NULL;
+	bool prev_was_link = false;
+	bool fail_link = false;
 	int i, submit = 0;
 
 	if (to_submit > IO_PLUG_THRESHOLD) {
@@ -2144,15 +3223,38 @@ static int io_ring_submit(struct io_ring_ctx *ctx, unsigned int to_submit)
 		if (!io_get_sqring(ctx, &s))
 			break;
 
+		/*
+		 * If previous wasn't linked and we have a linked command,
+		 * that's the end of the chain. Submit the previous link.
+		 */
+		if (!prev_was_link) {
+			if (link) {
+				io_queue_link_head(ctx, link);
+				link = NULL;
+			}
+			fail_link = false;
+		}
+		prev_was_link = (READ_ONCE(s.sqe->flags) & IOSQE_IO_LINK) != 0;
+
 		s.has_user = true;
 		s.needs_lock = false;
 		s.needs_fixed_file = false;
 		submit++;
 
-		ret = io_submit_sqe(ctx, &s, statep);
-		if (ret)
+		if (fail_link)
+			ret = -ECANCELED;
+		else
+			ret = io_submit_sqe(ctx, &s, statep, &link);
+		if (ret) {
+			/* the head of a chain failed, cancel the rest of it */
+			if (!link && prev_was_link)
+				fail_link = true;
 			io_cqring_add_event(ctx, s.sqe->user_data, ret);
+		}
 	}
+
+	if (link)
+		io_queue_link_head(ctx, link);
 	io_commit_sqring(ctx);
 
 	if (statep)
@@ -2207,6 +3309,81 @@ static int io_cqring_wait(struct io_ring_ctx *ctx, int min_events,
 	return READ_ONCE(ring->r.head) == READ_ONCE(ring->r.tail) ? ret : 0;
 }
 
+static void io_ring_file_put(struct io_ring_ctx *ctx, struct file *file);
+
+static void io_file_ref_node_work(struct work_struct *work)
+{
+	struct io_file_ref_node *node = container_of(work,
+					struct io_file_ref_node, work);
+	struct io_ring_ctx *ctx = node->ctx;
+	struct io_file_put *pfile, *tmp;
+
+	list_for_each_entry_safe(pfile, tmp, &node->file_list, list) {
+		io_ring_file_put(ctx, pfile->file);
+		kfree(pfile);
+	}
+
+	/* the files of the next generation may go now */
+	if (node->next)
+		percpu_ref_put(&node->next->refs);
+	percpu_ref_exit(&node->refs);
+	kfree(node);
+
+	if (atomic_dec_and_test(&ctx->nr_file_nodes))
+		wake_up_var(&ctx->nr_file_nodes);
+}
+
+static void io_file_ref_node_release(struct percpu_ref *ref)
+{
+	struct io_file_ref_node *node = container_of(ref,
+					struct io_file_ref_node, refs);
+
+	/* the last request may go away in irq context */
+	schedule_work(&node->work);
+}
+
+static struct io_file_ref_node *io_file_ref_node_alloc(struct io_ring_ctx *ctx)
+{
+	struct io_file_ref_node *node;
+
+	node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (!node)
+		return NULL;
+
+	if (percpu_ref_init(&node->refs, io_file_ref_node_release, 0,
+			    GFP_KERNEL)) {
+		kfree(node);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&node->file_list);
+	INIT_WORK(&node->work, io_file_ref_node_work);
+	node->ctx = ctx;
+	atomic_inc(&ctx->nr_file_nodes);
+	return node;
+}
+
+static void io_file_ref_node_free(struct io_file_ref_node *node)
+{
+	atomic_dec(&node->ctx->nr_file_nodes);
+	percpu_ref_exit(&node->refs);
+	kfree(node);
+}
+
+/*
+ * Make @node the current generation, the files queued on the previous one are
+ * put once the requests that may still use them are gone.
+ */
+static void io_file_ref_node_switch(struct io_ring_ctx *ctx,
+				    struct io_file_ref_node *node)
+{
+	struct io_file_ref_node *prev = ctx->file_node;
+
+	percpu_ref_get(&node->refs);
+	prev->next = node;
+	ctx->file_node = node;
+	percpu_ref_kill(&prev->refs);
+}
+
 static void __io_sqe_files_unregister(struct io_ring_ctx *ctx)
 {
 #if defined(CONFIG_UNIX)
@@ -2221,7 +3398,8 @@ static void __io_sqe_files_unregister(struct io_ring_ctx *ctx)
 	int i;
 
 	for (i = 0; i < ctx->nr_user_files; i++)
-		fput(ctx->user_files[i]);
+		if (ctx->user_files[i])
+			fput(ctx->user_files[i]);
 #endif
 }
 
@@ -2230,34 +3408,138 @@ static int io_sqe_files_unregister(struct io_ring_ctx *ctx)
 	if (!ctx->user_files)
 		return -ENXIO;
 
+	/* the files replaced by updates must be put before the rest */
+	percpu_ref_kill(&ctx->file_node->refs);
+	ctx->file_node = NULL;
+	wait_var_event(&ctx->nr_file_nodes, !atomic_read(&ctx->nr_file_nodes));
+
 	__io_sqe_files_unregister(ctx);
-	kfree(ctx->user_files);
+	kvfree(ctx->user_files);
 	ctx->user_files = NULL;
 	ctx->nr_user_files = 0;
 	return 0;
 }
 
+static int io_sq_data_create(struct io_ring_ctx *ctx,
+			     struct io_uring_params *p)
+{
+	struct io_sq_data *sqd;
+	int ret;
+
+	sqd = kzalloc(sizeof(*sqd), GFP_KERNEL);
+	if (!sqd)
+		return -ENOMEM;
+
+	refcount_set(&sqd->refs, 1);
+	mutex_init(&sqd->lock);
+	INIT_LIST_HEAD(&sqd->ctx_list);
+	init_waitqueue_head(&sqd->wait);
+	sqd->sq_thread_idle = ctx->sq_thread_idle;
+	list_add(&ctx->sqd_list, &sqd->ctx_list);
+
+	if (p->flags & IORING_SETUP_SQ_AFF) {
+		int cpu = p->sq_thread_cpu;
+
+		ret = -EINVAL;
+		if (cpu >= nr_cpu_ids)
+			goto err;
+		if (!cpu_online(cpu))
+			goto err;
+
+		sqd->thread = kthread_create_on_cpu(io_sq_thread, sqd, cpu,
+						    "io_uring-sq");
+	} else {
+		sqd->thread = kthread_create(io_sq_thread, sqd, "io_uring-sq");
+	}
+	if (IS_ERR(sqd->thread)) {
+		ret = PTR_ERR(sqd->thread);
+		goto err;
+	}
+
+	ctx->sq_data = sqd;
+	wake_up_process(sqd->thread);
+	return 0;
+err:
+	kfree(sqd);
+	return ret;
+}
+
+/*
+ * Have the SQ poll thread of the ring behind @fd serve @ctx as well. Its file
+ * reference keeps that ring, hence the thread, alive meanwhile.
+ */
+static int io_sq_data_attach(struct io_ring_ctx *ctx, int fd)
+{
+	struct io_sq_data *sqd;
+	struct fd f;
+	int ret;
+
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+
+	ret = -EINVAL;
+	if (f.file->f_op != &io_uring_fops)
+		goto out;
+	sqd = ((struct io_ring_ctx *) f.file->private_data)->sq_data;
+	if (!sqd)
+		goto out;
+
+	refcount_inc(&sqd->refs);
+	mutex_lock(&sqd->lock);
+	kthread_park(sqd->thread);
+	list_add_tail(&ctx->sqd_list, &sqd->ctx_list);
+	sqd->sq_thread_idle = max(sqd->sq_thread_idle, ctx->sq_thread_idle);
+	ctx->sq_data = sqd;
+	kthread_unpark(sqd->thread);
+	mutex_unlock(&sqd->lock);
+	ret = 0;
+out:
+	fdput(f);
+	return ret;
+}
+
 static void io_sq_thread_stop(struct io_ring_ctx *ctx)
 {
-	if (ctx->sqo_thread) {
-		/*
-		 * The park is a bit of a work-around, without it we get
-		 * warning spews on shutdown with SQPOLL set and affinity
-		 * set to a single CPU.
-		 */
-		kthread_park(ctx->sqo_thread);
-		kthread_stop(ctx->sqo_thread);
-		ctx->sqo_thread = NULL;
+	struct io_sq_data *sqd = ctx->sq_data;
+	struct io_ring_ctx *iter;
+
+	if (!sqd)
+		return;
+
+	/*
+	 * The park is a bit of a work-around, without it we get
+	 * warning spews on shutdown with SQPOLL set and affinity
+	 * set to a single CPU. It also keeps the thread off the
+	 * list of rings while we leave it.
+	 */
+	mutex_lock(&sqd->lock);
+	kthread_park(sqd->thread);
+	list_del(&ctx->sqd_list);
+	ctx->sq_data = NULL;
+
+	if (refcount_dec_and_test(&sqd->refs)) {
+		mutex_unlock(&sqd->lock);
+		kthread_stop(sqd->thread);
+		kfree(sqd);
+		return;
 	}
+
+	sqd->sq_thread_idle = 0;
+	list_for_each_entry(iter, &sqd->ctx_list, sqd_list)
+		sqd->sq_thread_idle = max(sqd->sq_thread_idle,
+					  iter->sq_thread_idle);
+	kthread_unpark(sqd->thread);
+	mutex_unlock(&sqd->lock);
 }
 
 static void io_finish_async(struct io_ring_ctx *ctx)
 {
 	io_sq_thread_stop(ctx);
 
-	if (ctx->sqo_wq) {
-		destroy_workqueue(ctx->sqo_wq);
-		ctx->sqo_wq = NULL;
+	if (ctx->io_wq) {
+		io_wq_destroy(ctx->io_wq);
+		ctx->io_wq = NULL;
 	}
 }
 
@@ -2275,15 +3557,23 @@ static void io_destruct_skb(struct sk_buff *skb)
  * the io_uring can be safely unregistered on process exit, even if we have
  * loops in the file referencing.
  */
-static int __io_sqe_files_scm(struct io_ring_ctx *ctx, int nr, int offset)
+static int __io_sqe_files_scm(struct io_ring_ctx *ctx, struct file **files,
+			      int nr)
 {
 	struct sock *sk = ctx->ring_sock->sk;
 	struct scm_fp_list *fpl;
 	struct sk_buff *skb;
-	int i;
+	int i, nr_files = 0;
+
+	/* the empty slots of a sparse table are skipped */
+	for (i = 0; i < nr; i++)
+		if (files[i])
+			nr_files++;
+	if (!nr_files)
+		return 0;
 
 	if (!capable(CAP_SYS_RESOURCE) && !capable(CAP_SYS_ADMIN)) {
-		unsigned long inflight = ctx->user->unix_inflight + nr;
+		unsigned long inflight = ctx->user->unix_inflight + nr_files;
 
 		if (inflight > task_rlimit(current, RLIMIT_NOFILE))
 			return -EMFILE;
@@ -2304,17 +3594,23 @@ static int __io_sqe_files_scm(struct io_ring_ctx *ctx, int nr, int offset)
 
 	fpl->user = get_uid(ctx->user);
 	for (i = 0; i < nr; i++) {
-		fpl->fp[i] = get_file(ctx->user_files[i + offset]);
-		unix_inflight(fpl->user, fpl->fp[i]);
+		if (!files[i])
+			continue;
+		fpl->fp[fpl->count] = get_file(files[i]);
+		unix_inflight(fpl->user, fpl->fp[fpl->count]);
+		fpl->count++;
 	}
 
-	fpl->max = fpl->count = nr;
+	/* io_sqe_file_scm() fills it up later on */
+	fpl->max = SCM_MAX_FD;
 	UNIXCB(skb).fp = fpl;
 	refcount_add(skb->truesize, &sk->sk_wmem_alloc);
 	skb_queue_head(&sk->sk_receive_queue, skb);
 
+	/* the skb may be updated from io_ring_file_put() from now on */
 	for (i = 0; i < nr; i++)
-		fput(fpl->fp[i]);
+		if (files[i])
+			fput(files[i]);
 
 	return 0;
 }
@@ -2334,7 +3630,8 @@ static int io_sqe_files_scm(struct io_ring_ctx *ctx)
 	while (left) {
 		unsigned this_files = min_t(unsigned, left, SCM_MAX_FD);
 
-		ret = __io_sqe_files_scm(ctx, this_files, total);
+		ret = __io_sqe_files_scm(ctx, ctx->user_files + total,
+					 this_files);
 		if (ret)
 			break;
 		left -= this_files;
@@ -2345,19 +3642,136 @@ static int io_sqe_files_scm(struct io_ring_ctx *ctx)
 		return 0;
 
 	while (total < ctx->nr_user_files) {
-		fput(ctx->user_files[total]);
+		if (ctx->user_files[total])
+			fput(ctx->user_files[total]);
 		total++;
 	}
 
 	return ret;
 }
+
+/*
+ * Account a file installed by IORING_REGISTER_FILES_UPDATE, in the first skb
+ * if it has room. The skb is off the queue while it is updated, like in
+ * io_ring_file_put(), and ->file_scm_lock keeps the two from missing the
+ * skbs that the other one has taken off.
+ */
+static int io_sqe_file_scm(struct io_ring_ctx *ctx, struct file *file)
+{
+	struct sk_buff_head *head = &ctx->ring_sock->sk->sk_receive_queue;
+	struct scm_fp_list *fpl;
+	struct sk_buff *skb;
+	int ret = 0;
+
+	mutex_lock(&ctx->file_scm_lock);
+
+	spin_lock_irq(&head->lock);
+	skb = skb_peek(head);
+	if (skb && UNIXCB(skb).fp->count < SCM_MAX_FD)
+		__skb_unlink(skb, head);
+	else
+		skb = NULL;
+	spin_unlock_irq(&head->lock);
+
+	if (!skb) {
+		ret = __io_sqe_files_scm(ctx, &file, 1);
+		goto out;
+	}
+
+	fpl = UNIXCB(skb).fp;
+	fpl->fp[fpl->count] = get_file(file);
+	unix_inflight(fpl->user, file);
+	fpl->count++;
+	skb_queue_head(head, skb);
+
+	fput(file);
+out:
+	mutex_unlock(&ctx->file_scm_lock);
+	return ret;
+}
+
+/*
+ * Put a file replaced by IORING_REGISTER_FILES_UPDATE, by dropping it from the
+ * skb that holds its reference.
+ */
+static void io_ring_file_put(struct io_ring_ctx *ctx, struct file *file)
+{
+	struct sk_buff_head list, *head = &ctx->ring_sock->sk->sk_receive_queue;
+	struct sk_buff *skb;
+	bool found = false;
+	int i;
+
+	mutex_lock(&ctx->file_scm_lock);
+
+	__skb_queue_head_init(&list);
+	while ((skb = skb_dequeue(head)) != NULL) {
+		struct scm_fp_list *fpl = UNIXCB(skb).fp;
+
+		/*
+		 * An skb is kept even once it is empty, as freeing it would
+		 * run io_destruct_skb() on a live ring.
+		 */
+		__skb_queue_tail(&list, skb);
+		for (i = 0; i < fpl->count; i++)
+			if (fpl->fp[i] == file)
+				break;
+		if (i == fpl->count)
+			continue;
+
+		unix_notinflight(fpl->user, file);
+		fpl->count--;
+		memmove(&fpl->fp[i], &fpl->fp[i + 1],
+			(fpl->count - i) * sizeof(struct file *));
+		fput(file);
+		found = true;
+		break;
+	}
+
+	spin_lock_irq(&head->lock);
+	skb_queue_splice(&list, head);
+	spin_unlock_irq(&head->lock);
+
+	mutex_unlock(&ctx->file_scm_lock);
+
+	/* every installed file is held by one of the skbs */
+	WARN_ON_ONCE(!found);
+}
 #else
 static int io_sqe_files_scm(struct io_ring_ctx *ctx)
 {
 	return 0;
 }
+
+static int io_sqe_file_scm(struct io_ring_ctx *ctx, struct file *file)
+{
+	return 0;
+}
+
+static void io_ring_file_put(struct io_ring_ctx *ctx, struct file *file)
+{
+	fput(file);
+}
 #endif
 
+/*
+ * Get the file to install in a fixed file slot. Don't allow io_uring
+ * instances to be registered. If UNIX isn't enabled, then this causes a
+ * reference cycle and this instance can never get freed. If UNIX is enabled
+ * we'll handle it just fine, but there's still no point in allowing a ring
+ * fd as it doesn't support regular read/write anyway.
+ */
+static struct file *io_sqe_file_get(int fd)
+{
+	struct file *file;
+
+	file = fget(fd);
+	if (file && file->f_op == &io_uring_fops) {
+		fput(file);
+		file = NULL;
+	}
+	return file;
+}
+
 static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
 				 unsigned nr_args)
 {
@@ -2372,40 +3786,42 @@ static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
 	if (nr_args > IORING_MAX_FIXED_FILES)
 		return -EMFILE;
 
-	ctx->user_files = kcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
+	ctx->user_files = kvcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
 	if (!ctx->user_files)
 		return -ENOMEM;
+	ctx->file_node = io_file_ref_node_alloc(ctx);
+	if (!ctx->file_node) {
+		kvfree(ctx->user_files);
+		ctx->user_files = NULL;
+		return -ENOMEM;
+	}
+	ctx->nr_user_files = nr_args;
 
 	for (i = 0; i < nr_args; i++) {
 		ret = -EFAULT;
 		if (copy_from_user(&fd, &fds[i], sizeof(fd)))
 			break;
 
-		ctx->user_files[i] = fget(fd);
+		/* -1 leaves the slot empty, for IORING_REGISTER_FILES_UPDATE */
+		ret = 0;
+		if (fd == -1)
+			continue;
 
-		ret = -EBADF;
-		if (!ctx->user_files[i])
-			break;
-		/*
-		 * Don't allow io_uring instances to be registered. If UNIX
-		 * isn't enabled, then this causes a reference cycle and this
-		 * instance can never get freed. If UNIX is enabled we'll
-		 * handle it just fine, but there's still no point in allowing
-		 * a ring fd as it doesn't support regular read/write anyway.
-		 */
-		if (ctx->user_files[i]->f_op == &io_uring_fops) {
-			fput(ctx->user_files[i]);
+		ctx->user_files[i] = io_sqe_file_get(fd);
+		if (!ctx->user_files[i]) {
+			ret = -EBADF;
 			break;
 		}
-		ctx->nr_user_files++;
-		ret = 0;
 	}
 
 	if (ret) {
 		for (i = 0; i < ctx->nr_user_files; i++)
-			fput(ctx->user_files[i]);
+			if (ctx->user_files[i])
+				fput(ctx->user_files[i]);
 
-		kfree(ctx->user_files);
+		io_file_ref_node_free(ctx->file_node);
+		ctx->file_node = NULL;
+		kvfree(ctx->user_files);
 		ctx->user_files = NULL;
 		ctx->nr_user_files = 0;
 		return ret;
@@ -2418,14 +3834,116 @@ static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
 	return ret;
 }
 
+/*
+ * Lookups hold ->uring_lock, and requests pin their file through ->file_node
+ * rather than through the table, so it can simply be reallocated.
+ */
+static int io_sqe_files_grow(struct io_ring_ctx *ctx, unsigned nr)
+{
+	struct file **files;
+
+	if (nr <= ctx->nr_user_files)
+		return 0;
+
+	nr = min_t(unsigned, roundup_pow_of_two(nr), IORING_MAX_FIXED_FILES);
+	files = kvcalloc(nr, sizeof(struct file *), GFP_KERNEL);
+	if (!files)
+		return -ENOMEM;
+
+	memcpy(files, ctx->user_files,
+	       ctx->nr_user_files * sizeof(struct file *));
+	kvfree(ctx->user_files);
+	ctx->user_files = files;
+	ctx->nr_user_files = nr;
+	return 0;
+}
+
+/*
+ * IORING_REGISTER_FILES_UPDATE: install the files in @nr_args slots from
+ * ->offset on, growing the table as needed, or empty the slots given -1.
+ * The ring isn't quiesced, requests that already looked up a replaced file
+ * keep it until they are freed. Returns the number of slots updated.
+ */
+static int io_sqe_files_update(struct io_ring_ctx *ctx, void __user *arg,
+			       unsigned nr_args)
+{
+	struct io_uring_files_update up;
+	struct io_file_ref_node *node;
+	__s32 __user *fds;
+	unsigned done, end;
+	int fd, ret;
+
+	if (!ctx->user_files)
+		return -ENXIO;
+	if (!nr_args)
+		return -EINVAL;
+	if (copy_from_user(&up, arg, sizeof(up)))
+		return -EFAULT;
+	if (up.resv)
+		return -EINVAL;
+	if (check_add_overflow(up.offset, nr_args, &end) ||
+	    end > IORING_MAX_FIXED_FILES)
+		return -EMFILE;
+
+	ret = io_sqe_files_grow(ctx, end);
+	if (ret)
+		return ret;
+	node = io_file_ref_node_alloc(ctx);
+	if (!node)
+		return -ENOMEM;
+
+	fds = u64_to_user_ptr(up.fds);
+	for (done = 0; done < nr_args; done++) {
+		struct file **slot = &ctx->user_files[up.offset + done];
+		struct io_file_put *pfile = NULL;
+		struct file *file = NULL;
+
+		ret = -EFAULT;
+		if (copy_from_user(&fd, &fds[done], sizeof(fd)))
+			break;
+
+		if (*slot) {
+			ret = -ENOMEM;
+			pfile = kmalloc(sizeof(*pfile), GFP_KERNEL);
+			if (!pfile)
+				break;
+		}
+		if (fd != -1) {
+			ret = -EBADF;
+			file = io_sqe_file_get(fd);
+			if (file)
+				ret = io_sqe_file_scm(ctx, file);
+			if (ret) {
+				if (file)
+					fput(file);
+				kfree(pfile);
+				break;
+			}
+		}
+
+		if (pfile) {
+			pfile->file = *slot;
+			list_add_tail(&pfile->list, &ctx->file_node->file_list);
+		}
+		*slot = file;
+	}
+
+	if (done)
+		io_file_ref_node_switch(ctx, node);
+	else
+		io_file_ref_node_free(node);
+
+	return done ? done : ret;
+}
+
 static int io_sq_offload_start(struct io_ring_ctx *ctx,
 			       struct io_uring_params *p)
 {
 	int ret;
 
-	init_waitqueue_head(&ctx->sqo_wait);
 	mmgrab(current->mm);
 	ctx->sqo_mm = current->mm;
+	ctx->creds = get_current_cred();
 
 	if (ctx->flags & IORING_SETUP_SQPOLL) {
 		ret = -EPERM;
@@ -2436,39 +3954,33 @@ static int io_sq_offload_start(struct io_ring_ctx *ctx,
 		if (!ctx->sq_thread_idle)
 			ctx->sq_thread_idle = HZ;
 
-		if (p->flags & IORING_SETUP_SQ_AFF) {
-			int cpu = p->sq_thread_cpu;
-
+		/* the affinity of a shared thread is set by its creator */
+		if (p->flags & IORING_SETUP_ATTACH_SQ) {
 			ret = -EINVAL;
-			if (cpu >= nr_cpu_ids)
-				goto err;
-			if (!cpu_online(cpu))
+			if (p->flags & IORING_SETUP_SQ_AFF)
 				goto err;
-
-			ctx->sqo_thread = kthread_create_on_cpu(io_sq_thread,
-							ctx, cpu,
-							"io_uring-sq");
+			ret = io_sq_data_attach(ctx, p->sq_fd);
 		} else {
-			ctx->sqo_thread = kthread_create(io_sq_thread, ctx,
-							"io_uring-sq");
+			ret = io_sq_data_create(ctx, p);
 		}
-		if (IS_ERR(ctx->sqo_thread)) {
-			ret = PTR_ERR(ctx->sqo_thread);
-			ctx->sqo_thread = NULL;
+		if (ret)
 			goto err;
-		}
-		wake_up_process(ctx->sqo_thread);
-	} else if (p->flags & IORING_SETUP_SQ_AFF) {
-		/* Can't have SQ_AFF without SQPOLL */
+	} else if (p->flags & (IORING_SETUP_SQ_AFF | IORING_SETUP_ATTACH_SQ)) {
+		/* Can't have SQ_AFF or ATTACH_SQ without SQPOLL */
 		ret = -EINVAL;
 		goto err;
 	}
 
-	/* Do QD, or 2 * CPUS, whatever is smallest */
-	ctx->sqo_wq = alloc_workqueue("io_ring-wq", WQ_UNBOUND | WQ_FREEZABLE,
-			min(ctx->sq_entries - 1, 2 * num_online_cpus()));
-	if (!ctx->sqo_wq) {
-		ret = -ENOMEM;
+	/*
+	 * Do QD, or 2 * CPUS, whatever is smallest, for each node. The workers
+	 * run with the mm and the credentials of the creator of the ring.
+	 */
+	ctx->io_wq = io_wq_create(min(ctx->sq_entries - 1,
+				      2 * num_online_cpus()),
+				  ctx->sqo_mm, ctx->creds);
+	if (IS_ERR(ctx->io_wq)) {
+		ret = PTR_ERR(ctx->io_wq);
+		ctx->io_wq = NULL;
 		goto err;
 	}
 
@@ -2767,11 +4279,14 @@ static void io_ring_ctx_free(struct io_ring_ctx *ctx)
 	io_finish_async(ctx);
 	if (ctx->sqo_mm)
 		mmdrop(ctx->sqo_mm);
+	if (ctx->creds)
+		put_cred(ctx->creds);
 
 	io_iopoll_reap_events(ctx);
 	io_sqe_buffer_unregister(ctx);
 	io_sqe_files_unregister(ctx);
 	io_eventfd_unregister(ctx);
+	io_destroy_buffers(ctx);
 
 #if defined(CONFIG_UNIX)
 	if (ctx->ring_sock) {
@@ -2826,6 +4341,7 @@ static void io_ring_ctx_wait_and_kill(struct io_ring_ctx *ctx)
 	mutex_unlock(&ctx->uring_lock);
 
 	io_poll_remove_all(ctx);
+	io_timeout_remove_all(ctx);
 	io_iopoll_reap_events(ctx);
 	wait_for_completion(&ctx->ctx_done);
 	io_ring_ctx_free(ctx);
@@ -2903,7 +4419,7 @@ SYSCALL_DEFINE6(io_uring_enter, unsigned int, fd, u32, to_submit,
 	 */
 	if (ctx->flags & IORING_SETUP_SQPOLL) {
 		if (flags & IORING_ENTER_SQ_WAKEUP)
-			wake_up(&ctx->sqo_wait);
+			wake_up(&ctx->sq_data->wait);
 		submitted = to_submit;
 		goto out_ctx;
 	}
@@ -2937,11 +4453,39 @@ SYSCALL_DEFINE6(io_uring_enter, unsigned int, fd, u32, to_submit,
 	return submitted ? submitted : ret;
 }
 
+#ifdef CONFIG_PROC_FS
+static void io_uring_show_fdinfo(struct seq_file *m, struct file *f)
+{
+	struct io_ring_ctx *ctx = f->private_data;
+	struct io_sq_stats *stats = &ctx->sq_stats;
+	u64 nr_batches;
+
+	if (ctx->io_wq)
+		io_wq_show_fdinfo(ctx->io_wq, m);
+
+	if (!ctx->sq_data)
+		return;
+
+	/* sampled without locking, the counters only go up */
+	nr_batches = READ_ONCE(stats->nr_batches);
+	seq_printf(m, "sq_thread:\t%d\n", task_pid_nr(ctx->sq_data->thread));
+	seq_printf(m, "sq_submitted:\t%llu\n", READ_ONCE(stats->nr_sqes));
+	seq_printf(m, "sq_batches:\t%llu\n", nr_batches);
+	seq_printf(m, "sq_wait_avg_ns:\t%llu\n", nr_batches ?
+		   div64_u64(READ_ONCE(stats->wait_ns), nr_batches) : 0);
+	seq_printf(m, "sq_wait_max_ns:\t%llu\n",
+		   READ_ONCE(stats->wait_max_ns));
+}
+#endif
+
 static const struct file_operations io_uring_fops = {
 	.release	= io_uring_release,
 	.mmap		= io_uring_mmap,
 	.poll		= io_uring_poll,
 	.fasync		= io_uring_fasync,
+#ifdef CONFIG_PROC_FS
+	.show_fdinfo	= io_uring_show_fdinfo,
+#endif
 };
 
 static int io_allocate_scq_urings(struct io_ring_ctx *ctx,
@@ -3121,7 +4665,7 @@ static long io_uring_setup(u32 entries, struct io_uring_params __user *params)
 	}
 
 	if (p.flags & ~(IORING_SETUP_IOPOLL | IORING_SETUP_SQPOLL |
-			IORING_SETUP_SQ_AFF))
+			IORING_SETUP_SQ_AFF | IORING_SETUP_ATTACH_SQ))
 		return -EINVAL;
 
 	ret = io_uring_create(entries, &p);
@@ -3140,11 +4684,23 @@ SYSCALL_DEFINE2(io_uring_setup, u32, entries,
 	return io_uring_setup(entries, params);
 }
 
+/* the opcodes that are fine with requests in flight */
+static bool io_register_op_must_quiesce(unsigned opcode)
+{
+	switch (opcode) {
+	case IORING_REGISTER_FILES_UPDATE:
+		return false;
+	default:
+		return true;
+	}
+}
+
 static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 			       void __user *arg, unsigned nr_args)
 	__releases(ctx->uring_lock)
 	__acquires(ctx->uring_lock)
 {
+	bool quiesce = io_register_op_must_quiesce(opcode);
 	int ret;
 
 	/*
@@ -3155,18 +4711,21 @@ static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 	if (percpu_ref_is_dying(&ctx->refs))
 		return -ENXIO;
 
-	percpu_ref_kill(&ctx->refs);
+	if (quiesce) {
+		percpu_ref_kill(&ctx->refs);
 
-	/*
-	 * Drop uring mutex before waiting for references to exit. If another
-	 * thread is currently inside io_uring_enter() it might need to grab
-	 * the uring_lock to make progress. If we hold it here across the drain
-	 * wait, then we can deadlock. It's safe to drop the mutex here, since
-	 * no new references will come in after we've killed the percpu ref.
-	 */
-	mutex_unlock(&ctx->uring_lock);
-	wait_for_completion(&ctx->ctx_done);
-	mutex_lock(&ctx->uring_lock);
+		/*
+		 * Drop uring mutex before waiting for references to exit. If
+		 * another thread is currently inside io_uring_enter() it might
+		 * need to grab the uring_lock to make progress. If we hold it
+		 * here across the drain wait, then we can deadlock. It's safe
+		 * to drop the mutex here, since no new references will come in
+		 * after we've killed the percpu ref.
+		 */
+		mutex_unlock(&ctx->uring_lock);
+		wait_for_completion(&ctx->ctx_done);
+		mutex_lock(&ctx->uring_lock);
+	}
 
 	switch (opcode) {
 	case IORING_REGISTER_BUFFERS:
@@ -3187,6 +4746,9 @@ static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 			break;
 		ret = io_sqe_files_unregister(ctx);
 		break;
+	case IORING_REGISTER_FILES_UPDATE:
+		ret = io_sqe_files_update(ctx, arg, nr_args);
+		break;
 	case IORING_REGISTER_EVENTFD:
 		ret = -EINVAL;
 		if (nr_args != 1)
@@ -3204,9 +4766,11 @@ static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
 		break;
 	}
 
-	/* bring the ctx back to life */
-	reinit_completion(&ctx->ctx_done);
-	percpu_ref_reinit(&ctx->refs);
+	if (quiesce) {
+		/* bring the ctx back to life */
+		reinit_completion(&ctx->ctx_done);
+		percpu_ref_reinit(&ctx->refs);
+	}
 	return ret;
 }
 
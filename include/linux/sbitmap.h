@@ -423,6 +423,23 @@ int __sbitmap_queue_get(struct sbitmap_queue *sbq);
 int __sbitmap_queue_get_shallow(struct sbitmap_queue *sbq,
 				unsigned int shallow_depth);
 
+/**
+ * __sbitmap_queue_get_batch() - Try to allocate a batch of free bits from a
+ * &struct sbitmap_queue with preemption already disabled.
+ * @sbq: Bitmap queue to allocate from.
+ * @nr_tags: Number of bits to allocate, less than BITS_PER_LONG.
+ * @offset: Output parameter; bit number that the returned mask starts at.
+ *
+ * The bits are taken from a single word, with a single atomic operation, so
+ * fewer than @nr_tags bits may be allocated. Bitmaps that allocate in
+ * round-robin order don't support batches.
+ *
+ * Return: Mask of the allocated bits, relative to @offset. Zero if no bits
+ * could be allocated this way.
+ */
+unsigned long __sbitmap_queue_get_batch(struct sbitmap_queue *sbq, int nr_tags,
+					unsigned int *offset);
+
 /**
  * sbitmap_queue_get() - Try to allocate a free bit from a &struct
  * sbitmap_queue.
@@ -496,6 +513,20 @@ void sbitmap_queue_min_shallow_depth(struct sbitmap_queue *sbq,
 void sbitmap_queue_clear(struct sbitmap_queue *sbq, unsigned int nr,
 			 unsigned int cpu);
 
+/**
+ * sbitmap_queue_clear_batch() - Free a batch of allocated bits and wake up
+ * waiters on a &struct sbitmap_queue.
+ * @sbq: Bitmap to free from.
+ * @offset: Value to subtract from each entry of @tags to get its bit number.
+ * @tags: Bits to free.
+ * @nr_tags: Number of entries in @tags.
+ *
+ * Bits that share a word are freed with a single atomic operation, so this is
+ * cheapest when @tags is mostly sorted.
+ */
+void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq, int offset,
+			       int *tags, int nr_tags);
+
 static inline int sbq_index_inc(int index)
 {
 	return (index + 1) & (SBQ_WAIT_QUEUES - 1);
@@ -27,10 +27,13 @@ struct io_uring_sqe {
 		__u32		fsync_flags;
 		__u16		poll_events;
 		__u32		sync_range_flags;
+		__u32		msg_flags;
+		__u32		timeout_flags;
 	};
 	__u64	user_data;	/* data to be passed back at completion time */
 	union {
 		__u16	buf_index;	/* index into fixed buffers, if used */
+		__u16	buf_group;	/* group to select a buffer from */
 		__u64	__pad2[3];
 	};
 };
@@ -40,6 +43,8 @@ struct io_uring_sqe {
  */
 #define IOSQE_FIXED_FILE	(1U << 0)	/* use fixed fileset */
 #define IOSQE_IO_DRAIN		(1U << 1)	/* issue after inflight IO */
+#define IOSQE_IO_LINK		(1U << 2)	/* links next sqe */
+#define IOSQE_BUFFER_SELECT	(1U << 3)	/* use buffer of buf_group */
 
 /*
  * io_uring_setup() flags
@@ -47,6 +52,7 @@ struct io_uring_sqe {
 #define IORING_SETUP_IOPOLL	(1U << 0)	/* io_context is polled */
 #define IORING_SETUP_SQPOLL	(1U << 1)	/* SQ poll thread */
 #define IORING_SETUP_SQ_AFF	(1U << 2)	/* sq_thread_cpu is valid */
+#define IORING_SETUP_ATTACH_SQ	(1U << 3)	/* share SQ thread of sq_fd */
 
 #define IORING_OP_NOP		0
 #define IORING_OP_READV		1
@@ -57,6 +63,13 @@ struct io_uring_sqe {
 #define IORING_OP_POLL_ADD	6
 #define IORING_OP_POLL_REMOVE	7
 #define IORING_OP_SYNC_FILE_RANGE	8
+#define IORING_OP_SENDMSG	9
+#define IORING_OP_RECVMSG	10
+#define IORING_OP_SEND		11
+#define IORING_OP_RECV		12
+#define IORING_OP_TIMEOUT	13
+#define IORING_OP_PROVIDE_BUFFERS	14
+#define IORING_OP_REMOVE_BUFFERS	15
 
 /*
  * sqe->fsync_flags
@@ -72,6 +85,15 @@ struct io_uring_cqe {
 	__u32	flags;
 };
 
+/*
+ * cqe->flags
+ *
+ * IORING_CQE_F_BUFFER	the upper 16 bits are the ID of the selected buffer
+ */
+#define IORING_CQE_F_BUFFER		(1U << 0)
+
+#define IORING_CQE_BUFFER_SHIFT		16
+
 /*
  * Magic offsets for the application to mmap the data it needs
  */
@@ -124,7 +146,8 @@ struct io_uring_params {
 	__u32 flags;
 	__u32 sq_thread_cpu;
 	__u32 sq_thread_idle;
-	__u32 resv[5];
+	__u32 sq_fd;
+	__u32 resv[4];
 	struct io_sqring_offsets sq_off;
 	struct io_cqring_offsets cq_off;
 };
@@ -138,5 +161,16 @@ struct io_uring_params {
 #define IORING_UNREGISTER_FILES		3
 #define IORING_REGISTER_EVENTFD		4
 #define IORING_UNREGISTER_EVENTFD	5
+#define IORING_REGISTER_FILES_UPDATE	6
+
+/*
+ * IORING_REGISTER_FILES_UPDATE argument: nr_args fds for the fixed file slots
+ * from offset on, -1 empties a slot
+ */
+struct io_uring_files_update {
+	__u32 offset;
+	__u32 resv;
+	__aligned_u64 /* __s32 * */ fds;
+};
 
 #endif
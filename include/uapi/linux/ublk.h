@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace block device - block device whose requests are served by a
+ * user-space process.
+ *
+ * A device is created through /dev/ublk-control and shows up as a block
+ * device /dev/ublkbN plus a character device /dev/ublkcN. The server opens
+ * the character device once per hardware queue, binds each file to a queue
+ * and serves that queue through it:
+ *
+ * - mmap() at offset 0 maps the queue's descriptor array, followed by the
+ *   ring of tags the kernel has handed to the server.
+ * - poll() reports EPOLLIN while the ring holds tags the server has not
+ *   consumed yet, and EPOLLHUP once the device has been deleted.
+ * - pread() at UBLK_IO_BUF_OFFSET(tag) copies the data of a WRITE out of the
+ *   request's pages, pwrite() there copies the data of a READ into them.
+ * - pwrite() of an array of struct ublk_io_cmpl at UBLK_CMPL_OFFSET completes
+ *   requests.
+ *
+ * All of these work with IORING_OP_POLL_ADD, IORING_OP_READV/WRITEV and
+ * their fixed buffer variants, so a server can drive a queue entirely from
+ * an io_uring.
+ */
+#ifndef _UAPI_LINUX_UBLK_H
+#define _UAPI_LINUX_UBLK_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define UBLK_MAX_NR_QUEUES	64
+#define UBLK_MAX_QUEUE_DEPTH	4096
+
+/*
+ * Device flags
+ */
+#define UBLK_F_FLUSH		(1ULL << 0)	/* volatile cache: FLUSH, FUA */
+#define UBLK_F_DISCARD		(1ULL << 1)	/* send DISCARD/WRITE_ZEROES */
+
+/*
+ * Passed to UBLK_CTL_ADD_DEV
+ */
+struct ublk_dev_info {
+	__u32	dev_id;		/* out: N of /dev/ublkbN and /dev/ublkcN */
+	__u16	nr_hw_queues;
+	__u16	queue_depth;
+	__u32	block_size;	/* power of 2, 512 up to page size */
+	__u32	max_io_bytes;
+	__u64	dev_sectors;	/* capacity in 512-byte sectors */
+	__u64	flags;		/* UBLK_F_* */
+};
+
+/*
+ * Passed to UBLK_GET_QUEUE_AFFINITY
+ */
+struct ublk_queue_affinity {
+	__u16	q_id;
+	__u16	resv;
+	__u32	len;		/* size of the mask buffer in bytes */
+	__aligned_u64 mask;	/* user pointer, filled as a cpu_set_t */
+};
+
+/*
+ * /dev/ublk-control ioctls. START and DEL take the dev_id as argument.
+ */
+#define UBLK_CTL_ADD_DEV	_IOWR('u', 0x00, struct ublk_dev_info)
+#define UBLK_CTL_START_DEV	_IO('u', 0x01)
+#define UBLK_CTL_DEL_DEV	_IO('u', 0x02)
+
+/*
+ * /dev/ublkcN ioctls. BIND_QUEUE takes the queue index as argument.
+ */
+#define UBLK_BIND_QUEUE		_IO('u', 0x10)
+#define UBLK_GET_QUEUE_AFFINITY _IOWR('u', 0x11, struct ublk_queue_affinity)
+
+/*
+ * Request descriptor, one per tag, at the start of the queue mapping
+ */
+#define UBLK_IO_OP_READ		0
+#define UBLK_IO_OP_WRITE	1
+#define UBLK_IO_OP_FLUSH	2
+#define UBLK_IO_OP_DISCARD	3
+#define UBLK_IO_OP_WRITE_ZEROES	4
+
+#define UBLK_IO_F_FUA		(1U << 0)
+
+struct ublk_io_desc {
+	__u8	op;		/* UBLK_IO_OP_* */
+	__u8	resv;
+	__u16	flags;		/* UBLK_IO_F_* */
+	__u32	nr_sectors;
+	__u64	start_sector;
+};
+
+/*
+ * Tag ring, right behind the descriptors at UBLK_RING_OFFSET(queue_depth).
+ * The kernel fills tags[tail & mask] and then bumps tail, the server
+ * consumes entries and bumps head.
+ */
+struct ublk_queue_ring {
+	__u32	head;
+	__u32	tail;
+	__u32	mask;
+	__u32	resv;
+	__u32	tags[];
+};
+
+#define UBLK_RING_OFFSET(depth)	((depth) * sizeof(struct ublk_io_desc))
+
+/*
+ * File offsets of the data of a request, and of the completion area
+ */
+#define UBLK_IO_BUF_BITS	25
+#define UBLK_TAG_BITS		16
+#define UBLK_MAX_IO_BYTES	(1U << UBLK_IO_BUF_BITS)
+#define UBLK_IO_BUF_OFFSET(tag)	((__u64)(tag) << UBLK_IO_BUF_BITS)
+#define UBLK_CMPL_OFFSET	(1ULL << (UBLK_IO_BUF_BITS + UBLK_TAG_BITS))
+
+/*
+ * Completion entry. A negative result fails the request with that errno,
+ * anything else completes it successfully. The data of a READ must have
+ * been written before the request is completed.
+ */
+struct ublk_io_cmpl {
+	__u16	tag;
+	__u16	resv;
+	__s32	result;
+};
+
+#endif
@@ -494,6 +494,66 @@ int __sbitmap_queue_get_shallow(struct sbitmap_queue *sbq,
 }
 EXPORT_SYMBOL_GPL(__sbitmap_queue_get_shallow);
 
+unsigned long __sbitmap_queue_get_batch(struct sbitmap_queue *sbq, int nr_tags,
+					unsigned int *offset)
+{
+	struct sbitmap *sb = &sbq->sb;
+	unsigned int hint, depth, index;
+	int i;
+
+	if (unlikely(sbq->round_robin))
+		return 0;
+
+	depth = READ_ONCE(sb->depth);
+	hint = this_cpu_read(*sbq->alloc_hint);
+	if (unlikely(hint >= depth))
+		hint = 0;
+	index = SB_NR_TO_INDEX(sb, hint);
+
+	for (i = 0; i < sb->map_nr; i++) {
+		struct sbitmap_word *map = &sb->map[index];
+		unsigned long get_mask, val;
+		unsigned int nr;
+
+		do {
+			nr = find_first_zero_bit(&map->word, map->depth);
+			if (nr + nr_tags <= map->depth)
+				break;
+		} while (sbitmap_deferred_clear(sb, index));
+
+		if (nr + nr_tags <= map->depth) {
+			/*
+			 * Claim the whole range at once, other allocators may
+			 * have taken some of it since we looked. Pairs with
+			 * the barrier in sbitmap_queue_clear_batch() like
+			 * test_and_set_bit_lock() does for single bits.
+			 */
+			get_mask = ((1UL << nr_tags) - 1) << nr;
+			do {
+				val = READ_ONCE(map->word);
+			} while (cmpxchg(&map->word, val,
+					 val | get_mask) != val);
+
+			get_mask = (get_mask & ~val) >> nr;
+			if (get_mask) {
+				*offset = nr + (index << sb->shift);
+				hint = *offset + nr_tags;
+				if (hint >= depth - 1)
+					hint = 0;
+				this_cpu_write(*sbq->alloc_hint, hint);
+				return get_mask;
+			}
+		}
+
+		/* Jump to next index. */
+		if (++index >= sb->map_nr)
+			index = 0;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(__sbitmap_queue_get_batch);
+
 void sbitmap_queue_min_shallow_depth(struct sbitmap_queue *sbq,
 				     unsigned int min_shallow_depth)
 {
@@ -603,6 +663,47 @@ void sbitmap_queue_clear(struct sbitmap_queue *sbq, unsigned int nr,
 }
 EXPORT_SYMBOL_GPL(sbitmap_queue_clear);
 
+void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq, int offset,
+			       int *tags, int nr_tags)
+{
+	struct sbitmap *sb = &sbq->sb;
+	unsigned long *addr = NULL;
+	unsigned long mask = 0;
+	int i, last;
+
+	/* See sbitmap_queue_clear() for the barriers */
+	smp_mb__before_atomic();
+	for (i = 0; i < nr_tags; i++) {
+		const int tag = tags[i] - offset;
+		unsigned long *this_addr;
+
+		this_addr = &sb->map[SB_NR_TO_INDEX(sb, tag)].cleared;
+		if (addr && addr != this_addr) {
+			atomic_long_or(mask, (atomic_long_t *)addr);
+			mask = 0;
+		}
+		addr = this_addr;
+		mask |= 1UL << SB_NR_TO_BIT(sb, tag);
+	}
+
+	if (mask)
+		atomic_long_or(mask, (atomic_long_t *)addr);
+
+	smp_mb__after_atomic();
+
+	/*
+	 * Each freed bit counts towards a wakeup batch. This is a single
+	 * atomic_read() per bit when nobody is waiting.
+	 */
+	for (i = 0; i < nr_tags; i++)
+		sbitmap_queue_wake_up(sbq);
+
+	last = tags[nr_tags - 1] - offset;
+	if (likely(!sbq->round_robin && last < sbq->sb.depth))
+		this_cpu_write(*sbq->alloc_hint, last);
+}
+EXPORT_SYMBOL_GPL(sbitmap_queue_clear_batch);
+
 void sbitmap_queue_wake_all(struct sbitmap_queue *sbq)
 {
 	int i, wake_index;
@@ -5,6 +5,9 @@
  * options that are control how we use io_uring, see the OPTIONS section
  * below. This uses the raw io_uring interface.
  *
+ * With -e, it instead echoes messages over a number of socket pairs, see
+ * the ECHO section below.
+ *
  * Copyright (C) 2018-2019 Jens Axboe
  */
 #include <stdio.h>
@@ -22,6 +25,7 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <linux/fs.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -60,6 +64,10 @@ struct io_cq_ring {
 
 #define MAX_FDS			16
 
+#define ECHO_MSG		64
+/* every connection has a request in flight on both ends */
+#define MAX_CONNS		(DEPTH / 2)
+
 static unsigned sq_ring_mask, cq_ring_mask;
 
 struct file {
@@ -69,6 +77,22 @@ struct file {
 	int fixed_fd;
 };
 
+enum {
+	ECHO_CLIENT,
+	ECHO_SERVER,
+};
+
+struct conn {
+	int real_fd[2];
+	int fixed_fd[2];
+	char buf[2][ECHO_MSG];
+	struct iovec iov[2];
+	struct msghdr msg[2];
+	int bid;		/* provided buffer held by the server end */
+	unsigned long trips[2];	/* round trips finished by each end */
+	int idle;		/* ends waiting for the reconnect */
+};
+
 struct submitter {
 	pthread_t thread;
 	int ring_fd;
@@ -81,6 +105,7 @@ struct submitter {
 	unsigned long reaps;
 	unsigned long done;
 	unsigned long calls;
+	unsigned long reconnects;
 	volatile int finish;
 
 	__s32 *fds;
@@ -88,6 +113,9 @@ struct submitter {
 	struct file files[MAX_FDS];
 	unsigned nr_files;
 	unsigned cur_file;
+
+	struct conn conns[MAX_CONNS];
+	char echo_pool[MAX_CONNS][ECHO_MSG];
 };
 
 static struct submitter submitters[1];
@@ -103,6 +131,12 @@ static int buffered = 0;	/* use buffered IO, not O_DIRECT */
 static int sq_thread_poll = 0;	/* use kernel submission/poller thread */
 static int sq_thread_cpu = -1;	/* pin above thread to this CPU */
 static int do_nop = 0;		/* no-op SQ ring commands */
+static int nr_conns = 0;	/* echo over this many socket pairs (-e) */
+static int echo_msg = 0;	/* echo with sendmsg/recvmsg (-m) */
+static int echo_bufs = 0;	/* server receives into provided buffers (-b) */
+static int echo_churn = 0;	/* reconnect after this many round trips (-c) */
+
+static int echo_register_files(struct submitter *s);
 
 static int io_uring_register_buffers(struct submitter *s)
 {
@@ -119,6 +153,8 @@ static int io_uring_register_files(struct submitter *s)
 
 	if (do_nop)
 		return 0;
+	if (nr_conns)
+		return echo_register_files(s);
 
 	s->fds = calloc(s->nr_files, sizeof(__s32));
 	for (i = 0; i < s->nr_files; i++) {
@@ -369,6 +405,293 @@ static void *submitter_fn(void *data)
 	return NULL;
 }
 
+/*
+ * ECHO: the client end of every socket pair sends a message, the server end
+ * receives it and sends it back, and the client receives it again. Each round
+ * trip counts as one IO. The receives are queued before the data is there,
+ * so the kernel has to wait for the socket to become readable.
+ */
+#define ECHO_SEND		1
+#define ECHO_USER_DATA(c, side, send)	(((c) << 2) | ((side) << 1) | (send))
+#define ECHO_PROVIDE		(~0ULL)
+
+/*
+ * With -b, the server ends don't own a buffer: the kernel picks one from
+ * ECHO_BGID once a message arrives, and it is given back after the echo.
+ */
+#define ECHO_BGID		0
+
+/*
+ * With -c, a connection is replaced by a new socket pair every so many round
+ * trips, once both ends are done with the last one. Its two fixed file slots
+ * are updated in place, without touching the rest of the table.
+ */
+static int echo_reconnect(struct submitter *s, int i)
+{
+	struct conn *c = &s->conns[i];
+	struct io_uring_files_update up;
+	int ret;
+
+	close(c->real_fd[ECHO_CLIENT]);
+	close(c->real_fd[ECHO_SERVER]);
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, c->real_fd) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	s->reconnects++;
+	if (!register_files)
+		return 0;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = c->fixed_fd[ECHO_CLIENT];
+	up.fds = (unsigned long) c->real_fd;
+	ret = io_uring_register(s->ring_fd, IORING_REGISTER_FILES_UPDATE, &up,
+				2);
+	if (ret != 2) {
+		perror("io_uring_register");
+		return -1;
+	}
+	return 0;
+}
+
+static int echo_register_files(struct submitter *s)
+{
+	int i, side;
+
+	s->fds = calloc(2 * nr_conns, sizeof(__s32));
+	for (i = 0; i < nr_conns; i++) {
+		for (side = ECHO_CLIENT; side <= ECHO_SERVER; side++) {
+			struct conn *c = &s->conns[i];
+
+			s->fds[2 * i + side] = c->real_fd[side];
+			c->fixed_fd[side] = 2 * i + side;
+		}
+	}
+
+	return io_uring_register(s->ring_fd, IORING_REGISTER_FILES, s->fds,
+					2 * nr_conns);
+}
+
+static int echo_setup(struct submitter *s)
+{
+	int i, side;
+
+	for (i = 0; i < nr_conns; i++) {
+		struct conn *c = &s->conns[i];
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, c->real_fd) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		for (side = ECHO_CLIENT; side <= ECHO_SERVER; side++) {
+			c->iov[side].iov_base = c->buf[side];
+			c->iov[side].iov_len = ECHO_MSG;
+			c->msg[side].msg_iov = &c->iov[side];
+			c->msg[side].msg_iovlen = 1;
+		}
+		memset(c->buf[ECHO_CLIENT], i, ECHO_MSG);
+	}
+	return 0;
+}
+
+static void echo_prep(struct submitter *s, unsigned *tail, int i, int side,
+		      int send, unsigned len)
+{
+	struct io_sq_ring *ring = &s->sq_ring;
+	unsigned index = *tail & sq_ring_mask;
+	struct io_uring_sqe *sqe = &s->sqes[index];
+	struct conn *c = &s->conns[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (register_files) {
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = c->fixed_fd[side];
+	} else {
+		sqe->fd = c->real_fd[side];
+	}
+	if (echo_msg) {
+		sqe->opcode = send ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+		c->iov[side].iov_len = len;
+		sqe->addr = (unsigned long) &c->msg[side];
+	} else if (echo_bufs && side == ECHO_SERVER) {
+		sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+		if (send) {
+			sqe->addr = (unsigned long) s->echo_pool[c->bid];
+		} else {
+			sqe->flags |= IOSQE_BUFFER_SELECT;
+			sqe->buf_group = ECHO_BGID;
+		}
+		sqe->len = len;
+	} else {
+		sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+		sqe->addr = (unsigned long) c->buf[side];
+		sqe->len = len;
+	}
+	sqe->user_data = ECHO_USER_DATA(i, side, send);
+
+	ring->array[index] = index;
+	(*tail)++;
+}
+
+static void echo_provide(struct submitter *s, unsigned *tail, int bid, int nr)
+{
+	struct io_sq_ring *ring = &s->sq_ring;
+	unsigned index = *tail & sq_ring_mask;
+	struct io_uring_sqe *sqe = &s->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->addr = (unsigned long) s->echo_pool[bid];
+	sqe->len = ECHO_MSG;
+	sqe->fd = nr;
+	sqe->off = bid;
+	sqe->buf_group = ECHO_BGID;
+	sqe->user_data = ECHO_PROVIDE;
+
+	ring->array[index] = index;
+	(*tail)++;
+}
+
+static void echo_start(struct submitter *s, unsigned *tail, int i)
+{
+	echo_prep(s, tail, i, ECHO_SERVER, 0, ECHO_MSG);
+	echo_prep(s, tail, i, ECHO_CLIENT, ECHO_SEND, ECHO_MSG);
+}
+
+/*
+ * Count a round trip for one end of a connection, after its last step. Returns
+ * 1 if the end must stop for the reconnect, the end to get there last does it
+ * and starts the connection over.
+ */
+static int echo_trip(struct submitter *s, unsigned *tail, int i, int side,
+		      int *err)
+{
+	struct conn *c = &s->conns[i];
+
+	c->trips[side]++;
+	if (!echo_churn || c->trips[side] % echo_churn)
+		return 0;
+
+	if (++c->idle == 2) {
+		c->idle = 0;
+		*err = echo_reconnect(s, i);
+		if (!*err)
+			echo_start(s, tail, i);
+	}
+	return 1;
+}
+
+/*
+ * Queue the next step of a connection, or return -1 if the last one failed.
+ */
+static int echo_complete(struct submitter *s, unsigned *tail,
+			 struct io_uring_cqe *cqe)
+{
+	int i = cqe->user_data >> 2;
+	int side = (cqe->user_data >> 1) & 1;
+	int send = cqe->user_data & ECHO_SEND;
+	int err = 0;
+
+	if (cqe->res <= 0) {
+		printf("echo: unexpected ret=%d\n", cqe->res);
+		return -1;
+	}
+	if (cqe->user_data == ECHO_PROVIDE)
+		return 0;
+
+	if (side == ECHO_SERVER && echo_bufs) {
+		if (!send) {
+			if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+				printf("echo: no buffer on connection %d\n", i);
+				return -1;
+			}
+			s->conns[i].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		} else {
+			/* ordered before the receive that may need it */
+			echo_provide(s, tail, s->conns[i].bid, 1);
+		}
+	}
+
+	if (side == ECHO_SERVER) {
+		if (send && echo_trip(s, tail, i, side, &err))
+			return err;
+		/* echo what was received, then wait for the next message */
+		echo_prep(s, tail, i, side, !send, send ? ECHO_MSG : cqe->res);
+		return 0;
+	}
+
+	if (!send) {
+		char *buf = s->conns[i].buf[ECHO_CLIENT];
+
+		if (cqe->res != ECHO_MSG || buf[0] != (char) i ||
+		    buf[ECHO_MSG - 1] != (char) i) {
+			printf("echo: bad message on connection %d\n", i);
+			return -1;
+		}
+		s->done++;
+		if (echo_trip(s, tail, i, side, &err))
+			return err;
+	}
+	echo_prep(s, tail, i, side, !send, ECHO_MSG);
+	return 0;
+}
+
+static void *echo_submitter_fn(void *data)
+{
+	struct submitter *s = data;
+	struct io_sq_ring *sring = &s->sq_ring;
+	struct io_cq_ring *cring = &s->cq_ring;
+	unsigned head, tail;
+	int i, ret;
+
+	printf("submitter=%d\n", gettid());
+
+	tail = *sring->tail;
+	if (echo_bufs)
+		echo_provide(s, &tail, 0, nr_conns);
+	for (i = 0; i < nr_conns; i++)
+		echo_start(s, &tail, i);
+
+	do {
+		unsigned flags = IORING_ENTER_GETEVENTS;
+		unsigned to_submit = tail - *sring->tail;
+
+		/* order tail store with writes to sqes above */
+		write_barrier();
+		*sring->tail = tail;
+		write_barrier();
+
+		if (sq_thread_poll && (*sring->flags & IORING_SQ_NEED_WAKEUP))
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		ret = io_uring_enter(s->ring_fd, to_submit, 1, flags, NULL);
+		s->calls++;
+		if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+			printf("io_submit: %s\n", strerror(errno));
+			break;
+		}
+
+		head = *cring->head;
+		do {
+			read_barrier();
+			if (head == *cring->tail)
+				break;
+			if (echo_complete(s, &tail,
+					  &cring->cqes[head & cq_ring_mask])) {
+				s->finish = 1;
+				break;
+			}
+			s->reaps++;
+			head++;
+		} while (1);
+
+		*cring->head = head;
+		write_barrier();
+	} while (!s->finish);
+
+	finish = 1;
+	return NULL;
+}
+
 static void sig_int(int sig)
 {
 	printf("Exiting on signal %d\n", sig);
@@ -480,12 +803,62 @@ static void file_depths(char *buf)
 int main(int argc, char *argv[])
 {
 	struct submitter *s = &submitters[0];
-	unsigned long done, calls, reap;
-	int err, i, flags, fd;
+	unsigned long done, calls, reap, reconnects;
+	int err, i, flags, fd, opt;
 	char *fdepths;
 	void *ret;
 
-	if (!do_nop && argc < 2) {
+	while ((opt = getopt(argc, argv, "e:mbc:F")) != -1) {
+		switch (opt) {
+		case 'e':
+			nr_conns = atoi(optarg);
+			if (nr_conns < 1 || nr_conns > MAX_CONNS) {
+				printf("Connections must be 1..%d\n", MAX_CONNS);
+				return 1;
+			}
+			break;
+		case 'm':
+			echo_msg = 1;
+			break;
+		case 'b':
+			echo_bufs = 1;
+			break;
+		case 'c':
+			echo_churn = atoi(optarg);
+			if (echo_churn < 1) {
+				printf("Round trips must be at least 1\n");
+				return 1;
+			}
+			break;
+		case 'F':
+			register_files = 0;
+			break;
+		default:
+			printf("%s: [-e connections [-m|-b] [-c round trips]] "
+				"[-F] [filename...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (echo_churn && !nr_conns) {
+		printf("-c needs -e\n");
+		return 1;
+	}
+
+	/* a server end queues a provide and a receive per completion */
+	if (echo_bufs && (echo_msg || nr_conns > MAX_CONNS / 2)) {
+		printf("-b needs -e of at most %d connections, without -m\n",
+			MAX_CONNS / 2);
+		return 1;
+	}
+
+	if (nr_conns) {
+		/* sockets support neither polled IO nor fixed buffers */
+		polled = 0;
+		fixedbufs = 0;
+		if (echo_setup(s))
+			return 1;
+	} else if (!do_nop && optind == argc) {
 		printf("%s: filename\n", argv[0]);
 		return 1;
 	}
@@ -494,8 +867,8 @@ int main(int argc, char *argv[])
 	if (!buffered)
 		flags |= O_DIRECT;
 
-	i = 1;
-	while (!do_nop && i < argc) {
+	i = optind;
+	while (!do_nop && !nr_conns && i < argc) {
 		struct file *f;
 
 		if (s->nr_files == MAX_FDS) {
@@ -556,11 +929,16 @@ int main(int argc, char *argv[])
 	}
 	printf("polled=%d, fixedbufs=%d, buffered=%d", polled, fixedbufs, buffered);
 	printf(" QD=%d, sq_ring=%d, cq_ring=%d\n", DEPTH, *s->sq_ring.ring_entries, *s->cq_ring.ring_entries);
+	if (nr_conns)
+		printf("echo: connections=%d, msg=%d, bufs=%d, churn=%d, "
+			"fixed files=%d\n", nr_conns, echo_msg, echo_bufs,
+			echo_churn, register_files);
 
-	pthread_create(&s->thread, NULL, submitter_fn, s);
+	pthread_create(&s->thread, NULL, nr_conns ? echo_submitter_fn :
+			submitter_fn, s);
 
-	fdepths = malloc(8 * s->nr_files);
-	reap = calls = done = 0;
+	fdepths = malloc(8 * s->nr_files + 1);
+	reap = calls = done = reconnects = 0;
 	do {
 		unsigned long this_done = 0;
 		unsigned long this_reap = 0;
@@ -571,6 +949,12 @@ int main(int argc, char *argv[])
 		this_done += s->done;
 		this_call += s->calls;
 		this_reap += s->reaps;
+		if (echo_churn) {
+			unsigned long this_reconnects = s->reconnects;
+
+			printf("reconnects=%lu, ", this_reconnects - reconnects);
+			reconnects = this_reconnects;
+		}
 		if (this_call - calls) {
 			rpc = (this_done - done) / (this_call - calls);
 			ipc = (this_reap - reap) / (this_call - calls);
@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Test for the SGX virtual EPC, /dev/sgx/virt_epc
+ *
+ * Copyright (C) 2019, Intel Corporation.
+ *
+ * Verifies that KVM does not advertise the provisioning key to the guests,
+ * and that a virtual EPC mapped into a memory slot is allocated when the guest
+ * touches it and freed when the VM and the file are released.
+ *
+ * With SGX exposed by KVM, also runs ENCLS in a guest: ECREATE of a SECS that
+ * the guest CPUID allows, ECREATE of SECS pages with a withheld attribute or
+ * XFRM feature (#GP), a leaf that the guest CPUID does not enumerate (#UD), and
+ * EINIT of a bogus SIGSTRUCT, whose error code must reach the guest in RAX.
+ */
+
+#define _GNU_SOURCE /* for program_invocation_short_name */
+#include <fcntl.h>
+#include <glob.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/stringify.h>
+
+#include "test_util.h"
+#include "kvm_util.h"
+#include "processor.h"
+
+#define VCPU_ID			0
+#define EPC_SLOT		1
+#define EPC_GPA			0xc0000000ul
+#define EPC_NR_PAGES		16
+
+#define CPUID_1_ECX_XSAVE	(1u << 26)
+#define CPUID_7_EBX_SGX		(1u << 2)
+#define SGX_ATTR_MODE64BIT	(1u << 2)
+#define SGX_ATTR_PROVISIONKEY	(1u << 4)
+
+#define FEAT_CTL_LOCKED		(1ull << 0)
+#define FEAT_CTL_SGX_ENABLED	(1ull << 18)
+
+#define EFLAGS_ZF		(1u << 6)
+#define UD_VECTOR		6
+#define GP_VECTOR		13
+
+#define ENCLS_ECREATE		0
+#define ENCLS_EINIT		2
+#define ENCLS_BAD_LEAF		0x3f
+
+#define XFEATURE_MASK_FPSSE	0x3ull
+
+/* SECS fields, by offset. */
+struct secs {
+	uint64_t size;
+	uint64_t base;
+	uint32_t ssa_frame_size;
+	uint32_t miscselect;
+	uint8_t reserved1[24];
+	uint64_t attributes;
+	uint64_t xfrm;
+	uint8_t reserved2[4032];
+} __attribute__((aligned(4096)));
+
+struct pageinfo {
+	uint64_t addr;
+	uint64_t contents;
+	uint64_t metadata;
+	uint64_t secs;
+} __attribute__((aligned(32)));
+
+/* The inputs of the guest ENCLS, filled by the host. */
+struct encls_data {
+	struct secs secs[3];
+	uint8_t sigstruct[4096] __attribute__((aligned(4096)));
+	uint8_t token[512] __attribute__((aligned(512)));
+	struct pageinfo pageinfo[3];
+	uint64_t secinfo[8] __attribute__((aligned(64)));
+};
+
+/* Set by the guest exception handlers, which skip the faulting ENCLS. */
+volatile uint64_t guest_exc_vector;
+
+void guest_ud_handler(void);
+void guest_gp_handler(void);
+
+asm(".pushsection .text\n"
+    "guest_ud_handler:\n"
+    "	movq $" __stringify(UD_VECTOR) ", guest_exc_vector(%rip)\n"
+    "	addq $3, (%rsp)\n"
+    "	iretq\n"
+    "guest_gp_handler:\n"
+    "	movq $" __stringify(GP_VECTOR) ", guest_exc_vector(%rip)\n"
+    "	addq $8, %rsp\n"
+    "	addq $3, (%rsp)\n"
+    "	iretq\n"
+    ".popsection");
+
+static uint64_t encls(uint64_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
+		      uint64_t *rflags)
+{
+	uint64_t rax = leaf;
+
+	guest_exc_vector = 0;
+	asm volatile(".byte 0x0f, 0x01, 0xcf\n\t"
+		     "pushfq\n\t"
+		     "pop %[rflags]"
+		     : "+a" (rax), [rflags] "=r" (*rflags)
+		     : "b" (rbx), "c" (rcx), "d" (rdx)
+		     : "cc", "memory");
+	return rax;
+}
+
+static void guest_code(void)
+{
+	volatile uint8_t *epc = (volatile uint8_t *)EPC_GPA;
+	int i;
+
+	for (i = 0; i < EPC_NR_PAGES; i++)
+		(void)epc[i * 4096];
+
+	GUEST_SYNC(0);
+}
+
+static void guest_encls_code(struct encls_data *data)
+{
+	volatile uint8_t *epc = (volatile uint8_t *)EPC_GPA;
+	uint64_t rflags;
+	uint64_t ret;
+	int i;
+
+	for (i = 0; i < EPC_NR_PAGES; i++)
+		(void)epc[i * 4096];
+
+	/* Allow the XFRM of the SECS. */
+	asm volatile("xsetbv" : : "a" ((uint32_t)XFEATURE_MASK_FPSSE),
+		     "d" (0), "c" (0));
+
+	encls(ENCLS_ECREATE, (uint64_t)&data->pageinfo[0], EPC_GPA, 0,
+	      &rflags);
+	GUEST_ASSERT(!guest_exc_vector);
+
+	/* The provisioning key is withheld from the guests. */
+	encls(ENCLS_ECREATE, (uint64_t)&data->pageinfo[1], EPC_GPA + 4096, 0,
+	      &rflags);
+	GUEST_ASSERT(guest_exc_vector == GP_VECTOR);
+
+	/* So are the XFRM features that KVM does not support. */
+	encls(ENCLS_ECREATE, (uint64_t)&data->pageinfo[2], EPC_GPA + 2 * 4096,
+	      0, &rflags);
+	GUEST_ASSERT(guest_exc_vector == GP_VECTOR);
+
+	encls(ENCLS_BAD_LEAF, 0, 0, 0, &rflags);
+	GUEST_ASSERT(guest_exc_vector == UD_VECTOR);
+
+	/* EINIT fails with an error code in RAX and ZF set, not a fault. */
+	ret = encls(ENCLS_EINIT, (uint64_t)data->sigstruct, EPC_GPA,
+		    (uint64_t)data->token, &rflags);
+	GUEST_ASSERT(!guest_exc_vector);
+	GUEST_ASSERT(ret && (rflags & EFLAGS_ZF));
+
+	GUEST_SYNC(ret);
+}
+
+/* The EPC pages in use on all the nodes. */
+static unsigned long sgx_used_pages(void)
+{
+	unsigned long total = 0, val;
+	glob_t g;
+	FILE *f;
+	size_t i;
+
+	if (glob("/sys/kernel/mm/sgx/node*/used_pages", 0, NULL, &g))
+		return 0;
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		f = fopen(g.gl_pathv[i], "r");
+		TEST_ASSERT(f, "Failed to open %s", g.gl_pathv[i]);
+		TEST_ASSERT(fscanf(f, "%lu", &val) == 1,
+			    "Failed to read %s", g.gl_pathv[i]);
+		fclose(f);
+		total += val;
+	}
+
+	globfree(&g);
+	return total;
+}
+
+static bool kvm_has_sgx(void)
+{
+	struct kvm_cpuid_entry2 *entry;
+
+	entry = kvm_get_supported_cpuid_entry(7);
+	return entry->ebx & CPUID_7_EBX_SGX;
+}
+
+static void test_supported_cpuid(void)
+{
+	struct kvm_cpuid_entry2 *entry;
+
+	if (!kvm_has_sgx()) {
+		fprintf(stderr, "SGX not supported by KVM, skip CPUID\n");
+		return;
+	}
+
+	entry = kvm_get_supported_cpuid_index(0x12, 1);
+	TEST_ASSERT(!(entry->eax & SGX_ATTR_PROVISIONKEY),
+		    "PROVISIONKEY advertised in CPUID.0x12.1: 0x%x",
+		    entry->eax);
+}
+
+/* Map EPC_NR_PAGES of a virtual EPC at EPC_GPA, identity mapped. */
+static void *vm_map_virt_epc(struct kvm_vm *vm, int fd)
+{
+	struct kvm_userspace_memory_region region;
+	void *epc;
+	int i;
+
+	epc = mmap(NULL, EPC_NR_PAGES * 4096, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	TEST_ASSERT(epc != MAP_FAILED, "Failed to map the virtual EPC");
+
+	region.slot = EPC_SLOT;
+	region.flags = 0;
+	region.guest_phys_addr = EPC_GPA;
+	region.memory_size = EPC_NR_PAGES * 4096;
+	region.userspace_addr = (uint64_t)epc;
+	vm_ioctl(vm, KVM_SET_USER_MEMORY_REGION, &region);
+
+	for (i = 0; i < EPC_NR_PAGES; i++)
+		virt_pg_map(vm, EPC_GPA + i * 4096, EPC_GPA + i * 4096, 0);
+
+	return epc;
+}
+
+/* Install the #UD and #GP handlers of the guest. */
+static void vm_setup_idt(struct kvm_vm *vm)
+{
+	struct kvm_sregs sregs;
+	vm_vaddr_t idt_gva;
+	uint64_t *idt;
+	uint64_t handler;
+	int vector;
+
+	idt_gva = vm_vaddr_alloc(vm, getpagesize(), 0x10000, 0, 0);
+	idt = addr_gva2hva(vm, idt_gva);
+	memset(idt, 0, getpagesize());
+
+	for (vector = 0; vector <= GP_VECTOR; vector++) {
+		if (vector == UD_VECTOR)
+			handler = (uint64_t)guest_ud_handler;
+		else if (vector == GP_VECTOR)
+			handler = (uint64_t)guest_gp_handler;
+		else
+			continue;
+
+		/* A present 64-bit interrupt gate with the kernel CS. */
+		idt[vector * 2] = (handler & 0xffff) | (0x8ull << 16) |
+				  (0x8eull << 40) |
+				  ((handler >> 16 & 0xffff) << 48);
+		idt[vector * 2 + 1] = handler >> 32;
+	}
+
+	vcpu_sregs_get(vm, VCPU_ID, &sregs);
+	sregs.idt.base = idt_gva;
+	sregs.idt.limit = (GP_VECTOR + 1) * 16 - 1;
+	sregs.cr4 |= X86_CR4_OSXSAVE;
+	vcpu_sregs_set(vm, VCPU_ID, &sregs);
+}
+
+static void test_encls(int fd)
+{
+	struct kvm_cpuid_entry2 *entry;
+	struct encls_data *data;
+	vm_vaddr_t data_gva;
+	struct kvm_run *run;
+	struct kvm_vm *vm;
+	struct ucall uc;
+	void *epc;
+	int i;
+
+	entry = kvm_get_supported_cpuid_entry(1);
+	if (!kvm_has_sgx() || !(entry->ecx & CPUID_1_ECX_XSAVE)) {
+		fprintf(stderr, "SGX not supported by KVM, skip ENCLS\n");
+		return;
+	}
+
+	vm = vm_create_default(VCPU_ID, 0, guest_encls_code);
+	vcpu_set_cpuid(vm, VCPU_ID, kvm_get_supported_cpuid());
+	vcpu_set_msr(vm, VCPU_ID, MSR_IA32_FEATURE_CONTROL,
+		     FEAT_CTL_LOCKED | FEAT_CTL_SGX_ENABLED);
+	run = vcpu_state(vm, VCPU_ID);
+
+	epc = vm_map_virt_epc(vm, fd);
+	vm_setup_idt(vm);
+
+	data_gva = vm_vaddr_alloc(vm, sizeof(*data), 0x10000, 0, 0);
+	data = addr_gva2hva(vm, data_gva);
+	memset(data, 0, sizeof(*data));
+
+	for (i = 0; i < 3; i++) {
+		data->secs[i].size = 2 * 4096;
+		data->secs[i].ssa_frame_size = 1;
+		data->secs[i].attributes = SGX_ATTR_MODE64BIT;
+		data->secs[i].xfrm = XFEATURE_MASK_FPSSE;
+
+		data->pageinfo[i].contents = data_gva +
+			offsetof(struct encls_data, secs) +
+			i * sizeof(struct secs);
+		data->pageinfo[i].metadata = data_gva +
+			offsetof(struct encls_data, secinfo);
+	}
+
+	data->secs[1].attributes |= SGX_ATTR_PROVISIONKEY;
+	data->secs[2].xfrm |= 1ull << 62;
+
+	vcpu_args_set(vm, VCPU_ID, 1, data_gva);
+
+	vcpu_run(vm, VCPU_ID);
+	TEST_ASSERT(run->exit_reason == KVM_EXIT_IO,
+		    "Exit_reason other than KVM_EXIT_IO: %u (%s),\n",
+		    run->exit_reason,
+		    exit_reason_str(run->exit_reason));
+
+	switch (get_ucall(vm, VCPU_ID, &uc)) {
+	case UCALL_SYNC:
+		fprintf(stderr, "EINIT of a bogus SIGSTRUCT returned %lu\n",
+			uc.args[1]);
+		break;
+	case UCALL_ABORT:
+		TEST_ASSERT(false, "%s at %s:%ld", (const char *)uc.args[0],
+			    __FILE__, uc.args[1]);
+		break;
+	default:
+		TEST_ASSERT(false, "Unknown ucall 0x%lx.", uc.cmd);
+	}
+
+	kvm_vm_free(vm);
+	munmap(epc, EPC_NR_PAGES * 4096);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long before, during, after;
+	struct kvm_run *run;
+	struct kvm_vm *vm;
+	struct ucall uc;
+	void *epc;
+	int fd;
+
+	/* Tell stdout not to buffer its content */
+	setbuf(stdout, NULL);
+
+	fd = open("/dev/sgx/virt_epc", O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "/dev/sgx/virt_epc not available, skip test\n");
+		exit(KSFT_SKIP);
+	}
+
+	test_supported_cpuid();
+
+	before = sgx_used_pages();
+
+	vm = vm_create_default(VCPU_ID, 0, guest_code);
+	run = vcpu_state(vm, VCPU_ID);
+
+	epc = vm_map_virt_epc(vm, fd);
+
+	vcpu_run(vm, VCPU_ID);
+	TEST_ASSERT(run->exit_reason == KVM_EXIT_IO,
+		    "Exit_reason other than KVM_EXIT_IO: %u (%s),\n",
+		    run->exit_reason,
+		    exit_reason_str(run->exit_reason));
+	get_ucall(vm, VCPU_ID, &uc);
+	TEST_ASSERT(uc.cmd == UCALL_SYNC,
+		    "Received ucall other than UCALL_SYNC: %lu\n", uc.cmd);
+
+	during = sgx_used_pages();
+	TEST_ASSERT(during >= before + EPC_NR_PAGES,
+		    "Expected %d more used EPC pages, before: %lu, during: %lu",
+		    EPC_NR_PAGES, before, during);
+
+	kvm_vm_free(vm);
+	munmap(epc, EPC_NR_PAGES * 4096);
+	close(fd);
+
+	after = sgx_used_pages();
+	TEST_ASSERT(after + EPC_NR_PAGES <= during,
+		    "The virtual EPC was not freed, during: %lu, after: %lu",
+		    during, after);
+
+	fd = open("/dev/sgx/virt_epc", O_RDWR);
+	TEST_ASSERT(fd >= 0, "Failed to reopen /dev/sgx/virt_epc");
+	test_encls(fd);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,434 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+// Copyright(c) 2016-19 Intel Corporation.
+/*
+ * EPC performance benchmark.
+ *
+ * Reports the enclave build time, the EPC fault latency and the reclaim
+ * throughput under EPC pressure. The enclaves are built and faulted through
+ * the regular driver ioctls and are never entered, i.e. the benchmark also
+ * runs on kernels built with CONFIG_INTEL_SGX_SW_EMU. On real hardware only
+ * the build phase can pass EINIT because the test SIGSTRUCT measures the test
+ * enclave, the other phases are skipped.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "encl_piggy.h"
+#include "defines.h"
+
+#define PAGE_SIZE  4096
+
+struct bench_encl {
+	int fd;
+	void *base;
+	uint64_t size;
+	uint64_t nr_pages;
+};
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool bench_encl_add_page(struct bench_encl *encl, uint64_t offset,
+				void *data, uint64_t flags)
+{
+	struct sgx_enclave_add_page ioc;
+	struct sgx_secinfo secinfo;
+
+	memset(&secinfo, 0, sizeof(secinfo));
+	secinfo.flags = flags;
+
+	memset(&ioc, 0, sizeof(ioc));
+	ioc.secinfo = (unsigned long)&secinfo;
+	ioc.mrmask = 0xFFFF;
+	ioc.addr = (unsigned long)encl->base + offset;
+	ioc.src = (unsigned long)data;
+
+	if (ioctl(encl->fd, SGX_IOC_ENCLAVE_ADD_PAGE, &ioc)) {
+		fprintf(stderr, "EADD failed at 0x%lx, errno=%d.\n",
+			(unsigned long)offset, errno);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Add a range of zeroed read/write pages with SGX_IOC_ENCLAVE_ADD_PAGES, and
+ * resume the ioctl when it is interrupted.
+ */
+static bool bench_encl_add_pages(struct bench_encl *encl, uint64_t offset,
+				 uint64_t length)
+{
+	struct sgx_enclave_add_pages ioc;
+	struct sgx_secinfo secinfo;
+	uint64_t done = 0;
+	void *src;
+	int rc;
+
+	src = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (src == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	memset(&secinfo, 0, sizeof(secinfo));
+	secinfo.flags = SGX_SECINFO_REG | SGX_SECINFO_R | SGX_SECINFO_W;
+
+	memset(&ioc, 0, sizeof(ioc));
+	ioc.secinfo = (unsigned long)&secinfo;
+	ioc.mrmask = 0xFFFF;
+
+	do {
+		ioc.addr = (unsigned long)encl->base + offset + done;
+		ioc.src = (unsigned long)src + done;
+		ioc.length = length - done;
+		ioc.count = 0;
+
+		rc = ioctl(encl->fd, SGX_IOC_ENCLAVE_ADD_PAGES, &ioc);
+		done += ioc.count;
+	} while (rc && errno == EINTR);
+
+	munmap(src, length);
+
+	if (rc) {
+		fprintf(stderr, "EADD failed at 0x%lx, errno=%d.\n",
+			(unsigned long)(offset + done), errno);
+		return false;
+	}
+
+	return true;
+}
+
+static void bench_encl_destroy(struct bench_encl *encl)
+{
+	if (encl->base)
+		munmap(encl->base, encl->size);
+
+	close(encl->fd);
+}
+
+/*
+ * Build an enclave of @nr_pages pages: the test enclave followed by zeroed
+ * read/write pages. Return zero on success, a positive SGX error code if
+ * EINIT fails and -1 on any other failure.
+ */
+static int bench_encl_build(struct bench_encl *encl, uint64_t nr_pages)
+{
+	unsigned long bin_size = encl_bin_end - encl_bin;
+	struct sgx_enclave_create create_ioc;
+	struct sgx_enclave_init init_ioc;
+	struct sgx_secs secs;
+	uint64_t offset;
+	uint64_t flags;
+	int rc;
+
+	memset(encl, 0, sizeof(*encl));
+
+	if (nr_pages * PAGE_SIZE < bin_size)
+		nr_pages = bin_size / PAGE_SIZE;
+
+	encl->nr_pages = nr_pages;
+
+	encl->fd = open("/dev/sgx/enclave", O_RDWR);
+	if (encl->fd < 0) {
+		fprintf(stderr, "Unable to open /dev/sgx/enclave\n");
+		return -1;
+	}
+
+	memset(&secs, 0, sizeof(secs));
+	secs.ssa_frame_size = 1;
+	secs.attributes = SGX_ATTR_MODE64BIT;
+	secs.xfrm = 3;
+
+	for (secs.size = 2 * PAGE_SIZE; secs.size < nr_pages * PAGE_SIZE; )
+		secs.size <<= 1;
+
+	encl->size = secs.size;
+	encl->base = mmap(NULL, secs.size, PROT_NONE, MAP_SHARED, encl->fd, 0);
+	if (encl->base == MAP_FAILED) {
+		perror("mmap");
+		encl->base = NULL;
+		goto err;
+	}
+
+	secs.base = (unsigned long)encl->base;
+
+	create_ioc.src = (unsigned long)&secs;
+	if (ioctl(encl->fd, SGX_IOC_ENCLAVE_CREATE, &create_ioc)) {
+		fprintf(stderr, "ECREATE failed, errno=%d.\n", errno);
+		goto err;
+	}
+
+	for (offset = 0; offset < bin_size; offset += PAGE_SIZE) {
+		if (!offset)
+			flags = SGX_SECINFO_TCS;
+		else
+			flags = SGX_SECINFO_REG | SGX_SECINFO_R |
+				SGX_SECINFO_W | SGX_SECINFO_X;
+
+		if (!bench_encl_add_page(encl, offset, encl_bin + offset,
+					 flags))
+			goto err;
+	}
+
+	/* The zeroed pages beyond the test enclave are added in one go. */
+	if (offset < nr_pages * PAGE_SIZE &&
+	    !bench_encl_add_pages(encl, offset, nr_pages * PAGE_SIZE - offset))
+		goto err;
+
+	init_ioc.sigstruct = (unsigned long)&encl_ss;
+	rc = ioctl(encl->fd, SGX_IOC_ENCLAVE_INIT, &init_ioc);
+	if (rc) {
+		bench_encl_destroy(encl);
+		return rc > 0 ? rc : -1;
+	}
+
+	return 0;
+
+err:
+	bench_encl_destroy(encl);
+	return -1;
+}
+
+static bool bench_encl_map(struct bench_encl *encl)
+{
+	void *addr;
+
+	addr = mmap(encl->base, encl->nr_pages * PAGE_SIZE,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, encl->fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "mmap() failed, errno=%d.\n", errno);
+		return false;
+	}
+
+	return true;
+}
+
+static inline void bench_touch(struct bench_encl *encl, uint64_t i)
+{
+	(void)*(volatile uint8_t *)(encl->base + i * PAGE_SIZE);
+}
+
+static int bench_build(unsigned int iterations)
+{
+	unsigned long bin_pages = (encl_bin_end - encl_bin) / PAGE_SIZE;
+	struct bench_encl encl;
+	uint64_t start, total = 0;
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		start = bench_now_ns();
+		if (bench_encl_build(&encl, bin_pages)) {
+			fprintf(stderr, "build: failed to build the test enclave\n");
+			return 1;
+		}
+		total += bench_now_ns() - start;
+		bench_encl_destroy(&encl);
+	}
+
+	printf("build: %u enclaves of %lu pages, %lu us/enclave, %lu pages/s\n",
+	       iterations, bin_pages, (unsigned long)(total / iterations / 1000),
+	       (unsigned long)(iterations * bin_pages * 1000000000ULL / total));
+	return 0;
+}
+
+static bool bench_build_or_skip(const char *name, struct bench_encl *encl,
+				uint64_t nr_pages, int *status)
+{
+	int rc;
+
+	rc = bench_encl_build(encl, nr_pages);
+	if (rc > 0) {
+		printf("%s: skipped, EINIT returned %d, the phase needs an emulated EPC\n",
+		       name, rc);
+		return false;
+	}
+
+	if (rc) {
+		fprintf(stderr, "%s: failed to build a %lu page enclave\n",
+			name, (unsigned long)nr_pages);
+		*status = 1;
+		return false;
+	}
+
+	if (!bench_encl_map(encl)) {
+		bench_encl_destroy(encl);
+		*status = 1;
+		return false;
+	}
+
+	return true;
+}
+
+static int bench_fault(uint64_t nr_pages)
+{
+	struct bench_encl encl;
+	uint64_t *lat;
+	uint64_t start;
+	uint64_t sum = 0;
+	int status = 0;
+	uint64_t i;
+
+	if (!bench_build_or_skip("fault", &encl, nr_pages, &status))
+		return status;
+
+	lat = calloc(encl.nr_pages, sizeof(*lat));
+	if (!lat) {
+		bench_encl_destroy(&encl);
+		return 1;
+	}
+
+	for (i = 0; i < encl.nr_pages; i++) {
+		start = bench_now_ns();
+		bench_touch(&encl, i);
+		lat[i] = bench_now_ns() - start;
+		sum += lat[i];
+	}
+
+	qsort(lat, encl.nr_pages, sizeof(*lat), bench_cmp_u64);
+
+	printf("fault: %lu pages, avg %lu ns, p50 %lu ns, p99 %lu ns\n",
+	       (unsigned long)encl.nr_pages,
+	       (unsigned long)(sum / encl.nr_pages),
+	       (unsigned long)lat[encl.nr_pages / 2],
+	       (unsigned long)lat[encl.nr_pages * 99 / 100]);
+
+	free(lat);
+	bench_encl_destroy(&encl);
+	return 0;
+}
+
+/* Print the paging counters of the enclave from its fdinfo. */
+static void bench_print_stats(const char *name, struct bench_encl *encl)
+{
+	static const char * const keys[] = {
+		"sgx_resident_pages", "sgx_faults", "sgx_evictions",
+		"sgx_reloads", "sgx_etrack_retries", "sgx_ipis",
+	};
+	char path[64], line[128];
+	unsigned int i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", encl->fd);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			if (!strncmp(line, keys[i], strlen(keys[i])) &&
+			    line[strlen(keys[i])] == ':')
+				printf("%s: %s", name, line);
+		}
+	}
+
+	fclose(f);
+}
+
+static int bench_reclaim(uint64_t nr_pages, unsigned int passes)
+{
+	struct bench_encl encl;
+	uint64_t start, total;
+	unsigned int pass;
+	int status = 0;
+	uint64_t i;
+
+	start = bench_now_ns();
+	if (!bench_build_or_skip("reclaim", &encl, nr_pages, &status))
+		return status;
+	total = bench_now_ns() - start;
+
+	printf("reclaim: built %lu pages in %lu ms\n",
+	       (unsigned long)encl.nr_pages,
+	       (unsigned long)(total / 1000000));
+
+	/*
+	 * The enclave is sized to exceed the EPC, therefore every pass over it
+	 * has to reload the pages evicted by the previous pass and to evict
+	 * others in their place.
+	 */
+	for (pass = 0; pass < passes; pass++) {
+		start = bench_now_ns();
+		for (i = 0; i < encl.nr_pages; i++)
+			bench_touch(&encl, i);
+		total = bench_now_ns() - start;
+
+		printf("reclaim: pass %u, %lu ms, %lu pages/s\n", pass,
+		       (unsigned long)(total / 1000000),
+		       (unsigned long)(encl.nr_pages * 1000000000ULL / total));
+	}
+
+	bench_print_stats("reclaim", &encl);
+	bench_encl_destroy(&encl);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-i iterations] [-f fault pages] [-r reclaim pages] [-p passes]\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iterations = 100;
+	uint64_t reclaim_pages = 16384;
+	uint64_t fault_pages = 1024;
+	unsigned int passes = 3;
+	int status = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:f:r:p:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fault_pages = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			reclaim_pages = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!iterations || !fault_pages || !reclaim_pages) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	status |= bench_build(iterations);
+	status |= bench_fault(fault_pages);
+	status |= bench_reclaim(reclaim_pages, passes);
+
+	exit(status);
+}
@@ -3,6 +3,19 @@
 
 #include <stddef.h>
 #include "defines.h"
+#include "encl_ops.h"
+
+/* The enclave has no .bss, its variables must be in .data. */
+#define __encl_data __attribute__((section(".data")))
+
+static uint8_t encl_buffer[ENCL_BUFFER_PAGES * 4096] __aligned(4096)
+	__encl_data;
+
+/* The %ENCL_OP_OCALL in progress, which spans several entries. */
+static struct {
+	struct encl_call *call;
+	uint64_t remaining;
+} encl_ocall __encl_data;
 
 static void *memcpy(void *dest, const void *src, size_t n)
 {
@@ -14,7 +27,103 @@ static void *memcpy(void *dest, const void *src, size_t n)
 	return dest;
 }
 
-void encl_body(void *rdi, void *rsi)
+static void encl_touch(struct encl_call *call)
+{
+	volatile uint8_t *buffer = encl_buffer;
+	uint64_t i;
+
+	for (i = 0; i < call->nr && i < ENCL_BUFFER_PAGES; i++)
+		buffer[i * 4096] = 1;
+
+	call->buffer = (uint64_t)encl_buffer;
+}
+
+/* Post a call to the host, which is serviced once the enclave exits. */
+static void encl_ocall_post(void)
 {
-	memcpy(rsi, rdi, 8);
+	struct encl_call *call = encl_ocall.call;
+
+	call->arg = encl_ocall.remaining;
+	call->ocall = 1;
+}
+
+/* Check the result of the serviced call, and post the next one if any. */
+static void encl_ocall_return(void)
+{
+	struct encl_call *call = encl_ocall.call;
+
+	if (call->ret != call->arg + 1)
+		call->nr_errors++;
+
+	call->ocall = 0;
+
+	if (--encl_ocall.remaining)
+		encl_ocall_post();
+	else
+		encl_ocall.call = NULL;
+}
+
+/*
+ * Keep every slot of the ring busy: reap the call posted to a slot in the
+ * previous round before posting the next one to it.
+ */
+static void encl_switchless(struct encl_call *call)
+{
+	struct encl_ring_slot *slot;
+	uint64_t i;
+
+	for (i = 0; i < call->nr + ENCL_RING_SLOTS; i++) {
+		slot = &call->ring->slots[i % ENCL_RING_SLOTS];
+
+		if (i >= ENCL_RING_SLOTS && i - ENCL_RING_SLOTS < call->nr) {
+			while (__atomic_load_n(&slot->state,
+					       __ATOMIC_ACQUIRE) !=
+			       ENCL_SLOT_DONE)
+				__builtin_ia32_pause();
+
+			if (slot->ret != slot->arg + 1)
+				call->nr_errors++;
+
+			slot->state = ENCL_SLOT_FREE;
+		}
+
+		if (i < call->nr) {
+			slot->arg = i;
+			__atomic_store_n(&slot->state, ENCL_SLOT_POSTED,
+					 __ATOMIC_RELEASE);
+		}
+	}
+}
+
+void encl_body(void *rdi, void *rsi, uint64_t op)
+{
+	struct encl_call *call = rdi;
+
+	/* Entered again after a call was serviced, the registers are void. */
+	if (encl_ocall.call) {
+		encl_ocall_return();
+		return;
+	}
+
+	switch (op) {
+	case ENCL_OP_COPY:
+		memcpy(rsi, rdi, 8);
+		break;
+	case ENCL_OP_NOP:
+		break;
+	case ENCL_OP_TOUCH:
+		encl_touch(call);
+		break;
+	case ENCL_OP_OCALL:
+		if (!call->nr)
+			break;
+
+		encl_ocall.call = call;
+		encl_ocall.remaining = call->nr;
+		encl_ocall_post();
+		break;
+	case ENCL_OP_SWITCHLESS:
+		encl_switchless(call);
+		break;
+	}
 }
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/*
+ * Copyright(c) 2016-19 Intel Corporation.
+ *
+ * The operations of the test enclave, selected by the untrusted %rdx at
+ * EENTER, and the untrusted memory shared with the host.
+ */
+
+#ifndef ENCL_OPS_H
+#define ENCL_OPS_H
+
+#include <stdint.h>
+
+enum encl_op {
+	/* Copy 8 bytes from %rdi to %rsi. */
+	ENCL_OP_COPY		= 0,
+	/* Exit right away. */
+	ENCL_OP_NOP		= 1,
+	/* Write to @nr pages of the enclave buffer. */
+	ENCL_OP_TOUCH		= 2,
+	/* Make @nr calls to the host with EEXIT, serviced by the callback. */
+	ENCL_OP_OCALL		= 3,
+	/* Make @nr calls to the host through @ring, without exiting. */
+	ENCL_OP_SWITCHLESS	= 4,
+};
+
+/* The size of the buffer of the enclave written by %ENCL_OP_TOUCH. */
+#define ENCL_BUFFER_PAGES	16
+
+#define ENCL_RING_SLOTS		64
+
+enum encl_slot_state {
+	ENCL_SLOT_FREE		= 0,
+	ENCL_SLOT_POSTED	= 1,
+	ENCL_SLOT_DONE		= 2,
+};
+
+/* A call to the host, which returns @arg + 1 in @ret. */
+struct encl_ring_slot {
+	uint64_t state;
+	uint64_t arg;
+	uint64_t ret;
+	uint64_t pad[5];
+} __attribute__((aligned(64)));
+
+/*
+ * The switchless calls are posted to the slots in a round-robin order, and
+ * serviced by the host threads that poll the slots.
+ */
+struct encl_ring {
+	struct encl_ring_slot slots[ENCL_RING_SLOTS];
+};
+
+/*
+ * The arguments of the operations other than %ENCL_OP_COPY, pointed to by %rdi
+ * at EENTER.  The general purpose registers are cleared at EEXIT, and are not
+ * preserved across the callback, hence the enclave keeps the state of an
+ * operation that spans several entries, and the host finds a pending call in
+ * @ocall.
+ *
+ * @nr:		the number of pages or of calls
+ * @ocall:	set while the enclave waits for the host to service a call
+ * @arg:	the argument of the pending call
+ * @ret:	the result of the pending call, set by the host
+ * @buffer:	the address of the enclave buffer, set by %ENCL_OP_TOUCH
+ * @nr_errors:	the calls that returned a wrong result
+ * @ring:	the ring of the switchless calls
+ */
+struct encl_call {
+	uint64_t nr;
+	uint64_t ocall;
+	uint64_t arg;
+	uint64_t ret;
+	uint64_t buffer;
+	uint64_t nr_errors;
+	struct encl_ring *ring;
+};
+
+#endif /* ENCL_OPS_H */
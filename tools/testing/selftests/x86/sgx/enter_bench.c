@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause)
+// Copyright(c) 2016-19 Intel Corporation.
+/*
+ * Enclave entry benchmark.
+ *
+ * Measures the paths that go through __vdso_sgx_enter_enclave(): the
+ * EENTER/EEXIT round trip, the AEX and ERESUME on a fault on an enclave page,
+ * the calls to the host that exit the enclave and are serviced in the exit
+ * callback of the vDSO, and as a reference, switchless calls serviced by host
+ * threads through a ring in untrusted memory, without exiting the enclave.
+ * The optional limits fail the benchmark if the entry or the callback path
+ * regresses. The enclave is entered, hence the benchmark needs SGX hardware.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "encl_piggy.h"
+#include "encl_ops.h"
+#include "defines.h"
+#include "vdso.h"
+
+#define PAGE_SIZE  4096
+
+#define ENCLU_EENTER	2
+#define ENCLU_EEXIT	4
+
+void *eenter;
+
+int sgx_call(void *rdi, void *rsi, long rdx, void *rcx, void *r8, void *r9,
+	     void *tcs, struct sgx_enclave_exception *ei, void *cb);
+
+struct enter_encl {
+	int fd;
+	void *base;
+	uint64_t size;
+	void *buffer;
+};
+
+static struct enter_encl encl;
+static struct sgx_enclave_exception exception;
+static struct encl_call call;
+static struct encl_ring ring;
+static unsigned int nr_workers;
+static int stop_workers;
+
+static uint64_t enter_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int enter_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool enter_encl_add_page(uint64_t offset, void *data, uint64_t flags)
+{
+	struct sgx_enclave_add_page ioc;
+	struct sgx_secinfo secinfo;
+
+	memset(&secinfo, 0, sizeof(secinfo));
+	secinfo.flags = flags;
+
+	memset(&ioc, 0, sizeof(ioc));
+	ioc.secinfo = (unsigned long)&secinfo;
+	ioc.mrmask = 0xFFFF;
+	ioc.addr = (unsigned long)encl.base + offset;
+	ioc.src = (unsigned long)data;
+
+	if (ioctl(encl.fd, SGX_IOC_ENCLAVE_ADD_PAGE, &ioc)) {
+		fprintf(stderr, "EADD failed at 0x%lx, errno=%d.\n",
+			(unsigned long)offset, errno);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Build and map the test enclave.  The enclave file stays open, the buffer of
+ * the enclave is mapped again to zap its page table entries.
+ */
+static bool enter_encl_load(void)
+{
+	unsigned long bin_size = encl_bin_end - encl_bin;
+	struct sgx_enclave_create create_ioc;
+	struct sgx_enclave_init init_ioc;
+	struct sgx_secs secs;
+	uint64_t offset;
+	uint64_t flags;
+	void *addr;
+	int rc;
+
+	encl.fd = open("/dev/sgx/enclave", O_RDWR);
+	if (encl.fd < 0) {
+		fprintf(stderr, "Unable to open /dev/sgx/enclave\n");
+		return false;
+	}
+
+	memset(&secs, 0, sizeof(secs));
+	secs.ssa_frame_size = 1;
+	secs.attributes = SGX_ATTR_MODE64BIT;
+	secs.xfrm = 3;
+
+	for (secs.size = PAGE_SIZE; secs.size < bin_size; )
+		secs.size <<= 1;
+
+	encl.size = secs.size;
+	encl.base = mmap(NULL, secs.size, PROT_NONE, MAP_SHARED, encl.fd, 0);
+	if (encl.base == MAP_FAILED) {
+		perror("mmap");
+		goto err_fd;
+	}
+
+	secs.base = (unsigned long)encl.base;
+
+	create_ioc.src = (unsigned long)&secs;
+	if (ioctl(encl.fd, SGX_IOC_ENCLAVE_CREATE, &create_ioc)) {
+		fprintf(stderr, "ECREATE failed, errno=%d.\n", errno);
+		goto err_map;
+	}
+
+	for (offset = 0; offset < bin_size; offset += PAGE_SIZE) {
+		if (!offset)
+			flags = SGX_SECINFO_TCS;
+		else
+			flags = SGX_SECINFO_REG | SGX_SECINFO_R |
+				SGX_SECINFO_W | SGX_SECINFO_X;
+
+		if (!enter_encl_add_page(offset, encl_bin + offset, flags))
+			goto err_map;
+	}
+
+	init_ioc.sigstruct = (unsigned long)&encl_ss;
+	rc = ioctl(encl.fd, SGX_IOC_ENCLAVE_INIT, &init_ioc);
+	if (rc) {
+		fprintf(stderr, "EINIT failed rc=%d, errno=%d.\n", rc, errno);
+		goto err_map;
+	}
+
+	addr = mmap(encl.base, PAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED, encl.fd, 0);
+	if (addr == MAP_FAILED)
+		goto err_mmap;
+
+	addr = mmap(encl.base + PAGE_SIZE, bin_size - PAGE_SIZE,
+		    PROT_READ | PROT_WRITE | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+		    encl.fd, 0);
+	if (addr == MAP_FAILED)
+		goto err_mmap;
+
+	return true;
+
+err_mmap:
+	fprintf(stderr, "mmap() failed, errno=%d.\n", errno);
+err_map:
+	munmap(encl.base, encl.size);
+err_fd:
+	close(encl.fd);
+	return false;
+}
+
+static int enter_call(enum encl_op op, void *cb)
+{
+	return sgx_call(&call, NULL, op, NULL, NULL, NULL, encl.base,
+			&exception, cb);
+}
+
+static void enter_print_lat(const char *name, uint64_t *lat, unsigned int nr)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		sum += lat[i];
+
+	qsort(lat, nr, sizeof(*lat), enter_cmp_u64);
+
+	printf("%s: %u calls, avg %lu ns, p50 %lu ns, p99 %lu ns\n", name, nr,
+	       (unsigned long)(sum / nr), (unsigned long)lat[nr / 2],
+	       (unsigned long)lat[nr * 99 / 100]);
+}
+
+/* Time the EENTER/EEXIT round trip of an enclave that exits right away. */
+static int enter_bench_eenter(unsigned int iterations, uint64_t limit)
+{
+	uint64_t start, p50;
+	uint64_t *lat;
+	unsigned int i;
+
+	lat = calloc(iterations, sizeof(*lat));
+	if (!lat)
+		return 1;
+
+	for (i = 0; i < iterations; i++) {
+		start = enter_now_ns();
+		if (enter_call(ENCL_OP_NOP, NULL)) {
+			fprintf(stderr, "eenter: failed, trapnr %u\n",
+				exception.trapnr);
+			free(lat);
+			return 1;
+		}
+		lat[i] = enter_now_ns() - start;
+	}
+
+	enter_print_lat("eenter", lat, iterations);
+	p50 = lat[iterations / 2];
+	free(lat);
+
+	if (limit && p50 > limit) {
+		fprintf(stderr, "eenter: p50 %lu ns exceeds the limit of %lu ns\n",
+			(unsigned long)p50, (unsigned long)limit);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write to every page of the enclave buffer, once after its page table
+ * entries have been zapped, which takes an AEX, a fault and an ERESUME per
+ * page, and once more with the pages mapped.  The difference is the cost of
+ * the faults.
+ */
+static int enter_bench_aex(unsigned int iterations)
+{
+	uint64_t start, cold = 0, warm = 0;
+	unsigned int i;
+	void *addr;
+
+	call.nr = ENCL_BUFFER_PAGES;
+
+	/* The enclave reports the address of the buffer, touch it untimed. */
+	if (enter_call(ENCL_OP_TOUCH, NULL))
+		goto err;
+
+	encl.buffer = (void *)call.buffer;
+
+	for (i = 0; i < iterations; i++) {
+		addr = mmap(encl.buffer, ENCL_BUFFER_PAGES * PAGE_SIZE,
+			    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			    encl.fd, 0);
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "aex: mmap() failed, errno=%d.\n",
+				errno);
+			return 1;
+		}
+
+		start = enter_now_ns();
+		if (enter_call(ENCL_OP_TOUCH, NULL))
+			goto err;
+		cold += enter_now_ns() - start;
+
+		start = enter_now_ns();
+		if (enter_call(ENCL_OP_TOUCH, NULL))
+			goto err;
+		warm += enter_now_ns() - start;
+	}
+
+	printf("aex: %u calls of %u pages, cold %lu ns, warm %lu ns, %lu ns/fault\n",
+	       iterations, ENCL_BUFFER_PAGES,
+	       (unsigned long)(cold / iterations),
+	       (unsigned long)(warm / iterations),
+	       (unsigned long)(cold > warm ? (cold - warm) / iterations /
+					     ENCL_BUFFER_PAGES : 0));
+	return 0;
+
+err:
+	fprintf(stderr, "aex: failed, trapnr %u\n", exception.trapnr);
+	return 1;
+}
+
+/*
+ * The exit callback of __vdso_sgx_enter_enclave().  Service the call posted by
+ * the enclave and enter it again, or return to the caller of the vDSO when the
+ * enclave is done.
+ */
+static int enter_ocall_cb(long rdi, long rsi, long rdx,
+			  struct sgx_enclave_exception *ei, long r8, long r9,
+			  void *tcs, long ursp)
+{
+	if (ei->leaf != ENCLU_EEXIT)
+		return -EFAULT;
+
+	if (!call.ocall)
+		return 0;
+
+	call.ret = call.arg + 1;
+	return ENCLU_EENTER;
+}
+
+static int enter_bench_ocall(unsigned int nr_calls, uint64_t limit)
+{
+	uint64_t start, total, avg;
+
+	call.nr = nr_calls;
+	call.nr_errors = 0;
+
+	start = enter_now_ns();
+	if (enter_call(ENCL_OP_OCALL, enter_ocall_cb)) {
+		fprintf(stderr, "ocall: failed, trapnr %u\n", exception.trapnr);
+		return 1;
+	}
+	total = enter_now_ns() - start;
+
+	if (call.nr_errors) {
+		fprintf(stderr, "ocall: %lu calls returned a wrong result\n",
+			(unsigned long)call.nr_errors);
+		return 1;
+	}
+
+	avg = total / nr_calls;
+	printf("ocall: %u calls, %lu ns/call, %lu calls/s\n", nr_calls,
+	       (unsigned long)avg,
+	       (unsigned long)(nr_calls * 1000000000ULL / total));
+
+	if (limit && avg > limit) {
+		fprintf(stderr, "ocall: %lu ns/call exceeds the limit of %lu ns\n",
+			(unsigned long)avg, (unsigned long)limit);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Service the posted calls of the slots of the ring that belong to @arg. */
+static void *enter_worker(void *arg)
+{
+	unsigned long id = (unsigned long)arg;
+	struct encl_ring_slot *slot;
+	unsigned int i;
+
+	while (!__atomic_load_n(&stop_workers, __ATOMIC_ACQUIRE)) {
+		for (i = id; i < ENCL_RING_SLOTS; i += nr_workers) {
+			slot = &ring.slots[i];
+			if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) !=
+			    ENCL_SLOT_POSTED)
+				continue;
+
+			slot->ret = slot->arg + 1;
+			__atomic_store_n(&slot->state, ENCL_SLOT_DONE,
+					 __ATOMIC_RELEASE);
+		}
+
+		__builtin_ia32_pause();
+	}
+
+	return NULL;
+}
+
+static int enter_bench_switchless(unsigned int nr_calls)
+{
+	pthread_t workers[ENCL_RING_SLOTS];
+	uint64_t start, total;
+	unsigned long i;
+	int status = 0;
+	int rc;
+
+	memset(&ring, 0, sizeof(ring));
+	stop_workers = 0;
+
+	for (i = 0; i < nr_workers; i++) {
+		rc = pthread_create(&workers[i], NULL, enter_worker, (void *)i);
+		if (rc) {
+			fprintf(stderr, "switchless: pthread_create() failed, %d\n",
+				rc);
+			nr_workers = i;
+			status = 1;
+			goto out;
+		}
+	}
+
+	call.nr = nr_calls;
+	call.nr_errors = 0;
+	call.ring = &ring;
+
+	start = enter_now_ns();
+	if (enter_call(ENCL_OP_SWITCHLESS, NULL)) {
+		fprintf(stderr, "switchless: failed, trapnr %u\n",
+			exception.trapnr);
+		status = 1;
+		goto out;
+	}
+	total = enter_now_ns() - start;
+
+	if (call.nr_errors) {
+		fprintf(stderr, "switchless: %lu calls returned a wrong result\n",
+			(unsigned long)call.nr_errors);
+		status = 1;
+		goto out;
+	}
+
+	printf("switchless: %u calls, %u workers, %lu ns/call, %lu calls/s\n",
+	       nr_calls, nr_workers, (unsigned long)(total / nr_calls),
+	       (unsigned long)(nr_calls * 1000000000ULL / total));
+
+out:
+	__atomic_store_n(&stop_workers, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	return status;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-i iterations] [-c calls] [-w workers] [-e eenter p50 limit ns] [-o ocall limit ns]\n",
+		name);
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+	unsigned int iterations = 10000;
+	unsigned int nr_calls = 100000;
+	uint64_t eenter_limit = 0;
+	uint64_t ocall_limit = 0;
+	struct vdso_symtab symtab;
+	Elf64_Sym *eenter_sym;
+	int status = 0;
+	void *addr;
+	int opt;
+
+	nr_workers = 1;
+
+	while ((opt = getopt(argc, argv, "i:c:w:e:o:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			nr_calls = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			eenter_limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			ocall_limit = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!iterations || !nr_calls || !nr_workers ||
+	    nr_workers > ENCL_RING_SLOTS) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	addr = vdso_get_base_addr(envp);
+	if (!addr || !vdso_get_symtab(addr, &symtab))
+		exit(1);
+
+	eenter_sym = vdso_symtab_get(&symtab, "__vdso_sgx_enter_enclave");
+	if (!eenter_sym) {
+		fprintf(stderr, "__vdso_sgx_enter_enclave() not found\n");
+		exit(1);
+	}
+	eenter = addr + eenter_sym->st_value;
+
+	if (!enter_encl_load())
+		exit(1);
+
+	status |= enter_bench_eenter(iterations, eenter_limit);
+	if (!status) {
+		status |= enter_bench_aex(iterations / 10 ? : 1);
+		status |= enter_bench_ocall(nr_calls, ocall_limit);
+		status |= enter_bench_switchless(nr_calls);
+	}
+
+	munmap(encl.base, encl.size);
+	close(encl.fd);
+	exit(status);
+}
@@ -16,7 +16,8 @@
 #include <sys/time.h>
 #include "encl_piggy.h"
 #include "defines.h"
-#include "../../../../../arch/x86/kernel/cpu/sgx/arch.h"
+#include "vdso.h"
+#include "../../../../../arch/x86/include/asm/sgx_arch.h"
 #include "../../../../../arch/x86/include/uapi/asm/sgx.h"
 
 #define PAGE_SIZE  4096
@@ -24,108 +25,6 @@
 static const uint64_t MAGIC = 0x1122334455667788ULL;
 void *eenter;
 
-struct vdso_symtab {
-	Elf64_Sym *elf_symtab;
-	const char *elf_symstrtab;
-	Elf64_Word *elf_hashtab;
-};
-
-static void *vdso_get_base_addr(char *envp[])
-{
-	Elf64_auxv_t *auxv;
-	int i;
-
-	for (i = 0; envp[i]; i++)
-		;
-
-	auxv = (Elf64_auxv_t *)&envp[i + 1];
-
-	for (i = 0; auxv[i].a_type != AT_NULL; i++) {
-		if (auxv[i].a_type == AT_SYSINFO_EHDR)
-			return (void *)auxv[i].a_un.a_val;
-	}
-
-	return NULL;
-}
-
-static Elf64_Dyn *vdso_get_dyntab(void *addr)
-{
-	Elf64_Ehdr *ehdr = addr;
-	Elf64_Phdr *phdrtab = addr + ehdr->e_phoff;
-	int i;
-
-	for (i = 0; i < ehdr->e_phnum; i++)
-		if (phdrtab[i].p_type == PT_DYNAMIC)
-			return addr + phdrtab[i].p_offset;
-
-	return NULL;
-}
-
-static void *vdso_get_dyn(void *addr, Elf64_Dyn *dyntab, Elf64_Sxword tag)
-{
-	int i;
-
-	for (i = 0; dyntab[i].d_tag != DT_NULL; i++)
-		if (dyntab[i].d_tag == tag)
-			return addr + dyntab[i].d_un.d_ptr;
-
-	return NULL;
-}
-
-static bool vdso_get_symtab(void *addr, struct vdso_symtab *symtab)
-{
-	Elf64_Dyn *dyntab = vdso_get_dyntab(addr);
-
-	symtab->elf_symtab = vdso_get_dyn(addr, dyntab, DT_SYMTAB);
-	if (!symtab->elf_symtab)
-		return false;
-
-	symtab->elf_symstrtab = vdso_get_dyn(addr, dyntab, DT_STRTAB);
-	if (!symtab->elf_symstrtab)
-		return false;
-
-	symtab->elf_hashtab = vdso_get_dyn(addr, dyntab, DT_HASH);
-	if (!symtab->elf_hashtab)
-		return false;
-
-	return true;
-}
-
-static unsigned long elf_sym_hash(const char *name)
-{
-	unsigned long h = 0, high;
-
-	while (*name) {
-		h = (h << 4) + *name++;
-		high = h & 0xf0000000;
-
-		if (high)
-			h ^= high >> 24;
-
-		h &= ~high;
-	}
-
-	return h;
-}
-
-static Elf64_Sym *vdso_symtab_get(struct vdso_symtab *symtab, const char *name)
-{
-	Elf64_Word bucketnum = symtab->elf_hashtab[0];
-	Elf64_Word *buckettab = &symtab->elf_hashtab[2];
-	Elf64_Word *chaintab = &symtab->elf_hashtab[2 + bucketnum];
-	Elf64_Sym *sym;
-	Elf64_Word i;
-
-	for (i = buckettab[elf_sym_hash(name) % bucketnum]; i != STN_UNDEF;
-	     i = chaintab[i]) {
-		sym = &symtab->elf_symtab[i];
-		if (!strcmp(name, &symtab->elf_symstrtab[sym->st_name]))
-			return sym;
-	}
-
-	return NULL;
-}
-
 static bool encl_create(int dev_fd, unsigned long bin_size,
 			struct sgx_secs *secs)
 {
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-3-Clause) */
+/*
+ * Copyright(c) 2016-18 Intel Corporation.
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <elf.h>
+#include <stdbool.h>
+
+struct vdso_symtab {
+	Elf64_Sym *elf_symtab;
+	const char *elf_symstrtab;
+	Elf64_Word *elf_hashtab;
+};
+
+void *vdso_get_base_addr(char *envp[]);
+bool vdso_get_symtab(void *addr, struct vdso_symtab *symtab);
+Elf64_Sym *vdso_symtab_get(struct vdso_symtab *symtab, const char *name);
+
+#endif /* VDSO_H */
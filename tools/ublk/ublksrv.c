@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple userspace block device server. Creates a /dev/ublkbN device backed
+ * by a file or block device and serves every hardware queue from its own
+ * thread, pinned to the CPUs blk-mq maps to that queue. Each queue thread
+ * drives its queue through an io_uring: IORING_OP_POLL_ADD on the queue file
+ * to learn about new requests, IORING_OP_READV/WRITEV on it to copy data
+ * to and from the request pages and to complete requests, and READV, WRITEV
+ * and FSYNC on the backing file to do the actual IO.
+ *
+ * Runs until SIGINT or SIGTERM, then deletes the device.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+
+#include "../io_uring/liburing.h"
+#include "../../include/uapi/linux/ublk.h"
+
+#define UD_POLL			(1ULL << 32)
+#define UD_CMPL			(2ULL << 32)
+
+enum {
+	IO_IDLE,
+	IO_BACKING,	/* reading or writing the backing file */
+	IO_COPY,	/* copying data to or from the request */
+};
+
+struct io {
+	int state;
+	struct iovec iov;
+};
+
+struct queue {
+	pthread_t thread;
+	int q_id;
+	int fd;
+	struct io_uring ring;
+	struct ublk_io_desc *descs;
+	struct ublk_queue_ring *tags;
+	struct io *ios;
+	int dead;
+
+	/* completions being written, and the ones gathered meanwhile */
+	struct ublk_io_cmpl *cmpls[2];
+	unsigned nr_cmpls[2];
+	struct iovec cmpl_iov;
+	int cmpl_inflight;
+};
+
+static struct ublk_dev_info info;
+static struct queue queues[UBLK_MAX_NR_QUEUES];
+static int backing_fd;
+
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static int nr_ready, nr_failed;
+
+/*
+ * OPTIONS
+ */
+static int nr_queues = 1;		/* hardware queues (-q) */
+static int depth = 64;			/* queue depth (-d) */
+static int block_size = 512;		/* logical block size (-b) */
+static int max_io_bytes = 256 * 1024;	/* largest request (-m) */
+static int direct = 0;			/* O_DIRECT backing file (-D) */
+
+static struct io_uring_sqe *get_sqe(struct queue *q)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+
+	/* the ring has room for every tag plus the poll and completion */
+	if (!sqe) {
+		fprintf(stderr, "queue %d: out of sqes\n", q->q_id);
+		exit(1);
+	}
+	return sqe;
+}
+
+static void arm_poll(struct queue *q)
+{
+	struct io_uring_sqe *sqe = get_sqe(q);
+
+	io_uring_prep_poll_add(sqe, q->fd, POLLIN);
+	sqe->user_data = UD_POLL;
+}
+
+static void flush_cmpls(struct queue *q)
+{
+	struct ublk_io_cmpl *tmp;
+	struct io_uring_sqe *sqe;
+
+	if (q->cmpl_inflight || !q->nr_cmpls[1])
+		return;
+
+	tmp = q->cmpls[0];
+	q->cmpls[0] = q->cmpls[1];
+	q->cmpls[1] = tmp;
+	q->nr_cmpls[0] = q->nr_cmpls[1];
+	q->nr_cmpls[1] = 0;
+
+	q->cmpl_iov.iov_base = q->cmpls[0];
+	q->cmpl_iov.iov_len = q->nr_cmpls[0] * sizeof(struct ublk_io_cmpl);
+	sqe = get_sqe(q);
+	io_uring_prep_writev(sqe, q->fd, &q->cmpl_iov, 1, UBLK_CMPL_OFFSET);
+	sqe->user_data = UD_CMPL;
+	q->cmpl_inflight = 1;
+}
+
+static void complete_io(struct queue *q, int tag, int res)
+{
+	struct ublk_io_cmpl *c = &q->cmpls[1][q->nr_cmpls[1]++];
+
+	c->tag = tag;
+	c->resv = 0;
+	c->result = res;
+	q->ios[tag].state = IO_IDLE;
+}
+
+static void prep_io(struct queue *q, int tag, int op, int fd, off_t off)
+{
+	struct ublk_io_desc *desc = &q->descs[tag];
+	struct io *io = &q->ios[tag];
+	struct io_uring_sqe *sqe = get_sqe(q);
+
+	io->iov.iov_len = (size_t) desc->nr_sectors << 9;
+	io_uring_prep_rw(op, sqe, fd, &io->iov, 1, off);
+	if (fd == backing_fd && op == IORING_OP_WRITEV &&
+	    (desc->flags & UBLK_IO_F_FUA))
+		sqe->rw_flags = RWF_DSYNC;
+	sqe->user_data = tag;
+}
+
+static void start_io(struct queue *q, int tag)
+{
+	struct ublk_io_desc *desc = &q->descs[tag];
+	off_t off = (off_t) desc->start_sector << 9;
+	off_t len = (off_t) desc->nr_sectors << 9;
+	struct io_uring_sqe *sqe;
+	int mode;
+
+	switch (desc->op) {
+	case UBLK_IO_OP_READ:
+		q->ios[tag].state = IO_BACKING;
+		prep_io(q, tag, IORING_OP_READV, backing_fd, off);
+		break;
+	case UBLK_IO_OP_WRITE:
+		q->ios[tag].state = IO_COPY;
+		prep_io(q, tag, IORING_OP_READV, q->fd,
+			UBLK_IO_BUF_OFFSET(tag));
+		break;
+	case UBLK_IO_OP_FLUSH:
+		q->ios[tag].state = IO_BACKING;
+		sqe = get_sqe(q);
+		io_uring_prep_fsync(sqe, backing_fd, IORING_FSYNC_DATASYNC);
+		sqe->user_data = tag;
+		break;
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		mode = desc->op == UBLK_IO_OP_DISCARD ?
+			FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+		if (fallocate(backing_fd, mode | FALLOC_FL_KEEP_SIZE, off, len))
+			complete_io(q, tag, -errno);
+		else
+			complete_io(q, tag, 0);
+		break;
+	default:
+		complete_io(q, tag, -EOPNOTSUPP);
+		break;
+	}
+}
+
+static void handle_io(struct queue *q, int tag, int res)
+{
+	struct ublk_io_desc *desc = &q->descs[tag];
+	struct io *io = &q->ios[tag];
+
+	if (res < 0) {
+		complete_io(q, tag, res);
+		return;
+	}
+
+	switch (desc->op) {
+	case UBLK_IO_OP_READ:
+		if (io->state == IO_COPY) {
+			complete_io(q, tag, res);
+			break;
+		}
+		/* zero fill reads beyond the end of the backing file */
+		if ((size_t) res < io->iov.iov_len)
+			memset(io->iov.iov_base + res, 0,
+				io->iov.iov_len - res);
+		io->state = IO_COPY;
+		prep_io(q, tag, IORING_OP_WRITEV, q->fd,
+			UBLK_IO_BUF_OFFSET(tag));
+		break;
+	case UBLK_IO_OP_WRITE:
+		if ((size_t) res != io->iov.iov_len) {
+			complete_io(q, tag, -EIO);
+			break;
+		}
+		if (io->state == IO_BACKING) {
+			complete_io(q, tag, res);
+			break;
+		}
+		io->state = IO_BACKING;
+		prep_io(q, tag, IORING_OP_WRITEV, backing_fd,
+			(off_t) desc->start_sector << 9);
+		break;
+	default:
+		complete_io(q, tag, res);
+		break;
+	}
+}
+
+static void fetch_ios(struct queue *q)
+{
+	struct ublk_queue_ring *tags = q->tags;
+	unsigned head = tags->head;
+	unsigned tail = __atomic_load_n(&tags->tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		start_io(q, tags->tags[head & tags->mask]);
+		head++;
+	}
+	__atomic_store_n(&tags->head, head, __ATOMIC_RELEASE);
+}
+
+static void handle_cqe(struct queue *q, struct io_uring_cqe *cqe)
+{
+	if (cqe->user_data == UD_POLL) {
+		if (cqe->res < 0 || (cqe->res & (POLLHUP | POLLERR))) {
+			q->dead = 1;
+			return;
+		}
+		fetch_ios(q);
+		arm_poll(q);
+	} else if (cqe->user_data == UD_CMPL) {
+		if (cqe->res < 0)
+			fprintf(stderr, "queue %d: completion: %s\n", q->q_id,
+				strerror(-cqe->res));
+		q->cmpl_inflight = 0;
+	} else {
+		handle_io(q, cqe->user_data, cqe->res);
+	}
+}
+
+static int queue_setup(struct queue *q)
+{
+	struct ublk_queue_affinity aff;
+	cpu_set_t cpus;
+	char path[64];
+	unsigned entries = 1;
+	size_t len;
+	void *ptr;
+	int i;
+
+	sprintf(path, "/dev/ublkc%u", info.dev_id);
+	q->fd = open(path, O_RDWR);
+	if (q->fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (ioctl(q->fd, UBLK_BIND_QUEUE, q->q_id) < 0) {
+		perror("UBLK_BIND_QUEUE");
+		return 1;
+	}
+
+	/* serve the queue from the CPUs that submit to it */
+	CPU_ZERO(&cpus);
+	memset(&aff, 0, sizeof(aff));
+	aff.q_id = q->q_id;
+	aff.len = sizeof(cpus);
+	aff.mask = (unsigned long) &cpus;
+	if (ioctl(q->fd, UBLK_GET_QUEUE_AFFINITY, &aff) < 0)
+		perror("UBLK_GET_QUEUE_AFFINITY");
+	else if (CPU_COUNT(&cpus))
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	/* the tag ring has a power of 2 entries */
+	while (entries < (unsigned) depth)
+		entries <<= 1;
+	len = UBLK_RING_OFFSET(depth) + sizeof(struct ublk_queue_ring) +
+		entries * sizeof(__u32);
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			q->fd, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	q->descs = ptr;
+	q->tags = ptr + UBLK_RING_OFFSET(depth);
+
+	q->ios = calloc(depth, sizeof(struct io));
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&q->ios[i].iov.iov_base, 4096,
+				   info.max_io_bytes)) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	q->cmpls[0] = calloc(depth, sizeof(struct ublk_io_cmpl));
+	q->cmpls[1] = calloc(depth, sizeof(struct ublk_io_cmpl));
+
+	if (io_uring_queue_init(depth + 2, &q->ring, 0) < 0) {
+		perror("io_uring_queue_init");
+		return 1;
+	}
+	return 0;
+}
+
+static void *queue_fn(void *data)
+{
+	struct queue *q = data;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	ret = queue_setup(q);
+
+	pthread_mutex_lock(&ready_lock);
+	if (ret)
+		nr_failed++;
+	else
+		nr_ready++;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&ready_lock);
+	if (ret)
+		return NULL;
+
+	arm_poll(q);
+	while (!q->dead) {
+		ret = io_uring_submit(&q->ring);
+		if (ret < 0) {
+			fprintf(stderr, "queue %d: submit: %s\n", q->q_id,
+				strerror(-ret));
+			break;
+		}
+		ret = io_uring_wait_cqe(&q->ring, &cqe);
+		while (!ret && cqe) {
+			handle_cqe(q, cqe);
+			io_uring_cqe_seen(&q->ring, cqe);
+			ret = io_uring_peek_cqe(&q->ring, &cqe);
+		}
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "queue %d: wait: %s\n", q->q_id,
+				strerror(-ret));
+			break;
+		}
+		flush_cmpls(q);
+	}
+
+	io_uring_queue_exit(&q->ring);
+	close(q->fd);
+	return NULL;
+}
+
+static int get_backing_size(int fd, unsigned long long *bytes)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, bytes) != 0) {
+			perror("ioctl");
+			return -1;
+		}
+		return 0;
+	} else if (S_ISREG(st.st_mode)) {
+		*bytes = st.st_size;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s: [-q queues] [-d depth] [-b block size] "
+			"[-m max io bytes] [-D] <file>\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long bytes;
+	int i, opt, ctl_fd, sig;
+	sigset_t sigs;
+
+	while ((opt = getopt(argc, argv, "q:d:b:m:Dh?")) != -1) {
+		switch (opt) {
+		case 'q':
+			nr_queues = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 'm':
+			max_io_bytes = atoi(optarg);
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	backing_fd = open(argv[optind], O_RDWR | (direct ? O_DIRECT : 0));
+	if (backing_fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (get_backing_size(backing_fd, &bytes))
+		return 1;
+
+	ctl_fd = open("/dev/ublk-control", O_RDWR);
+	if (ctl_fd < 0) {
+		perror("open /dev/ublk-control");
+		return 1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.nr_hw_queues = nr_queues;
+	info.queue_depth = depth;
+	info.block_size = block_size;
+	info.max_io_bytes = max_io_bytes;
+	info.dev_sectors = bytes >> 9;
+	info.flags = UBLK_F_FLUSH | (direct ? 0 : UBLK_F_DISCARD);
+	if (ioctl(ctl_fd, UBLK_CTL_ADD_DEV, &info) < 0) {
+		perror("UBLK_CTL_ADD_DEV");
+		return 1;
+	}
+	nr_queues = info.nr_hw_queues;
+
+	/* signals go to the main thread only */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	for (i = 0; i < nr_queues; i++) {
+		queues[i].q_id = i;
+		pthread_create(&queues[i].thread, NULL, queue_fn, &queues[i]);
+	}
+
+	pthread_mutex_lock(&ready_lock);
+	while (nr_ready + nr_failed < nr_queues)
+		pthread_cond_wait(&ready_cond, &ready_lock);
+	pthread_mutex_unlock(&ready_lock);
+
+	if (nr_failed) {
+		fprintf(stderr, "queue setup failed\n");
+	} else if (ioctl(ctl_fd, UBLK_CTL_START_DEV, info.dev_id) < 0) {
+		perror("UBLK_CTL_START_DEV");
+	} else {
+		printf("/dev/ublkb%u: %d queues, depth %d, %llu sectors\n",
+			info.dev_id, nr_queues, depth,
+			(unsigned long long) info.dev_sectors);
+		sigwait(&sigs, &sig);
+	}
+
+	if (ioctl(ctl_fd, UBLK_CTL_DEL_DEV, info.dev_id) < 0)
+		perror("UBLK_CTL_DEL_DEV");
+	for (i = 0; i < nr_queues; i++)
+		pthread_join(queues[i].thread, NULL);
+	close(ctl_fd);
+	return 0;
+}